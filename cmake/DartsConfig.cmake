@@ -14,9 +14,15 @@ endif()
 # ============================================================================
 option(USE_NANOVDB "Include nanovdb support?" OFF)
 option(USE_FLIP "Include support for the FLIP image comparison tool?" OFF)
+option(USE_OIDN "Include support for the Intel Open Image Denoise library (must be installed)?" OFF)
+option(USE_EMBREE "Include the Intel Embree ray tracing accelerator (Embree 4 must be installed)?" OFF)
+option(USE_STAT_TIMERS "Time the phases of the program (STAT_TIMER) in the statistics report?" ON)
 
 message(STATUS "NANOVDB support is: ${USE_NANOVDB}")
 message(STATUS "FLIP support is: ${USE_FLIP}")
+message(STATUS "OIDN support is: ${USE_OIDN}")
+message(STATUS "Embree support is: ${USE_EMBREE}")
+message(STATUS "Statistics timers are: ${USE_STAT_TIMERS}")
 
 # ============================================================================
 # Set a default build configuration (Release)
@@ -241,6 +247,20 @@ if(USE_FLIP)
   FetchContent_MakeAvailable(flip)
 endif()
 
+if(USE_OIDN)
+  # OIDN is distributed as prebuilt binaries, so it is found instead of built; set OpenImageDenoise_DIR if needed
+  find_package(OpenImageDenoise REQUIRED)
+  message(STATUS "Adding Intel Open Image Denoise ${OpenImageDenoise_VERSION}")
+  list(APPEND DARTS_PRIVATE_LIBS OpenImageDenoise)
+endif()
+
+if(USE_EMBREE)
+  # like OIDN, Embree is found instead of built; set embree_DIR if needed
+  find_package(embree 4 REQUIRED)
+  message(STATUS "Adding Intel Embree ${embree_VERSION}")
+  list(APPEND DARTS_PRIVATE_LIBS embree)
+endif()
+
 set(THREADS_PREFER_PTHREAD_FLAG ON)
 find_package(Threads REQUIRED)
 list(APPEND DARTS_PRIVATE_LIBS Threads::Threads)
@@ -0,0 +1,71 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+
+/** \addtogroup Random
+    @{
+*/
+
+/**
+    A discrete distribution over a fixed set of weighted items, sampled in constant time using Walker's alias method.
+
+    Each item \c i is assigned a bin holding the probability \c q of keeping \c i, and an alias that is chosen instead
+    with probability <tt>1 - q</tt>. A sample therefore only needs to pick a bin uniformly and make a single binary
+    decision, no matter how many items there are.
+*/
+class AliasTable
+{
+public:
+    AliasTable() = default;
+
+    /// Build the table from (not necessarily normalized) non-negative \p weights. A zero total weight is invalid
+    explicit AliasTable(const vector<float> &weights);
+
+    /// The number of items in the distribution
+    size_t size() const
+    {
+        return m_bins.size();
+    }
+
+    /// Whether the table contains no items
+    bool empty() const
+    {
+        return m_bins.empty();
+    }
+
+    /// The probability of choosing item \p i
+    float pmf(uint32_t i) const
+    {
+        return m_bins[i].pmf;
+    }
+
+    /**
+        Sample an item in proportion to its weight.
+
+        \param [in,out] rv1 Random variable distributed uniformly in [0,1). It is remapped to a fresh uniform random
+                            variable on return, so it can be reused
+        \return             The index of the chosen item
+    */
+    uint32_t sample(float &rv1) const;
+
+private:
+    struct Bin
+    {
+        float    q     = 0.f; ///< Probability of keeping the item of this bin rather than its alias
+        float    pmf   = 0.f; ///< The normalized probability of the item of this bin
+        uint32_t alias = 0;   ///< The item chosen with probability <tt>1 - q</tt>
+    };
+    vector<Bin> m_bins;
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #AliasTable
+*/
@@ -0,0 +1,106 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/array2d.h>
+#include <darts/common.h>
+#include <darts/fwd.h>
+#include <darts/image.h>
+#include <darts/ray.h>
+#include <darts/stats.h>
+
+/** \addtogroup Integrators
+    @{
+*/
+
+/**
+    The auxiliary quantities ("arbitrary output variables") of the first hit of a camera ray.
+
+    Integrators fill these in with #record() from the first intersection they compute anyway, so the AOVs come for free
+    with the color of the path. Camera rays that miss the scene have zero AOVs.
+*/
+struct AOVSample
+{
+    Color3f albedo   = Color3f(0.f); ///< The reflectance of the surface (see Material::reflectance())
+    Vec3f   normal   = Vec3f(0.f);   ///< The world-space shading normal
+    Vec3f   position = Vec3f(0.f);   ///< The world-space hit point
+    float   depth    = 0.f;          ///< The distance from the ray origin to the hit point
+
+    bool recorded = false; ///< Whether the integrator recorded the first hit
+
+    RenderCost cost;          ///< The work done for the whole path (see Scene::sample_pixel())
+    float      time_ns = 0.f; ///< The wall-clock time spent on the whole path, in nanoseconds
+
+    /// Record the first hit \p hit of the camera ray \p ray, or a miss if \p hit is null
+    void record(const Ray3f &ray, const HitInfo *hit);
+};
+
+/**
+    The per-pixel AOVs of a rendering: the averages of the #AOVSample%s of all samples of each pixel.
+
+    Scene::raytrace() and Scene::raytrace_progressive() accumulate these in the same passes that compute the colors of
+    the pixels, and #save() writes them together with the color image as the layers of a single EXR file, which is the
+    input denoisers and compositing tools expect.
+
+    Optionally, the buffers also accumulate the cost of the pixels (see AOVSample::cost), which #save_costs() writes
+    as false-color heatmaps to find the geometry and materials that are expensive to render.
+*/
+class AOVBuffers
+{
+public:
+    /// Create black buffers of \p size pixels, including the cost buffers if \p costs is true
+    AOVBuffers(const Vec2i &size, bool costs = false);
+
+    /// Whether the cost buffers are recorded
+    bool has_costs() const
+    {
+        return time_ns.length() > 0;
+    }
+
+    /// Add \p sample to the sums of pixel (\p x, \p y)
+    void add(int x, int y, const AOVSample &sample);
+
+    /// Multiply all buffers by \p factor, e.g. to turn the sums of the samples into averages
+    void scale(float factor);
+
+    /**
+        Save \p color and the AOVs to the EXR file \p filename.
+
+        The color goes to the default \c R, \c G, \c B channels, and the AOVs to the layers \c albedo, \c normal,
+        \c position, and the depth channel \c Z. Depth and position are stored in full precision, the rest as halves.
+    */
+    bool save(const string &filename, const Image3f &color) const;
+
+    /**
+        Save false-color heatmaps of the cost buffers to the PNG files \p basename followed by \c -nodes.png,
+        \c -prims.png, \c -rays.png, and \c -time.png.
+
+        Each heatmap maps zero to the bottom of the inferno colormap and the 99th percentile of its buffer to the top
+        (so that a few outliers don't hide the variation of the rest), and the scale is logged.
+    */
+    bool save_costs(const string &basename) const;
+
+    Image3f        albedo;   ///< The albedo of the first hits
+    Image3f        normal;   ///< The shading normal of the first hits
+    Image3f        position; ///< The world-space position of the first hits
+    Array2d<float> depth;    ///< The distance to the first hits
+
+    Array2d<float> nodes_visited; ///< The BBH nodes visited per sample (if #has_costs())
+    Array2d<float> prims_tested;  ///< The primitives tested per sample (if #has_costs())
+    Array2d<float> path_length;   ///< The closest-hit rays traced per sample (if #has_costs())
+    Array2d<float> time_ns;       ///< The nanoseconds spent per sample (if #has_costs())
+
+    /// Whether a rendering recorded its samples in the buffers (adaptive sampling, and integrators that render whole
+    /// images by themselves, leave them black)
+    bool recorded = false;
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Struct #AOVSample and class #AOVBuffers
+*/
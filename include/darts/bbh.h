@@ -0,0 +1,720 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/box.h>
+#include <darts/json.h>
+#include <darts/ray.h>
+#include <darts/stats.h>
+#include <cstring>
+#include <functional>
+
+class Progress;
+class CacheWriter;
+class CacheReader;
+struct BBHBuildNode;
+struct BBHNodeAllocator;
+
+/** \addtogroup Surfaces
+    @{
+*/
+
+/**
+    A node of the flattened binary BBH.
+
+    After construction, the temporary build tree is compacted into a contiguous array of these nodes in depth-first
+    order. The first child of an interior node immediately follows it in the array, so only the offset to the second
+    child needs to be stored. Leaf nodes instead store a range of primitive indices.
+*/
+struct LinearBBHNode
+{
+    Box3f bbox; ///< The bounding box of this node
+    union
+    {
+        uint32_t prims_offset;        ///< leaf: index of the first primitive
+        uint32_t second_child_offset; ///< interior: index of the second child in #BBHTree::nodes
+    };
+    uint16_t num_prims; ///< Number of primitives in this leaf, or 0 for interior nodes
+    uint8_t  axis;      ///< interior: the axis along which the children were split
+    uint8_t  pad[1];    ///< ensure 32 byte total size
+};
+static_assert(sizeof(LinearBBHNode) == 32, "LinearBBHNode should fit exactly into 32 bytes.");
+
+/**
+    A node of a wide (4- or 8-way) BBH, created by collapsing the binary tree.
+
+    The bounds of all \p N children are stored in structure-of-arrays form, so a ray can be tested against all of them
+    at once with a loop over the lanes that the compiler can turn into SIMD instructions. Unused lanes have empty
+    bounds and a #child of 0, and are skipped by the traversal (see #used()).
+*/
+template <int N>
+struct alignas(32) WideBBHNode
+{
+    static constexpr int width = N;
+
+    float    min[3][N]; ///< Lower corners of the child bounding boxes, one array per axis
+    float    max[3][N]; ///< Upper corners of the child bounding boxes, one array per axis
+    uint32_t child[N];  ///< Index of the child node, or of the first primitive for leaf children
+    uint16_t count[N];  ///< Number of primitives in a leaf child, or 0 for interior children
+
+    WideBBHNode()
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            set_bounds(i, Box3f());
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+
+    void set_bounds(int i, const Box3f &b)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            min[a][i] = b.min[a];
+            max[a][i] = b.max[a];
+        }
+    }
+
+    /// Set the bounds of all \p N children at once
+    void set_bounds(const Box3f (&b)[N])
+    {
+        for (int i = 0; i < N; ++i) set_bounds(i, b[i]);
+    }
+
+    Box3f bounds(int i) const
+    {
+        return Box3f(Vec3f(min[0][i], min[1][i], min[2][i]), Vec3f(max[0][i], max[1][i], max[2][i]));
+    }
+
+    /// Whether lane \p i holds a child (the root is never a child, so unused lanes have a #child of 0)
+    bool used(int i) const
+    {
+        return count[i] > 0 || child[i] > 0;
+    }
+
+    /**
+        Slab test of \p ray against all \p N children at once.
+
+        The near and far planes are picked by the sign of the ray direction, so the empty bounds of unused lanes
+        (whose lower corner lies above their upper corner) are never hit.
+
+        \param [in]  ray        The ray, whose \c mint and \c maxt limit the intersections
+        \param [in]  inv_d      The reciprocal of the ray direction
+        \param [in]  dir_is_neg Whether each component of the ray direction is negative
+        \param [out] tnear      The distance at which the ray enters each child
+        \param [out] hit        Whether the ray hits each child
+    */
+    void intersect(const Ray3f &ray, const Vec3f &inv_d, const bool dir_is_neg[3], float tnear[N], bool hit[N]) const
+    {
+        float tfar[N];
+        for (int i = 0; i < N; ++i)
+        {
+            tnear[i] = ray.mint;
+            tfar[i]  = ray.maxt;
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            const float *near = dir_is_neg[a] ? max[a] : min[a];
+            const float *far  = dir_is_neg[a] ? min[a] : max[a];
+            for (int i = 0; i < N; ++i)
+            {
+                tnear[i] = std::max(tnear[i], (near[i] - ray.o[a]) * inv_d[a]);
+                tfar[i]  = std::min(tfar[i], (far[i] - ray.o[a]) * inv_d[a]);
+            }
+        }
+        for (int i = 0; i < N; ++i) hit[i] = used(i) && tnear[i] <= tfar[i];
+    }
+};
+
+/**
+    A node of a wide (4- or 8-way) BBH with compressed child bounds.
+
+    Each child box is stored as 8-bit offsets from the lower corner (#origin) of the node's bounds, in units of a power
+    of two per axis (#exponent). The offsets are rounded outwards, so the decompressed boxes always enclose the exact
+    ones and traversal stays conservative: rays may just visit a few more nodes. A 4-wide node fits into a single
+    64-byte cache line, and an 8-wide one into two, which is half the size of a WideBBHNode.
+*/
+template <int N>
+struct alignas(64) QuantizedBBHNode
+{
+    static constexpr int width = N;
+
+    float    origin[3];   ///< The lower corner of the union of the child bounds
+    int8_t   exponent[3]; ///< The offsets along axis \c a are in units of <tt>2^exponent[a]</tt>
+    uint8_t  qmin[3][N];  ///< Lower corners of the child bounding boxes, as offsets from #origin, one array per axis
+    uint8_t  qmax[3][N];  ///< Upper corners of the child bounding boxes, as offsets from #origin, one array per axis
+    uint32_t child[N];    ///< Index of the child node, or of the first primitive for leaf children
+    uint16_t count[N];    ///< Number of primitives in a leaf child, or 0 for interior children
+
+    QuantizedBBHNode()
+    {
+        Box3f empty[N];
+        set_bounds(empty);
+        for (int i = 0; i < N; ++i)
+        {
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+
+    /// The size of one unit of the offsets along axis \p a
+    float scale(int a) const
+    {
+        // assemble 2^exponent directly from the bits of the float
+        uint32_t bits = uint32_t(exponent[a] + 127) << 23;
+        float    s;
+        std::memcpy(&s, &bits, sizeof(s));
+        return s;
+    }
+
+    /// Compress the bounds of all \p N children (which can only be done at once, since they share #origin)
+    void set_bounds(const Box3f (&b)[N])
+    {
+        Box3f all;
+        for (int i = 0; i < N; ++i)
+            if (!b[i].is_empty())
+                all.enclose(b[i]);
+
+        for (int a = 0; a < 3; ++a)
+        {
+            // the smallest power of two that spans the bounds in less than 255 steps, leaving room to round outwards
+            int e = 0;
+            std::frexp(all.is_empty() ? 0.f : (all.max[a] - all.min[a]) / 254.f, &e);
+            exponent[a] = int8_t(std::clamp(e, -126, 127));
+            origin[a]   = all.is_empty() ? 0.f : all.min[a];
+
+            float s = scale(a);
+            for (int i = 0; i < N; ++i)
+            {
+                if (b[i].is_empty())
+                {
+                    qmin[a][i] = 255;
+                    qmax[a][i] = 0;
+                    continue;
+                }
+                int lo = std::clamp(int(std::floor((b[i].min[a] - origin[a]) / s)), 0, 255);
+                int hi = std::clamp(int(std::ceil((b[i].max[a] - origin[a]) / s)), 0, 255);
+                // step outwards wherever rounding while decompressing would cut off part of the box
+                while (lo > 0 && origin[a] + lo * s > b[i].min[a]) --lo;
+                while (hi < 255 && origin[a] + hi * s < b[i].max[a]) ++hi;
+                qmin[a][i] = uint8_t(lo);
+                qmax[a][i] = uint8_t(hi);
+            }
+        }
+    }
+
+    /// The decompressed bounds of child \p i
+    Box3f bounds(int i) const
+    {
+        Box3f b;
+        for (int a = 0; a < 3; ++a)
+        {
+            if (qmin[a][i] > qmax[a][i])
+                return Box3f();
+            b.min[a] = origin[a] + qmin[a][i] * scale(a);
+            b.max[a] = origin[a] + qmax[a][i] * scale(a);
+        }
+        return b;
+    }
+
+    /// Whether lane \p i holds a child (the root is never a child, so unused lanes have a #child of 0)
+    bool used(int i) const
+    {
+        return count[i] > 0 || child[i] > 0;
+    }
+
+    /// Slab test of \p ray against all \p N children at once, decompressing their bounds on the fly
+    /// (see WideBBHNode::intersect())
+    void intersect(const Ray3f &ray, const Vec3f &inv_d, const bool dir_is_neg[3], float tnear[N], bool hit[N]) const
+    {
+        float tfar[N];
+        for (int i = 0; i < N; ++i)
+        {
+            tnear[i] = ray.mint;
+            tfar[i]  = ray.maxt;
+        }
+        for (int a = 0; a < 3; ++a)
+        {
+            const uint8_t *near = dir_is_neg[a] ? qmax[a] : qmin[a];
+            const uint8_t *far  = dir_is_neg[a] ? qmin[a] : qmax[a];
+            float          s    = scale(a);
+            for (int i = 0; i < N; ++i)
+            {
+                tnear[i] = std::max(tnear[i], (origin[a] + near[i] * s - ray.o[a]) * inv_d[a]);
+                tfar[i]  = std::min(tfar[i], (origin[a] + far[i] * s - ray.o[a]) * inv_d[a]);
+            }
+        }
+        for (int i = 0; i < N; ++i) hit[i] = used(i) && tnear[i] <= tfar[i];
+    }
+};
+static_assert(sizeof(QuantizedBBHNode<4>) == 64, "QuantizedBBHNode<4> should fit exactly into a cache line.");
+static_assert(sizeof(QuantizedBBHNode<8>) == 128, "QuantizedBBHNode<8> should fit exactly into two cache lines.");
+
+/// Bounds and centroid of a single primitive, precomputed once so the builder never needs to query the primitive again
+struct BBHPrimInfo
+{
+    Box3f    bbox;     ///< The bounding box of the primitive
+    Vec3f    centroid; ///< The center of #bbox
+    uint32_t index;    ///< Index of the primitive in the caller's list of primitives
+};
+
+/**
+    A bounding box hierarchy over an abstract list of primitives.
+
+    This class implements the construction and traversal logic shared by all users of a BBH (the #BBH SurfaceGroup,
+    and meshes with an internal BBH over their faces). It only knows about primitive bounds: #build() reorders a list
+    of #BBHPrimInfo so that each leaf references a consecutive range of it, and #intersect() calls back into the owner
+    to intersect the primitives in each leaf it reaches.
+*/
+class BBHTree
+{
+public:
+    enum class SplitMethod
+    {
+        SAH,
+        Middle,
+        Equal,
+        SBVH ///< The SAH with spatial splits, which reference primitives from several leaves (see #build())
+    } split_method       = SplitMethod::Middle;
+    int      max_leaf_size   = 1;
+    int      width           = 2;     ///< The branching factor of the flattened tree: 2, 4, or 8
+    bool     compress        = false; ///< Store the wide nodes as QuantizedBBHNode (requires a #width of 4 or 8)
+    float    refit_threshold = 1.5f;  ///< #refit() callers rebuild the tree once its SAH cost grew by this factor
+    float    build_cost      = 0.f;   ///< The #sah_cost() of the tree when it was built
+    float    sbvh_budget     = 1.5f;  ///< SplitMethod::SBVH: the maximum number of references per primitive, on average
+    uint32_t num_prims       = 0;     ///< The number of primitives the tree was built over
+
+    /// Subtrees with at least this many primitives have their two children built concurrently on the thread pool
+    static constexpr uint32_t parallel_build_threshold = 4096;
+    /// The number of bins used when evaluating the surface area heuristic
+    static constexpr int num_sah_bins = 32;
+    /// The cost of traversing a node relative to intersecting a primitive, as assumed by the surface area heuristic
+    static constexpr float sah_traversal_cost = 0.125f;
+    /// The maximum number of rays traversed together by #intersect_packet()
+    static constexpr int max_packet_size = 16;
+    /// SplitMethod::SBVH only tries spatial splits where the children of the best object split overlap by more than
+    /// this fraction of the root's surface area
+    static constexpr float sbvh_alpha = 1e-5f;
+    /// The maximum number of levels of the tree, which bounds the size of the traversal stacks (#build() throws if a
+    /// tree gets deeper)
+    static constexpr int max_depth = 64;
+    /// SplitMethod::SBVH stops trying spatial splits below this depth, so the tree stays within #max_depth
+    static constexpr int sbvh_max_depth = 48;
+
+    /**
+        Callable returning the bounds of the part of primitive \p index inside \p box.
+
+        Spatial splits use this to split the bounds of the primitives they cut through. Returning a box that encloses
+        the part of the primitive inside \p box (e.g. the clipped primitive bounds) is always correct, but the tighter
+        the bounds the more spatial splits pay off.
+    */
+    using ClipFunc = std::function<Box3f(uint32_t index, const Box3f &box)>;
+
+    /// Read the "split_method", "max_leaf_size", "width", "compress", "refit_threshold", and "sbvh_budget" parameters
+    /// from \p j
+    void parse(const json &j);
+
+    /**
+        Construct the tree over \p prim_info.
+
+        On return, \p prim_info has been reordered so that the leaves reference consecutive ranges of it: the
+        primitive indices passed to the leaf callback of #intersect() are indices into this reordered array.
+
+        With SplitMethod::SBVH, primitives cut by spatial splits are referenced by several leaves, so \p prim_info
+        also grows (by at most a factor of #sbvh_budget), and the same BBHPrimInfo::index may occur several times.
+        Their bounds are clipped with \p clip, or just to the split planes if it is null.
+    */
+    void build(vector<BBHPrimInfo> &prim_info, Progress &progress, const ClipFunc &clip = nullptr);
+
+    /**
+        Update the bounds of all nodes (bottom-up) after the primitives moved, keeping the structure of the tree.
+
+        This is much cheaper than rebuilding the tree, but the tree gets less efficient the further the primitives
+        move from where they were when it was built, which #sah_cost() measures.
+
+        \param prim_bounds The new bounds of each primitive, in the order of the reordered list passed to #build()
+    */
+    void refit(const vector<Box3f> &prim_bounds);
+
+    /**
+        The expected cost of intersecting a ray with the tree according to the surface area heuristic, in units of
+        primitive intersections.
+
+        Refitting a tree whose primitives have moved far from where they were when it was built increases this cost,
+        so comparing it to the #build_cost shows how much the tree has degraded.
+    */
+    float sah_cost() const;
+
+    /// Release all nodes
+    void clear();
+
+    /// Write the flattened tree to the scene cache
+    void save(CacheWriter &cache) const;
+
+    /// Read a flattened tree written by #save(), returning false if the cache entry is invalid
+    bool load(CacheReader &cache);
+
+    /// Whether the tree contains any nodes
+    bool empty() const
+    {
+        return nodes.empty() && nodes4.empty() && nodes8.empty() && qnodes4.empty() && qnodes8.empty();
+    }
+
+    /// The number of nodes in the flattened tree
+    size_t num_nodes() const
+    {
+        if (width == 4)
+            return compress ? qnodes4.size() : nodes4.size();
+        else if (width == 8)
+            return compress ? qnodes8.size() : nodes8.size();
+        return nodes.size();
+    }
+
+    /// The memory used by the flattened tree, in bytes
+    size_t size() const
+    {
+        return nodes.size() * sizeof(LinearBBHNode) + nodes4.size() * sizeof(WideBBHNode<4>) +
+               nodes8.size() * sizeof(WideBBHNode<8>) + qnodes4.size() * sizeof(QuantizedBBHNode<4>) +
+               qnodes8.size() * sizeof(QuantizedBBHNode<8>);
+    }
+
+    /**
+        Intersect a ray with the tree.
+
+        \param [in,out] ray     The ray to trace. Its \c maxt is used to cull nodes and should be shortened by the
+                                leaf callback whenever it finds a closer hit
+        \param [in]     leaf    Callable with signature <tt>bool(uint32_t first, uint32_t count, Ray3f &ray)</tt>
+                                which intersects \p ray with primitives <tt>[first, first + count)</tt> and returns
+                                whether any of them were hit
+        \return                 True if any call to \p leaf reported a hit
+    */
+    template <typename LeafFunc>
+    bool intersect(Ray3f &ray, LeafFunc &&leaf) const
+    {
+        if (width == 4)
+            return compress ? intersect_wide<false>(qnodes4, ray, leaf) : intersect_wide<false>(nodes4, ray, leaf);
+        else if (width == 8)
+            return compress ? intersect_wide<false>(qnodes8, ray, leaf) : intersect_wide<false>(nodes8, ray, leaf);
+        else
+            return intersect_binary<false>(ray, leaf);
+    }
+
+    /**
+        Determine whether a ray hits any primitive in the tree, stopping at the first leaf that reports a hit.
+
+        \copydetails intersect()
+    */
+    template <typename LeafFunc>
+    bool occluded(Ray3f &ray, LeafFunc &&leaf) const
+    {
+        if (width == 4)
+            return compress ? intersect_wide<true>(qnodes4, ray, leaf) : intersect_wide<true>(nodes4, ray, leaf);
+        else if (width == 8)
+            return compress ? intersect_wide<true>(qnodes8, ray, leaf) : intersect_wide<true>(nodes8, ray, leaf);
+        else
+            return intersect_binary<true>(ray, leaf);
+    }
+
+    /**
+        Intersect a packet of up to #max_packet_size rays with the tree.
+
+        The rays traverse the tree together, testing each node against all rays of the packet at once, for as long as
+        at least two of them reach a node. Once a subtree is only hit by a single ray, that ray continues on its own.
+        Trees with a #width of 4 or 8 are traversed one ray at a time.
+
+        \param [in,out] rays    The rays to trace, whose \c maxt the leaf callback should shorten at closer hits
+        \param [in]     count   The number of rays in the packet
+        \param [in]     leaf    Callable with signature <tt>bool(uint32_t first, uint32_t count, Ray3f &ray, int
+                                lane)</tt>, which intersects \p ray (number \p lane in the packet) with primitives
+                                <tt>[first, first + count)</tt> and returns whether any of them were hit
+    */
+    template <typename LeafFunc>
+    void intersect_packet(Ray3f *rays, int count, LeafFunc &&leaf) const;
+
+    vector<LinearBBHNode>       nodes;   ///< The flattened binary tree (if #width is 2), in depth-first order
+    vector<WideBBHNode<4>>      nodes4;  ///< The collapsed 4-wide tree (if #width is 4), root first
+    vector<WideBBHNode<8>>      nodes8;  ///< The collapsed 8-wide tree (if #width is 8), root first
+    vector<QuantizedBBHNode<4>> qnodes4; ///< The compressed 4-wide tree (if #width is 4 and #compress), root first
+    vector<QuantizedBBHNode<8>> qnodes8; ///< The compressed 8-wide tree (if #width is 8 and #compress), root first
+
+private:
+    /**
+        Recursively build the subtree over <tt>prim_info[begin, end)</tt>, reordering its elements in place.
+
+        The subtrees that are built serially step \p progress once when they are done (the ones below them are built
+        with \p report set to false), so that the concurrent tasks don't all contend for the progress counter at every
+        leaf. The nodes are created by \p alloc, and live until the whole tree is released after flattening it.
+    */
+    BBHBuildNode *build_recursive(BBHNodeAllocator &alloc, vector<BBHPrimInfo> &prim_info, uint32_t begin,
+                                  uint32_t end, Progress &progress, bool report = true) const;
+
+    /**
+        Build the tree with SplitMethod::SBVH, replacing \p prim_info by the (at most \p max_refs) references of the
+        leaves, in leaf order.
+
+        Unlike #build_recursive(), this builds the tree serially, since each node needs to own the list of its
+        references (whose bounds differ from those of the primitives once they are clipped).
+    */
+    BBHBuildNode *build_sbvh(BBHNodeAllocator &alloc, vector<BBHPrimInfo> &prim_info, uint32_t max_refs,
+                             const ClipFunc &clip, Progress &progress) const;
+
+    /// Append the subtree rooted at \p node to #nodes, returning its index within #nodes
+    uint32_t flatten(const BBHBuildNode *node);
+
+    /// Collapse the binary subtree rooted at \p node into wide nodes (of type \p Node) appended to \p wide_nodes
+    template <typename Node>
+    uint32_t flatten_wide(const BBHBuildNode *node, vector<Node> &wide_nodes);
+
+    /// Traverse the binary subtree rooted at node \p root, returning at the first hit if \p AnyHit
+    template <bool AnyHit, typename LeafFunc>
+    bool intersect_binary(Ray3f &ray, LeafFunc &leaf, uint32_t root = 0) const;
+
+    /// Traverse the wide tree (of WideBBHNode or QuantizedBBHNode), returning at the first hit if \p AnyHit
+    template <bool AnyHit, typename Node, typename LeafFunc>
+    bool intersect_wide(const vector<Node> &wide_nodes, Ray3f &ray, LeafFunc &leaf) const;
+};
+
+/** @}*/
+
+STAT_RATIO("BBH/Nodes visited per ray", bbh_nodes_visited, bbh_total_rays);
+STAT_RATIO("BBH/Active rays per packet node", bbh_packet_active_rays, bbh_packet_nodes_visited);
+
+template <bool AnyHit, typename LeafFunc>
+bool BBHTree::intersect_binary(Ray3f &ray, LeafFunc &leaf, uint32_t root) const
+{
+    if (nodes.empty())
+        return false;
+
+    ++bbh_total_rays;
+    bool  hit_something = false;
+    Vec3f inv_d         = 1.f / ray.d;
+    bool  dir_is_neg[3] = {inv_d.x < 0, inv_d.y < 0, inv_d.z < 0};
+
+    // follow ray through BBH nodes to find primitive intersections
+    uint32_t to_visit_offset = 0, current = root;
+    uint32_t to_visit[max_depth];
+    while (true)
+    {
+        ++bbh_nodes_visited;
+        ++g_render_cost.nodes_visited;
+        const LinearBBHNode &node = nodes[current];
+        if (node.bbox.intersect(ray, inv_d))
+        {
+            if (node.num_prims > 0)
+            {
+                // intersect ray with the primitives in the leaf node
+                g_render_cost.prims_tested += node.num_prims;
+                if (leaf(node.prims_offset, uint32_t(node.num_prims), ray))
+                {
+                    if constexpr (AnyHit)
+                        return true;
+                    hit_something = true;
+                }
+                if (to_visit_offset == 0)
+                    break;
+                current = to_visit[--to_visit_offset];
+            }
+            else
+            {
+                // put the far child on the stack, and advance to the near child
+                if (dir_is_neg[node.axis])
+                {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current                     = node.second_child_offset;
+                }
+                else
+                {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current                     = current + 1;
+                }
+            }
+        }
+        else
+        {
+            if (to_visit_offset == 0)
+                break;
+            current = to_visit[--to_visit_offset];
+        }
+    }
+
+    return hit_something;
+}
+
+template <typename LeafFunc>
+void BBHTree::intersect_packet(Ray3f *rays, int count, LeafFunc &&leaf) const
+{
+    constexpr int P = max_packet_size;
+
+    if (width != 2 || count < 2)
+    {
+        for (int i = 0; i < count; ++i)
+            intersect(rays[i], [&leaf, i](uint32_t first, uint32_t num, Ray3f &r) { return leaf(first, num, r, i); });
+        return;
+    }
+    if (nodes.empty())
+        return;
+
+    // precompute the per-ray quantities of the slab test, padding unused lanes with rays that never hit anything
+    float org[3][P], inv_d[3][P], tmin[P], tmax[P];
+    for (int i = 0; i < P; ++i)
+    {
+        const Ray3f &r = rays[std::min(i, count - 1)];
+        for (int a = 0; a < 3; ++a)
+        {
+            org[a][i]   = r.o[a];
+            inv_d[a][i] = 1.f / r.d[a];
+        }
+        tmin[i] = r.mint;
+        tmax[i] = i < count ? r.maxt : -1.f;
+    }
+    bbh_total_rays += count;
+
+    // the packet is coherent, so all rays visit the children in the order preferred by the first ray
+    bool dir_is_neg[3] = {inv_d[0][0] < 0, inv_d[1][0] < 0, inv_d[2][0] < 0};
+
+    uint32_t to_visit_offset = 0, current = 0;
+    uint32_t to_visit[max_depth];
+    while (true)
+    {
+        const LinearBBHNode &node = nodes[current];
+        ++bbh_packet_nodes_visited;
+        ++g_render_cost.nodes_visited;
+
+        // slab test of the node against all rays of the packet at once
+        bool hit_node[P];
+        int  num_hit = 0, last_hit = 0;
+        for (int i = 0; i < P; ++i)
+        {
+            float t0 = tmin[i], t1 = tmax[i];
+            for (int a = 0; a < 3; ++a)
+            {
+                float tn = (node.bbox.min[a] - org[a][i]) * inv_d[a][i];
+                float tf = (node.bbox.max[a] - org[a][i]) * inv_d[a][i];
+                t0       = std::max(t0, std::min(tn, tf));
+                t1       = std::min(t1, std::max(tn, tf));
+            }
+            hit_node[i] = t0 <= t1;
+        }
+        for (int i = 0; i < P; ++i)
+            if (hit_node[i])
+            {
+                ++num_hit;
+                last_hit = i;
+            }
+        bbh_packet_active_rays += num_hit;
+
+        if (num_hit == 1)
+        {
+            // the packet has diverged: let the one remaining ray traverse this subtree on its own
+            int  i          = last_hit;
+            auto single_ray = [&leaf, i](uint32_t first, uint32_t num, Ray3f &r) { return leaf(first, num, r, i); };
+            intersect_binary<false>(rays[i], single_ray, current);
+            tmax[i] = rays[i].maxt;
+        }
+        else if (num_hit > 1)
+        {
+            if (node.num_prims > 0)
+            {
+                // intersect the rays that reached the leaf with its primitives
+                g_render_cost.prims_tested += num_hit * node.num_prims;
+                for (int i = 0; i < count; ++i)
+                    if (hit_node[i] && leaf(node.prims_offset, uint32_t(node.num_prims), rays[i], i))
+                        tmax[i] = rays[i].maxt;
+            }
+            else
+            {
+                // put the far child on the stack, and advance to the near child
+                if (dir_is_neg[node.axis])
+                {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current                     = node.second_child_offset;
+                }
+                else
+                {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current                     = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (to_visit_offset == 0)
+            break;
+        current = to_visit[--to_visit_offset];
+    }
+}
+
+template <bool AnyHit, typename Node, typename LeafFunc>
+bool BBHTree::intersect_wide(const vector<Node> &wide_nodes, Ray3f &ray, LeafFunc &leaf) const
+{
+    constexpr int N = Node::width;
+
+    if (wide_nodes.empty())
+        return false;
+
+    ++bbh_total_rays;
+    bool  hit_something = false;
+    Vec3f inv_d         = 1.f / ray.d;
+    bool  dir_is_neg[3] = {inv_d.x < 0, inv_d.y < 0, inv_d.z < 0};
+
+    struct StackEntry
+    {
+        uint32_t child, count;
+        float    tnear;
+    };
+    StackEntry to_visit[max_depth * N];
+    int        to_visit_offset  = 0;
+    to_visit[to_visit_offset++] = {0, 0, ray.mint};
+
+    while (to_visit_offset > 0)
+    {
+        StackEntry entry = to_visit[--to_visit_offset];
+
+        // skip subtrees that are farther away than the closest hit found so far
+        if (entry.tnear > ray.maxt)
+            continue;
+
+        if (entry.count > 0)
+        {
+            // intersect ray with the primitives in the leaf
+            g_render_cost.prims_tested += entry.count;
+            if (leaf(entry.child, entry.count, ray))
+            {
+                if constexpr (AnyHit)
+                    return true;
+                hit_something = true;
+            }
+            continue;
+        }
+
+        ++bbh_nodes_visited;
+        ++g_render_cost.nodes_visited;
+        const Node &node = wide_nodes[entry.child];
+
+        // slab test against all N children at once
+        float tnear[N];
+        bool  hit_child[N];
+        node.intersect(ray, inv_d, dir_is_neg, tnear, hit_child);
+
+        // push the children that were hit so that the closest one is visited first
+        int first = to_visit_offset;
+        for (int i = 0; i < N; ++i)
+            if (hit_child[i])
+            {
+                int j = to_visit_offset++;
+                for (; j > first && to_visit[j - 1].tnear < tnear[i]; --j) to_visit[j] = to_visit[j - 1];
+                to_visit[j] = {node.child[i], node.count[i], tnear[i]};
+            }
+    }
+
+    return hit_something;
+}
+
+/**
+    \file
+    \brief Class #BBHTree and the node layouts used by the BBH acceleration structures
+*/
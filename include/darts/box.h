@@ -54,6 +54,13 @@ struct Box
         max = la::max(max, p);
     }
 
+    /// Shrink the box to its intersection with \p box2, which leaves it empty if the two boxes are disjoint
+    void clip(const Box &box2)
+    {
+        min = la::max(min, box2.min);
+        max = la::min(max, box2.max);
+    }
+
     /// Check whether the box contains this \p point.
     bool contains(const Vec<N, T> &point, bool proper = false) const
     {
@@ -136,6 +143,41 @@ struct Box
             *hitt1 = maxT;
         return true;
     }
+
+    /**
+        Check whether a #Ray intersects this #Box, using a precomputed reciprocal ray direction.
+
+        This is useful when testing the same ray against many boxes (e.g. while traversing an acceleration structure).
+
+        \param ray      The ray along which to check for intersection
+        \param inv_d    The component-wise reciprocal of the ray direction, <tt>1 / ray.d</tt>
+        \param hitt0    If not null, stores the lower bound of the intersection interval
+        \param hitt1    If not null, stores the upper bound of the intersection interval
+        \return         \c true if there is an intersection
+    */
+    bool intersect(const Ray<N, T> &ray, const Vec<N, T> &inv_d, T *hitt0 = nullptr, T *hitt1 = nullptr) const
+    {
+        T minT = ray.mint;
+        T maxT = ray.maxt;
+
+        for (auto i : range(N))
+        {
+            T t0 = (min[i] - ray.o[i]) * inv_d[i];
+            T t1 = (max[i] - ray.o[i]) * inv_d[i];
+            if (inv_d[i] < T(0))
+                std::swap(t0, t1);
+
+            minT = t0 > minT ? t0 : minT;
+            maxT = t1 < maxT ? t1 : maxT;
+            if (maxT < minT)
+                return false;
+        }
+        if (hitt0)
+            *hitt0 = minT;
+        if (hitt1)
+            *hitt1 = maxT;
+        return true;
+    }
 };
 
 template <typename T>
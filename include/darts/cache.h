@@ -0,0 +1,256 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+#include <fstream>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
+/** \addtogroup Utilities
+    @{
+*/
+
+/**
+    Set the directory used to cache the results of expensive scene loading steps (mesh parsing, BBH construction).
+
+    Caching is disabled (the default) if \p dir is empty. The directory is created if it does not exist yet.
+*/
+void set_cache_dir(const string &dir);
+
+/// The directory used for caching, or an empty string if caching is disabled
+const string &cache_dir();
+
+/// Whether the binary scene cache is enabled
+inline bool cache_enabled()
+{
+    return !cache_dir().empty();
+}
+
+/// Incrementally compute a 64-bit FNV-1a hash of some data, used to key entries in the cache
+class Hasher
+{
+public:
+    /// Hash \p size raw bytes
+    Hasher &add(const void *data, size_t size)
+    {
+        auto bytes = reinterpret_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) m_hash = (m_hash ^ bytes[i]) * 1099511628211ull;
+        return *this;
+    }
+
+    Hasher &add(const string &s)
+    {
+        add(s.data(), s.size());
+        return add_pod(s.size());
+    }
+
+    /// Hash a trivially copyable value
+    template <typename T>
+    Hasher &add_pod(const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only hash trivially copyable types.");
+        return add(&value, sizeof(T));
+    }
+
+    /// Hash the contents of a vector of trivially copyable values
+    template <typename T>
+    Hasher &add(const vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only hash trivially copyable types.");
+        add(v.data(), v.size() * sizeof(T));
+        return add_pod(v.size());
+    }
+
+    uint64_t value() const
+    {
+        return m_hash;
+    }
+
+private:
+    uint64_t m_hash = 14695981039346656037ull;
+};
+
+/// Return a hash of the modification time and size of \p filename, which changes whenever the file does
+uint64_t file_signature(const string &filename);
+
+/**
+    Write an entry of the binary scene cache.
+
+    Each entry is identified by a \p kind (e.g. "mesh") and a 64-bit \p key. The data is first written to a temporary
+    file, which is atomically renamed when the writer is destroyed, so that several processes sharing the same cache
+    directory never see partially written entries.
+*/
+class CacheWriter
+{
+public:
+    CacheWriter(const string &kind, uint64_t key);
+    ~CacheWriter();
+
+    /// Whether the entry could be opened and everything so far was written successfully
+    bool good() const
+    {
+        return m_stream.good();
+    }
+
+    /// Write a trivially copyable value
+    template <typename T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only cache trivially copyable types.");
+        m_stream.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    /// Write a vector of trivially copyable values
+    template <typename T>
+    void write(const vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only cache trivially copyable types.");
+        write(uint64_t(v.size()));
+        m_stream.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+    }
+
+    void write(const string &s)
+    {
+        write(uint64_t(s.size()));
+        m_stream.write(s.data(), s.size());
+    }
+
+private:
+    string        m_filename, m_tmp_filename;
+    std::ofstream m_stream;
+};
+
+/// Read an entry of the binary scene cache written by #CacheWriter
+class CacheReader
+{
+public:
+    /// Open the entry with the given \p kind and \p key. Check #good() to see if the entry exists and is valid
+    CacheReader(const string &kind, uint64_t key);
+
+    /// Whether the entry exists and everything so far was read successfully
+    bool good() const
+    {
+        return m_stream.good();
+    }
+
+    /// Read a trivially copyable value
+    template <typename T>
+    void read(T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only cache trivially copyable types.");
+        m_stream.read(reinterpret_cast<char *>(&value), sizeof(T));
+    }
+
+    /// Read a vector of trivially copyable values
+    template <typename T>
+    void read(vector<T> &v)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Can only cache trivially copyable types.");
+        uint64_t size = 0;
+        read(size);
+        if (!fits(size, sizeof(T)))
+            return;
+        v.resize(size);
+        m_stream.read(reinterpret_cast<char *>(v.data()), size * sizeof(T));
+    }
+
+    void read(string &s)
+    {
+        uint64_t size = 0;
+        read(size);
+        if (!fits(size, 1))
+            return;
+        s.resize(size);
+        m_stream.read(&s[0], size);
+    }
+
+    /// The current read position within the entry, for #seek()ing back to it later
+    uint64_t position()
+    {
+        return uint64_t(m_stream.tellg());
+    }
+
+    /// Continue reading at \p pos, a value returned by #position()
+    void seek(uint64_t pos)
+    {
+        m_stream.seekg(std::streamoff(pos));
+    }
+
+private:
+    /// Whether \p count elements of \p bytes each are left in the entry, failing the stream otherwise (so a corrupt
+    /// size is never allocated)
+    bool fits(uint64_t count, size_t bytes)
+    {
+        if (!good())
+            return false;
+        uint64_t pos = uint64_t(m_stream.tellg());
+        if (pos > m_size || count > (m_size - pos) / bytes)
+        {
+            m_stream.setstate(std::ios::failbit);
+            return false;
+        }
+        return true;
+    }
+
+    std::ifstream m_stream;
+    uint64_t      m_size = 0; ///< The size of the entry in bytes
+};
+
+/**
+    The live objects of type \p T (e.g. meshes) that were loaded from files, keyed like the binary scene cache.
+
+    This lets a scene that is parsed while another one is still alive (e.g. the next frame of a batch, see \c darts)
+    copy the loaded data instead of reading and parsing the same files again, whether or not the binary scene cache is
+    enabled. Objects #add() themselves once they are loaded and #remove() themselves when they are destroyed.
+*/
+template <typename T>
+class LoadedAssets
+{
+public:
+    /// Make \p asset available under \p key, replacing any other asset with the same key
+    void add(uint64_t key, const T *asset)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_assets[key] = asset;
+    }
+
+    /// Stop offering \p asset under \p key (e.g. because it is being destroyed)
+    void remove(uint64_t key, const T *asset)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto it = m_assets.find(key); it != m_assets.end() && it->second == asset)
+            m_assets.erase(it);
+    }
+
+    /**
+        Call \p func with the asset loaded under \p key, if any, and return whether there was one.
+
+        The asset cannot be destroyed while \p func runs, so \p func should only copy what it needs.
+    */
+    template <typename Func>
+    bool reuse(uint64_t key, Func &&func) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto                        it = m_assets.find(key);
+        if (it == m_assets.end())
+            return false;
+        func(*it->second);
+        return true;
+    }
+
+private:
+    mutable std::mutex                      m_mutex;
+    std::unordered_map<uint64_t, const T *> m_assets;
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief A simple versioned binary cache for expensive scene loading steps
+*/
@@ -19,6 +19,10 @@
     system. It has an image plane positioned a z = -dist with size
     (width, height).
 
+    For motion blur, the camera can open its shutter over an interval of time (\c "shutter", a pair of times in
+    [0,1]), and also move from its \c "transform" to an \c "end_transform" during it. Surfaces that support motion
+    blur move over the same interval of time.
+
     We currently only support pinhole perspective cameras. This class could
     be made into a virtual base class to support other types of cameras
     (e.g. an orthographic camera, or omni-directional camera).
@@ -61,17 +65,48 @@ public:
         respectively.
 
         \param pixel 	        The pixel position within the image.
+        \param lens_rv          A 2D random variable in \f$[0,1)^2\f$ used to sample a point on the aperture.
         \return 	            The #Ray data structure filled with the appropriate position and direction.
      */
+    Ray3f generate_ray(const Vec2f &pixel, const Vec2f &lens_rv) const;
+
+    /// Generate a ray going through \p pixel, sampling the aperture with the global randf() RNG
     Ray3f generate_ray(const Vec2f &pixel) const;
 
+    /**
+        Generate a ray going through \p pixel at \p time, taking the motion of the camera into account.
+
+        Unlike the other overloads, the ray also carries a footprint (see #Ray::spread) about one pixel wide, which
+        the renderers propagate along the path to filter texture lookups.
+    */
+    Ray3f generate_ray(const Vec2f &pixel, const Vec2f &lens_rv, float time) const;
+
+    /// Whether the shutter is open for a non-empty interval of time, so renderings should sample #sample_time()
+    bool has_motion_blur() const
+    {
+        return m_shutter.x < m_shutter.y;
+    }
+
+    /// The times at which the shutter opens and closes
+    const Vec2f &shutter() const
+    {
+        return m_shutter;
+    }
+
+    /// Map the random variable \p rv in [0,1) to a time within the shutter interval
+    float sample_time(float rv) const
+    {
+        return lerp(m_shutter.x, m_shutter.y, rv);
+    }
 
 private:
-    Transform m_xform           = Transform();     ///< Local coordinate system
-    Vec2f     m_size            = Vec2f(1, 1);     ///< Physical size of the image plane
-    float     m_focal_distance  = 1.f;             ///< Distance to image plane along local z axis
-    Vec2i     m_resolution      = Vec2i(512, 512); ///< Image resolution
-    float     m_aperture_radius = 0.f;             ///< The size of the aperture for depth of field
+    Transform         m_xform           = Transform();     ///< Local coordinate system
+    Vec2f             m_size            = Vec2f(1, 1);     ///< Physical size of the image plane
+    float             m_focal_distance  = 1.f;             ///< Distance to image plane along local z axis
+    Vec2i             m_resolution      = Vec2i(512, 512); ///< Image resolution
+    float             m_aperture_radius = 0.f;             ///< The size of the aperture for depth of field
+    Vec2f             m_shutter         = Vec2f(0.f, 0.f); ///< The times at which the shutter opens and closes
+    AnimatedTransform m_motion;                            ///< The motion during the shutter interval, if any
 };
 
 /**
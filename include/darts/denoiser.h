@@ -0,0 +1,49 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/aov.h>
+#include <darts/factory.h>
+#include <darts/image.h>
+
+/** \addtogroup Integrators
+    @{
+*/
+
+/**
+    Abstract denoiser: removes the Monte Carlo noise from a rendered image, guided by its AOVs.
+
+    Denoisers are created by the #DartsFactory, e.g. from the \c "denoiser" field of the scene or the \c --denoise
+    option of darts. The built-in \c "nlmeans" denoiser is always available; the \c "oidn" denoiser (Intel Open Image
+    Denoise) is only compiled with the \c USE_OIDN CMake option.
+*/
+class Denoiser
+{
+public:
+    /// Default constructor which accepts a #json object of named parameters
+    Denoiser(const json &j = json::object())
+    {
+    }
+
+    /// Free all memory
+    virtual ~Denoiser() = default;
+
+    /**
+        Denoise the rendered image \p color.
+
+        \param color    The noisy image
+        \param aovs     The AOVs of \p color (see Scene::raytrace()) to guide the denoiser, or null if there are none
+        \return         The denoised image, of the same size
+    */
+    virtual Image3f denoise(const Image3f &color, const AOVBuffers *aovs) const = 0;
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #Denoiser
+*/
@@ -0,0 +1,164 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <darts/math.h>
+
+/** \addtogroup Surfaces
+    @{
+*/
+
+/** \name Binary mesh format
+
+    A compact binary format for triangle meshes (with the extension \c .dmesh), which #Mesh can load much faster than
+    an OBJ file, and with less temporary memory, by memory-mapping it.
+
+    A file starts with a #DMeshHeader, followed by the sections listed in #DMeshSection, each starting at a 16-byte
+    aligned offset given in the header (an offset of 0 means that the section is absent):
+
+    - \c Positions: \c num_vertices positions, either as three floats, or (with #DMeshQuantizedPositions) as three
+      uint16 values quantized within the header's bounds
+    - \c Normals: \c num_normals octahedrally encoded unit vectors of 32 bits each (see #encode_octahedral())
+    - \c UVs: \c num_uvs texture coordinates as two half floats
+    - \c VertexIndices, \c NormalIndices, \c UVIndices: three indices per face, as uint32 values, or as uint16 values
+      with #DMeshShortIndices. The largest value of the type marks a missing index
+    - \c MaterialIndices: one index into the material names per face, of the same type as the other indices
+    - \c MaterialNames: \c num_materials strings, each stored as a uint32 length followed by its characters. The first
+      one refers to the mesh's default material and is empty
+
+    Use the \c obj2dmesh tool to convert OBJ files to this format.
+
+    @{
+*/
+
+/// The current version of the binary mesh format
+constexpr uint32_t dmesh_version = 1;
+
+/// The sections of a binary mesh file, in the order they are stored in
+enum DMeshSection : uint32_t
+{
+    DMeshPositions = 0,
+    DMeshNormals,
+    DMeshUVs,
+    DMeshVertexIndices,
+    DMeshNormalIndices,
+    DMeshUVIndices,
+    DMeshMaterialIndices,
+    DMeshMaterialNames,
+    DMeshNumSections
+};
+
+/// Flags describing the encoding of a binary mesh file
+enum DMeshFlags : uint32_t
+{
+    DMeshQuantizedPositions = 1 << 0, ///< The positions are stored as 16-bit values within the bounds
+    DMeshShortIndices       = 1 << 1  ///< All indices are stored as 16-bit values
+};
+
+/// The header at the beginning of a binary mesh file
+struct DMeshHeader
+{
+    char     magic[4]      = {'D', 'M', 'S', 'H'};
+    uint32_t version       = dmesh_version;
+    uint32_t flags         = 0; ///< A combination of #DMeshFlags
+    uint32_t num_vertices  = 0;
+    uint32_t num_normals   = 0;
+    uint32_t num_uvs       = 0;
+    uint32_t num_faces     = 0;
+    uint32_t num_materials = 0;
+    float    bounds_min[3] = {0.f, 0.f, 0.f}; ///< The bounds of the positions
+    float    bounds_max[3] = {0.f, 0.f, 0.f};
+    uint64_t offsets[DMeshNumSections] = {}; ///< The offset of each section from the beginning of the file, or 0
+};
+
+/// Reinterpret the bits of \p from as type \p To
+template <typename To, typename From>
+inline To bit_cast_pod(const From &from)
+{
+    static_assert(sizeof(To) == sizeof(From), "bit_cast_pod needs types of the same size.");
+    To to;
+    std::memcpy(&to, &from, sizeof(To));
+    return to;
+}
+
+/// Convert \p f to a 16-bit half float, rounding to the nearest representable value
+inline uint16_t float_to_half(float f)
+{
+    uint32_t x    = bit_cast_pod<uint32_t>(f);
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t bits = x & 0x7fffffffu;
+
+    if (bits >= 0x7f800000u) // infinity or NaN
+        return uint16_t(sign | 0x7c00u | (bits > 0x7f800000u ? 0x200u : 0u));
+    if (bits >= 0x477ff000u) // too large, round to infinity
+        return uint16_t(sign | 0x7c00u);
+    if (bits < 0x38800000u) // a half subnormal (or zero)
+        return uint16_t(sign | uint32_t(std::nearbyint(bit_cast_pod<float>(bits) * 0x1p24f)));
+
+    // rebias the exponent, and round the mantissa to nearest even
+    bits += 0xc8000fffu + ((bits >> 13) & 1u);
+    return uint16_t(sign | (bits >> 13));
+}
+
+/// Convert the 16-bit half float \p h to a float
+inline float half_to_float(uint16_t h)
+{
+    uint32_t sign     = uint32_t(h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1fu;
+    uint32_t mantissa = h & 0x3ffu;
+
+    if (exponent == 0) // subnormal (or zero)
+    {
+        float f = float(mantissa) * 0x1p-24f;
+        return sign ? -f : f;
+    }
+    if (exponent == 31) // infinity or NaN
+        return bit_cast_pod<float>(sign | 0x7f800000u | (mantissa << 13));
+    return bit_cast_pod<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+/**
+    Encode the unit vector \p n in 32 bits.
+
+    The unit sphere is mapped to an octahedron, which is unfolded onto the square <tt>[-1,1]^2</tt>, and the two
+    coordinates in that square are stored as 16-bit signed normalized integers (see Cigolle et al.'s "A Survey of
+    Efficient Representations for Independent Unit Vectors", JCGT 2014), which keeps the error to a few thousandths of a
+    degree.
+*/
+inline uint32_t encode_octahedral(const Vec3f &n)
+{
+    auto  sign_not_zero = [](float v) { return v >= 0.f ? 1.f : -1.f; };
+    float l1            = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    Vec2f p             = l1 > 0.f ? Vec2f(n.x, n.y) / l1 : Vec2f(0.f);
+    if (n.z < 0.f)
+        p = Vec2f((1.f - std::abs(p.y)) * sign_not_zero(p.x), (1.f - std::abs(p.x)) * sign_not_zero(p.y));
+
+    auto quantize = [](float v)
+    { return uint32_t(uint16_t(int16_t(std::round(std::clamp(v, -1.f, 1.f) * 32767.f)))); };
+    return quantize(p.x) | (quantize(p.y) << 16);
+}
+
+/// Decode a unit vector encoded by #encode_octahedral()
+inline Vec3f decode_octahedral(uint32_t bits)
+{
+    Vec2f p(std::max(int16_t(bits & 0xffffu) / 32767.f, -1.f), std::max(int16_t(bits >> 16) / 32767.f, -1.f));
+    Vec3f n(p.x, p.y, 1.f - std::abs(p.x) - std::abs(p.y));
+    float t = std::max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return normalize(n);
+}
+
+/** @}*/
+
+/** @}*/
+
+/**
+    \file
+    \brief The binary mesh format read by #Mesh and written by the \c obj2dmesh tool
+*/
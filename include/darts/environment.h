@@ -0,0 +1,62 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/image.h>
+#include <darts/sampling.h>
+#include <darts/surface.h>
+#include <darts/transform.h>
+
+/**
+    An infinitely distant environment map lighting the scene from all directions.
+
+    The map is an equirectangular (latitude-longitude) HDR image in which the pole of the spherical coordinates is the
+    local z-axis; use the \c "transform" to orient it within the scene. It is specified as the scene's background:
+
+    \code{.json}
+    "background": {"type": "environment", "filename": "sky.exr", "scale": 1.0, "transform": {...}}
+    \endcode
+
+    Besides looking up the radiance of escaping rays, it can importance sample directions proportionally to the
+    luminance of its pixels (weighted by \f$\sin\theta\f$ to account for the distortion of the mapping), so that
+    integrators can use it for next-event estimation.
+
+    \ingroup Surfaces
+*/
+class Environment
+{
+public:
+    Environment(const json &j = json::object());
+
+    /// Return the radiance arriving from the world-space direction \p dir
+    Color3f eval(const Vec3f &dir) const;
+
+    /**
+        Sample a direction towards the environment from \p rec.o.
+
+        Store the result in \p rec (with \p rec.hit.t set to infinity and \p rec.emitter to nullptr), and return the
+        radiance divided by the solid-angle density of the sample. A zero value means that sampling failed.
+    */
+    Color3f sample(EmitterRecord &rec, const Vec2f &rv) const;
+
+    /// Return the solid angle density of sampling the world-space direction \p dir with #sample()
+    float pdf(const Vec3f &dir) const;
+
+protected:
+    /// The pixel seen along the local-space direction \p dir
+    Vec2i pixel(const Vec3f &dir) const;
+
+    Image3f        m_image;                   ///< The equirectangular map
+    float          m_scale     = 1.f;         ///< Multiplier applied to the radiance of #m_image
+    Transform      m_xform     = Transform(); ///< Local-to-world transformation
+    Transform      m_inv_xform = Transform(); ///< Cached inverse of #m_xform
+    Distribution2D m_distribution;            ///< Distribution over the pixels of #m_image
+};
+
+/**
+    \file
+    \brief Class #Environment
+*/
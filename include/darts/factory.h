@@ -6,6 +6,7 @@
 #pragma once
 
 #include <darts/json.h>
+#include <mutex>
 
 /// Abstract factory used to construct objects by name.
 /// \ingroup Parser
@@ -116,11 +117,13 @@ public:
         {
             string name = j.get<string>();
             // find a pre-declared SharedT
-            auto i = instance_registry().find(name);
-            if (i != instance_registry().end())
-                return i->second;
-            else
-                throw DartsException("Cannot find an object with name '{}' here:\n{}", name, jp.dump(4));
+            {
+                std::lock_guard<std::mutex> lock(instance_mutex());
+                auto                        i = instance_registry().find(name);
+                if (i != instance_registry().end())
+                    return i->second;
+            }
+            throw DartsException("Cannot find an object with name '{}' here:\n{}", name, jp.dump(4));
         }
         else if (j.is_object())
         {
@@ -147,9 +150,17 @@ public:
     /// Associate and store a shared_ptr to an object instance \p o with the name \p name
     static void register_instance(const std::string &name, SharedT o)
     {
+        std::lock_guard<std::mutex> lock(instance_mutex());
         instance_registry()[name] = o;
     }
 
+    /// Forget all instances stored with #register_instance(), so names from a previously parsed scene are not found
+    static void clear_instances()
+    {
+        std::lock_guard<std::mutex> lock(instance_mutex());
+        instance_registry().clear();
+    }
+
 protected:
     /// Global map of #SharedT instances that have been create/parsed
     static std::map<std::string, SharedT> &instance_registry()
@@ -157,6 +168,13 @@ protected:
         static std::map<std::string, SharedT> registry;
         return registry;
     }
+
+    /// Guards #instance_registry(), since surfaces (which may register and look up instances) are parsed concurrently
+    static std::mutex &instance_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
 };
 
 template <>
@@ -0,0 +1,101 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+#include <darts/image.h>
+#include <darts/math.h>
+
+/** \addtogroup Utilities
+    @{
+*/
+
+/// The formats in which a #Framebuffer can store its pixels
+enum class PixelFormat : uint8_t
+{
+    Float, ///< Three 32-bit floats (12 bytes per pixel)
+    Half,  ///< Three 16-bit half floats (6 bytes per pixel), the precision darts writes to EXR files
+    RGBE   ///< Greg Ward's shared-exponent format (4 bytes per pixel), like the power of a #Photon
+};
+
+/// Parse a #PixelFormat from its name: \c "float", \c "half", or \c "rgbe"
+PixelFormat parse_pixel_format(const string &name);
+
+/**
+    The number of equally weighted batches of samples that can be blended into a pixel of \p format (see
+    Framebuffer::blend()) before the weight of the next batch drops so low that rounding swallows most of its update.
+*/
+int max_blends(PixelFormat format);
+
+/**
+    A color image kept in a compact #PixelFormat, for the accumulation buffers of large renderings.
+
+    The renderers accumulate the running average of the samples taken in each pixel (see #blend()) rather than their
+    sum, so the rounding error of the compact formats stays relative to the final pixel values. Each blend is rounded,
+    though, so once a batch makes up less than about 1 / #max_blends() of the samples, it barely changes the pixel:
+    many small batches need to be summed up in floats first (like the passes of a progressive rendering). The pixels
+    are encoded and decoded on every access, so the format trades a little time for a lot of memory: a 16K x 8K
+    framebuffer takes 1.5 GB as floats, but only 0.75 GB as halves, and 0.5 GB as RGBE. Statistics that need full
+    precision (like the variance estimates of adaptive sampling) stay in floats.
+*/
+class Framebuffer
+{
+public:
+    /// Create a black framebuffer of \p size pixels
+    Framebuffer(const Vec2i &size, PixelFormat format = PixelFormat::Float);
+
+    Framebuffer(const Framebuffer &)            = delete;
+    Framebuffer &operator=(const Framebuffer &) = delete;
+
+    /// The (decoded) value of pixel \p i (in scanline order)
+    Color3f get(int i) const;
+
+    /// Set pixel \p i to \p c, rounded to the #format()
+    void set(int i, const Color3f &c);
+
+    /// Move pixel \p i towards \p c by the fraction \p t, e.g. to add a batch of samples to a running average
+    void blend(int i, const Color3f &c, float t)
+    {
+        set(i, t >= 1.f ? c : lerp(get(i), c, t));
+    }
+
+    /// Decode all pixels into an image
+    Image3f image() const;
+
+    Vec2i size() const
+    {
+        return m_size;
+    }
+
+    int length() const
+    {
+        return m_size.x * m_size.y;
+    }
+
+    PixelFormat format() const
+    {
+        return m_format;
+    }
+
+    /// The number of bytes each pixel takes
+    size_t bytes_per_pixel() const
+    {
+        return m_stride;
+    }
+
+private:
+    Vec2i           m_size;
+    PixelFormat     m_format;
+    size_t          m_stride; ///< The number of bytes per pixel
+    vector<uint8_t> m_data;   ///< The encoded pixels
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #Framebuffer
+*/
@@ -7,6 +7,7 @@
 
 // Forward declarations
 class Camera;
+class Environment;
 template <typename T>
 class Image;
 class Integrator;
@@ -0,0 +1,264 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <algorithm>
+#include <darts/common.h>
+#include <darts/point_kdtree.h>
+#include <vector>
+
+/**
+    A uniform grid, stored in a hash table, that accelerates fixed-radius queries of N-dimensional points with
+    associated data.
+
+    The points are binned into cubical cells (whose side length is passed to #build()), and a search only needs to look
+    at the few cells that overlap its radius. Choosing the cell size equal to the search radius (as e.g. in progressive
+    photon mapping) means that a 3D query checks at most 27 cells. Only the non-empty cells take up memory: the cells
+    are hashed (following Teschner et al.'s "Optimized Spatial Hashing for Collision Detection of Deformable Objects")
+    into a table with about as many entries as there are points. Points in cells that collide in the table are rejected
+    by the distance test.
+
+    Building the grid is a counting sort of the points by their hash table entry, i.e. a couple of linear passes, which
+    is much cheaper than building a #PointKDTree. This makes it a good fit for data that is rebuilt often, like the
+    photon map of each iteration of progressive photon mapping.
+
+    It provides the same interface for filling and searching as #PointKDTree, and accepts the same search objects
+    (which must provide \c query_position, \c max_dist2, and <tt>check(node, dist2)</tt>). Since the cells to visit are
+    determined by the initial \c max_dist2 of a search, it is mostly meant for fixed-radius searches.
+
+    \tparam N       The number of dimensions (at most 4)
+    \tparam T       The underlying type of #Position (e.g. float or double)
+    \tparam Data    Any data type to associate with each Position.
+*/
+template <int N, class T, typename Data>
+class HashGrid
+{
+    static_assert(N >= 1 && N <= 4, "HashGrid only supports up to 4 dimensions.");
+
+public:
+    using Position = Vec<N, T>;
+    using Node     = typename PointKDTree<N, T, Data>::Node;
+    using Nodes    = std::vector<Node>;
+
+    Nodes     nodes;  ///< All points of the grid, sorted by their hash table entry after #build()
+    Box<N, T> bounds; ///< Bounding box containing all the elements
+
+    /// Return the number of points in the grid
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    /// Ensure that the #nodes vector can store at least \p t elements
+    void reserve(size_t t)
+    {
+        nodes.reserve(t);
+    }
+
+    /// Clear all points and the grid, keeping the allocated memory
+    void clear()
+    {
+        nodes.clear();
+        m_cell_start.clear();
+        bounds = Box<N, T>();
+    }
+
+    /// Insert a data point, and update the #bounds. The grid needs to be rebuilt afterwards
+    void insert(const Position &k, const Data &v)
+    {
+        nodes.push_back(Node(k, v));
+        bounds.enclose(k);
+    }
+
+    /// Append several batches of points in a single pass. \copydetails PointKDTree::merge()
+    void merge(std::vector<Nodes> &batches)
+    {
+        std::vector<size_t> offsets(batches.size() + 1, nodes.size());
+        for (size_t b = 0; b < batches.size(); ++b) offsets[b + 1] = offsets[b] + batches[b].size();
+        nodes.resize(offsets.back());
+
+        std::vector<Box<N, T>> batch_bounds(batches.size());
+        parallel_for(blocked_range<size_t>(0, batches.size(), 1),
+                     [&](blocked_range<size_t> r)
+                     {
+                         for (auto b : r)
+                         {
+                             std::copy(batches[b].begin(), batches[b].end(), nodes.begin() + offsets[b]);
+                             for (auto &node : batches[b]) batch_bounds[b].enclose(node.position);
+                             Nodes().swap(batches[b]);
+                         }
+                     });
+
+        for (auto &box : batch_bounds) bounds.enclose(box);
+    }
+
+    /**
+        Build the grid with cells of side \p cell_size, reordering #nodes by cell.
+
+        The hash table entries of the points are computed in parallel, and the points are then counting-sorted: a
+        histogram of the entries is turned into the start of each entry's range in #nodes by a prefix sum, and each
+        point is moved to the next free slot of its entry. This keeps the order of the points within an entry (and
+        therefore the result of a search) deterministic.
+    */
+    void build(T cell_size)
+    {
+        m_cell_start.clear();
+        if (nodes.empty())
+            return;
+
+        if (!(cell_size > T(0)))
+            throw DartsException("HashGrid::build(): the cell size must be positive, got {}.", cell_size);
+
+        m_inv_cell_size = T(1) / cell_size;
+        for (int a = 0; a < N; ++a)
+            m_res[a] = int(std::min(std::floor(bounds.diagonal()[a] * m_inv_cell_size), T(1 << 30))) + 1;
+
+        // a power-of-two table with at least as many entries as points
+        m_mask = 1;
+        while (m_mask < size()) m_mask <<= 1;
+        m_mask -= 1;
+
+        std::vector<uint32_t> entry(size());
+        parallel_for(blocked_range<size_t>(0, size(), 1 << 14),
+                     [&](blocked_range<size_t> r)
+                     {
+                         for (auto i : r) entry[i] = hash(cell(nodes[i].position)) & m_mask;
+                     });
+
+        // counting sort by hash table entry
+        m_cell_start.assign(size_t(m_mask) + 2, 0);
+        for (auto e : entry) ++m_cell_start[e + 1];
+        for (size_t e = 1; e < m_cell_start.size(); ++e) m_cell_start[e] += m_cell_start[e - 1];
+
+        std::vector<uint32_t> next(m_cell_start.begin(), m_cell_start.end() - 1);
+        Nodes                 sorted(size());
+        for (size_t i = 0; i < size(); ++i) sorted[next[entry[i]]++] = nodes[i];
+        nodes.swap(sorted);
+    }
+
+    /**
+        Perform a search to find nearby data points.
+
+        Visits the points of all cells overlapping the sphere of radius <tt>sqrt(search.max_dist2)</tt> around
+        \c search.query_position, and passes those within the current search radius on to the search.
+    */
+    template <typename Search>
+    void find(Search &search) const
+    {
+        if (m_cell_start.empty())
+            return;
+
+        // the range of cells overlapping the search, clamped to the grid
+        T           radius    = std::sqrt(search.max_dist2) * m_inv_cell_size;
+        double      num_cells = 1.0;
+        Vec<N, int> lo, hi;
+        for (int a = 0; a < N; ++a)
+        {
+            T q = (search.query_position[a] - bounds.min[a]) * m_inv_cell_size;
+            T l = std::floor(q - radius), h = std::floor(q + radius);
+            if (h < T(0) || l > T(m_res[a] - 1))
+                return;
+            lo[a] = int(std::max(l, T(0)));
+            hi[a] = int(std::min(h, T(m_res[a] - 1)));
+            num_cells *= hi[a] - lo[a] + 1;
+        }
+
+        // for huge radii, it is cheaper to just look at all points
+        if (num_cells > double(m_mask) + 1.0)
+        {
+            check_range(search, 0, uint32_t(size()));
+            return;
+        }
+
+        // several cells may share a hash table entry, so collect the entries and visit each of them only once
+        constexpr int         max_local = 64;
+        uint32_t              local[max_local];
+        std::vector<uint32_t> many;
+        uint32_t             *entries = local;
+        if (num_cells > max_local)
+        {
+            many.resize(size_t(num_cells));
+            entries = many.data();
+        }
+
+        int         count = 0;
+        Vec<N, int> c     = lo;
+        while (true)
+        {
+            entries[count++] = hash(c) & m_mask;
+
+            // advance to the next cell in the range
+            int a = 0;
+            for (; a < N; ++a)
+            {
+                if (++c[a] <= hi[a])
+                    break;
+                c[a] = lo[a];
+            }
+            if (a == N)
+                break;
+        }
+
+        std::sort(entries, entries + count);
+        count = int(std::unique(entries, entries + count) - entries);
+        for (int i = 0; i < count; ++i) check_range(search, m_cell_start[entries[i]], m_cell_start[entries[i] + 1]);
+    }
+
+    /// Perform one search per query position, reusing \p search. \copydetails PointKDTree::find_batch()
+    template <typename Search, typename Visit>
+    void find_batch(const Position *queries, size_t count, Search &search, Visit &&visit) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            search.reset(queries[i]);
+            find(search);
+            visit(i, search);
+        }
+    }
+
+private:
+    /// Check the points <tt>nodes[begin, end)</tt> against the search radius
+    template <typename Search>
+    void check_range(Search &search, uint32_t begin, uint32_t end) const
+    {
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            T dist2 = length2(nodes[i].position - search.query_position);
+            if (dist2 < search.max_dist2)
+                search.check(nodes[i], dist2);
+        }
+    }
+
+    /// The integer coordinates of the cell containing \p p
+    Vec<N, int> cell(const Position &p) const
+    {
+        Vec<N, int> c;
+        for (int a = 0; a < N; ++a)
+            c[a] = clamp(int((p[a] - bounds.min[a]) * m_inv_cell_size), 0, m_res[a] - 1);
+        return c;
+    }
+
+    /// Hash the integer coordinates of a cell
+    static uint32_t hash(const Vec<N, int> &c)
+    {
+        constexpr uint32_t primes[4] = {73856093u, 19349663u, 83492791u, 2654435761u};
+        uint32_t           h         = 0;
+        for (int a = 0; a < N; ++a) h ^= uint32_t(c[a]) * primes[a];
+        return h;
+    }
+
+    T           m_inv_cell_size = T(1);           ///< One over the side length of the cells
+    Vec<N, int> m_res           = Vec<N, int>(1); ///< The number of cells along each dimension
+    uint32_t    m_mask          = 0;              ///< The number of entries of the hash table, minus one
+
+    /// The points of hash table entry \c e are <tt>nodes[m_cell_start[e], m_cell_start[e + 1])</tt>
+    std::vector<uint32_t> m_cell_start;
+};
+
+/**
+    \file
+    \brief Class #HashGrid
+*/
@@ -41,7 +41,7 @@ public:
      */
     Image(int w, int h, const T &v) : Base(w, h)
     {
-        reset(v);
+        this->reset(v);
     }
 
     /**
@@ -100,6 +100,24 @@ bool Image3f::save(const std::string &filename, float gain);
 template <>
 bool Image4f::save(const std::string &filename, float gain);
 
+/// A named channel of a multi-channel EXR file (e.g. \c "albedo.R"), with one value per pixel in scanline order
+struct ExrChannel
+{
+    string        name;
+    vector<float> values;
+    bool          half = true; ///< Whether to store the channel as half floats (instead of full floats)
+};
+
+/**
+    Save \p channels, each of \p width x \p height pixels, as the channels of one (multi-layer) EXR file.
+
+    Dots in the names group the channels into layers, as in \c "normal.X", \c "normal.Y", \c "normal.Z". The channels
+    are sorted by name, as the EXR format requires.
+
+    \return True if the file saved successfully
+*/
+bool save_exr_channels(const string &filename, int width, int height, vector<ExrChannel> channels);
+
 /**
     \file
     \brief Class #Image, #Image3f, and #Image4f
@@ -0,0 +1,104 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/aov.h>
+#include <darts/factory.h>
+#include <darts/fwd.h>
+#include <darts/image.h>
+#include <darts/ray.h>
+
+/** \addtogroup Integrators
+    @{
+*/
+
+/**
+    Abstract integrator: computes the incident radiance along a camera ray.
+
+    Integrators are created by the #DartsFactory from the \c "integrator" field of the scene. If a scene does not
+    specify one, Scene::recursive_color() is used instead.
+*/
+class Integrator
+{
+public:
+    /// Default constructor which accepts a #json object of named parameters
+    Integrator(const json &j = json::object())
+    {
+    }
+
+    /// Free all memory
+    virtual ~Integrator() = default;
+
+    /**
+        Compute the radiance arriving along \p ray.
+
+        \param scene    The scene to render
+        \param sampler  The source of random numbers (owned by the calling thread)
+        \param ray      The camera ray
+        \param aov      If not null, \ref AOVSample::record() "record" the first hit of \p ray here (integrators that
+                        don't leave it to Scene::sample_pixel(), which then intersects the camera ray once more)
+        \return         An estimate of the incident radiance
+    */
+    virtual Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const = 0;
+
+    /**
+        The number of camera rays this integrator would like to process at once with #Li_batch().
+
+        The default of 0 means that the scene calls #Li() for one camera ray at a time.
+    */
+    virtual int batch_size() const
+    {
+        return 0;
+    }
+
+    /**
+        Compute the radiance arriving along each ray in a batch of camera rays.
+
+        The default implementation simply calls #Li() for each ray.
+
+        \param scene        The scene to render
+        \param samplers     The source of random numbers for each of the rays (owned by the calling thread)
+        \param rays         The camera rays
+        \param radiance     Resized to, and filled with an estimate of the incident radiance for each ray
+        \param aovs         If not null, the AOVs of the rays, which have the same size as \p rays (see #Li())
+    */
+    virtual void Li_batch(const Scene &scene, const vector<Sampler *> &samplers, const vector<Ray3f> &rays,
+                          vector<Color3f> &radiance, vector<AOVSample> *aovs = nullptr) const
+    {
+        radiance.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); ++i)
+            radiance[i] = Li(scene, *samplers[i], rays[i], aovs ? &(*aovs)[i] : nullptr);
+    }
+
+    /**
+        Whether this integrator renders the whole image itself with #render(), instead of one camera ray at a time.
+
+        This is needed by integrators whose passes share work across all pixels (e.g. tracing photons between passes
+        of camera rays). The default is false.
+    */
+    virtual bool renders_image() const
+    {
+        return false;
+    }
+
+    /**
+        Render the whole image of \p scene. Only called if #renders_image() returns true.
+
+        \param scene    The scene to render
+        \return         The rendered image, with the resolution of the scene's camera
+    */
+    virtual Image3f render(const Scene &scene) const
+    {
+        throw DartsException("This integrator does not render whole images.");
+    }
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #Integrator
+*/
@@ -0,0 +1,146 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+
+/** \addtogroup Random
+    @{
+*/
+
+/** \name Low-discrepancy sequences
+
+    Building blocks for the quasi-Monte Carlo samplers: radical inverses, Sobol points, and hash-based Owen scrambling
+    following Burley's "Practical Hash-based Owen Scrambling" (JCGT 2020).
+
+    @{
+*/
+
+/// The largest float smaller than one
+constexpr float one_minus_epsilon = 0x1.fffffep-1f;
+
+/// Convert the 32 bits of \p x to a float in <tt>[0,1)</tt>
+inline float bits_to_float(uint32_t x)
+{
+    return std::min(float(x) * 0x1p-32f, one_minus_epsilon);
+}
+
+/// Reverse the order of the bits of \p x
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+/// Combine \p seed with the value \p v into a new well-mixed 32-bit hash
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    seed ^= v + 0x9e3779b9u + (seed << 6) + (seed >> 2);
+    // final avalanche (from MurmurHash3)
+    seed ^= seed >> 16;
+    seed *= 0x85ebca6bu;
+    seed ^= seed >> 13;
+    seed *= 0xc2b2ae35u;
+    seed ^= seed >> 16;
+    return seed;
+}
+
+/// Laine and Karras' hash-based permutation, in which each bit only depends on the bits below it
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+/**
+    Owen-scramble the 32-bit fixed-point value \p x in <tt>[0,1)</tt>.
+
+    Each bit is flipped depending on the bits above it, so stratification in all elementary intervals is preserved.
+    Applied to a sample index, this also shuffles the order of a sequence without destroying its progressive nature.
+*/
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/// The number of dimensions for which #sobol() has direction numbers
+constexpr int num_sobol_dimensions = 16;
+
+/// The Sobol direction numbers (from Joe and Kuo's "new-joe-kuo-6.21201" table), one row per dimension
+extern const uint32_t (&sobol_directions)[num_sobol_dimensions][32];
+
+/// Dimension \p dim (which must be less than #num_sobol_dimensions) of the \p index-th Sobol point, as 32-bit fixed point
+inline uint32_t sobol(uint32_t index, int dim)
+{
+    uint32_t x = 0;
+    for (int bit = 0; index; index >>= 1, ++bit)
+        if (index & 1)
+            x ^= sobol_directions[dim][bit];
+    return x;
+}
+
+/// The number of dimensions for which #radical_inverse() has a prime base
+constexpr int num_halton_dimensions = 64;
+
+/// The first #num_halton_dimensions primes, used as the bases of the dimensions of the Halton sequence
+extern const uint32_t halton_primes[num_halton_dimensions];
+
+/**
+    Compute the radical inverse of \p index in the prime base of dimension \p dim (less than #num_halton_dimensions).
+
+    If \p seed is nonzero, each digit is randomly shifted (modulo the base) by an amount that depends on the seed and
+    the digit's position. This decorrelates pixels while keeping the stratification of the sequence.
+*/
+inline float radical_inverse(uint32_t index, int dim, uint32_t seed = 0)
+{
+    const uint32_t base     = halton_primes[dim];
+    const float    inv_base = 1.f / float(base);
+
+    // accumulate the reversed digits in fixed point, and generate enough digits to resolve a float
+    uint64_t reversed   = 0;
+    float    inv_base_n = 1.f;
+    for (uint32_t level = 0; 1.f - inv_base_n < 1.f; ++level)
+    {
+        uint32_t next  = index / base;
+        uint32_t digit = index - next * base;
+        if (seed)
+            digit = (digit + hash_combine(seed, level) % base) % base;
+        reversed = reversed * base + digit;
+        inv_base_n *= inv_base;
+        index = next;
+    }
+    return std::min(float(reversed) * inv_base_n, one_minus_epsilon);
+}
+
+/// The width and height of the tileable blue-noise mask used by #blue_noise()
+constexpr int blue_noise_size = 64;
+
+/**
+    A blue-noise dither value for pixel (\p x, \p y), as 32-bit fixed point.
+
+    The values come from a tileable #blue_noise_size x #blue_noise_size mask of ranks, generated once with Ulichney's
+    void-and-cluster method, so neighboring pixels get very different values and their differences contain mostly high
+    frequencies. Each \p seed looks the mask up with a different toroidal offset, which gives roughly independent
+    masks (e.g. for the different dimensions of a sampler).
+*/
+uint32_t blue_noise(int x, int y, uint32_t seed);
+
+/** @}*/
+
+/** @}*/
+
+/**
+    \file
+    \brief Radical inverses, Sobol points, Owen scrambling, and blue noise used by the low-discrepancy samplers
+*/
@@ -0,0 +1,99 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+#include <fstream>
+#include <iterator>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** \addtogroup Utilities
+    @{
+*/
+
+/**
+    A read-only view of the whole contents of a file.
+
+    The file is memory-mapped where possible, so that it does not take up any heap memory and only the parts that are
+    actually accessed are read from disk. If the file cannot be mapped (or on Windows), it is read into memory instead.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const string &filename)
+    {
+#if !defined(_WIN32)
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw DartsException("Unable to open file '{}'!", filename);
+
+        struct stat st     = {};
+        bool        has_st = fstat(fd, &st) == 0;
+        if (has_st && st.st_size > 0)
+        {
+            void *data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, size_t(st.st_size), MADV_SEQUENTIAL);
+                m_data = reinterpret_cast<const char *>(data);
+                m_size = size_t(st.st_size);
+            }
+        }
+        close(fd);
+        if (m_data || (has_st && st.st_size == 0))
+            return;
+#endif
+        // fall back to reading the whole file into memory
+        std::ifstream is(filename, std::ios::binary);
+        if (is.fail())
+            throw DartsException("Unable to open file '{}'!", filename);
+        m_buffer.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+    }
+
+    ~MappedFile()
+    {
+#if !defined(_WIN32)
+        if (m_buffer.empty() && m_data)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+    }
+
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *begin() const
+    {
+        return m_data;
+    }
+    const char *end() const
+    {
+        return m_data + m_size;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    const char  *m_data = nullptr;
+    size_t       m_size = 0;
+    vector<char> m_buffer; ///< The file contents, if it could not be mapped
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #MappedFile
+*/
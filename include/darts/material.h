@@ -21,6 +21,15 @@ struct ScatterRecord
     bool    is_specular = false; ///< Flag indicating whether the ray has a degenerate PDF
 };
 
+/// The built-in types of #Material, which #dispatch() can call without virtual calls
+enum class MaterialType : uint8_t
+{
+    Plugin = 0, ///< Any other material, which can only be called through its virtual functions
+    Lambertian,
+    Metal,
+    Dielectric,
+    DiffuseLight
+};
 
 /// A base class used to represent surface material properties.
 class Material
@@ -32,6 +41,23 @@ public:
     /// Free all memory
     virtual ~Material() = default;
 
+    /// The built-in type of this material (see #dispatch())
+    MaterialType type() const
+    {
+        return m_type;
+    }
+
+    /**
+        Update the parameters of this Material from the #json object \p j.
+
+        Parameters that \p j does not specify keep their current values. This allows changing the materials of a scene
+        that stays in memory (e.g.\ in the render server mode of darts) without recreating the surfaces that refer to
+        them. The base Material class has no parameters.
+    */
+    virtual void update(const json &j)
+    {
+    }
+
     /**
        \brief Compute the scattered direction scattered at a surface hitpoint.
 
@@ -41,13 +67,37 @@ public:
        \param  [in] hit             the ray's intersection with the surface
        \param  [in] attenuation     how much the light should be attenuated
        \param  [in] scattered       the direction light should be scattered
+       \param  [in] sampler         the source of random numbers (owned by the calling thread)
        \return bool                 True if the surface scatters light
      */
-    virtual bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const
+    virtual bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                         Sampler &sampler) const
     {
         return false;
     }
 
+    /**
+        The approximate reflectance of this Material at \p hit, for the albedo AOV that denoisers use as a guide.
+
+        The base Material class doesn't reflect light.
+    */
+    virtual Color3f reflectance(const HitInfo &hit) const
+    {
+        return Color3f(0.f);
+    }
+
+    /**
+        The angle by which scattering off this Material at \p hit widens the footprint of a ray.
+
+        The integrators pass this to Ray::continue_footprint() for the scattered rays, so that texture lookups after
+        blurry bounces use coarser mip levels. Perfectly specular materials keep the footprint of the incoming ray and
+        return 0. The base Material class doesn't know how blurry it is, so it assumes a diffuse bounce.
+    */
+    virtual float footprint_spread(const HitInfo &hit) const
+    {
+        return 0.5f;
+    }
+
     /**
        Compute the amount of emitted light at the surface hitpoint.
 
@@ -62,6 +112,17 @@ public:
         return Color3f(0, 0, 0);
     }
 
+    /**
+        Return the average radiance emitted from the front side of a surface with this Material.
+
+        This is only used to estimate the power of emitters so they can be sampled proportionally to it, so an
+        approximation (e.g.\ of a textured emitter) is fine. The base Material class does not emit light.
+    */
+    virtual Color3f average_emitted() const
+    {
+        return Color3f(0.f);
+    }
+
     /**
         Return whether or not this Material is emissive.
         This is primarily used to create a global list of emitters for sampling.
@@ -71,6 +132,17 @@ public:
         return false;
     }
 
+    /**
+        Return whether this Material only marks the boundary of a #medium, with light passing straight through it.
+
+        Such surfaces neither reflect nor refract light; volumetric integrators skip them (e.g.\ along shadow rays)
+        and only use them to keep track of the medium that a path travels through.
+    */
+    virtual bool is_boundary() const
+    {
+        return false;
+    }
+
     /**
        Sample a scattered direction at the surface hitpoint \p hit.
 
@@ -125,6 +197,12 @@ public:
     {
         return 0.0f;
     }
+
+    /// The medium filling the inside (the side opposite to the normals) of surfaces with this Material, if any
+    shared_ptr<const Medium> medium;
+
+protected:
+    MaterialType m_type = MaterialType::Plugin; ///< Set by the built-in materials of materials.h
 };
 
 /**
@@ -0,0 +1,142 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/material.h>
+#include <darts/texture.h>
+
+/** \addtogroup Materials
+    @{
+*/
+
+/// A perfectly diffuse (%Lambertian) material.
+class Lambertian final : public Material
+{
+public:
+    Lambertian(const json &j = json::object());
+
+    void update(const json &j) override;
+
+    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                 Sampler &sampler) const override;
+
+    Color3f reflectance(const HitInfo &hit) const override
+    {
+        return albedo->value(hit);
+    }
+
+    /// The diffuse color (fraction of light that is reflected per color channel).
+    shared_ptr<const Texture> albedo = make_shared<ConstantTexture>(Color3f(0.8f));
+};
+
+/// A metallic material that reflects light into the (potentially rough) mirror reflection direction.
+class Metal final : public Material
+{
+public:
+    Metal(const json &j = json::object());
+
+    void update(const json &j) override;
+
+    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                 Sampler &sampler) const override;
+
+    Color3f reflectance(const HitInfo &hit) const override
+    {
+        return albedo->value(hit);
+    }
+
+    /// The blur of the reflection grows with the #roughness
+    float footprint_spread(const HitInfo &hit) const override
+    {
+        return roughness;
+    }
+
+    /// The reflective color (fraction of light that is reflected per color channel).
+    shared_ptr<const Texture> albedo    = make_shared<ConstantTexture>(Color3f(0.8f));
+    float                     roughness = 0.f; ///< Between 0 and 1, indicating how smooth vs. rough the reflection is.
+};
+
+/// A smooth dielectric surface that reflects and refracts light according to the specified index of refraction #ior.
+class Dielectric final : public Material
+{
+public:
+    Dielectric(const json &j = json::object());
+
+    void update(const json &j) override;
+
+    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                 Sampler &sampler) const override;
+
+    /// Dielectrics neither absorb nor tint light, so their reflectance is white
+    Color3f reflectance(const HitInfo &hit) const override
+    {
+        return Color3f(1.f);
+    }
+
+    /// Smooth reflection and refraction keep the footprint of the incoming ray
+    float footprint_spread(const HitInfo &hit) const override
+    {
+        return 0.f;
+    }
+
+    float ior; ///< The (relative) index of refraction of the material
+};
+
+/// A material that emits light equally in all directions from the front side of a surface.
+class DiffuseLight final : public Material
+{
+public:
+    DiffuseLight(const json &j = json::object());
+
+    void update(const json &j) override;
+
+    /// Returns a constant Color3f if the ray hits the surface on the front side.
+    Color3f emitted(const Ray3f &ray, const HitInfo &hit) const override;
+
+    Color3f average_emitted() const override
+    {
+        return emit;
+    }
+
+    bool is_emissive() const override
+    {
+        return true;
+    }
+
+    Color3f emit; ///< The emissive color of the light
+};
+
+/**
+    Call \p func with \p material cast to its built-in type, or with the plain #Material pointer for plugins.
+
+    Since the built-in materials are \c final, the calls that \p func makes through the cast pointer are bound
+    statically (and can be inlined where their definitions are visible), so the hot loops of the integrators can
+    replace several virtual calls per hit with a single switch on #Material::type(). All cases must return the same
+    type.
+
+    \code{.cpp}
+    bool scatters = dispatch(hit.mat, [&](auto m) { return m->scatter(ray, hit, attenuation, scattered, sampler); });
+    \endcode
+*/
+template <typename Func>
+decltype(auto) dispatch(const Material *material, Func &&func)
+{
+    switch (material->type())
+    {
+    case MaterialType::Lambertian: return func(static_cast<const Lambertian *>(material));
+    case MaterialType::Metal: return func(static_cast<const Metal *>(material));
+    case MaterialType::Dielectric: return func(static_cast<const Dielectric *>(material));
+    case MaterialType::DiffuseLight: return func(static_cast<const DiffuseLight *>(material));
+    default: return func(material);
+    }
+}
+
+/** @}*/
+
+/**
+    \file
+    \brief The built-in materials, and #dispatch() to call them without virtual calls
+*/
@@ -89,7 +89,11 @@ public:
         assumption that an unbiased transmittance estimate is returned.
 
         The default implementation performs track-length estimation using
-        #sample_free_flight().
+        #sample_free_flight(). Heterogeneous media may instead perform ratio
+        tracking against local majorants, which stays unbiased only as long
+        as each majorant bounds \f$\sigma_t\f$ everywhere in its region;
+        NanoVDBMedium bounds each region by the leaves and active tiles
+        overlapping it, each with its own maximum value.
      */
     virtual Color3f total_transmittance(const Ray3f &ray, Sampler &sampler) const
     {
@@ -5,8 +5,54 @@
 */
 #pragma once
 
+#include <darts/bbh.h>
+#include <darts/numa.h>
 #include <darts/surface.h>
 
+/**
+    Per-face material indices, stored with as few bytes per face as the number of materials allows.
+
+    If all faces use the same material, only that one index is stored.
+*/
+class MaterialIndices
+{
+public:
+    /// Store \p indices using the narrowest representation that can hold all of them
+    void assign(const vector<uint32_t> &indices);
+
+    /// The material index of face \p face
+    uint32_t operator[](size_t face) const
+    {
+        switch (m_bytes)
+        {
+        case 0: return m_uniform;
+        case 1: return m_u8[face];
+        case 2: return m_u16[face];
+        default: return m_u32[face];
+        }
+    }
+
+    /// The number of bytes per face (0 if all faces use the same material)
+    int bytes_per_face() const
+    {
+        return m_bytes;
+    }
+
+    /// Report the approximate size (in bytes) of the indices
+    size_t size() const
+    {
+        return m_u8.capacity() * sizeof(uint8_t) + m_u16.capacity() * sizeof(uint16_t) +
+               m_u32.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    int              m_bytes   = 0;
+    uint32_t         m_uniform = 0; ///< The material index of all faces, if #m_bytes is 0
+    vector<uint8_t>  m_u8;
+    vector<uint16_t> m_u16;
+    vector<uint32_t> m_u32;
+};
+
 /**
     A triangle mesh.
 
@@ -15,6 +61,16 @@
     the specifics of how to create its contents (e.g. by loading from an
     external file)
 
+    By default, #add_to_parent() adds one #Triangle per face to the parent. If the mesh's json specification contains
+    an \c "accelerator" object, the mesh instead adds itself to the parent as a single Surface, and accelerates
+    intersections with its own BBH over the face indices (see #BBHTree::parse() for the supported parameters).
+
+    The leaves of the internal BBH are intersected by #intersect_packed(), which runs its own Moller-Trumbore test
+    over several faces at a time instead of calling single_triangle_intersect() (used by #Triangle, and by the Embree
+    filter) for each face. The two can therefore disagree, e.g. as long as single_triangle_intersect() is not
+    implemented. Setting \c "packed" to false in the \c "accelerator" object intersects the leaves face by face with
+    #intersect_face() instead, so all triangles go through single_triangle_intersect().
+
     \ingroup Surfaces
     \ingroup Helpers
 */
@@ -26,9 +82,16 @@ public:
     {
     }
 
-    /// Try to load a mesh from an OBJ file
+    /**
+        Try to load a mesh from an OBJ file, or from a binary mesh file if its extension is \c .dmesh.
+
+        If a live mesh was already loaded from the same (unchanged) file with the same parameters, e.g. for the previous
+        frame of a batch, its data is copied instead.
+    */
     Mesh(const json &j);
 
+    ~Mesh();
+
     Box3f bounds() const override
     {
         return bbox_w;
@@ -42,20 +105,176 @@ public:
     /// Report the approximate size (in bytes) of the mesh
     size_t size() const;
 
+    /// Build the internal BBH over the faces (if enabled)
+    void build() override;
+
+    /// Intersect a ray with the mesh using its internal BBH (only used if the mesh was added to its parent as a whole)
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+
+    /// Determine whether a ray hits the mesh using its internal BBH, stopping at the first hit
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Whether any of the mesh's materials are emissive
+    bool is_emissive() const override;
+
+    /**
+        Intersect a ray with a single face of the mesh.
+
+        \param [in] face       The index of the face (triangle) to intersect
+        \param [in] ray        The ray to intersect
+        \param [out] hit       The intersection record, filled in if there is a hit
+        \param [in] surface    The Surface to report as having been hit
+        \return                True if the ray hits the face within its [mint, maxt] interval
+    */
+    bool intersect_face(uint32_t face, const Ray3f &ray, HitInfo &hit, const Surface *surface) const;
+
+    /// The world-space bounds of face \p face (slightly padded if the triangle lies in an axis-aligned plane)
+    Box3f face_bounds(uint32_t face) const;
+
+    /// The bounds of the part of face \p face inside \p box (empty if the face misses it), for spatial BBH splits
+    Box3f clipped_face_bounds(uint32_t face, const Box3f &box) const;
+
+    /**
+        Intersect a ray with faces <tt>[first, first + count)</tt> of #packed, #packet_width faces at a time.
+
+        Only geometry is considered here: the shading information is fetched from the mesh, for the closest hit only.
+        If \p hit is null, this is an any-hit query which returns as soon as any face is hit.
+
+        \return True if any of the faces were hit. In that case \p hit is filled in and \p ray.maxt is shortened.
+    */
+    bool intersect_packed(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const;
+
+    /// Like #intersect_packed(), but intersects the faces one by one with #intersect_face()
+    bool intersect_faces(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const;
+
+    /// Intersect a ray with a leaf of #bbh, using #intersect_packed() or #intersect_faces() (see #use_packed)
+    bool intersect_leaf(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const;
+
+    /**
+        Fold the per-face index streams into a more compact form once everything is loaded.
+
+        The normal and texture coordinate indices are dropped if they are identical to #Fv (see
+        #normals_use_vertex_indices and #uvs_use_vertex_indices), and #Fm is moved into #face_materials, which only
+        stores a single index for single-material meshes and narrows the indices to 8 or 16 bits when possible.
+
+        Afterwards, the per-face indices must be accessed through #normal_indices(), #uv_indices(), and
+        #face_material().
+    */
+    void compact_indices();
+
+    /// The normal indices of face \p face, or -1 if the face has no normals
+    Vec3i normal_indices(uint32_t face) const
+    {
+        if (normals_use_vertex_indices)
+            return Fv[face];
+        return face < Fn.size() ? Fn[face] : Vec3i(-1);
+    }
+
+    /// The texture coordinate indices of face \p face, or -1 if the face has no texture coordinates
+    Vec3i uv_indices(uint32_t face) const
+    {
+        if (uvs_use_vertex_indices)
+            return Fv[face];
+        return face < Ft.size() ? Ft[face] : Vec3i(-1);
+    }
+
+    /// The material of face \p face
+    const Material *face_material(uint32_t face) const
+    {
+        return materials[face_materials[face]].get();
+    }
+
+    /// Fill in \p hit for a hit at distance \p t and barycentric coordinates (\p u, \p v) on face \p face
+    void fill_hit(uint32_t face, float t, float u, float v, const Ray3f &ray, HitInfo &hit) const;
+
+    /// The number of triangles tested at once by #intersect_packed()
+    static constexpr int packet_width = 8;
+
+    /// Per-face geometry in structure-of-arrays form, stored in the leaf order of #bbh
+    struct PackedTriangles
+    {
+        vector<float> v0[3]; ///< The first vertex of each face
+        vector<float> e1[3]; ///< The edge from the first to the second vertex
+        vector<float> e2[3]; ///< The edge from the first to the third vertex
+
+        size_t size() const
+        {
+            return 9 * v0[0].capacity() * sizeof(float);
+        }
+    };
+
     vector<Vec3f>                      vs;        ///< Vertex positions
     vector<Vec3f>                      ns;        ///< Vertex normals
     vector<Vec2f>                      uvs;       ///< Vertex texture coordinates
     vector<Vec3i>                      Fv;        ///< Vertex indices per face (triangle)
     vector<Vec3i>                      Fn;        ///< Normal indices per face (triangle)
     vector<Vec3i>                      Ft;        ///< Texture indices per face (triangle)
-    vector<uint32_t>                   Fm;        ///< One material index per face (triangle)
+    vector<uint32_t>                   Fm;        ///< One material index per face (until #compact_indices())
     vector<shared_ptr<const Material>> materials; ///< All materials in the mesh
     Transform                          xform;     ///< Transformation that the data has already been transformed by
     Transform object_to_texture;                  ///< Transformation from object space to texture (bounding box) space
     Box3f     bbox_w;                             ///< The bounds, after transformation (in world space)
     Box3f     bbox_o;                             ///< The bounds, before transformation (in object space)
+    bool      use_bbh = false;                    ///< Whether to intersect the faces using the internal #bbh
+    bool      use_packed = true;                  ///< Whether the leaves of #bbh use #intersect_packed()
+    BBHTree   bbh;                                ///< Internal hierarchy over the faces (if #use_bbh)
+    NumaReplicas<BBHTree> bbh_replicas;           ///< Copies of #bbh on the other NUMA nodes (see NumaReplicas)
+    vector<uint32_t> bbh_faces;                   ///< Face indices in the leaf order of #bbh
+    PackedTriangles  packed;                      ///< Face geometry in the leaf order of #bbh
+    vector<string>   material_names;              ///< Names of #materials (empty for the default material)
+    uint64_t         cache_key = 0;               ///< Key of this mesh in the scene cache (0 if caching is disabled)
+    uint64_t         load_key  = 0;               ///< Key of this mesh among the live loaded meshes (see LoadedAssets)
+    bool             cached    = false;           ///< Whether the scene cache holds the current data (and #bbh)
+
+    MaterialIndices face_materials;                     ///< One material index per face (after #compact_indices())
+    bool            normals_use_vertex_indices = false; ///< Whether #Fn was dropped because it equals #Fv
+    bool            uvs_use_vertex_indices     = false; ///< Whether #Ft was dropped because it equals #Fv
 
     virtual void add_to_parent(Surface *parent, shared_ptr<Surface> self, const json &j) override;
+
+    /**
+        Write the mesh to the binary mesh file \p filename (see dmesh.h).
+
+        The data is stored as it is in the mesh, i.e. after #xform. Normals are always stored octahedrally encoded
+        and texture coordinates as half floats, while the positions are optionally quantized to 16 bits within the
+        mesh bounds if \p quantize_positions is true.
+    */
+    void save_dmesh(const string &filename, bool quantize_positions = false) const;
+
+protected:
+    /// Build the internal BBH over the faces
+    void build_bbh();
+
+    /// Parse the OBJ file \p filename from stream \p is using tinyobjloader
+    void load_obj(std::istream &is, const json &j, const string &filename);
+
+    /**
+        Parse the OBJ file \p filename in parallel.
+
+        The file is memory-mapped and split into chunks of whole lines. A first parallel pass counts the elements in
+        each chunk, so that all arrays can be allocated at their final size (leaving out normals or texture coordinates
+        that no face refers to), and a second pass then parses each chunk directly into place.
+    */
+    void load_obj_parallel(const json &j, const string &filename);
+
+    /// Load the binary mesh file \p filename (see dmesh.h), decoding and transforming its contents in parallel
+    void load_dmesh(const json &j, const string &filename);
+
+    /// Return the index of material \p name in #materials, adding it (or falling back to the default material) if it
+    /// isn't in \p material_map yet
+    uint32_t material_index(const string &name, map<string, uint32_t> &material_map);
+
+    /// Discard all loaded mesh data (but not the parameters), e.g. to load it from the file after a failed attempt
+    void discard_data();
+
+    /// Try to copy the mesh data (and the internal BBH, if any) from a live mesh loaded with the same #load_key
+    bool reuse_loaded();
+
+    /// Try to load the mesh data (and the internal BBH, if any) from the scene cache
+    bool load_cached(const json &j);
+
+    /// Store the mesh data (and the internal BBH, if any) in the scene cache
+    void save_cached() const;
 };
 
 /**
@@ -0,0 +1,90 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <darts/common.h>
+#include <functional>
+
+/** \addtogroup Parallel
+    @{
+*/
+
+/// The CPUs of each NUMA node of the machine, read from \c /sys on Linux (a single node with all CPUs elsewhere)
+const vector<vector<int>> &numa_nodes();
+
+/// The NUMA node the calling thread was pinned to by #pin_pool_threads(), or -1 if it isn't pinned
+int numa_node();
+
+/**
+    Pin the threads of the thread pool to CPUs, so that they keep using the memory of the NUMA node they first touched.
+
+    The threads are spread round-robin over the NUMA nodes. With \p mode \c "core" each thread is pinned to a single
+    CPU of its node, with \c "socket" it may run on any CPU of its node, and with \c "none" nothing happens.
+
+    Pinning is only supported on Linux, and merely logs a warning elsewhere.
+*/
+void pin_pool_threads(const string &mode);
+
+/**
+    Enable or disable replicating the read-only BBHs on each NUMA node (see NumaReplicas).
+
+    This trades memory for bandwidth on multi-socket machines, and only has an effect once the pool threads are pinned
+    with #pin_pool_threads(), since other threads don't know which node they run on.
+*/
+void set_numa_replication(bool enable);
+
+/// Whether the BBHs are replicated on each NUMA node
+bool numa_replication();
+
+/// Run \p func on a temporary thread pinned to the CPUs of NUMA node \p node (e.g. to first-touch memory there)
+void run_on_numa_node(int node, const std::function<void()> &func);
+
+/**
+    Copies of a read-only structure, one for each NUMA node besides the first.
+
+    Each copy is created by a thread running on its node, so the operating system's first-touch policy places its
+    memory there. Threads then read the copy of their own node with #local(), and all others (e.g. unpinned threads, or
+    the threads of the first node) read the original.
+*/
+template <typename T>
+class NumaReplicas
+{
+public:
+    /// Replace the copies by new copies of \p original, if #numa_replication() is enabled and there are several nodes
+    void replicate(const T &original)
+    {
+        copies.clear();
+        if (!numa_replication())
+            return;
+
+        copies.resize(numa_nodes().size() - 1);
+        for (size_t n = 0; n < copies.size(); ++n)
+            run_on_numa_node(int(n + 1), [&]() { copies[n] = make_unique<T>(original); });
+    }
+
+    /// Release all copies
+    void clear()
+    {
+        copies.clear();
+    }
+
+    /// The copy of \p original on the NUMA node of the calling thread
+    const T &local(const T &original) const
+    {
+        int node = numa_node();
+        return node > 0 && node <= int(copies.size()) ? *copies[node - 1] : original;
+    }
+
+private:
+    vector<unique_ptr<T>> copies;
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief NUMA topology, thread pinning, and per-node replication of read-only data
+*/
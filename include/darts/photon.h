@@ -7,6 +7,7 @@
 
 #include <darts/common.h>
 #include <darts/fwd.h>
+#include <darts/hash_grid.h>
 #include <darts/math.h>
 #include <darts/point_kdtree.h>
 #include <darts/ray.h>
@@ -21,11 +22,11 @@ struct Photon
     enum Flags
     {
         SPLITTING_PLANE = (1 << 0) | (1 << 1),
-        RADIANCE_PHOTON = 1 << 2
+        RADIANCE_PHOTON = 1 << 2 ///< Stores precomputed irradiance and a normal (see #precompute_radiance_photons)
     };
 
-    uint8_t  rgbe[4]; ///< Photon power stored in Greg Ward's RGBE format
-    uint16_t flags;   ///< splitting plane for kd-tree
+    uint8_t  rgbe[4]; ///< Photon power (or irradiance of a radiance photon) stored in Greg Ward's RGBE format
+    uint16_t flags;   ///< splitting plane for kd-tree, and #RADIANCE_PHOTON
     uint8_t  theta;   ///< Discretized photon direction (\p theta component)
     uint8_t  phi;     ///< Discretized photon direction (\p phi component)
 
@@ -39,6 +40,12 @@ struct Photon
         flags |= (a & SPLITTING_PLANE);
     }
 
+    /// Whether this is a radiance photon, whose #direction() is the surface normal and #power() the irradiance there
+    bool is_radiance_photon() const
+    {
+        return flags & RADIANCE_PHOTON;
+    }
+
     /// Dummy constructor
     Photon()
     {
@@ -47,6 +54,14 @@ struct Photon
     /// Initialize a photon with the specified direction of propagation and power
     Photon(const Vec3f &dir, const Color3f &power);
 
+    /// Create an (as yet empty) radiance photon on a surface with normal \p n, facing the side the light arrives from
+    static Photon radiance_photon(const Vec3f &n)
+    {
+        Photon photon(n, Color3f(0.f));
+        photon.flags |= RADIANCE_PHOTON;
+        return photon;
+    }
+
     /**
         Convert the stored photon direction from quantized spherical coordinates to a Vector3f value. Uses
         precomputation similar to that of Henrik Wann Jensen's implementation.
@@ -84,6 +99,12 @@ protected:
 /// A kd-tree storing photons in 3D
 using PhotonMap = PointKDTree<3, float, Photon>;
 
+/// A kd-tree storing photons in 3D in leaf buckets, which can be searched with the same search objects as #PhotonMap
+using BucketedPhotonMap = BucketedPointKDTree<3, float, Photon>;
+
+/// A hashed uniform grid storing photons in 3D, for fixed-radius searches with the same search objects as #PhotonMap
+using PhotonHashGrid = HashGrid<3, float, Photon>;
+
 //! Structure to store both the photon and its (squared) distance to a query_position location
 struct SearchResult
 {
@@ -117,9 +138,17 @@ struct SearchBase
 {
     Vec3f query_position; ///< The search query position
     float max_dist2;      ///< Search for photons only within this maximum squared distance to #query_position
+    float search_dist2;   ///< The initial #max_dist2, restored by #reset()
+
+    SearchBase(const Vec3f &q, float md2) : query_position(q), max_dist2(md2), search_dist2(md2)
+    {
+    }
 
-    SearchBase(const Vec3f &q, float md2) : query_position(q), max_dist2(md2)
+    /// Prepare for a new search around \p q, with the original search radius
+    void reset(const Vec3f &q)
     {
+        query_position = q;
+        max_dist2      = search_dist2;
     }
 
     /**
@@ -167,16 +196,28 @@ struct KNNSearch : public SearchBase
         results.reserve(max_count);
     }
 
+    /// Discard all results, keeping the allocated memory
     void reset()
     {
         results.resize(0);
+        is_heap = false;
+    }
+
+    /// Discard all results and prepare for a new search around \p q, keeping the allocated memory
+    void reset(const Vec3f &q)
+    {
+        SearchBase::reset(q);
+        reset();
     }
 
     void check(const PhotonMap::Node &photon)
     {
-        Vec3f to_node = photon.position - query_position;
-        float dist2   = length2(to_node);
+        check(photon, length2(photon.position - query_position));
+    }
 
+    /// Process \p photon, whose squared distance to the #query_position is \p dist2
+    void check(const PhotonMap::Node &photon, float dist2)
+    {
         // process the current node if it is within the radius
         if (dist2 >= max_dist2)
             return;
@@ -193,6 +234,10 @@ struct KNNSearch : public SearchBase
                 std::make_heap(results.begin(), results.end());
                 max_dist2 = results.front().dist2;
                 is_heap   = true;
+
+                // the new photon may be farther away than all the ones found so far
+                if (dist2 >= max_dist2)
+                    return;
             }
 
             // Remove most distant photon from heap and add new photon
@@ -204,21 +249,29 @@ struct KNNSearch : public SearchBase
     }
 };
 
-//! A search process which finds *all* photons within a maximum radius
+/**
+    A search process which finds *all* photons within a maximum radius
+
+    \tparam Func    The type of the function applied to each photon. Passing a lambda directly (and relying on class
+                    template argument deduction) avoids the cost of calling it through a \c std::function
+*/
+template <typename Func = std::function<void(const SearchResult &p)>>
 struct FixedRadiusProcess : public SearchBase
 {
-    std::function<void(const SearchResult &p)> func; ///< Function to apply to each photon within the radius
+    Func func; ///< Function to apply to each photon within the radius
 
-    FixedRadiusProcess(const Vec3f &q, float md2, std::function<void(const SearchResult &p)> f) :
-        SearchBase(q, md2), func(f)
+    FixedRadiusProcess(const Vec3f &q, float md2, Func f) : SearchBase(q, md2), func(std::move(f))
     {
     }
 
     void check(const PhotonMap::Node &photon)
     {
-        Vec3f to_node = photon.position - query_position;
-        float dist2   = length2(to_node);
+        check(photon, length2(photon.position - query_position));
+    }
 
+    /// Process \p photon, whose squared distance to the #query_position is \p dist2
+    void check(const PhotonMap::Node &photon, float dist2)
+    {
         // process the current node if it is within the radius
         if (dist2 >= max_dist2)
             return;
@@ -227,6 +280,59 @@ struct FixedRadiusProcess : public SearchBase
     }
 };
 
+/**
+    A search process which finds the nearest radiance photon (see #precompute_radiance_photons()) on a surface facing
+    roughly the same way as #normal.
+
+    Ordinary photons are skipped, and the radius shrinks to the nearest radiance photon found so far, so this visits
+    far fewer photons than a k-nearest-neighbor density estimate.
+*/
+struct RadiancePhotonSearch : public SearchBase
+{
+    Vec3f                  normal;           ///< The surface normal at the #query_position
+    const PhotonMap::Node *photon = nullptr; ///< The nearest radiance photon found, if any
+
+    /// Radiance photons whose normals deviate from #normal by more than about 25 degrees lie on other surfaces
+    static constexpr float min_cos_normal = 0.9f;
+
+    RadiancePhotonSearch(const Vec3f &q, const Vec3f &n, float md2) : SearchBase(q, md2), normal(n)
+    {
+    }
+
+    void check(const PhotonMap::Node &node)
+    {
+        check(node, length2(node.position - query_position));
+    }
+
+    /// Process \p node, whose squared distance to the #query_position is \p dist2
+    void check(const PhotonMap::Node &node, float dist2)
+    {
+        if (dist2 >= max_dist2 || !node.data.is_radiance_photon() ||
+            dot(node.data.direction(), normal) < min_cos_normal)
+            return;
+
+        photon    = &node;
+        max_dist2 = dist2;
+    }
+};
+
+/**
+    Precompute the irradiance at the radiance photons of a balanced \p photons map (following Christensen's "Faster
+    Photon Map Global Illumination", JGT 1999).
+
+    The radiance photons are extra nodes created with Photon::radiance_photon() alongside a subset of the ordinary
+    photons. For each of them, the irradiance is estimated from the \p k nearest ordinary photons that arrive at the
+    front side of its surface (within \p max_dist2), and stored in place of its power. Afterwards, a final gather only
+    needs a single #RadiancePhotonSearch per gather ray instead of a full density estimate.
+
+    \param photons     The photon map, which must already be built
+    \param k           The number of photons to use in each irradiance estimate
+    \param max_dist2   The maximum squared distance of the photons used in an estimate
+    \param scale       A factor applied to the power of all photons (e.g. one over the number of emitted photons)
+    \return            The number of radiance photons
+*/
+size_t precompute_radiance_photons(PhotonMap &photons, int k, float max_dist2, float scale);
+
 /** @}*/
 
 /**
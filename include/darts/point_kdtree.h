@@ -7,7 +7,9 @@
 
 #include <algorithm>
 #include <darts/box.h>
+#include <darts/cache.h>
 #include <darts/math.h>
+#include <darts/parallel.h>
 #include <utility>
 #include <vector>
 
@@ -74,6 +76,11 @@ public:
     Nodes     nodes;                 ///< All nodes of the tree.
     Box<N, T> bounds;                ///< Bounding box containing all the elements
 
+    /// Subtrees with at least this many nodes have their two children balanced concurrently on the thread pool
+    static constexpr int parallel_build_threshold = 1 << 16;
+    /// Subtrees with at most this many nodes are searched as one bucket, without descending any further
+    static constexpr int leaf_bucket_size = 8;
+
     PointKDTree()
     {
     }
@@ -101,20 +108,47 @@ public:
         nodes.reserve(t);
     }
 
-    /// Clear all the #nodes of the kd-tree
+    /// Clear all the #nodes of the kd-tree, keeping the allocated memory, and reset the #bounds
     void clear()
     {
         nodes.clear();
+        bounds = Box<N, T>();
+    }
+
+    /**
+        Write the #nodes and #bounds of a built kd-tree to \p cache.
+
+        Since the tree is stored implicitly, this is all that is needed to search it again after #load(), without
+        rebuilding it.
+    */
+    void save(CacheWriter &cache) const
+    {
+        cache.write(nodes);
+        cache.write(bounds);
+    }
+
+    /// Read a built kd-tree written by #save(), returning false (and clearing the tree) if the cache entry is invalid
+    bool load(CacheReader &cache)
+    {
+        cache.read(nodes);
+        cache.read(bounds);
+        if (cache.good())
+            return true;
+
+        clear();
+        return false;
     }
 
     /**
         Build (or balance) the kd-tree.
 
-        Calling this function re-arranges the elements of #nodes so that they form a proper kd-tree.
+        Calling this function re-arranges the elements of #nodes so that they form a proper kd-tree. The top levels
+        are partitioned with \c std::nth_element, after which the two subtrees of each large node are built
+        concurrently on the thread pool.
     */
     void build()
     {
-        build(0, int(size()) - 1);
+        build(0, int(size()) - 1, bounds);
     }
 
     /**
@@ -150,13 +184,48 @@ public:
         bounds.enclose(k);
     }
 
+    /**
+        Append several batches of nodes to the end of the #nodes vector in a single pass, and update the #bounds.
+
+        This is meant for filling the tree in parallel: each thread (or task) inserts its data points into its own
+        batch without any synchronization, and the batches are merged once at the end. The batches are appended in
+        order and copied concurrently, and are cleared afterwards.
+    */
+    void merge(std::vector<Nodes> &batches)
+    {
+        std::vector<size_t> offsets(batches.size() + 1, nodes.size());
+        for (size_t b = 0; b < batches.size(); ++b) offsets[b + 1] = offsets[b] + batches[b].size();
+        nodes.resize(offsets.back());
+
+        std::vector<Box<N, T>> batch_bounds(batches.size());
+        parallel_for(blocked_range<size_t>(0, batches.size(), 1),
+                     [&](blocked_range<size_t> r)
+                     {
+                         for (auto b : r)
+                         {
+                             std::copy(batches[b].begin(), batches[b].end(), nodes.begin() + offsets[b]);
+                             for (auto &node : batches[b]) batch_bounds[b].enclose(node.position);
+                             Nodes().swap(batches[b]);
+                         }
+                     });
+
+        for (auto &box : batch_bounds) bounds.enclose(box);
+    }
+
     /**
         Perform a search to find nearby data points by traversing the tree.
 
         The kd-tree must first have been constructrd by calling the #build method.
 
+        Since the tree is stored implicitly, every subtree is a contiguous range of #nodes. Small subtrees (of at most
+        #leaf_bucket_size nodes) are therefore not traversed, but handled as a bucket: the distances to all of their
+        nodes are computed in one tight loop that the compiler can vectorize, and only the nodes within the current
+        search radius are passed on to the search.
+
         \tparam Search  A helper object (see #SearchBase) used to determine which nodes to visit during the traversal
-        and to accumulate results during the search.
+        and to accumulate results during the search. Besides \c check() and \c check_children(), it needs to provide
+        the \c query_position and current maximum squared distance \c max_dist2, and a
+        <tt>check(node, dist2)</tt> function processing a node whose squared distance is already known.
     */
     template <typename Search>
     void find(Search &search) const
@@ -181,6 +250,20 @@ public:
 
         while (true)
         {
+            if (hi - lo < leaf_bucket_size)
+            {
+                check_bucket(search, lo, hi);
+
+                // Grab next node to search from todo list
+                if (todo_pos == 0)
+                    break;
+                --todo_pos;
+                lo  = todo[todo_pos].lo;
+                hi  = todo[todo_pos].hi;
+                box = todo[todo_pos].box;
+                continue;
+            }
+
             int         median = (lo + hi) / 2;
             const Node &node   = nodes[median];
 
@@ -255,9 +338,41 @@ public:
         }
     }
 
+    /**
+        Perform one search for each of the \p count positions in \p queries (e.g. all hit points of a tile).
+
+        All queries reuse the same \p search object, and therefore any memory it allocated for its results, so a
+        batch of queries allocates nothing once the first query is done. Before each query, \c search.reset(position)
+        is called, and afterwards, \c visit(i, search) can consume the results of the \c i-th query. The queries are
+        processed in the given order, so passing spatially coherent positions keeps the visited nodes in the cache.
+    */
+    template <typename Search, typename Visit>
+    void find_batch(const Position *queries, size_t count, Search &search, Visit &&visit) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            search.reset(queries[i]);
+            find(search);
+            visit(i, search);
+        }
+    }
+
 private:
-    //! Recursive function to build the PointKDTree structure.
-    void build(int lo, int hi)
+    /// Check all nodes in <tt>[lo, hi]</tt> (at most #leaf_bucket_size) against the search radius at once
+    template <typename Search>
+    void check_bucket(Search &search, int lo, int hi) const
+    {
+        T   dist2[leaf_bucket_size];
+        int count = hi - lo + 1;
+        for (int i = 0; i < count; ++i) dist2[i] = length2(nodes[lo + i].position - search.query_position);
+
+        for (int i = 0; i < count; ++i)
+            if (dist2[i] < search.max_dist2)
+                search.check(nodes[lo + i], dist2[i]);
+    }
+
+    //! Recursive function to build the PointKDTree structure over nodes <tt>[lo, hi]</tt>, which lie within \p box.
+    void build(int lo, int hi, const Box<N, T> &box)
     {
         if (hi - lo <= 0)
             return;
@@ -265,7 +380,7 @@ private:
         int median = (lo + hi) / 2;
 
         // find axis to split along (split along the biggest axis)
-        Position range = bounds.diagonal();
+        Position range = box.diagonal();
         unsigned axis  = la::argmax(range);
 
         // split about the median element
@@ -276,21 +391,265 @@ private:
         Node &node = nodes[median];
         AxisOp::set_axis(node.data, axis);
 
-        // build the left subtree, if there is more then 1 node in it
-        T tmp_max        = bounds.max[axis];
-        bounds.max[axis] = node.position[axis];
-        build(lo, median - 1);
-        bounds.max[axis] = tmp_max;
-
-        // build the right subtree, if there is more then 1 node in it
-        T tmp_min        = bounds.min[axis];
-        bounds.min[axis] = node.position[axis];
-        build(median + 1, hi);
-        bounds.min[axis] = tmp_min;
+        // the left and right subtrees lie on either side of the splitting plane
+        Box<N, T> left_box = box, right_box = box;
+        left_box.max[axis]  = node.position[axis];
+        right_box.min[axis] = node.position[axis];
+
+        // the subtrees are disjoint ranges of nodes, so they can safely be built concurrently
+        if (hi - lo + 1 >= parallel_build_threshold)
+            parallel_for(blocked_range<int>(0, 2, 1),
+                         [&](blocked_range<int> r)
+                         {
+                             for (auto c : r)
+                                 if (c == 0)
+                                     build(lo, median - 1, left_box);
+                                 else
+                                     build(median + 1, hi, right_box);
+                         });
+        else
+        {
+            build(lo, median - 1, left_box);
+            build(median + 1, hi, right_box);
+        }
+    }
+};
+
+/**
+    An alternative layout of #PointKDTree, with the points grouped into contiguous leaf buckets.
+
+    The implicit layout of #PointKDTree stores one point per tree node, so the last levels of every search visit single
+    points that are scattered across memory. This tree instead stops splitting once a subtree contains at most
+    #bucket_size points:
+
+    - The (few) interior nodes are stored depth-first in a small separate array that stays hot in the cache.
+    - The coordinates of the points are stored in structure-of-arrays form (one array per dimension), in leaf order,
+      so the distances from a query to all points of a bucket are computed by a loop the compiler can vectorize.
+    - The points themselves (with their data) are stored in the same order in #nodes, and only those within the
+      search radius are touched.
+
+    It provides the same interface for filling, building, and searching as #PointKDTree, and accepts the same search
+    objects (which must provide \c query_position, \c max_dist2, and <tt>check(node, dist2)</tt>).
+*/
+template <int N, class T, typename Data, typename AxisOp = AxisOperator<Data>>
+class BucketedPointKDTree
+{
+public:
+    using Position = Vec<N, T>;
+    using Node     = typename PointKDTree<N, T, Data, AxisOp>::Node;
+    using Nodes    = std::vector<Node>;
+
+    Nodes     nodes;  ///< All points of the tree, in leaf order after #build()
+    Box<N, T> bounds; ///< Bounding box containing all the elements
+
+    /// Maximum number of points in a leaf bucket
+    static constexpr int bucket_size = 16;
+    /// Subtrees with at least this many points have their two children built concurrently on the thread pool
+    static constexpr int parallel_build_threshold = 1 << 16;
+
+    /// Return the number of points in the kd-tree
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    /// Ensure that the #nodes vector can store at least \p t elements
+    void reserve(size_t t)
+    {
+        nodes.reserve(t);
+    }
+
+    /// Clear all points and the tree
+    void clear()
+    {
+        nodes.clear();
+        m_interior.clear();
+        for (auto &c : m_coords) c.clear();
+        bounds = Box<N, T>();
+    }
+
+    /// Insert a data point, and update the #bounds. The tree needs to be rebuilt afterwards
+    void insert(const Position &k, const Data &v)
+    {
+        nodes.push_back(Node(k, v));
+        bounds.enclose(k);
+    }
+
+    /// Append several batches of points in a single pass. \copydetails PointKDTree::merge()
+    void merge(std::vector<Nodes> &batches)
+    {
+        std::vector<size_t> offsets(batches.size() + 1, nodes.size());
+        for (size_t b = 0; b < batches.size(); ++b) offsets[b + 1] = offsets[b] + batches[b].size();
+        nodes.resize(offsets.back());
+
+        std::vector<Box<N, T>> batch_bounds(batches.size());
+        parallel_for(blocked_range<size_t>(0, batches.size(), 1),
+                     [&](blocked_range<size_t> r)
+                     {
+                         for (auto b : r)
+                         {
+                             std::copy(batches[b].begin(), batches[b].end(), nodes.begin() + offsets[b]);
+                             for (auto &node : batches[b]) batch_bounds[b].enclose(node.position);
+                             Nodes().swap(batches[b]);
+                         }
+                     });
+
+        for (auto &box : batch_bounds) bounds.enclose(box);
+    }
+
+    /// Build the tree, reordering #nodes into leaf order
+    void build()
+    {
+        m_interior.clear();
+        if (nodes.empty())
+            return;
+
+        // the shape of the tree only depends on the number of points, so each subtree knows where its nodes go
+        // beforehand, and the two halves can be built independently
+        m_interior.resize(count_nodes(uint32_t(size())));
+        build(0, 0, uint32_t(size()), bounds);
+
+        for (int a = 0; a < N; ++a)
+        {
+            m_coords[a].resize(size());
+            for (size_t i = 0; i < size(); ++i) m_coords[a][i] = nodes[i].position[a];
+        }
     }
+
+    /// Perform a search to find nearby data points. \see PointKDTree::find()
+    template <typename Search>
+    void find(Search &search) const
+    {
+        if (m_interior.empty())
+            return;
+
+        // the stack stores the far children along with their squared distance to the query along the splitting axis,
+        // so they can be culled if the search radius has shrunk by the time they are popped
+        struct StackItem
+        {
+            uint32_t node;
+            T        dist2;
+        };
+        StackItem todo[64];
+        int       todo_pos = 0;
+        uint32_t  current  = 0;
+        while (true)
+        {
+            const TreeNode &node = m_interior[current];
+            if (node.count)
+                check_bucket(search, node.offset, node.count);
+            else
+            {
+                T        d    = search.query_position[node.axis] - node.split;
+                uint32_t near = d < 0 ? current + 1 : node.offset, far = d < 0 ? node.offset : current + 1;
+                if (d * d < search.max_dist2)
+                    todo[todo_pos++] = {far, d * d};
+                current = near;
+                continue;
+            }
+
+            // grab the next node that may still overlap the search radius
+            while (todo_pos > 0 && todo[todo_pos - 1].dist2 >= search.max_dist2) --todo_pos;
+            if (todo_pos == 0)
+                break;
+            current = todo[--todo_pos].node;
+        }
+    }
+
+    /// Perform one search per query position, reusing \p search. \copydetails PointKDTree::find_batch()
+    template <typename Search, typename Visit>
+    void find_batch(const Position *queries, size_t count, Search &search, Visit &&visit) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            search.reset(queries[i]);
+            find(search);
+            visit(i, search);
+        }
+    }
+
+private:
+    /// A node of the tree: interior nodes split at #split along #axis, leaves reference a range of #nodes
+    struct TreeNode
+    {
+        T        split  = 0; ///< interior: the position of the splitting plane
+        uint32_t offset = 0; ///< interior: index of the second child; leaf: index of the first point
+        uint16_t count  = 0; ///< leaf: the number of points (at most #bucket_size), or 0 for interior nodes
+        uint16_t axis   = 0; ///< interior: the splitting axis
+    };
+
+    /// The number of tree nodes needed for \p n points
+    static uint32_t count_nodes(uint32_t n)
+    {
+        return n <= bucket_size ? 1 : 1 + count_nodes(n / 2) + count_nodes(n - n / 2);
+    }
+
+    /// Build the subtree with root \p index over the points <tt>[begin, end)</tt>, which lie within \p box
+    void build(uint32_t index, uint32_t begin, uint32_t end, const Box<N, T> &box)
+    {
+        TreeNode &node = m_interior[index];
+        uint32_t  n    = end - begin;
+        if (n <= bucket_size)
+        {
+            node.offset = begin;
+            node.count  = uint16_t(n);
+            return;
+        }
+
+        // split about the median along the biggest axis
+        unsigned axis = la::argmax(box.diagonal());
+        uint32_t mid  = begin + n / 2;
+        std::nth_element(nodes.begin() + begin, nodes.begin() + mid, nodes.begin() + end,
+                         [axis](const Node &k0, const Node &k1) { return k0.position[axis] < k1.position[axis]; });
+
+        node.axis   = uint16_t(axis);
+        node.split  = nodes[mid].position[axis];
+        node.offset = index + 1 + count_nodes(n / 2);
+
+        Box<N, T> left_box = box, right_box = box;
+        left_box.max[axis]  = node.split;
+        right_box.min[axis] = node.split;
+
+        uint32_t right = node.offset;
+        if (n >= parallel_build_threshold)
+            parallel_for(blocked_range<int>(0, 2, 1),
+                         [&](blocked_range<int> r)
+                         {
+                             for (auto c : r)
+                                 if (c == 0)
+                                     build(index + 1, begin, mid, left_box);
+                                 else
+                                     build(right, mid, end, right_box);
+                         });
+        else
+        {
+            build(index + 1, begin, mid, left_box);
+            build(right, mid, end, right_box);
+        }
+    }
+
+    /// Check the \p count points starting at \p first against the search radius at once
+    template <typename Search>
+    void check_bucket(Search &search, uint32_t first, uint32_t count) const
+    {
+        T dist2[bucket_size] = {};
+        for (int a = 0; a < N; ++a)
+        {
+            const T *coords = m_coords[a].data() + first;
+            T        q      = search.query_position[a];
+            for (uint32_t i = 0; i < count; ++i) dist2[i] += (coords[i] - q) * (coords[i] - q);
+        }
+
+        for (uint32_t i = 0; i < count; ++i)
+            if (dist2[i] < search.max_dist2)
+                search.check(nodes[first + i], dist2[i]);
+    }
+
+    std::vector<TreeNode> m_interior;  ///< The nodes of the tree, in depth-first order
+    std::vector<T>        m_coords[N]; ///< The coordinates of #nodes, one array per dimension
 };
 
 /**
     \file
-    \brief Class #PointKDTree and #AxisOperator
+    \brief Classes #PointKDTree, #BucketedPointKDTree, and #AxisOperator
 */
\ No newline at end of file
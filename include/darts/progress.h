@@ -31,6 +31,8 @@
 class Progress
 {
 public:
+    class Batch;
+
     /**
         Create a progress bar with a \p title and \p total_steps number of steps.
 
@@ -41,14 +43,18 @@ public:
                             number of steps), and \p total_steps is used as the period, in milliseconds, of the
                             progress bar's spinning animation. If 0 is specified, a default number of milliseconds is
                             used.
+
+        \param silent       Only count the steps without displaying anything, e.g. for tasks that are usually too
+                            short to be worth a progress bar.
      */
-    Progress(const std::string &title, int64_t total_steps = 0);
+    Progress(const std::string &title, int64_t total_steps = 0, bool silent = false);
     ~Progress();
 
-    /// increment the progress by \p steps. \see operator+=()
+    /// increment the progress by \p steps. \see operator+=(), #Batch
     void step(int64_t steps = 1)
     {
-        m_steps_done += steps;
+        // only the display thread reads the count, and it doesn't need to synchronize with anything else
+        m_steps_done.fetch_add(steps, std::memory_order_relaxed);
     }
 
     /// mark the progress as complete
@@ -57,7 +63,7 @@ public:
     /// the current progress
     int progress() const
     {
-        return int(m_steps_done);
+        return int(m_steps_done.load(std::memory_order_relaxed));
     }
 
     /// increment the progress by 1 step
@@ -75,16 +81,110 @@ public:
     }
 
 private:
-    std::string          m_title;
-    int64_t              m_num_steps;
-    std::atomic<int64_t> m_steps_done;
-    std::atomic<bool>    m_exit;
-    std::thread          m_update_thread;
+    std::string       m_title;
+    int64_t           m_num_steps;
+    std::atomic<bool> m_exit;
+    bool              m_silent = false; ///< Whether this progress bar is silent, and has no display thread
+    std::thread       m_update_thread;
+
+    /// The steps done so far, on its own cache line so that the threads stepping it don't also evict the other members
+    alignas(64) std::atomic<int64_t> m_steps_done;
+};
+
+/**
+    Counts steps locally and adds them to a #Progress in batches.
+
+    Stepping a shared #Progress from many threads in a hot loop makes its counter bounce between the cores' caches.
+    Instead, each thread (or task, such as a tile) can count its steps in its own Batch, which only adds them to the
+    #Progress every \p flush_every steps, when #flush() is called, and when it goes out of scope:
+
+    \code{.cpp}
+    Progress progress("Solving", n);
+    parallel_for(blocked_range<int>(0, n),
+                 [&](blocked_range<int> range)
+                 {
+                     Progress::Batch batch(progress);
+                     for (auto i : range)
+                     {
+                         // do something
+                         ++batch;
+                     }
+                 });
+    \endcode
+*/
+class Progress::Batch
+{
+public:
+    explicit Batch(Progress &progress, int64_t flush_every = 4096) : m_progress(progress), m_flush_every(flush_every)
+    {
+    }
+
+    Batch(const Batch &)            = delete;
+    Batch &operator=(const Batch &) = delete;
+
+    ~Batch()
+    {
+        flush();
+    }
+
+    /// increment the local count by \p steps, and add it to the #Progress if it reached the batch size
+    void step(int64_t steps = 1)
+    {
+        m_pending += steps;
+        if (m_pending >= m_flush_every)
+            flush();
+    }
+
+    /// add the locally counted steps to the #Progress
+    void flush()
+    {
+        if (m_pending)
+            m_progress.step(m_pending);
+        m_pending = 0;
+    }
+
+    /// increment the local count by 1 step
+    Batch &operator++()
+    {
+        step();
+        return *this;
+    }
+
+    /// increment the local count by \p steps. \see step()
+    Batch &operator+=(int64_t steps)
+    {
+        step(steps);
+        return *this;
+    }
+
+private:
+    Progress &m_progress;
+    int64_t   m_flush_every;
+    int64_t   m_pending = 0;
 };
 
+/**
+    Silence (or re-enable) all progress bars created from now on, e.g. for headless jobs whose output goes to a log.
+
+    A silent #Progress does not print anything and does not start its display thread, so stepping it only updates its
+    counter. Progress bars are also silent if the log level is above \c info when they are created.
+*/
+void set_progress_silent(bool silent = true);
+
+/**
+    Start (or stop) catching SIGINT (Ctrl-C), so that long computations can stop cleanly.
+
+    While interrupts are caught, the first Ctrl-C only sets the flag returned by #interrupted(). A second Ctrl-C
+    terminates the program as usual.
+*/
+void catch_interrupts(bool enable = true);
+
+/// Whether SIGINT was received since the last call to #catch_interrupts()
+bool interrupted();
+
 /** @}*/
 
 /**
     \file
-    \brief Class #Progress
+    \brief Class #Progress and handling of interrupts
 */
@@ -16,7 +16,11 @@
     Simple ray segment data structure.
 
     Along with the ray origin and direction, this data structure additionally stores the segment interval [\ref mint,
-    \ref maxt], which may include positive/negative infinity.
+    \ref maxt], which may include positive/negative infinity, and the \ref time of the ray for motion blur.
+
+    Rays can also carry the cone of directions they stand for (e.g.\ the pixel of a camera ray), as the \ref width of
+    the cone at the origin plus its \ref spread angle. Texture lookups use this footprint to pick a mip level. A ray
+    with a zero width and spread has no footprint.
 */
 template <size_t N, typename T>
 struct Ray
@@ -26,10 +30,13 @@ struct Ray
     /// infinity for type \tparam T
     static constexpr float infinity = std::numeric_limits<T>::infinity();
 
-    Vec<N, T> o;    ///< The origin of the ray
-    Vec<N, T> d;    ///< The direction of the ray
-    T         mint; ///< Minimum distance along the ray segment
-    T         maxt; ///< Maximum distance along the ray segment
+    Vec<N, T> o;        ///< The origin of the ray
+    Vec<N, T> d;        ///< The direction of the ray
+    T         mint;     ///< Minimum distance along the ray segment
+    T         maxt;     ///< Maximum distance along the ray segment
+    T         time   = 0; ///< The time within the shutter interval at which the ray travels (for motion blur)
+    T         width  = 0; ///< The width of the ray's footprint at its origin
+    T         spread = 0; ///< The growth of the footprint's width per unit of the ray parameter (the cone angle * |d|)
 
     /// Construct a new ray
     Ray() : mint(epsilon), maxt(infinity)
@@ -37,13 +44,14 @@ struct Ray
     }
 
     /// Construct a new ray
-    Ray(const Vec<N, T> &o, const Vec<N, T> &d, T mint = Ray::epsilon, T maxt = Ray::infinity) :
-        o(o), d(d), mint(mint), maxt(maxt)
+    Ray(const Vec<N, T> &o, const Vec<N, T> &d, T mint = Ray::epsilon, T maxt = Ray::infinity, T time = 0) :
+        o(o), d(d), mint(mint), maxt(maxt), time(time)
     {
     }
 
     /// Copy a ray, but change the covered segment of the copy
-    Ray(const Ray &ray, T mint, T maxt) : o(ray.o), d(ray.d), mint(mint), maxt(maxt)
+    Ray(const Ray &ray, T mint, T maxt) :
+        o(ray.o), d(ray.d), mint(mint), maxt(maxt), time(ray.time), width(ray.width), spread(ray.spread)
     {
     }
 
@@ -52,6 +60,32 @@ struct Ray
     {
         return o + t * d;
     }
+
+    /// Whether the ray carries a footprint (see #width and #spread)
+    bool has_footprint() const
+    {
+        return width > 0 || spread > 0;
+    }
+
+    /// The width of the ray's footprint at the point at parameter \p t
+    T footprint(T t) const
+    {
+        return width + spread * t;
+    }
+
+    /**
+        Continue the footprint of \p parent, which hit a surface at parameter \p t, on this (scattered) ray.
+
+        The scattered cone starts out as wide as the parent's is at the hit, and its angle grows by \p angle, the
+        blur added by the scattering (0 for a perfect mirror or refraction).
+    */
+    void continue_footprint(const Ray &parent, T t, T angle)
+    {
+        if (!parent.has_footprint())
+            return;
+        width  = parent.footprint(t);
+        spread = (parent.spread / length(parent.d) + angle) * length(d);
+    }
 };
 
 template <typename T>
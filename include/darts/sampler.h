@@ -20,7 +20,7 @@
 class Sampler
 {
 public:
-    Sampler() : m_sample_count(1u), m_current_sample(0u), m_current_dimension(0u)
+    Sampler() : m_base_seed(0u), m_sample_count(1u), m_current_sample(0u), m_current_dimension(0u)
     {
     }
 
@@ -79,6 +79,18 @@ public:
         m_current_sample++;
     }
 
+    /**
+        Jump directly to sample \p index of the current pixel.
+
+        This allows rendering the samples of a pixel in several batches (e.g. progressive passes, or adaptive rounds)
+        while still generating exactly the same sequence as if all samples were taken at once.
+    */
+    virtual void set_sample(uint32_t index)
+    {
+        m_current_dimension = 0u;
+        m_current_sample    = index;
+    }
+
     /// Retrieve the next float value (dimension) from the current sample
     virtual float next1f() = 0;
 
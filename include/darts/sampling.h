@@ -6,6 +6,8 @@
 #pragma once
 
 #include <darts/common.h>
+#include <darts/low_discrepancy.h>
+#include <darts/sampler.h>
 #include <darts/spherical.h>
 #include <pcg32.h>
 
@@ -21,10 +23,15 @@
     @{
 */
 
-/// Global random number generator that produces floats between <tt>[0,1)</tt>
+/**
+    Global random number generator that produces floats between <tt>[0,1)</tt> (each thread has its own state).
+
+    Since the results depend on which thread runs which task, the renderer instead draws its random numbers from a
+    per-tile #Sampler; this function is meant for the tutorials and tests.
+*/
 inline float randf()
 {
-    static pcg32 rng = pcg32();
+    thread_local pcg32 rng = pcg32();
     return rng.nextFloat();
 }
 
@@ -57,6 +64,32 @@ inline Vec2f random_in_unit_disk()
     return p;
 }
 
+/// Sample a random point uniformly within a unit sphere, drawing the random numbers from \p sampler
+inline Vec3f random_in_unit_sphere(Sampler &sampler)
+{
+    Vec3f p;
+    do
+    {
+        float a = sampler.next1f();
+        Vec2f b = sampler.next2f();
+        p       = 2.0f * Vec3f(a, b.x, b.y) - Vec3f(1);
+    } while (length2(p) >= 1.0f);
+
+    return p;
+}
+
+/// Sample a random point uniformly within a unit disk, drawing the random numbers from \p sampler
+inline Vec2f random_in_unit_disk(Sampler &sampler)
+{
+    Vec2f p;
+    do
+    {
+        p = 2.0f * sampler.next2f() - Vec2f(1);
+    } while (length2(p) >= 1.0f);
+
+    return p;
+}
+
 /// Hash two integer coordinates (e.g. pixel coordinates) into a pseudo-random unsigned int
 inline uint32_t hash2d(int x, int y)
 {
@@ -202,6 +235,22 @@ inline float sample_triangle_pdf(const Vec3f &v0, const Vec3f &v1, const Vec3f &
 
 /** @}*/
 
+/** \name Multiple importance sampling
+    @{
+*/
+
+/**
+    The MIS weight of a sample drawn with density \p pdf_a, when the same integral is also estimated with samples
+    drawn with density \p pdf_b (Veach's power heuristic with an exponent of 2).
+*/
+inline float power_heuristic(float pdf_a, float pdf_b)
+{
+    float a = sqr(pdf_a), b = sqr(pdf_b);
+    return a + b > 0.f ? a / (a + b) : 0.f;
+}
+
+/** @}*/
+
 
 
 
@@ -218,30 +267,22 @@ inline float sample_triangle_pdf(const Vec3f &v0, const Vec3f &v1, const Vec3f &
     A tabulated 1D probability distribution (either continuous or discrete).
 
     This data structure can be used to transform uniformly distributed
-    samples to a stored 1D probability distribution.
+    samples to a stored 1D probability distribution. Sampling performs a binary search over the CDF, so it takes
+    O(log n) time; use an #AliasTable when only discrete samples are needed and O(1) sampling matters.
 */
 struct Distribution1D
 {
+    Distribution1D() = default;
+
     /// Construct a 1D distribution from an array of \p n floats starting at \p f
     Distribution1D(const float *f, int n) : func(f, f + n), cdf(n + 1)
     {
-        // Compute integral of step function at x_i
-        cdf[0] = 0;
-        for (int i = 1; i < n + 1; ++i)
-            cdf[i] = cdf[i - 1] + func[i - 1] / n;
+        func_int = build_cdf(f, n, cdf.data());
+    }
 
-        // Transform step function integral into CDF
-        func_int = cdf[n];
-        if (func_int == 0)
-        {
-            for (int i = 1; i < n + 1; ++i)
-                cdf[i] = float(i) / float(n);
-        }
-        else
-        {
-            for (int i = 1; i < n + 1; ++i)
-                cdf[i] /= func_int;
-        }
+    /// Construct a 1D distribution from the values in \p f
+    explicit Distribution1D(const std::vector<float> &f) : Distribution1D(f.data(), int(f.size()))
+    {
     }
 
     /// Number of elements in the distribution
@@ -253,30 +294,27 @@ struct Distribution1D
     /**
         Sample from a piecewise-constant tabulated 1D distribution.
 
+        If all function values are zero, the samples (and their pdf, see #pdf()) are uniform.
+
         \param [in] u      Uniform random number in [0,1)
         \param [out] pdf   If not null, stores the pdf of the sample
-        \param [out] off   If not null, stores the
+        \param [out] off   If not null, stores the index of the element containing the sample
         \return            The sample.
     */
     float sample_continuous(float u, float *pdf, int *off = nullptr) const
     {
         // Find surrounding CDF segments and offset
-        int offset = find_interval(u);
+        int offset = find_interval(cdf.data(), count(), u);
 
         if (off)
             *off = offset;
 
-        // Compute offset along CDF segment
-        float du = u - cdf[offset];
-        if ((cdf[offset + 1] - cdf[offset]) > 0)
-            du /= (cdf[offset + 1] - cdf[offset]);
-
         // Compute PDF for sampled offset
         if (pdf)
-            *pdf = (func_int > 0) ? func[offset] / func_int : 0;
+            *pdf = (func_int > 0) ? func[offset] / func_int : 1.f;
 
         // Return x in [0,1) corresponding to sample
-        return (offset + du) / count();
+        return std::min((offset + u) / count(), one_minus_epsilon);
     }
 
     /**
@@ -290,72 +328,142 @@ struct Distribution1D
     int sample_discrete(float u, float *pmf = nullptr, float *u_remapped = nullptr) const
     {
         // Find surrounding CDF segments and _offset_
-        int offset = find_interval(u);
+        int offset = find_interval(cdf.data(), count(), u);
         if (pmf)
-            *pmf = (func_int > 0) ? func[offset] / (func_int * count()) : 0;
+            *pmf = discrete_PDF(offset);
         if (u_remapped)
-            *u_remapped = (u - cdf[offset]) / (cdf[offset + 1] - cdf[offset]);
+            *u_remapped = u;
         return offset;
     }
+
     /// The discrete PDF value
     float discrete_PDF(int index) const
     {
-        return func[index] / (func_int * count());
+        return cdf[index + 1] - cdf[index];
     }
 
-    // Distribution1D Public Data
-    std::vector<float> func, cdf;
-    float              func_int;
+    /// The density of sampling \p x in [0,1) with #sample_continuous()
+    float pdf(float x) const
+    {
+        if (!(x >= 0.f && x < 1.f))
+            return 0.f;
+        return discrete_PDF(std::min(int(x * count()), count() - 1)) * count();
+    }
 
-private:
-    int find_interval(float u) const
+    /**
+        Fill the \p n + 1 entries of \p cdf from the \p n function values \p f.
+
+        Falls back to a uniform distribution if all values are zero.
+
+        \return The integral of the step function (the average of \p f)
+    */
+    static float build_cdf(const float *f, int n, float *cdf)
     {
-        std::vector<float>::const_iterator entry = std::lower_bound(cdf.begin(), cdf.end(), u);
-        int                                index = (int)std::max((ptrdiff_t)0, entry - cdf.begin() - 1);
-        return std::min(index, int(cdf.size()) - 2);
+        // Compute integral of step function at x_i, accumulating in double precision for long tables
+        double sum = 0.0;
+        cdf[0]     = 0;
+        for (int i = 1; i < n + 1; ++i)
+        {
+            sum += f[i - 1];
+            cdf[i] = float(sum / n);
+        }
+
+        // Transform step function integral into CDF
+        float func_int = float(sum / n);
+        if (func_int == 0)
+        {
+            for (int i = 1; i < n + 1; ++i)
+                cdf[i] = float(i) / float(n);
+        }
+        else
+        {
+            for (int i = 1; i < n + 1; ++i)
+                cdf[i] /= func_int;
+        }
+        cdf[n] = 1.f;
+        return func_int;
+    }
+
+    /**
+        Find the element of the \p n element \p cdf that contains \p u, skipping elements with zero probability.
+
+        \param [in]     cdf    The \p n + 1 entries of a CDF
+        \param [in]     n      The number of elements
+        \param [in,out] u      Uniform random number in [0,1), remapped to the relative offset within the element
+        \return                The index of the element
+    */
+    static int find_interval(const float *cdf, int n, float &u)
+    {
+        // the last entry that is <= u starts a segment of non-zero width
+        int index = clamp(int(std::upper_bound(cdf, cdf + n + 1, u) - cdf) - 1, 0, n - 1);
+
+        float width = cdf[index + 1] - cdf[index];
+        u           = width > 0 ? std::min((u - cdf[index]) / width, one_minus_epsilon) : 0.f;
+        return index;
     }
+
+    // Distribution1D Public Data
+    std::vector<float> func, cdf;
+    float              func_int = 0;
 };
 
-/// Allows sampling from a piecewise-constant 2D distribution.
+/**
+    Allows sampling from a piecewise-constant 2D distribution.
+
+    The conditional distributions of all rows are stored back to back in flat arrays (rather than as separate
+    Distribution1D objects), so sampling only touches the marginal CDF and one contiguous row.
+*/
 class Distribution2D
 {
 public:
-    // Distribution2D Public Methods
-    Distribution2D(const float *func, int nu, int nv)
+    Distribution2D() = default;
+
+    /// Construct a 2D distribution from the \p nu by \p nv floats (stored row by row) starting at \p func
+    Distribution2D(const float *func, int nu, int nv) :
+        m_nu(nu), m_conditional_func(func, func + nu * nv), m_conditional_cdf((nu + 1) * nv)
     {
-        p_conditional.reserve(nv);
+        // Compute conditional sampling distribution for vs
+        std::vector<float> marginal_func(nv);
         for (int v = 0; v < nv; ++v)
-        {
-            // Compute conditional sampling distribution for vs
-            p_conditional.emplace_back(new Distribution1D(&func[v * nu], nu));
-        }
+            marginal_func[v] = Distribution1D::build_cdf(&func[v * nu], nu, &m_conditional_cdf[v * (nu + 1)]);
+
         // Compute marginal sampling distribution p[v]
-        std::vector<float> marginal_func;
-        marginal_func.reserve(nv);
-        for (int v = 0; v < nv; ++v)
-            marginal_func.push_back(p_conditional[v]->func_int);
-        p_marginal.reset(new Distribution1D(&marginal_func[0], nv));
+        m_marginal = Distribution1D(marginal_func);
     }
+
+    /// Sample from the distribution, and store the pdf of the sample in \p pdf
     Vec2f sample_continuous(const Vec2f &u, float *pdf) const
     {
         float pdfs[2];
         int   v;
-        float d1 = p_marginal->sample_continuous(u[1], &pdfs[1], &v);
-        float d0 = p_conditional[v]->sample_continuous(u[0], &pdfs[0]);
-        *pdf     = pdfs[0] * pdfs[1];
+        float d1 = m_marginal.sample_continuous(u[1], &pdfs[1], &v);
+
+        const float *cdf    = &m_conditional_cdf[v * (m_nu + 1)];
+        float        u0     = u[0];
+        int          offset = Distribution1D::find_interval(cdf, m_nu, u0);
+        float        d0     = std::min((offset + u0) / m_nu, one_minus_epsilon);
+        pdfs[0]             = (cdf[offset + 1] - cdf[offset]) * m_nu;
+
+        *pdf = pdfs[0] * pdfs[1];
         return Vec2f(d0, d1);
     }
+
+    /// The density of sampling \p p in [0,1)^2 with #sample_continuous()
     float pdf(const Vec2f &p) const
     {
-        int iu = clamp(int(p[0] * p_conditional[0]->count()), 0, p_conditional[0]->count() - 1);
-        int iv = clamp(int(p[1] * p_marginal->count()), 0, p_marginal->count() - 1);
-        return p_conditional[iv]->func[iu] / p_marginal->func_int;
+        int iu = clamp(int(p[0] * m_nu), 0, m_nu - 1);
+        int iv = clamp(int(p[1] * m_marginal.count()), 0, m_marginal.count() - 1);
+        if (m_marginal.func_int == 0)
+            return 1.f;
+        return m_conditional_func[iv * m_nu + iu] / m_marginal.func_int;
     }
 
 private:
     // Distribution2D Private Data
-    std::vector<std::unique_ptr<Distribution1D>> p_conditional;
-    std::unique_ptr<Distribution1D>              p_marginal;
+    int                m_nu = 0;           ///< The number of elements per row
+    std::vector<float> m_conditional_func; ///< The function values, row by row
+    std::vector<float> m_conditional_cdf;  ///< The CDFs of the rows, \c m_nu + 1 entries per row
+    Distribution1D     m_marginal;         ///< The distribution of the row integrals
 };
 
 /** @}*/
@@ -5,12 +5,28 @@
 */
 #pragma once
 
+#include <darts/aov.h>
 #include <darts/camera.h>
 #include <darts/common.h>
 #include <darts/factory.h>
+#include <darts/framebuffer.h>
 #include <darts/image.h>
 #include <darts/material.h>
+#include <darts/sampler.h>
 #include <darts/surface_group.h>
+#include <functional>
+
+class Hasher;
+class Progress;
+
+/// Settings for Scene::raytrace_progressive()
+struct ProgressiveOptions
+{
+    int   pass_samples = 1;   ///< Number of samples per pixel added to the image in each pass
+    float time_budget  = 0.f; ///< If positive, stop before starting a pass that would not finish within this many seconds
+    int   save_passes  = 0;   ///< If positive, report the intermediate image every this many passes
+    float save_seconds = 0.f; ///< If positive, report the intermediate image once this many seconds have passed
+};
 
 /**
     Main scene data structure.
@@ -29,6 +45,19 @@ public:
     /// Parse a scene from a json object
     void parse(const json &j);
 
+    /**
+        Parse a scene from the json file \p filename, without ever holding the json of all its surfaces in memory.
+
+        The file is read by a streaming parser, which creates the elements of the top-level \c "surfaces" array in
+        batches as soon as they are read, and then drops their json. This requires \c "surfaces" to be the last
+        top-level field (as in files written by nlohmann::json, which sorts the keys), since the surfaces can refer to
+        the materials and media. Other files are parsed again as a whole, and files that aren't scenes (e.g. with
+        <tt>"type": "tests"</tt>) are only read.
+
+        \return The json of the file, with an empty \c "surfaces" array if the surfaces were streamed
+    */
+    json parse_file(const string &filename);
+
     /// Release all memory
     virtual ~Scene();
 
@@ -37,39 +66,235 @@ public:
         m_surfaces->add_child(surface);
     }
 
+    /// Update the acceleration structures after surfaces were moved with XformedSurface::set_transform()
+    void refit() override
+    {
+        m_surfaces->refit();
+        m_lighting_hash = 0; // the moved surfaces are not described by the parsed scene anymore
+    }
+
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
 
+    /// Trace a shadow ray: determine whether anything in the scene blocks \p ray
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Trace a packet of coherent rays (e.g. camera rays from the same tile) through the scene together
+    void intersect_packet(const Ray3f *rays, HitInfo *hits, bool *found, int count) const override;
+
     Box3f bounds() const override
     {
         return m_surfaces->bounds();
     }
 
-    /// Return the background color
+    /// Whether the scene contains any emissive surfaces (the environment map isn't included)
+    bool is_emissive() const override
+    {
+        return m_surfaces->is_emissive();
+    }
+
+    /// The solid angle density of sampling direction \p v from \p o with #sample_emitter() and Surface::sample()
+    float pdf(const Vec3f &o, const Vec3f &v) const override
+    {
+        return m_surfaces->is_emissive() ? m_surfaces->pdf(o, v) : 0.f;
+    }
+
+    /// Return the background color, looked up in the environment map if there is one
     Color3f background(const Ray3f &ray) const;
 
+    /// The environment map lighting the scene, or nullptr if the background is a constant color
+    const Environment *environment() const
+    {
+        return m_environment.get();
+    }
+
+    /// The medium surrounding the camera (the \c "medium" of the camera), or nullptr if the camera is in vacuum
+    const Medium *medium() const
+    {
+        return m_medium.get();
+    }
+
     /// Return the camera
     shared_ptr<const Camera> camera() const
     {
         return m_camera;
     }
 
+    /// Return the prototype of the sampler, which needs to be cloned before generating any samples
+    shared_ptr<const Sampler> sampler() const
+    {
+        return m_sampler;
+    }
+
+    /// Return the number of samples per pixel
+    int num_samples() const
+    {
+        return m_num_samples;
+    }
+
+    /**
+        A hash of everything in the scene that affects how light travels through it, but not of the camera, sampler,
+        or integrator: the surfaces, materials, media, and background, along with the files they load.
+
+        This keys cached data that can be reused for all views of a scene, e.g. photon maps. It is only computed when
+        the cache is enabled (see #cache_enabled()), and is 0 otherwise, or once surfaces were moved with #refit().
+    */
+    uint64_t lighting_hash() const
+    {
+        return m_lighting_hash;
+    }
+
+    /**
+        Choose an emissive surface of the scene, proportionally to its power.
+
+        \param [in,out] rv1 Random variable distributed uniformly in [0,1), which is remapped for reuse
+        \return             The chosen emitter (or nullptr if the scene has none) along with its probability
+    */
+    pair<const Surface *, float> sample_emitter(float &rv1) const;
+
     /**
         Sample the color along a ray
 
         \param ray      The ray in question
         \param depth    The current recursion depth
+        \param sampler  The source of random numbers (owned by the calling thread)
         \return         An estimate of the color from this direction
     */
-    Color3f recursive_color(const Ray3f &ray, int depth) const;
+    Color3f recursive_color(const Ray3f &ray, int depth, Sampler &sampler) const;
 
-    /// Generate the entire image by ray tracing.
-    Image3f raytrace() const;
+    /// Generate a camera ray through pixel (\p x, \p y), using the current sample of \p sampler
+    Ray3f camera_ray(int x, int y, Sampler &sampler) const;
+
+    /**
+        Take one sample of pixel (\p x, \p y) with the integrator, using the current sample of \p sampler.
+
+        If \p aov is not null, the AOVs of the camera ray, and the cost of the whole path, are recorded there. If the
+        integrator doesn't record the AOVs itself, the camera ray is intersected with the scene once more to find them
+        (which doesn't count towards the cost).
+    */
+    Color3f sample_pixel(int x, int y, Sampler &sampler, AOVSample *aov = nullptr) const;
+
+    /**
+        Generate the entire image by ray tracing.
+
+        The image is split into square tiles of #m_tile_size pixels which are handed out in #m_tile_order to the
+        threads of the nanothread pool. Each tile uses its own clone of #m_sampler, which is deterministically seeded
+        for each pixel and sample, so the result does not depend on the number of threads or on which thread rendered
+        which tile.
+
+        If the sampler specifies a \c "target_error", the image is rendered adaptively with #raytrace_adaptive().
+
+        \param aovs  If not null, also average the AOVs of all samples into these buffers (of the camera's resolution),
+                     in the same pass. This isn't supported by adaptive sampling or integrators rendering whole images.
+    */
+    Image3f raytrace(AOVBuffers *aovs = nullptr) const;
+
+    /**
+        Generate the image by adaptively distributing samples to the pixels that need them most.
+
+        Each pixel keeps a running estimate (using Welford's algorithm) of the mean and variance of the luminance of
+        its samples. The image is rendered in rounds: the first round takes #m_min_samples samples in every pixel, and
+        each later round takes #m_round_samples more samples in those pixels whose relative standard error is still
+        above #m_target_error, up to a maximum of #m_num_samples. Tiles whose pixels have all converged are dropped
+        from later rounds, so the threads concentrate on the remaining noisy regions of the image.
+    */
+    Image3f raytrace_adaptive() const;
+
+    /// Callback receiving an intermediate image of a progressive rendering, along with its samples per pixel
+    using ImageCallback = std::function<void(Image3f &image, int spp)>;
+
+    /**
+        Generate the image progressively, in passes of \p options.pass_samples samples per pixel.
+
+        Each pass is blended into a running average (a #Framebuffer in the sampler's \c "framebuffer" format:
+        \c "float", \c "half", or \c "rgbe"), and the current average is periodically handed to \p update
+        (e.g. to save it to disk), so that an approximation of the image is available long before the rendering
+        finishes. With the compact formats, passes are summed up in floats until they make up at least
+        1 / max_blends() of the samples, so the rounding of each blend doesn't stall the average after many passes.
+        The rendering stops early if the time budget runs out or when the user presses Ctrl-C, in which case the
+        incomplete pass is discarded (along with the passes not yet blended into the average).
+
+        \param samples_done  If not null, set to the number of samples per pixel of the returned image
+        \param aovs          If not null, the AOVs (see #raytrace()), which are averaged over the samples of the first
+                             pass only
+        \return The average of all completed passes
+    */
+    Image3f raytrace_progressive(const ProgressiveOptions &options, const ImageCallback &update = nullptr,
+                                 int *samples_done = nullptr, AOVBuffers *aovs = nullptr) const;
+
+    /**
+        Only render part of the image, e.g. to split a frame across the nodes of a compute cluster.
+
+        Only the tiles overlapping \p region (given as inclusive lower and exclusive upper pixel coordinates) are
+        rendered, clipped to the region. Of those, only tiles <tt>[first_tile, last_tile)</tt> in the scene's tile
+        order are kept (a negative \p last_tile keeps all of them). The images returned by the \c raytrace functions
+        keep the full resolution, but all other pixels are black.
+    */
+    void set_render_region(const Box2i &region, int first_tile = 0, int last_tile = -1);
+
+    /// The tiles that the \c raytrace functions render, in the order they are scheduled in
+    vector<Box2i> render_tiles() const;
+
+    /// Whether only part of the image is rendered (see #set_render_region())
+    bool renders_partial_image() const
+    {
+        return m_partial;
+    }
+
+    /// Replace the camera by one created from \p j, e.g. to render another view of a scene that stays in memory
+    void set_camera(const json &j);
+
+    /// Change the number of samples per pixel, recreating the sampler and seeding it with the current #random_seed
+    void set_num_samples(int spp);
 
 private:
+    /// Parse everything but the surfaces of the scene \p j (the camera, sampler, integrator, media, materials, ...)
+    void parse_settings(const json &j);
+
+    /// Create the surfaces \p specs of the scene \p j (in order), and add their json to \p surfaces_hash
+    void parse_surfaces(const json &specs, const json &j, Hasher &surfaces_hash);
+
+    /// Check the top-level fields of the scene \p j, build the acceleration structures, and compute #lighting_hash()
+    void finish_parsing(const json &j, const Hasher &surfaces_hash);
+
+    /**
+        Add up samples <tt>[first_sample, first_sample + num_samples)</tt> of each pixel to \p sum (and their AOVs
+        to \p aovs, if not null), rendering the tiles in parallel.
+
+        \return False if the pass was interrupted, in which case some tiles of \p sum are missing samples.
+    */
+    bool render_pass(Image3f &sum, const vector<Box2i> &tiles, int first_sample, int num_samples, Progress &progress,
+                     AOVBuffers *aovs = nullptr) const;
+
+    /// Add up samples <tt>[first_sample, first_sample + num_samples)</tt> of each pixel in \p tile to \p sum
+    void render_tile(Image3f &sum, const Box2i &tile, int first_sample, int num_samples, AOVBuffers *aovs) const;
+
+    /// Like #render_tile(), but hand batches of camera rays to Integrator::Li_batch()
+    void render_tile_batched(Image3f &sum, const Box2i &tile, int first_sample, int num_samples,
+                             AOVBuffers *aovs) const;
+
     shared_ptr<Camera>       m_camera;
     shared_ptr<SurfaceGroup> m_surfaces;
-    Color3f m_background  = Color3f(0.2f);
-    int     m_num_samples = 1;
+    shared_ptr<Sampler>      m_sampler;      ///< Prototype of the sampler, cloned for each tile
+    json                     m_sampler_spec; ///< The parameters #m_sampler was created from
+    shared_ptr<Integrator>   m_integrator;   ///< The integrator, or nullptr to use #recursive_color()
+    shared_ptr<Environment>  m_environment;  ///< The environment map, or nullptr to use #m_background
+    shared_ptr<const Medium> m_medium;       ///< The medium surrounding the camera, or nullptr for vacuum
+    Color3f m_background    = Color3f(0.2f);
+    int     m_num_samples   = 1;
+    int     m_tile_size     = 32;        ///< Side length, in pixels, of the square tiles rendered in parallel
+    string  m_tile_order    = "hilbert"; ///< Order tiles are scheduled in: "hilbert", "spiral", or "scanline"
+    float   m_target_error  = 0.f;       ///< Relative error at which adaptive sampling stops (0 disables it)
+    int     m_min_samples   = 16;        ///< Number of samples per pixel before adaptive sampling can stop
+    int     m_round_samples = 8;         ///< Number of samples added to noisy pixels in each adaptive round
+    bool    m_partial       = false;     ///< Whether to only render part of the image (see #set_render_region())
+    Box2i   m_region;                    ///< The part of the image to render, if #m_partial
+    int     m_first_tile    = 0;         ///< The first tile to render, if #m_partial
+    int     m_last_tile     = -1;        ///< One past the last tile to render (or -1 for all), if #m_partial
+
+    uint64_t m_lighting_hash = 0; ///< See #lighting_hash()
+
+    /// The format of the accumulation buffers of progressive and adaptive rendering
+    PixelFormat m_framebuffer_format = PixelFormat::Float;
 };
 
 /// create hard-coded test scenes that do not need to be loaded from a file
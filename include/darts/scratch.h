@@ -0,0 +1,92 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/** \addtogroup Utilities
+    @{
+*/
+
+/**
+    A per-thread bump allocator for short-lived temporaries of the render loop.
+
+    Allocating from the arena just advances an offset into a block of memory the thread owns. Nothing is returned to
+    the arena individually: a #Scope marks the current position, and rewinds the arena to it when it goes out of scope.
+    The blocks are kept for the next allocations, so once the arena has grown to the thread's peak use, rendering never
+    calls \c malloc for these temporaries again.
+
+    Example usage:
+
+    \code{.cpp}
+    ScratchArena::Scope scratch; // everything below is released at the end of the enclosing block
+    Color3f *throughput = scratch.arena.alloc<Color3f>(n);
+    \endcode
+
+    Only trivially destructible types can be allocated, since their destructors are never called.
+*/
+class ScratchArena
+{
+public:
+    /// Releases everything allocated from the calling thread's arena since its construction, when destroyed
+    class Scope
+    {
+    public:
+        ScratchArena &arena; ///< The arena of the calling thread
+
+        Scope();
+        ~Scope();
+
+        Scope(const Scope &)            = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        size_t m_block, m_offset;
+    };
+
+    /// The arena of the calling thread
+    static ScratchArena &local();
+
+    /// Allocate \p bytes of uninitialized memory, aligned to \p align bytes (which must be a power of two)
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+
+    /// Allocate uninitialized memory for \p count objects of type \p T
+    template <typename T>
+    T *alloc(size_t count)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "The arena never calls destructors.");
+        return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    /// The number of bytes currently allocated from the arena
+    size_t used() const;
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t                       size;
+    };
+
+    /// The size of the first block of each arena, in bytes
+    static constexpr size_t initial_block_size = 256 * 1024;
+
+    std::vector<Block> m_blocks;
+    size_t             m_block  = 0; ///< The index of the block allocations currently come from
+    size_t             m_offset = 0; ///< The first free byte within the current block
+    size_t             m_peak   = 0; ///< The largest #used() since the outermost #Scope was entered
+    int                m_depth  = 0; ///< The number of active #Scope%s
+};
+
+/** @}*/
+
+/**
+    \file
+    \brief Class #ScratchArena
+*/
@@ -17,8 +17,45 @@ public:
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
     Box3f local_bounds() const override;
 
+    /// Sample a point on the sphere with #sample_sphere(), which is only approximately uniform if it is scaled
+    /// non-uniformly (just like #area())
+    float sample_area(HitInfo &hit, const Vec2f &rv) const override;
+
+    /// The surface area, which is only approximate if the sphere is scaled non-uniformly
+    float area() const override;
+
+    /// The exact world-space bounds if #is_world_space(), otherwise the transformed #local_bounds()
+    Box3f bounds() const override;
+
+    void set_transform(const Transform &xform) override;
+
+    /// Whether the transform is a (static) similarity, so the sphere can be intersected in world space
+    bool is_world_space() const
+    {
+        return m_world_space;
+    }
+
+    /// The world-space center of the sphere, if #is_world_space()
+    const Vec3f &world_center() const
+    {
+        return m_center;
+    }
+
+    /// The world-space radius of the sphere, if #is_world_space()
+    float world_radius() const
+    {
+        return m_world_radius;
+    }
+
 protected:
+    /// Precompute the world-space #m_center and #m_world_radius if the transform allows it
+    void update_world_space();
+
     float m_radius = 1.0f; ///< The radius of the sphere
+
+    bool  m_world_space  = false; ///< Whether rays can be intersected with #m_center and #m_world_radius directly
+    Vec3f m_center       = Vec3f(0.f);
+    float m_world_radius = 1.f;
 };
 
 /**
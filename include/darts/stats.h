@@ -12,8 +12,11 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <limits>
+#include <nlohmann/json.hpp>
 #include <string>
 
 /** \addtogroup Utilities
@@ -30,6 +33,7 @@
      - Integer counter (#STAT_COUNTER), optionally formatted as an amount of memory (#STAT_MEMORY_COUNTER)
      - A fractional value which can be reported either as a ratio (#STAT_RATIO) or as a percentage (#STAT_PERCENT)
      - A distribution of floating point (#STAT_FLOAT_DISTRIBUTION) or integer (#STAT_INT_DISTRIBUTION) values
+     - The wall-clock and CPU time spent in a phase of the program (#STAT_TIMER), with a per-thread breakdown
 
     These macros take a string that will be used as a title in the statistics report returned by #stats_report(), and
     the names(s) for the global variables to create for tracking this statistic.
@@ -88,9 +92,12 @@ public:
 
     void report_int_distribution(const char *name, int64_t sum, int64_t count, int64_t min, int64_t max);
     void report_float_distribution(const char *name, double sum, int64_t count, double min, double max);
+    void report_timer(const char *name, int thread, int64_t wall_ns, int64_t cpu_ns, int64_t count);
 
-    std::string report();
-    void        clear();
+    std::string    report();
+    nlohmann::json to_json() const;
+    void           merge(const StatsAccumulator &other);
+    void           clear();
 
 private:
     // StatsAccumulator Private Data
@@ -106,11 +113,24 @@ private:
 */
 std::string stats_report();
 
+/**
+    Return all statistics gathered since the start of the program as a json object, e.g. for tracking performance
+    across builds.
+
+    Unlike #stats_report(), this includes the statistics that were already cleared by #clear_stats(), so it can be
+    called once at the very end. Each kind of statistic is stored in its own object (\c "counters", \c "memory",
+    \c "percentages", \c "ratios", \c "int_distributions", \c "float_distributions", and \c "timers"), keyed by the
+    full title of the statistic, e.g. <tt>j["ratios"]["BBH/Nodes visited per ray"]["value"]</tt>.
+
+    As for #stats_report(), call #accumulate_thread_stats() from every thread first.
+*/
+nlohmann::json stats_json();
+
 /**
     Clear all statistics.
 
     Call this if you'd like to restart gathering statistics during different stages of execution of your program (e.g.
-    rendering multiple images).
+    rendering multiple images). The cleared statistics still count towards the totals returned by #stats_json().
 */
 void clear_stats();
 
@@ -249,6 +269,102 @@ struct StatIntDistribution
             denom_var = 0;                                                                                       \
         });
 
+/// Return the CPU time, in nanoseconds, that the calling thread has spent so far
+int64_t thread_cpu_time_ns();
+
+/// A small integer identifying the calling thread in the statistics report, assigned on first use
+int stat_thread_index();
+
+/// The wall-clock and CPU time accumulated by a #STAT_TIMER on one thread
+struct StatTimer
+{
+    int64_t wall_ns = 0; ///< Total wall-clock time, in nanoseconds
+    int64_t cpu_ns  = 0; ///< Total CPU time of the thread, in nanoseconds
+    int64_t count   = 0; ///< Number of timed scopes
+};
+
+/// Add the wall-clock and CPU time between its construction and destruction to a #StatTimer. \see #SCOPED_STAT_TIMER
+class ScopedStatTimer
+{
+public:
+    explicit ScopedStatTimer(StatTimer &timer) :
+        m_timer(timer), m_wall_start(std::chrono::steady_clock::now()), m_cpu_start(thread_cpu_time_ns())
+    {
+    }
+
+    ~ScopedStatTimer()
+    {
+        auto wall = std::chrono::steady_clock::now() - m_wall_start;
+        m_timer.wall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count();
+        m_timer.cpu_ns += thread_cpu_time_ns() - m_cpu_start;
+        ++m_timer.count;
+    }
+
+    ScopedStatTimer(const ScopedStatTimer &)            = delete;
+    ScopedStatTimer &operator=(const ScopedStatTimer &) = delete;
+
+private:
+    StatTimer                            &m_timer;
+    std::chrono::steady_clock::time_point m_wall_start;
+    int64_t                               m_cpu_start;
+};
+
+#if defined(DARTS_STAT_TIMERS)
+
+/**
+    Create a thread-safe statistic measuring the wall-clock and CPU time spent in a phase of the program.
+
+    The phase is timed by placing a #SCOPED_STAT_TIMER in the scope(s) to measure. Timers are hierarchical: a title
+    with several levels, like \c "Time/Scene parsing/Mesh loading", is reported indented below its parent phase
+    (\c "Time/Scene parsing"). Several timers (e.g. in different files) with the same title are added up. Besides the
+    total, the report lists the wall-clock time spent on each thread that ran the phase.
+
+    Timers are only collected if darts is configured with \c USE_STAT_TIMERS (which defines \c DARTS_STAT_TIMERS),
+    and otherwise compile to nothing.
+
+    \copydetails STAT_COUNTER()
+*/
+#define STAT_TIMER(title, var)                                                                                         \
+    static thread_local StatTimer var;                                                                                 \
+    static StatRegisterer         STATS_REG##var(                                                                      \
+        [](StatsAccumulator &accum)                                                                            \
+        {                                                                                                      \
+            accum.report_timer(title, stat_thread_index(), var.wall_ns, var.cpu_ns, var.count);                \
+            var = StatTimer();                                                                                 \
+        });
+
+/// Time the rest of the enclosing scope with the #STAT_TIMER \p var
+#define SCOPED_STAT_TIMER(var) ScopedStatTimer var##_scope(var)
+
+#else
+
+#define STAT_TIMER(title, var)
+#define SCOPED_STAT_TIMER(var)
+
+#endif
+
 /** @}*/
 
+/**
+    Counters of the work done by the calling thread, which keep growing for the whole run.
+
+    Unlike the statistics above, these are not reset by #accumulate_thread_stats(), and can be read from anywhere:
+    sampling them before and after a piece of work (e.g. a pixel sample, see AOVSample::cost) attributes the work to
+    it. The BBH traversal and Scene::intersect() increment them unconditionally, just like the statistics.
+*/
+struct RenderCost
+{
+    int64_t nodes_visited = 0; ///< BBH nodes whose bounds were tested against a ray
+    int64_t prims_tested  = 0; ///< Primitives in the BBH leaves reached by a ray
+    int64_t rays          = 0; ///< Closest-hit rays traced through the scene (the combined length of the paths)
+
+    RenderCost operator-(const RenderCost &other) const
+    {
+        return {nodes_visited - other.nodes_visited, prims_tested - other.prims_tested, rays - other.rays};
+    }
+};
+
+/// The #RenderCost of the calling thread
+inline thread_local RenderCost g_render_cost;
+
 /** @}*/
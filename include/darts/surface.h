@@ -30,6 +30,9 @@ struct HitInfo
     Vec3f sn; ///< Interpolated shading normal
     Vec2f uv; ///< UV texture coordinates
 
+    /// The width of the ray's footprint around #uv, in uv units (0 if the ray or the surface doesn't provide one)
+    float uv_width = 0.f;
+
     const Material *mat = nullptr; ///< Material at the hit point
 
     /// Default constructor that leaves all members uninitialized
@@ -77,6 +80,16 @@ public:
     */
     virtual void build(){};
 
+    /**
+        Update any precomputed bounds after the transforms of (some of) the children of this surface changed.
+
+        Acceleration structures refit their hierarchies to the new bounds of their children instead of rebuilding
+        them. The base class implementation just does nothing.
+    */
+    virtual void refit()
+    {
+    }
+
     /**
         Add a child surface.
 
@@ -120,6 +133,42 @@ public:
     {
         throw DartsException("Surface intersection method not implemented.");
     }
+
+    /**
+        Ray-Surface occlusion (any-hit) test.
+
+        Determine whether the ray hits this surface anywhere within [ray.mint, ray.maxt], without computing the closest
+        hit or any of the hit information. This is what shadow rays need, and Surfaces should override it to return as
+        soon as any hit is found. The default implementation simply calls #intersect().
+
+        \param [in] ray     A 3-dimensional ray data structure with minimum/maximum extent information
+        \return             True if the ray is blocked by this surface
+     */
+    virtual bool occluded(const Ray3f &ray) const
+    {
+        HitInfo hit;
+        return intersect(ray, hit);
+    }
+
+    /// The maximum number of rays passed to #intersect_packet() at once
+    static constexpr int max_packet_size = 16;
+
+    /**
+        Intersect a packet of (ideally coherent) rays with this surface.
+
+        Acceleration structures override this to share the traversal among the rays of the packet. The default
+        implementation simply calls #intersect() for each ray.
+
+        \param [in] rays    The rays to intersect
+        \param [out] hits   The intersection records of the rays
+        \param [out] found  Whether each ray found an intersection
+        \param [in] count   The number of rays (at most #max_packet_size)
+     */
+    virtual void intersect_packet(const Ray3f *rays, HitInfo *hits, bool *found, int count) const
+    {
+        for (int i = 0; i < count; ++i) found[i] = intersect(rays[i], hits[i]);
+    }
+
     /// Return the surface's world-space AABB.
     virtual Box3f bounds() const = 0;
 
@@ -146,12 +195,35 @@ public:
         throw DartsException("This surface does not support sampling.");
     }
 
+    /**
+        Sample a point uniformly on this surface, e.g.\ to emit a photon from it.
+
+        \param [out] hit    The sampled point (\p hit.t is not meaningful)
+        \param [in]  rv     Two uniformly distributed random variables on [0,1)
+        \return             The probability density of the sample with respect to surface area
+    */
+    virtual float sample_area(HitInfo &hit, const Vec2f &rv) const
+    {
+        throw DartsException("This surface does not support area sampling.");
+    }
+
     /// Return whether or not this Surface's Material is emissive.
     virtual bool is_emissive() const
     {
         return false;
     }
 
+    /**
+        Return an estimate of the power emitted by this Surface (up to a constant factor).
+
+        Emitters are chosen proportionally to this by #SurfaceGroup::sample_child(). Non-emissive surfaces should
+        return zero. The base class implementation gives all emissive surfaces the same weight.
+    */
+    virtual float power() const
+    {
+        return is_emissive() ? 1.f : 0.f;
+    }
+
     /**
         Sample a random child.
 
@@ -170,7 +242,6 @@ public:
     {
         return 1.f;
     }
-
 };
 
 /**
@@ -188,14 +259,36 @@ public:
     XformedSurface(const json &j = json::object());
     virtual ~XformedSurface() = default;
 
-    /// The world-space bounds: obtained by simply applying #m_xform to the result of #local_bounds()
+    /// The world-space bounds: obtained by applying #m_xform (or all transforms of #m_motion) to #local_bounds()
     virtual Box3f bounds() const override;
 
     /// Return the surface's local-space AABB.
     virtual Box3f local_bounds() const = 0;
 
+    /**
+        Move the surface by replacing its local-to-world transform.
+
+        This stops any motion of the surface. Afterwards, call #refit() on the scene (or the groups containing this
+        surface) to update their bounds.
+    */
+    virtual void set_transform(const Transform &xform)
+    {
+        m_xform  = xform;
+        m_motion = AnimatedTransform();
+    }
+
 protected:
-    Transform m_xform = Transform(); ///< Local-to-world Transformation
+    /// Parse the optional \c "end_transform" that the surface moves to (from #m_xform) during the shutter interval
+    void parse_motion(const json &j);
+
+    /// The local-to-world transformation at \p time
+    Transform transform_at(float time) const
+    {
+        return m_motion.is_animated() ? m_motion.at(time) : m_xform;
+    }
+
+    Transform         m_xform = Transform(); ///< Local-to-world Transformation
+    AnimatedTransform m_motion;              ///< The motion of surfaces that support motion blur, if is_animated()
 };
 
 /**
@@ -208,7 +301,7 @@ class XformedSurfaceWithMaterial : public XformedSurface
 {
 public:
     XformedSurfaceWithMaterial(shared_ptr<const Material> material, const Transform &xform = Transform()) :
-        XformedSurface(xform), m_material(material)
+        XformedSurface(xform), m_material(material), m_emissive(material && material->is_emissive())
     {
     }
 
@@ -216,13 +309,28 @@ public:
     virtual ~XformedSurfaceWithMaterial() = default;
 
     /// Return whether or not this Surface's #Material is emissive.
-    bool is_emissive() const override;
+    bool is_emissive() const override
+    {
+        return m_emissive;
+    }
+
+    /// The power of an emissive surface, estimated as the luminance of its #Material's emission times its #area()
+    float power() const override;
+
+    /// Return the world-space surface area, used to estimate its #power(). Returns 1 unless overridden
+    virtual float area() const
+    {
+        return 1.f;
+    }
 
 protected:
     shared_ptr<const Material> m_material;
+    /// The cached #Material::is_emissive(), which only depends on the type of the material, so it can't change
+    bool m_emissive = false;
 };
 
 STAT_RATIO("Intersections/Total intersection tests per ray", g_num_total_intersection_tests, g_num_traced_rays);
+STAT_COUNTER("Intersections/Shadow rays", g_num_shadow_rays);
 
 /** @}*/
 
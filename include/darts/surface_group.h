@@ -5,6 +5,8 @@
 */
 #pragma once
 
+#include <darts/alias_table.h>
+#include <darts/bbh.h>
 #include <darts/surface.h>
 
 /**
@@ -17,7 +19,14 @@
     for performing ray-surface intersection tests against a collection of Surfaces.
 
     We derive SurfaceGroup from XformedSurface so that nested SurfaceGroups can be individually
-    positioned/oriented with respect to their parent.
+    positioned/oriented with respect to their parent. A group can also move during the shutter interval, from its
+    \c "transform" to its \c "end_transform", for motion blur. Its bounds then enclose its whole motion, so groups
+    containing it are only built once.
+
+    When used as a collection of emitters, #build() precomputes an #AliasTable over the #power() of the emissive
+    children, so that #sample_child() chooses emitters proportionally to their power in constant time. Large emitter
+    collections additionally get a light BBH over the bounds of the emitters, so that #pdf() only needs to visit the
+    emitters that a direction actually points towards.
 
     \ingroup Surfaces
 */
@@ -29,6 +38,16 @@ public:
 
     virtual void add_child(shared_ptr<Surface> surface) override;
 
+    /**
+        Build the emitter sampling distribution over the children.
+
+        Acceleration structures that override this must call the base class implementation.
+    */
+    void build() override;
+
+    /// Refit the children, the bounds, and the light BBH. \copydetails Surface::refit()
+    void refit() override;
+
     /**
         Intersect a ray against all surfaces registered with the Accelerator.
 
@@ -36,15 +55,54 @@ public:
     */
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
 
+    /// Determine whether the ray hits any of the surfaces, stopping at the first hit. \copydetails Surface::occluded()
+    bool occluded(const Ray3f &ray) const override;
+
     Box3f local_bounds() const override;
 
+    /// Whether #build() found any emissive children
+    bool is_emissive() const override
+    {
+        return m_emissive;
+    }
+
+    /// The number of emissive children that #sample_child() chooses among
+    size_t num_emitters() const
+    {
+        return m_emissive ? m_emitters.size() : 0;
+    }
+
+    /// The total power of all children
+    float power() const override;
+
+    /**
+        Sample a child with probability proportional to its #power().
+
+        If none of the children are emissive, or #build() has not been called yet, all children are equally likely.
+
+        \copydetails Surface::sample_child()
+    */
     pair<const Surface *, float> sample_child(float &rv1) const override;
-    float                        child_prob() const override;
-    float                        pdf(const Vec3f &o, const Vec3f &v) const override;
+
+    /// The average probability of the children that #sample_child() can choose
+    float child_prob() const override;
+
+    float pdf(const Vec3f &o, const Vec3f &v) const override;
 
 protected:
+    /// Compute the emitter sampling pdf by visiting only the emitters in the light BBH that the ray (\p o, \p v) reaches
+    float light_tree_pdf(const Vec3f &o, const Vec3f &v) const;
+
     vector<shared_ptr<Surface>> m_surfaces; ///< All children
     Box3f m_bounds;
+
+    vector<const Surface *> m_emitters;     ///< The children chosen by #sample_child(), in the leaf order of #m_light_tree
+    AliasTable              m_emitter_dist; ///< Distribution over #m_emitters proportional to their power
+    BBHTree                 m_light_tree;   ///< Optional hierarchy over the bounds of #m_emitters
+    bool                    m_emissive = false; ///< Whether #m_emitters are the emissive children
+
+    /// The light BBH is only built for groups with at least this many emitters
+    static constexpr size_t light_tree_threshold = 16;
 };
 
 /**
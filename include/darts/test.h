@@ -9,6 +9,7 @@
 #include <darts/common.h>
 #include <darts/fwd.h>
 #include <darts/image.h>
+#include <pcg32.h>
 
 /// Base class for unit tests in Darts
 struct Test
@@ -30,7 +31,20 @@ struct ScatterTest : public Test
     ScatterTest(const json &j);
 
     virtual void run() override;
-    virtual bool sample(Vec3f &dir, const Vec2f &rv, float rv1) = 0;
+
+    /**
+        Generate a sample \p dir from the random numbers \p rv and \p rv1.
+
+        #run() calls this concurrently from several threads, so implementations must be thread-safe (e.g. keep track
+        of problems with \c std::atomic flags). The samples are split into chunks (see #prepare_chunks()), and each
+        chunk is processed by one thread at a time, so any state that sampling modifies can be kept per \p chunk.
+    */
+    virtual bool sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t chunk) = 0;
+
+    /// Called by #run() before generating any samples, with the number of chunks that the samples are split into
+    virtual void prepare_chunks(uint64_t num_chunks)
+    {
+    }
     virtual void print_header() const override;
     virtual void print_more_statistics()
     {
@@ -43,11 +57,17 @@ struct ScatterTest : public Test
     static Image3f        generate_graymap(const Array2d<float> &density, float scale = 1.f);
     static Array2d<float> upsample(const Array2d<float> &img, int factor);
 
+    /// Draw one sample of chunk \p chunk with \p rng, and add its weight (\p weight_scale over the Jacobian) to its
+    /// bin of \p histogram
+    void accumulate_sample(Array2d<float> &histogram, pcg32 &rng, uint64_t chunk, float weight_scale,
+                           uint64_t &valid_samples, bool &nan_or_inf);
+
     string   name;
     Vec2i    image_size{256, 128};
     uint64_t total_samples;
     uint32_t up_samples = 4;
     float    max_value  = -1.f;
+    uint64_t seed       = 53; ///< Seeds the random number streams, which are told apart by their sequence index
 };
 
 struct SampleTest : public ScatterTest
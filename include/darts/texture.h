@@ -0,0 +1,174 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+#pragma once
+
+#include <array>
+#include <darts/factory.h>
+#include <darts/image.h>
+#include <darts/math.h>
+#include <darts/surface.h>
+#include <mutex>
+
+class CacheReader;
+
+/** \addtogroup Materials
+    @{
+*/
+
+/// A base class for spatially varying material parameters, looked up at the hit point of a ray
+class Texture
+{
+public:
+    Texture(const json &j = json::object())
+    {
+    }
+
+    virtual ~Texture() = default;
+
+    /// The value of the texture at the hit point \p hit
+    virtual Color3f value(const HitInfo &hit) const = 0;
+
+    /// The average value of the texture, e.g. to estimate the power of a textured emitter
+    virtual Color3f average() const = 0;
+};
+
+/// A texture with the same value everywhere
+class ConstantTexture : public Texture
+{
+public:
+    ConstantTexture(const Color3f &color) : color(color)
+    {
+    }
+
+    ConstantTexture(const json &j = json::object());
+
+    Color3f value(const HitInfo &hit) const override
+    {
+        return color;
+    }
+
+    Color3f average() const override
+    {
+        return color;
+    }
+
+    Color3f color = Color3f(0.8f);
+};
+
+/**
+    A texture looked up in an image, which is stored as a tiled mip-map pyramid that doesn't need to stay resident.
+
+    At load time, the image is reduced into a pyramid of mip levels, each one half the size of the previous one. The
+    levels are cut into #tile_size x #tile_size tiles, which are stored as half floats. With the scene cache enabled
+    (see set_cache_dir()), the tiles are written to the cache (so later runs skip the pyramid construction) and read
+    back from there on demand, so the tiles of the texture take no memory at all until they are used. Otherwise the
+    half-float tiles stay in memory.
+
+    All textures share one LRU cache of decoded tiles, whose size is limited by set_texture_cache_size(), so scenes
+    with many large textures only keep the tiles they actually use resident.
+
+    Parameters (as written by the Blender exporter):
+    - \c "filename": the image file
+    - \c "raw": if true, the image is not converted from sRGB to linear (default: false)
+    - \c "interpolation": either \c "closest" or \c "linear" (default); other modes fall back to \c "linear"
+    - \c "wrap mode x", \c "wrap mode y": one of \c "repeat" (default), \c "clamp", or \c "black"
+    - \c "scale": a multiplier of the texture's value (default: 1)
+*/
+class ImageTexture : public Texture
+{
+public:
+    /// The width and height of the tiles, in texels
+    static constexpr int tile_size = 32;
+
+    /// The decoded texels of a tile, row by row
+    using Tile = std::array<Color3f, tile_size * tile_size>;
+
+    ImageTexture(const json &j = json::object());
+    ~ImageTexture();
+
+    Color3f value(const HitInfo &hit) const override
+    {
+        return lookup(hit.uv, hit.uv_width);
+    }
+
+    Color3f average() const override;
+
+    /**
+        Look up the texture at \p uv, filtered over a footprint of about \p width (in uv units).
+
+        The two mip levels closest to the footprint are interpolated, so a width of 0 looks up the full-resolution
+        image. The origin of uv space is the bottom-left corner of the image.
+    */
+    Color3f lookup(const Vec2f &uv, float width) const;
+
+    /// The number of mip levels (the finest one being level 0)
+    int levels() const
+    {
+        return int(m_levels.size());
+    }
+
+protected:
+    enum class Wrap
+    {
+        Repeat,
+        Clamp,
+        Black
+    };
+
+    /// The layout of a mip level within the tiles of the pyramid
+    struct Level
+    {
+        Vec2i    size;       ///< The size of the level, in texels
+        Vec2i    tiles;      ///< The number of tiles along each axis
+        uint32_t first_tile; ///< The index of the first tile of this level
+    };
+
+    /// Build the tiled pyramid over \p image, storing the tiles in \p halves (three per texel)
+    void build_pyramid(const Image3f &image, vector<uint16_t> &halves);
+
+    /// The texel (\p x, \p y) of mip level \p level, applying the wrap modes to coordinates outside the level
+    Color3f texel(int level, int x, int y) const;
+
+    /// Bilinearly interpolate (or look up the closest texel of) mip level \p level at \p uv
+    Color3f filter(int level, const Vec2f &uv) const;
+
+    /// Decode tile \p index from the half-float storage (the cache or #m_halves)
+    void load_tile(uint32_t index, Tile &tile) const;
+
+    friend class TextureTileCache;
+
+    uint32_t      m_id;                    ///< Distinguishes the tiles of this texture in the shared tile cache
+    uint64_t      m_load_key = 0;          ///< Key of this texture among the live loaded textures (see LoadedAssets)
+    vector<Level> m_levels;                ///< The mip levels, finest first
+    float         m_scale   = 1.f;         ///< Multiplier of all values
+    bool          m_closest = false;       ///< Whether to look up the closest texel instead of interpolating
+    Wrap          m_wrap[2] = {Wrap::Repeat, Wrap::Repeat};
+    Color3f       m_average;               ///< The (unscaled) value of the coarsest mip level
+
+    vector<uint16_t>        m_halves;    ///< The half-float tiles, if they are not read from the cache
+    unique_ptr<CacheReader> m_cache;     ///< The cache entry holding the tiles, if the scene cache is enabled
+    uint64_t                m_cache_pos; ///< The position of the first tile within #m_cache
+    mutable std::mutex      m_cache_mutex;
+};
+
+/**
+    Parse a texture from \p j, which is either a constant color (a number or an array), or the json object of a
+    #Texture with a \c "type".
+*/
+shared_ptr<const Texture> parse_texture(const json &j);
+
+/// Limit the memory used by the decoded tiles of all #ImageTexture%s to \p bytes (default: 1 GiB)
+void set_texture_cache_size(size_t bytes);
+
+/// The number of tiles decoded by all #ImageTexture%s so far, i.e. the number of misses of their shared tile cache
+uint64_t texture_tiles_decoded();
+
+/** @}*/
+
+/**
+    \file
+    \brief Classes #Texture, #ConstantTexture, and #ImageTexture
+*/
@@ -18,14 +18,26 @@
 
     This class stores a general homogeneous coordinate transformation, such as rotation, translation, uniform or
     non-uniform scaling, and perspective transformations. The inverse of this transformation is also recorded here,
-    since it is required when transforming normal vectors.
+    since it is required when transforming normal vectors, and so that #inverse() is cheap.
+
+    The #type of the transformation is determined when it is created, so that code on the hot path can skip
+    transforming rays and hits by the (very common) identity transform.
 
     \ingroup Math
 */
 struct Transform
 {
+    /// The kinds of transformations that allow taking shortcuts
+    enum Type : uint8_t
+    {
+        Identity,    ///< The identity transform
+        Translation, ///< A pure translation
+        General      ///< Anything else
+    };
+
     Mat44f m;
     Mat44f m_inv;
+    Type   type = Identity; ///< What kind of transformation #m is
 
     /// Create the identity transform
     Transform() : m(la::identity), m_inv(la::identity)
@@ -33,19 +45,76 @@ struct Transform
     }
 
     /// Create a new transform instance for the given matrix
-    Transform(const Mat44f &m) : m(m), m_inv(la::inverse(m))
+    Transform(const Mat44f &m) : m(m), m_inv(la::inverse(m)), type(classify(m))
     {
     }
 
     /// Create a new transform instance for the given matrix and its inverse
-    Transform(const Mat44f &trafo, const Mat44f &inv) : m(trafo), m_inv(inv)
+    Transform(const Mat44f &trafo, const Mat44f &inv) : m(trafo), m_inv(inv), type(classify(trafo))
     {
     }
 
     /// Return the inverse transformation
     Transform inverse() const
     {
-        return Transform(m_inv, m);
+        return Transform(m_inv, m, type);
+    }
+
+    /// Whether this is the identity transform
+    bool is_identity() const
+    {
+        return type == Identity;
+    }
+
+    /// Whether this transform is a pure translation (or the identity)
+    bool is_translation() const
+    {
+        return type != General;
+    }
+
+    /// Whether this transform is affine (has no projective part), so it maps planes and parallelograms to the same
+    bool is_affine() const
+    {
+        return m[0][3] == 0.f && m[1][3] == 0.f && m[2][3] == 0.f && m[3][3] == 1.f;
+    }
+
+    /**
+        Whether this transform is a similarity: any combination of rotations, reflections, translations and uniform
+        scalings. Similarities map spheres to spheres, so e.g. a #Sphere can be intersected in world space.
+
+        \param [out] scale  If not null, set to the scale factor of the similarity
+    */
+    bool is_similarity(float *scale = nullptr) const
+    {
+        if (!is_affine())
+            return false;
+
+        // the columns of the linear part need to be orthogonal and of the same length
+        Vec3f x = m[0].xyz(), y = m[1].xyz(), z = m[2].xyz();
+        float s2 = length2(x), tolerance = 1e-5f * s2;
+        if (s2 <= 0.f || std::abs(length2(y) - s2) > tolerance || std::abs(length2(z) - s2) > tolerance ||
+            std::abs(dot(x, y)) > tolerance || std::abs(dot(y, z)) > tolerance || std::abs(dot(z, x)) > tolerance)
+            return false;
+
+        if (scale)
+            *scale = std::sqrt(s2);
+        return true;
+    }
+
+    /// Determine which #Type of transformation the matrix \p m is
+    static Type classify(const Mat44f &m)
+    {
+        // the first three columns (linear part and projective row), and the bottom of the last column, must be those
+        // of the identity matrix
+        for (int c = 0; c < 3; ++c)
+            for (int r = 0; r < 4; ++r)
+                if (m[c][r] != (c == r ? 1.f : 0.f))
+                    return General;
+        if (m[3][3] != 1.f)
+            return General;
+
+        // the translation is stored in the last column
+        return m[3][0] == 0.f && m[3][1] == 0.f && m[3][2] == 0.f ? Identity : Translation;
     }
 
     /// Concatenate with another transform
@@ -93,7 +162,8 @@ struct Transform
         // TODO: Transform a ray by this transform. A ray consists of an origin, the point r.o, and a direction, r.d.
         // Transform these, and return a new ray with the transformed coordinates.
 
-        // IMPORTANT: The ray you return should have the same mint and maxt as the original ray
+        // IMPORTANT: The ray you return should have the same mint, maxt, time, width, and spread as the original ray
+        // (e.g. copy r and replace its o and d)
         put_your_code_here("Assignment 1: insert your Transform*Ray3f code here");
         return Ray3f();
     }
@@ -102,9 +172,13 @@ struct Transform
     Box3f box(const Box3f &box) const
     {
         // a transformed empty box is still empty
-        if (box.is_empty())
+        if (box.is_empty() || is_identity())
             return box;
 
+        // a translated box is simply offset
+        if (is_translation())
+            return Box3f(box.min + m[3].xyz(), box.max + m[3].xyz());
+
         // Just in case this is a projection matrix, do things the naive way.
         Vec3f pts[8];
 
@@ -135,9 +209,64 @@ struct Transform
     {
         return Transform(Mat44f({x, 0}, {y, 0}, {z, 0}, {o, 1}));
     }
+
+private:
+    /// Create a new transform instance for the given matrix, its inverse, and their (shared) #Type
+    Transform(const Mat44f &trafo, const Mat44f &inv, Type t) : m(trafo), m_inv(inv), type(t)
+    {
+    }
+};
+
+/**
+    A transform that moves between two keyframes: #start() at time 0 and #end() at time 1.
+
+    The keyframes are decomposed into a translation, a rotation, and a scale (including any shear), which are
+    interpolated separately, the rotation by spherical linear interpolation of quaternions. Interpolating the matrices
+    directly would instead shrink rotating objects half way through their motion.
+
+    \ingroup Math
+*/
+class AnimatedTransform
+{
+public:
+    /// Create a static identity transform
+    AnimatedTransform() = default;
+
+    /// Create a transform that moves from \p start at time 0 to \p end at time 1
+    AnimatedTransform(const Transform &start, const Transform &end);
+
+    /// Whether the keyframes differ
+    bool is_animated() const
+    {
+        return m_animated;
+    }
+
+    const Transform &start() const
+    {
+        return m_start;
+    }
+
+    const Transform &end() const
+    {
+        return m_end;
+    }
+
+    /// The transform at \p time, which is clamped to [0,1]
+    Transform at(float time) const;
+
+    /// Return a box enclosing \p box transformed at all times in [0,1]
+    Box3f motion_bounds(const Box3f &box) const;
+
+private:
+    Transform m_start, m_end;
+    bool      m_animated = false;
+
+    Vec3f  m_translation[2]; ///< The translation of each keyframe
+    Vec4f  m_rotation[2];    ///< The rotation of each keyframe, as a quaternion
+    Mat33f m_scale[2];       ///< The remaining (scale and shear) part of each keyframe
 };
 
 /**
     \file
-    \brief Class #Transform
+    \brief Class #Transform and #AnimatedTransform
 */
@@ -11,21 +11,40 @@
 class Triangle : public Surface
 {
 public:
-    /// Parse and construct a single triangle
-    Triangle(const json &j);
-
-    /// Construct a single triangle of an existing mesh
-    Triangle(const json &j, shared_ptr<const Mesh> mesh, uint32_t tri_number);
+    /// Construct the triangle for face \p tri_number of \p mesh, which must outlive it (see #create_triangles())
+    Triangle(const Mesh *mesh, uint32_t tri_number);
 
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
 
     Box3f bounds() const override;
 
+    /// The bounds of the part of the triangle inside \p box (see Mesh::clipped_face_bounds())
+    Box3f clipped_bounds(const Box3f &box) const
+    {
+        return m_mesh->clipped_face_bounds(m_face_idx, box);
+    }
 
     bool is_emissive() const override
     {
-        return m_mesh && m_mesh->materials[m_mesh->Fm[m_face_idx]] &&
-               m_mesh->materials[m_mesh->Fm[m_face_idx]]->is_emissive();
+        return m_emissive;
+    }
+
+    /// The luminance of the face's emission times its area
+    float power() const override;
+
+    /// Sample a point on the triangle with #sample_triangle(), with the normal and uv interpolated like for a hit
+    float sample_area(HitInfo &hit, const Vec2f &rv) const override;
+
+    /// The mesh this triangle belongs to
+    const Mesh *mesh() const
+    {
+        return m_mesh;
+    }
+
+    /// The index of this triangle's face within #mesh()
+    uint32_t face() const
+    {
+        return m_face_idx;
     }
 
 protected:
@@ -35,16 +54,37 @@ protected:
         return m_mesh->vs[m_mesh->Fv[m_face_idx][i]];
     }
 
-    shared_ptr<const Mesh> m_mesh;
-    uint32_t               m_face_idx;
+    const Mesh *m_mesh;
+    uint32_t    m_face_idx;
+    bool        m_emissive; ///< Whether the face's material is emissive, cached since it is checked per sample
 };
 
+/**
+    Create a #Triangle for each face of \p mesh. \ingroup Surfaces
+
+    All triangles are stored in one array along with a reference to the mesh, and each of the returned pointers shares
+    the ownership of that array. This avoids an allocation (and a reference count of the mesh) per face, and keeps the
+    triangles of a mesh next to each other in memory.
+*/
+vector<shared_ptr<Surface>> create_triangles(shared_ptr<const Mesh> mesh);
+
 /// Intersect a ray with a single triangle. \ingroup Surfaces
 bool single_triangle_intersect(const Ray3f &ray, const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Vec3f *n0,
                                const Vec3f *n1, const Vec3f *n2, const Vec2f *t0, const Vec2f *t1, const Vec2f *t2,
                                HitInfo &hit, const Material *material = nullptr, const Surface *surface = nullptr,
                                const Mesh *mesh = nullptr);
 
+/**
+    The width of the footprint of \p ray around a hit on a triangle, in uv units. \ingroup Surfaces
+
+    Scales the ray's footprint at parameter \p t by the ratio of the triangle's extent in uv and world space, widening
+    it where the ray grazes the triangle (with geometric normal \p gn).
+
+    \return The uv width, or 0 if the ray has no footprint or the triangle has no texture coordinates
+*/
+float triangle_uv_width(const Ray3f &ray, float t, const Vec3f &gn, const Vec3f &p0, const Vec3f &p1, const Vec3f &p2,
+                        const Vec2f *t0, const Vec2f *t1, const Vec2f *t2);
+
 /**
     \file
     \brief Class #Triangle
@@ -3,7 +3,7 @@ from sys import argv, exit, stderr, stdout
 from datetime import datetime as dt
 import subprocess
 import pickle
-import re
+import json
 import math
 import sys
 
@@ -44,25 +44,17 @@ def render_image(exe_path, root_path):
     scene_name = "leaderboard"
     scene_file = os.path.join(scene_dir, scene_name + ".json")
 
+    stats_file = os.path.join(scene_dir, scene_name + "-stats.json")
+
     start_time = dt.now()
     
     print("Starting render.... this may take a bit... ")
-    proc = subprocess.Popen([exe_path, scene_file], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    proc = subprocess.Popen([exe_path, scene_file, "--stats-json", stats_file], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     out = proc.communicate()
     print("Finished rendering image")
 
-    stats_loc = out[0].decode('u8').find("Statistics:")
-
-    intersections = out[0].decode('u8').find("Total intersection tests per ray")
-    nodes = out[0].decode('u8').find("Nodes visited per ray")
-
-    tri_str = out[0].decode('u8')[intersections::]
-    tri_str_nodes = out[0].decode('u8')[nodes::]
-
-    intersection_pattern = re.compile(r".*\s+\b(\d+)\b.*\s+\b(\d+)\b")
-
-    match = intersection_pattern.match(tri_str.strip())
-    match_nodes = intersection_pattern.match(tri_str_nodes.strip())
+    with open(stats_file) as f:
+        ratios = json.load(f)["stats"]["ratios"]
 
     files = [os.path.join(scene_dir, fname) for fname in os.listdir(scene_dir) if fname.startswith(scene_name) and fname.endswith(".png")]
 
@@ -71,8 +63,8 @@ def render_image(exe_path, root_path):
     most_recent_img = files[-1]
     end_time = dt.now()
 
-    intersections = float(match.group(1)) / float(match.group(2))
-    nodes = float(match_nodes.group(1)) / float(match_nodes.group(2))
+    intersections = ratios["Intersections/Total intersection tests per ray"]["value"]
+    nodes = ratios["BBH/Nodes visited per ray"]["value"]
 
     return most_recent_img, intersections, nodes, start_time, end_time
 
@@ -0,0 +1,74 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/alias_table.h>
+#include <darts/low_discrepancy.h>
+#include <numeric>
+
+AliasTable::AliasTable(const vector<float> &weights) : m_bins(weights.size())
+{
+    double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    if (!(total > 0.0))
+        throw DartsException("AliasTable: the weights must sum to a positive value.");
+
+    // scale the probabilities so that an average bin holds exactly 1, and split the items into under- and overfull
+    vector<double>   scaled(weights.size());
+    vector<uint32_t> under, over;
+    for (uint32_t i = 0; i < weights.size(); ++i)
+    {
+        if (weights[i] < 0.f)
+            throw DartsException("AliasTable: the weights must not be negative.");
+        m_bins[i].pmf = float(weights[i] / total);
+        scaled[i]     = weights[i] / total * weights.size();
+        (scaled[i] < 1.0 ? under : over).push_back(i);
+    }
+
+    // fill up each underfull bin with the excess of an overfull item
+    while (!under.empty() && !over.empty())
+    {
+        uint32_t u = under.back(), o = over.back();
+        under.pop_back();
+
+        m_bins[u].q     = float(scaled[u]);
+        m_bins[u].alias = o;
+
+        scaled[o] -= 1.0 - scaled[u];
+        if (scaled[o] < 1.0)
+        {
+            over.pop_back();
+            under.push_back(o);
+        }
+    }
+
+    // whatever remains is (up to round-off) exactly full
+    for (auto i : under) m_bins[i].q = 1.f;
+    for (auto i : over) m_bins[i].q = 1.f;
+}
+
+uint32_t AliasTable::sample(float &rv1) const
+{
+    float    sx = rv1 * m_bins.size();
+    uint32_t i  = std::min(uint32_t(sx), uint32_t(m_bins.size() - 1));
+    float    u  = std::min(sx - i, one_minus_epsilon);
+
+    // remap the random number for reuse
+    const Bin &bin = m_bins[i];
+    if (u < bin.q)
+    {
+        rv1 = std::min(u / bin.q, one_minus_epsilon);
+        return i;
+    }
+    else
+    {
+        rv1 = std::min((u - bin.q) / (1.f - bin.q), one_minus_epsilon);
+        return bin.alias;
+    }
+}
+
+/**
+    \file
+    \brief Class #AliasTable
+*/
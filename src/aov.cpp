@@ -0,0 +1,124 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/aov.h>
+#include <darts/material.h>
+#include <darts/math.h>
+#include <darts/stats.h>
+#include <darts/surface.h>
+
+STAT_MEMORY_COUNTER("Memory/AOV buffers", aov_bytes);
+
+void AOVSample::record(const Ray3f &ray, const HitInfo *hit)
+{
+    recorded = true;
+    if (!hit)
+        return;
+    albedo   = hit->mat ? hit->mat->reflectance(*hit) : Color3f(0.f);
+    normal   = hit->sn;
+    position = hit->p;
+    depth    = hit->t * length(ray.d);
+}
+
+AOVBuffers::AOVBuffers(const Vec2i &size, bool costs) :
+    albedo(size.x, size.y, Color3f(0.f)), normal(size.x, size.y, Color3f(0.f)),
+    position(size.x, size.y, Color3f(0.f)), depth(size.x, size.y, 0.f)
+{
+    aov_bytes += size_t(size.x) * size.y * (3 * sizeof(Color3f) + sizeof(float));
+
+    if (costs)
+    {
+        for (auto buffer : {&nodes_visited, &prims_tested, &path_length, &time_ns})
+            *buffer = Array2d<float>(size.x, size.y, 0.f);
+        aov_bytes += size_t(size.x) * size.y * 4 * sizeof(float);
+    }
+}
+
+void AOVBuffers::add(int x, int y, const AOVSample &sample)
+{
+    albedo(x, y) += sample.albedo;
+    normal(x, y) += sample.normal;
+    position(x, y) += sample.position;
+    depth(x, y) += sample.depth;
+
+    if (has_costs())
+    {
+        nodes_visited(x, y) += float(sample.cost.nodes_visited);
+        prims_tested(x, y) += float(sample.cost.prims_tested);
+        path_length(x, y) += float(sample.cost.rays);
+        time_ns(x, y) += sample.time_ns;
+    }
+}
+
+void AOVBuffers::scale(float factor)
+{
+    for (int i = 0; i < depth.length(); ++i)
+    {
+        albedo(i) *= factor;
+        normal(i) *= factor;
+        position(i) *= factor;
+        depth(i) *= factor;
+    }
+
+    if (has_costs())
+        for (auto buffer : {&nodes_visited, &prims_tested, &path_length, &time_ns})
+            for (int i = 0; i < buffer->length(); ++i) (*buffer)(i) *= factor;
+}
+
+bool AOVBuffers::save(const string &filename, const Image3f &color) const
+{
+    vector<ExrChannel> channels;
+    auto               add_layer = [&](const Image3f &image, const string &layer, const char *names, bool half)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            ExrChannel channel{layer + names[c], vector<float>(image.length()), half};
+            for (int i = 0; i < image.length(); ++i) channel.values[i] = image(i)[c];
+            channels.push_back(std::move(channel));
+        }
+    };
+    add_layer(color, "", "RGB", true);
+    add_layer(albedo, "albedo.", "RGB", true);
+    add_layer(normal, "normal.", "XYZ", true);
+    add_layer(position, "position.", "XYZ", false);
+
+    ExrChannel z{"Z", vector<float>(depth.length()), false};
+    for (int i = 0; i < depth.length(); ++i) z.values[i] = depth(i);
+    channels.push_back(std::move(z));
+
+    return save_exr_channels(filename, color.width(), color.height(), std::move(channels));
+}
+
+bool AOVBuffers::save_costs(const string &basename) const
+{
+    auto save_heatmap = [&basename](const Array2d<float> &buffer, const char *suffix, const char *unit)
+    {
+        vector<float> sorted(buffer.length());
+        for (int i = 0; i < buffer.length(); ++i) sorted[i] = buffer(i);
+        auto p99 = sorted.begin() + std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+        std::nth_element(sorted.begin(), p99, sorted.end());
+        float scale = *p99 > 0.f ? 1.f / *p99 : 0.f;
+
+        Image3f heatmap(buffer.width(), buffer.height());
+        for (int i = 0; i < buffer.length(); ++i) heatmap(i) = inferno(std::min(buffer(i) * scale, 1.f));
+
+        string filename = basename + suffix;
+        spdlog::info("Writing the heatmap of the {} per sample (saturating at {:.4g}) to file \"{}\"...", unit, *p99,
+                     filename);
+        return heatmap.save(filename);
+    };
+
+    bool ok = save_heatmap(nodes_visited, "-nodes.png", "BBH nodes visited");
+    ok &= save_heatmap(prims_tested, "-prims.png", "primitives tested");
+    ok &= save_heatmap(path_length, "-rays.png", "rays traced");
+    ok &= save_heatmap(time_ns, "-time.png", "nanoseconds");
+    return ok;
+}
+
+/**
+    \file
+    \brief Implementation of #AOVSample and #AOVBuffers
+*/
@@ -0,0 +1,135 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <darts/cache.h>
+#include <filesystem/path.h>
+#include <random>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// Increment this whenever the layout of any cached data changes
+constexpr uint32_t cache_version = 3;
+constexpr char     cache_magic[] = "DARTSCACHE";
+
+string g_cache_dir;
+
+string entry_filename(const string &kind, uint64_t key)
+{
+    return (filesystem::path(g_cache_dir) / filesystem::path(fmt::format("{}-{:016x}.dcache", kind, key))).str();
+}
+
+/**
+    A temporary name next to \p filename that no other writer uses.
+
+    The process id and a per-process counter keep concurrent writers on this machine apart, and a random number those
+    on other machines sharing the cache directory.
+*/
+string temporary_filename(const string &filename)
+{
+    static std::atomic<uint64_t> counter{0};
+    static const uint32_t        nonce = std::random_device()();
+    return fmt::format("{}.{}-{:08x}-{}.tmp", filename, getpid(), nonce, counter++);
+}
+
+} // namespace
+
+void set_cache_dir(const string &dir)
+{
+    g_cache_dir = dir;
+    if (dir.empty())
+        return;
+
+    filesystem::path path(dir);
+    if (!path.exists() && !filesystem::create_directories(path))
+        throw DartsException("Cannot create cache directory '{}'.", dir);
+    if (!path.is_directory())
+        throw DartsException("Cache directory '{}' is not a directory.", dir);
+
+    spdlog::info("Caching scene data in directory '{}'.", dir);
+}
+
+const string &cache_dir()
+{
+    return g_cache_dir;
+}
+
+uint64_t file_signature(const string &filename)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return 0;
+
+    return Hasher().add(filename).add_pod(int64_t(st.st_mtime)).add_pod(int64_t(st.st_size)).value();
+}
+
+CacheWriter::CacheWriter(const string &kind, uint64_t key) :
+    m_filename(entry_filename(kind, key)),
+    m_tmp_filename(temporary_filename(m_filename))
+{
+    m_stream.open(m_tmp_filename, std::ios::binary);
+    m_stream.write(cache_magic, sizeof(cache_magic));
+    write(cache_version);
+    write(kind);
+    write(key);
+}
+
+CacheWriter::~CacheWriter()
+{
+    bool ok = m_stream.good();
+    m_stream.close();
+    if (ok && std::rename(m_tmp_filename.c_str(), m_filename.c_str()) == 0)
+        spdlog::info("Wrote cache file '{}'.", m_filename);
+    else
+    {
+        spdlog::warn("Could not write cache file '{}'.", m_filename);
+        std::remove(m_tmp_filename.c_str());
+    }
+}
+
+CacheReader::CacheReader(const string &kind, uint64_t key)
+{
+    auto filename = entry_filename(kind, key);
+    m_stream.open(filename, std::ios::binary);
+    if (!m_stream.good())
+        return;
+
+    m_stream.seekg(0, std::ios::end);
+    m_size = uint64_t(m_stream.tellg());
+    m_stream.seekg(0);
+
+    // validate the header, and mark the stream as failed if anything does not match
+    char     magic[sizeof(cache_magic)] = {};
+    uint32_t version                    = 0;
+    string   stored_kind;
+    uint64_t stored_key = 0;
+    m_stream.read(magic, sizeof(magic));
+    read(version);
+    read(stored_kind);
+    read(stored_key);
+    if (!good() || string(magic) != cache_magic || version != cache_version || stored_kind != kind ||
+        stored_key != key)
+    {
+        spdlog::warn("Ignoring invalid or outdated cache file '{}'.", filename);
+        m_stream.setstate(std::ios::failbit);
+    }
+}
+
+/**
+    \file
+    \brief Binary scene cache
+*/
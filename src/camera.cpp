@@ -4,6 +4,7 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 #include <darts/camera.h>
+#include <darts/sampling.h>
 #include <darts/stats.h>
 
 STAT_COUNTER("Integrator/Camera rays traced", num_camera_rays);
@@ -15,6 +16,14 @@ Camera::Camera(const json &j)
     m_focal_distance  = j.value("fdist", m_focal_distance);
     m_aperture_radius = j.value("aperture", m_aperture_radius);
 
+    // a moving camera keeps its shutter open for the whole motion unless told otherwise
+    if (j.contains("end_transform"))
+    {
+        m_motion  = AnimatedTransform(m_xform, j["end_transform"].get<Transform>());
+        m_shutter = Vec2f(0.f, 1.f);
+    }
+    m_shutter = j.value("shutter", m_shutter);
+
     float vfov = 90.f; // Default vfov value. Override this with the value from json
     // TODO: Assignment 1: read the vertical field-of-view from j ("vfov"),
     // and compute the width and height of the image plane. Remember that
@@ -26,9 +35,28 @@ Camera::Camera(const json &j)
 }
 
 Ray3f Camera::generate_ray(const Vec2f &pixel) const
+{
+    return generate_ray(pixel, Vec2f(randf(), randf()));
+}
+
+Ray3f Camera::generate_ray(const Vec2f &pixel, const Vec2f &lens_rv, float time) const
+{
+    Ray3f ray = generate_ray(pixel, lens_rv);
+    if (m_motion.is_animated())
+        // move the ray from the coordinate system of the camera's transform to that of the camera at this time
+        ray = (m_motion.at(time) * m_xform.inverse()).ray(ray);
+    ray.time = time;
+
+    // the cone through the pixel, whose angle is the height of a pixel on the image plane over its distance
+    ray.spread = m_size.y / (m_resolution.y * m_focal_distance) * length(ray.d);
+    return ray;
+}
+
+Ray3f Camera::generate_ray(const Vec2f &pixel, const Vec2f &lens_rv) const
 {
     ++num_camera_rays;
     // TODO: Assignment 1: Implement camera ray generation
+    //       For depth of field, use m_aperture_radius * sample_disk(lens_rv) as the point on the aperture
     put_your_code_here("Assignment 1: Insert your camera ray generation code here");
     return Ray3f(Vec3f(0.f), Vec3f(1.f));
 }
\ No newline at end of file
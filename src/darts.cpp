@@ -10,11 +10,263 @@
 */
 
 #include <CLI/CLI.hpp>
+#include <darts/cache.h>
+#include <darts/denoiser.h>
+#include <darts/numa.h>
 #include <darts/parallel.h>
+#include <darts/progress.h>
 #include <darts/scene.h>
+#include <darts/stats.h>
 #include <filesystem/resolver.h>
 #include <fmt/chrono.h>
+#include <fmt/printf.h>
 #include <darts/test.h>
+#include <darts/texture.h>
+#include <future>
+#include <iostream>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/stopwatch.h>
+
+/// Save \p image to all non-empty \p filenames, writing the files (e.g. a PNG and an EXR) concurrently
+void save_images(Image3f &image, const vector<string> &filenames)
+{
+    vector<string> files;
+    std::copy_if(filenames.begin(), filenames.end(), std::back_inserter(files), [](auto &f) { return !f.empty(); });
+
+    vector<char> saved(files.size(), false);
+    parallel_for(blocked_range<size_t>(0, files.size(), 1),
+                 [&](blocked_range<size_t> range)
+                 {
+                     for (auto i : range) saved[i] = image.save(files[i]);
+                 });
+
+    for (auto i : range(files.size()))
+        if (!saved[i])
+            spdlog::error("Could not write image file \"{}\".", files[i]);
+}
+
+/**
+    A description of a (possibly partial) rendering, saved next to each image of it, which lets \c img_merge stitch
+    the regions rendered on different nodes back together and weigh independent renderings by their sample counts.
+*/
+struct RenderInfo
+{
+    bool          write = false; ///< Whether to save the description next to the images at all
+    Vec2i         resolution;    ///< The resolution of the whole frame
+    Vec2i         offset;        ///< The position of the saved (cropped) image within the frame
+    vector<Box2i> tiles;         ///< The rendered tiles, in frame coordinates
+    int           spp  = 0;      ///< The number of samples per pixel
+    uint32_t      seed = 0;      ///< The random seed
+
+    json to_json() const
+    {
+        json t = json::array();
+        for (auto &tile : tiles) t.push_back({tile.min.x, tile.min.y, tile.max.x, tile.max.y});
+        return {{"resolution", {resolution.x, resolution.y}},
+                {"offset", {offset.x, offset.y}},
+                {"tiles", t},
+                {"spp", spp},
+                {"seed", seed}};
+    }
+};
+
+/// Crop \p image to \p bounds, unless they cover the whole image
+Image3f crop_image(const Image3f &image, const Box2i &bounds)
+{
+    if (bounds.is_empty() || (bounds.min == Vec2i(0) && bounds.max == image.size()))
+        return image;
+
+    Vec2i   size = bounds.max - bounds.min;
+    Image3f cropped(size.x, size.y);
+    for (auto y : range(size.y))
+        for (auto x : range(size.x)) cropped(x, y) = image(x + bounds.min.x, y + bounds.min.y);
+    return cropped;
+}
+
+/// Save \p image (\p spp samples per pixel) to all non-empty \p filenames, along with a <tt>.json</tt> description
+void save_rendering(const Image3f &image, const vector<string> &filenames, RenderInfo info, int spp)
+{
+    // only save the bounding box of the rendered tiles
+    Box2i bounds;
+    for (auto &tile : info.tiles) bounds.enclose(tile);
+    Image3f cropped = crop_image(image, bounds);
+    save_images(cropped, filenames);
+
+    if (!info.write)
+        return;
+
+    info.spp    = spp;
+    info.offset = bounds.min;
+    for (auto &filename : filenames)
+    {
+        if (filename.empty())
+            continue;
+        std::ofstream stream(filename + ".json");
+        stream << info.to_json().dump(4) << std::endl;
+        if (!stream.good())
+            spdlog::error("Could not write render description \"{}\".", filename + ".json");
+    }
+}
+
+/**
+    Keep \p scene in memory and render it repeatedly, as requested by json objects read from stdin, one per line.
+
+    A request can change how the scene is viewed and sampled, and the parameters of its materials, but not its
+    geometry, so the scene files are only parsed and the BBHs only built once. A request can contain:
+
+    - \c "camera": parameters merged into the current camera specification (initially \p camera_spec), e.g. a new
+      \c "transform"
+    - \c "spp" and \c "seed": the number of samples per pixel and the random seed to render with
+    - \c "materials": an object mapping the names of materials of the scene to the parameters to change (see
+      Material::update()). Since the emitters are not collected again, this cannot turn a material into an emitter or
+      back, and emitters are still sampled proportionally to their original power
+    - \c "transforms": an object mapping the names of top-level surfaces of the scene (e.g. instances) to their new
+      transforms. The acceleration structures are then refit instead of rebuilt (see BBHTree::refit())
+    - \c "outfile": the file to save the rendered image to, which is required unless the request contains
+      <tt>"quit": true</tt> to stop the server
+
+    All changes persist for later requests. Each request is answered with one line of json on stdout, either
+    <tt>{"status": "ok", "outfile": ..., "render_seconds": ...}</tt> or <tt>{"status": "error", "error": ...}</tt>.
+*/
+void serve(Scene &scene, json camera_spec)
+{
+    for (string line; std::getline(std::cin, line);)
+    {
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+
+        json reply;
+        try
+        {
+            json request = json::parse(line);
+            if (request.value("quit", false))
+                break;
+            if (!request.contains("outfile"))
+                throw DartsException("The request doesn't specify an \"outfile\".");
+
+            if (request.contains("camera"))
+            {
+                json spec = camera_spec;
+                spec.merge_patch(request["camera"]);
+                scene.set_camera(spec);
+                camera_spec = spec;
+            }
+
+            if (request.contains("seed"))
+                Scene::random_seed = request["seed"].get<uint32_t>();
+            if (request.contains("spp") || request.contains("seed"))
+                scene.set_num_samples(request.value("spp", scene.num_samples()));
+
+            if (request.contains("materials"))
+                for (auto &m : request["materials"].items())
+                    DartsFactory<Material>::find(json{{"material", m.key()}})->update(m.value());
+
+            if (request.contains("transforms"))
+            {
+                for (auto &t : request["transforms"].items())
+                {
+                    auto surface = std::dynamic_pointer_cast<XformedSurface>(
+                        DartsFactory<Surface>::find(json{{"surface", t.key()}}, "surface"));
+                    if (!surface)
+                        throw DartsException("The transform of surface \"{}\" cannot be changed.", t.key());
+                    surface->set_transform(t.value().get<Transform>());
+                }
+                scene.refit();
+            }
+
+            string outfile = request["outfile"].get<string>();
+            spdlog::info("Rendering \"{}\"...", outfile);
+
+            spdlog::stopwatch render_time;
+            Image3f           image          = scene.raytrace();
+            double            render_seconds = render_time.elapsed().count();
+            if (!image.save(outfile))
+                throw DartsException("Could not write image file \"{}\".", outfile);
+
+            reply = {{"status", "ok"},
+                     {"outfile", outfile},
+                     {"resolution", {image.width(), image.height()}},
+                     {"spp", scene.num_samples()},
+                     {"seed", Scene::random_seed},
+                     {"render_seconds", render_seconds}};
+        }
+        catch (const std::exception &e)
+        {
+            spdlog::error("{}", e.what());
+            reply = {{"status", "error"}, {"error", e.what()}};
+        }
+
+        fmt::print("{}\n", reply.dump());
+        fflush(stdout);
+    }
+}
+
+/// A scene file of a batch, loaded (possibly in the background) before it is rendered
+struct Frame
+{
+    string            scenefile;
+    json              j;
+    shared_ptr<Scene> scene; ///< The parsed scene, or null if the file only contains tests
+};
+
+/**
+    Read \p scenefile (or create the example scene it names), and parse the scene unless the file only contains tests.
+
+    This may run on a background thread while the previous frame of a batch renders, so that frame's meshes and
+    textures are still alive and are copied instead of loaded again if the scene refers to the same files.
+*/
+Frame load_frame(const string &scenefile)
+{
+    auto is_tests = [](const json &j) { return j.contains("type") && j["type"] == "tests"; };
+
+    Frame frame{scenefile};
+    int   scene_number = 0;
+    if (sscanf(scenefile.c_str(), "example_scene%d", &scene_number) == 1)
+    {
+        frame.j = create_example_scene(scene_number);
+        if (!is_tests(frame.j))
+            frame.scene = make_shared<Scene>(frame.j);
+    }
+    else
+    {
+        filesystem::path path(scenefile);
+
+        // Add the parent directory of the scene file to the file resolver. That way, the scene file can reference
+        // resources (OBJ files, textures) using relative paths. Consecutive frames usually share the directory, which
+        // then only needs to be added once
+        auto &resolver = get_file_resolver();
+        if (resolver.size() == 0 || resolver[0].str() != path.parent_path().str())
+            resolver.prepend(path.parent_path());
+
+        // stream the file, so the surfaces are created as they are read instead of after reading the whole json
+        auto scene = make_shared<Scene>();
+        frame.j    = scene->parse_file(scenefile);
+        if (!is_tests(frame.j))
+            frame.scene = scene;
+    }
+
+    // this may be a temporary thread, so report its statistics before they are lost
+    accumulate_thread_stats();
+    return frame;
+}
+
+/**
+    The filename of frame \p frame of a batch, given the filename \p pattern specified for all frames.
+
+    The frame number is substituted into \p pattern if it contains a printf-style conversion (e.g. \c "out%04d.png"),
+    and otherwise appended to its basename (e.g. \c "out-0012.png").
+*/
+string frame_filename(const string &pattern, int frame)
+{
+    if (pattern.find('%') != string::npos)
+        return fmt::sprintf(pattern, frame);
+
+    auto dot = pattern.find_last_of('.');
+    auto sep = pattern.find_last_of("/\\");
+    if (dot == string::npos || (sep != string::npos && dot < sep))
+        dot = pattern.size();
+    return fmt::format("{}-{:04d}{}", pattern.substr(0, dot), frame, pattern.substr(dot));
+}
 
 int main(int argc, char **argv)
 {
@@ -22,8 +274,21 @@ int main(int argc, char **argv)
 
     string   outfile;
     string   format = "png";
-    string   scenefile;
+    string   cache_dir;
+    size_t   texture_cache_mb = 1024;
+    string   stats_file;
+    string   aov_file;
+    string   denoiser_type;
+
+    ProgressiveOptions progressive;
+    vector<int>        region, tile_range, frames;
+    vector<string>     scenefiles;
     uint32_t threads;
+    bool     no_progress    = false;
+    bool     server         = false;
+    bool     cost_heatmaps  = false;
+    bool     numa_replicate = false;
+    string   pin_threads    = "none";
 
     CLI::App app{"Dartmouth Academic Ray Tracing Skeleton", "darts"};
 
@@ -37,9 +302,66 @@ int main(int argc, char **argv)
     app.add_option("-s,--seed", Scene::random_seed,
                    fmt::format("Seed for the random number generator (e.g. the node id on a compute cluster)."))
         ->check(CLI::PositiveNumber);
+    app.add_option("--region", region,
+                   "Only render the pixels in the rectangle x0,y0,x1,y1 (excluding x1 and y1), e.g. to split a frame "
+                   "across the nodes of a cluster. The saved images are cropped to the rendered part, and img_merge "
+                   "stitches them back together.")
+        ->delimiter(',')
+        ->expected(4);
+    app.add_option("--tile-range", tile_range,
+                   "Only render tiles first,last (excluding last) in the scene's tile order, e.g. to split a frame "
+                   "across the nodes of a cluster.")
+        ->delimiter(',')
+        ->expected(2);
     app.add_option("-t,--threads", threads,
                    fmt::format("Number of threads to use in the thread pool; default: number of detected cores."))
         ->check(CLI::NonNegativeNumber);
+    app.add_option("--pin-threads", pin_threads,
+                   "Pin the threads to CPUs, spread round-robin over the NUMA nodes: \"core\" pins each thread to a "
+                   "single CPU, \"socket\" to all CPUs of its node; default: none.")
+        ->check(CLI::IsMember({"none", "core", "socket"}));
+    app.add_flag("--numa-replicate", numa_replicate,
+                 "Replicate the BBHs on each NUMA node, so that the pinned threads (see --pin-threads) traverse the "
+                 "copy in their local memory.");
+    app.add_option("-c,--cache-dir", cache_dir,
+                   "Directory in which to cache parsed meshes and built BBHs to speed up reloading the same scene; "
+                   "default: caching disabled.");
+    app.add_option("--texture-cache", texture_cache_mb,
+                   "Memory limit (in MB) of the decoded image texture tiles shared by all textures; default: 1024.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--stats-json", stats_file,
+                   "Also write all gathered statistics, along with the scene, thread count, resolution, and samples "
+                   "per pixel, to this JSON file (e.g. for tracking performance across builds).");
+    app.add_option("--aovs", aov_file,
+                   "Also write the albedo, normal, depth, and position of the first hits (rendered in the same passes "
+                   "as the image) to this EXR file, as layers next to the color channels.");
+    app.add_flag("--cost-heatmaps", cost_heatmaps,
+                 "Also record the BBH nodes visited, primitives tested, rays traced, and time spent per pixel sample, "
+                 "and save them as false-color heatmaps next to the output image (ending in -cost-nodes.png, "
+                 "-cost-prims.png, -cost-rays.png, and -cost-time.png).");
+    app.add_option("--denoise", denoiser_type,
+                   "Denoise the final image before saving it, with this type of denoiser (\"nlmeans\", or \"oidn\" if "
+                   "compiled with USE_OIDN), guided by AOVs rendered along with the image. A \"denoiser\" object in "
+                   "the scene file sets its parameters (and denoises even without this option). The --aovs file keeps "
+                   "the image from before denoising.");
+    app.add_option("-p,--pass-spp", progressive.pass_samples,
+                   "Render progressively, adding this many samples per pixel to the image in each pass.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--save-passes", progressive.save_passes,
+                   "When rendering progressively, save the intermediate image every this many passes.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--save-interval", progressive.save_seconds,
+                   "When rendering progressively, save the intermediate image every this many seconds.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--time-budget", progressive.time_budget,
+                   "Render progressively, and stop before starting a pass that would exceed this many seconds.")
+        ->check(CLI::PositiveNumber);
+    app.add_flag("--no-progress", no_progress,
+                 "Don't display progress bars (e.g. for headless jobs whose output goes to a log).");
+    app.add_flag("--serve", server,
+                 "Load the scene once, and then render it for each line of json read from stdin, which can change the "
+                 "camera, samples per pixel, seed, and materials, and specifies the \"outfile\". Each request is "
+                 "answered with a line of json on stdout, and all other messages go to stderr.");
     app.add_option("-v,--verbosity", verbosity,
                    R"(Set verbosity threshold T with lower values meaning more verbose
 and higher values removing low-priority messages. All messages with
@@ -53,9 +375,18 @@ severity >= T are displayed, where the severities are:
     off      = 6
 The default is 2 (info).)")
         ->check(CLI::Range(0, 6));
-    app.add_option(
-           "scene", scenefile,
-           "The filename of the JSON scenefile to load (or the string \"example_sceneN\", where N is 0, 1, 2, or 3).")
+    app.add_option("--frames", frames,
+                   "Render frames first,last (excluding last) of an animation, substituting each frame number into the "
+                   "printf-style pattern given as the only scene file (e.g. \"frames/shot%04d.json\").")
+        ->delimiter(',')
+        ->expected(2);
+    app.add_option("scene", scenefiles,
+                   "The filename of the JSON scenefile to load (or the string \"example_sceneN\", where N is 0, 1, 2, "
+                   "or 3). Several scene files (or --frames) are rendered back to back as a batch: each frame is "
+                   "loaded while the previous one renders, reusing its meshes and textures, and its images are written "
+                   "while the next one renders. The frame number (see --frames, or the position in the list) is then "
+                   "substituted into the -o, --aovs filenames if they contain a printf-style conversion like %04d, "
+                   "and appended to them otherwise. A file containing tests can't be part of a batch.")
         ->required();
 
     try
@@ -63,6 +394,19 @@ The default is 2 (info).)")
         CLI11_PARSE(app, argc, argv);
 
         darts_init(verbosity);
+        set_progress_silent(no_progress || server);
+
+        // stdout only carries the replies of the server, so log to stderr instead
+        if (server)
+        {
+            spdlog::set_default_logger(spdlog::stderr_color_mt("server"));
+            spdlog::set_pattern("%^%v%$");
+            spdlog::set_level(spdlog::level::level_enum(verbosity));
+        }
+
+        if (!cache_dir.empty())
+            set_cache_dir(cache_dir);
+        set_texture_cache_size(texture_cache_mb << 20);
 
         if (app.count("--threads"))
         {
@@ -74,60 +418,216 @@ The default is 2 (info).)")
             spdlog::info("Automatically setting number of threads in thread pool to {}.", pool_size());
         }
 
-        // generate/load scene either by creating one of the hardcoded test scenes or loading from json file
-        json j;
-        int  scene_number = 0;
-        if (sscanf(scenefile.c_str(), "example_scene%d", &scene_number) == 1)
-            j = create_example_scene(scene_number);
-        else
+        // pin the threads before loading the scene, so that the BBH replicas can be placed on each node
+        pin_pool_threads(pin_threads);
+        set_numa_replication(numa_replicate);
+
+        // the scene files to render, along with their frame numbers
+        vector<std::pair<string, int>> batch;
+        if (app.count("--frames"))
         {
-            filesystem::path path(scenefile);
+            if (scenefiles.size() != 1 || scenefiles[0].find('%') == string::npos)
+                throw DartsException("--frames needs a single scene file pattern like \"shot%04d.json\".");
+            for (int f = frames[0]; f < frames[1]; ++f) batch.emplace_back(fmt::sprintf(scenefiles[0], f), f);
+        }
+        else
+            for (size_t f = 0; f < scenefiles.size(); ++f) batch.emplace_back(scenefiles[f], int(f));
 
-            // Add the parent directory of the scene file to the file resolver. That way, the scene file can reference
-            // resources (OBJ files, textures) using relative paths
-            get_file_resolver().prepend(path.parent_path());
+        if (batch.empty())
+            throw DartsException("There are no frames to render.");
+        bool is_batch = batch.size() > 1 || app.count("--frames");
+        if (server && is_batch)
+            throw DartsException("--serve only supports a single scene file.");
 
-            // open file
-            std::ifstream stream(scenefile, std::ifstream::in);
-            if (!stream.good())
-                throw DartsException("Cannot open file: {}.", scenefile);
+        // generate/load scene either by creating one of the hardcoded test scenes or loading from json file
+        Frame first = load_frame(batch[0].first);
+
+        // tests exit the program when done, so they can't run while other frames are loading or being written
+        if (!first.scene && is_batch)
+            throw DartsException("\"{}\" contains tests, which can't be run as part of a batch.", first.scenefile);
+        run_tests(first.j);
 
-            j = json::parse(stream,
-                            /* callback */ nullptr,
-                            /* allow exceptions */ true,
-                            /* ignore_comments */ true);
+        if (server)
+        {
+            serve(*first.scene, first.j["camera"]);
+            exit(EXIT_SUCCESS);
         }
 
-        run_tests(j);
+        std::future<Frame> next;
+        std::future<void>  writing;
+        json               frame_stats   = json::array();
+        double             total_seconds = 0.0;
+        for (size_t f = 0; f < batch.size(); ++f)
+        {
+            Frame frame = f == 0 ? std::move(first) : next.get();
 
-        auto scene = make_shared<Scene>(j);
+            // leaving the loop by an exception waits for the images of the previous frame to be written
+            if (!frame.scene)
+                throw DartsException("\"{}\" contains tests, which can't be run as part of a batch.", frame.scenefile);
 
-        // use the outfile if specified, otherwise take the basename from the scene file and append the time.
-        string outfile_hdr;
-        if (outfile.empty())
-        {
-            std::time_t t           = std::time(nullptr);
-            string      time_string = fmt::format("{:%Y-%m-%d-%H-%M-%S}", fmt::localtime(t));
+            // parse the next frame while this one renders
+            if (f + 1 < batch.size())
+                next = std::async(std::launch::async, load_frame, batch[f + 1].first);
 
-            auto base   = scenefile.substr(0, scenefile.find_last_of('.')) + "-" + time_string + ".";
-            outfile     = base + format;
-            outfile_hdr = base + "exr";
-        }
+            auto         &scene     = frame.scene;
+            const string &scenefile = frame.scenefile;
+            const json   &j         = frame.j;
+
+            RenderInfo info;
+            info.resolution = scene->camera()->resolution();
+            info.seed       = Scene::random_seed;
+            if (!region.empty() || !tile_range.empty())
+            {
+                Box2i r(Vec2i(0), info.resolution);
+                if (!region.empty())
+                    r = Box2i(la::max(Vec2i(region[0], region[1]), Vec2i(0)),
+                              la::min(Vec2i(region[2], region[3]), info.resolution));
+                scene->set_render_region(r, tile_range.empty() ? 0 : tile_range[0],
+                                         tile_range.empty() ? -1 : tile_range[1]);
+                info.tiles = scene->render_tiles();
+            }
+            else
+                info.tiles = {Box2i(Vec2i(0), info.resolution)};
+
+            // partial renderings, and renderings with a specific seed (e.g. from different nodes), are likely to be
+            // merged, so describe them next to the images
+            info.write = scene->renders_partial_image() || app.count("--seed");
+
+            // use the outfile if specified, otherwise take the basename from the scene file and append the time.
+            string frame_outfile  = is_batch && !outfile.empty() ? frame_filename(outfile, batch[f].second) : outfile;
+            string frame_aov_file = is_batch && !aov_file.empty() ? frame_filename(aov_file, batch[f].second)
+                                                                   : aov_file;
+            string outfile_hdr;
+            if (frame_outfile.empty())
+            {
+                std::time_t t           = std::time(nullptr);
+                string      time_string = fmt::format("{:%Y-%m-%d-%H-%M-%S}", fmt::localtime(t));
 
-        spdlog::info("Will save rendered image to \"{}\"", outfile);
+                auto base     = scenefile.substr(0, scenefile.find_last_of('.')) + "-" + time_string + ".";
+                frame_outfile = base + format;
+                outfile_hdr   = base + "exr";
+            }
 
-        auto image = scene->raytrace();
+            spdlog::info("Will save rendered image to \"{}\"", frame_outfile);
 
-        spdlog::info("Writing rendered image to file \"{}\"...", outfile);
+            // the denoiser needs the AOVs as guides, even if they aren't saved
+            shared_ptr<Denoiser> denoiser;
+            if (!denoiser_type.empty() || j.contains("denoiser"))
+            {
+                json spec = j.value("denoiser", json::object());
+                if (!denoiser_type.empty())
+                    spec["type"] = denoiser_type;
+                denoiser = DartsFactory<Denoiser>::create(spec);
+            }
 
-        image.save(outfile);
+            unique_ptr<AOVBuffers> aovs;
+            if (!frame_aov_file.empty() || denoiser || cost_heatmaps)
+                aovs = make_unique<AOVBuffers>(info.resolution, cost_heatmaps);
 
-        // if the outfile wasn't specified, also save the rendering in .hdr format
-        if (!outfile_hdr.empty())
+            Image3f           image;
+            int               spp = scene->num_samples();
+            spdlog::stopwatch render_time;
+            if (app.count("--pass-spp") || app.count("--time-budget"))
+            {
+                // save the intermediate results under the final filenames, so a killed job still leaves an image
+                auto save = [&frame_outfile, &outfile_hdr, &info](Image3f &img, int spp)
+                {
+                    spdlog::info("Writing intermediate image with {} samples per pixel to file \"{}\"...", spp,
+                                 frame_outfile);
+                    save_rendering(img, {frame_outfile, outfile_hdr}, info, spp);
+                };
+                image = scene->raytrace_progressive(progressive, save, &spp, aovs.get());
+            }
+            else
+                image = scene->raytrace(aovs.get());
+            double render_seconds = render_time.elapsed().count();
+            total_seconds += render_seconds;
+
+            // the AOV file keeps the image before denoising, next to the AOVs that guided the denoiser
+            Image3f noisy;
+            if (denoiser)
+            {
+                spdlog::info("Denoising the rendered image...");
+                if (!aovs->recorded)
+                    spdlog::warn("No AOVs were recorded, so the denoiser works without guides.");
+                if (!frame_aov_file.empty())
+                    noisy = image;
+                image = denoiser->denoise(image, aovs->recorded ? aovs.get() : nullptr);
+            }
+
+            frame_stats.push_back({{"scene", scenefile},
+                                   {"image", frame_outfile},
+                                   {"resolution", {info.resolution.x, info.resolution.y}},
+                                   {"spp", scene->num_samples()},
+                                   {"render_seconds", render_seconds}});
+
+            // write the images while the next frame renders, but wait for the previous frame's images first, so only
+            // one frame's images are held in memory for writing
+            if (writing.valid())
+                writing.get();
+            writing = std::async(
+                std::launch::async,
+                [frame_outfile, outfile_hdr, frame_aov_file, info, spp, cost_heatmaps, image = std::move(image),
+                 noisy = std::move(noisy), aovs = std::move(aovs)]()
+                {
+                    // if the outfile wasn't specified, also save the rendering in .exr format
+                    spdlog::info("Writing rendered image to file \"{}\"...", frame_outfile);
+                    if (!outfile_hdr.empty())
+                        spdlog::info("Writing rendered image to file \"{}\"...", outfile_hdr);
+                    save_rendering(image, {frame_outfile, outfile_hdr}, info, spp);
+
+                    if (!frame_aov_file.empty())
+                    {
+                        spdlog::info("Writing the image and its AOVs to file \"{}\"...", frame_aov_file);
+                        if (!aovs->save(frame_aov_file, noisy.length() > 0 ? noisy : image))
+                            spdlog::error("Could not write AOV file \"{}\".", frame_aov_file);
+                    }
+
+                    if (cost_heatmaps &&
+                        !aovs->save_costs(frame_outfile.substr(0, frame_outfile.find_last_of('.')) + "-cost"))
+                        spdlog::error("Could not write the cost heatmaps.");
+
+                    accumulate_thread_stats();
+                });
+        }
+        if (writing.valid())
+            writing.get();
+
+        // the statistics were already reported after rendering each frame, so only what happened since (e.g. the time
+        // spent writing the images) is left
+        accumulate_thread_stats();
+        spdlog::info(stats_report());
+
+        if (!stats_file.empty())
         {
-            spdlog::info("Writing rendered image to file \"{}\"...", outfile_hdr);
-            image.save(outfile_hdr);
+            json stats = stats_json();
+
+            // the number of rays is the denominator of the per-ray intersection statistics
+            auto    rays       = stats["ratios"].find("Intersections/Total intersection tests per ray");
+            int64_t total_rays = rays != stats["ratios"].end() ? (*rays)["denom"].get<int64_t>() : 0;
+
+            // a batch reports the totals, and each frame separately
+            json &last = frame_stats.back();
+            json  out  = {{"scene", last["scene"]},
+                          {"image", last["image"]},
+                          {"threads", pool_size()},
+                          {"resolution", last["resolution"]},
+                          {"spp", last["spp"]},
+                          {"seed", Scene::random_seed},
+                          {"render_seconds", total_seconds},
+                          {"rays", total_rays},
+                          {"rays_per_second", total_seconds > 0.0 ? total_rays / total_seconds : 0.0},
+                          {"stats", stats}};
+            if (is_batch)
+                out["frames"] = frame_stats;
+
+            std::ofstream stream(stats_file);
+            stream << out.dump(4) << std::endl;
+            if (!stream.good())
+                throw DartsException("Cannot write statistics to file: {}.", stats_file);
+            spdlog::info("Wrote statistics to file \"{}\"", stats_file);
         }
+        clear_stats();
 
         spdlog::info("done!");
     }
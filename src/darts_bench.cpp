@@ -0,0 +1,314 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+/**
+    \file
+    \brief Utility program to benchmark darts on a fixed set of scenes, and to compare the timings against a baseline
+*/
+
+#include <CLI/CLI.hpp>
+#include <atomic>
+#include <darts/parallel.h>
+#include <darts/photon.h>
+#include <darts/scene.h>
+#include <darts/stats.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <spdlog/stopwatch.h>
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// Gather the statistics of all threads, and return the totals of the whole run so far
+json stats_snapshot()
+{
+    for_each_thread(accumulate_thread_stats);
+    return stats_json();
+}
+
+/// The increase of the statistic <tt>j[kind][name][field]</tt> (or of <tt>j[kind][name]</tt> if \p field is empty)
+/// from \p before to \p after, or 0 if it was not gathered at all
+double stat_delta(const json &before, const json &after, const string &kind, const string &name,
+                  const string &field = "")
+{
+    auto value = [&](const json &j) -> double
+    {
+        auto it = j[kind].find(name);
+        if (it == j[kind].end())
+            return 0.0;
+        return field.empty() ? it->get<double>() : (*it)[field].get<double>();
+    };
+    return value(after) - value(before);
+}
+
+/// Load and render \p j, and return the timings and ray throughputs
+json bench_scene(const json &j)
+{
+    json before = stats_snapshot();
+
+    spdlog::stopwatch load_time;
+    auto              scene        = make_shared<Scene>(j);
+    double            load_seconds = load_time.elapsed().count();
+
+    spdlog::stopwatch render_time;
+    scene->raytrace();
+    double render_seconds = render_time.elapsed().count();
+
+    json after = stats_snapshot();
+
+    double camera_rays = stat_delta(before, after, "counters", "Integrator/Camera rays traced");
+    double traced_rays = stat_delta(before, after, "ratios", "Intersections/Total intersection tests per ray", "denom");
+    double shadow_rays = stat_delta(before, after, "counters", "Intersections/Shadow rays");
+
+    json result = {{"load_seconds", load_seconds},
+                   {"render_seconds", render_seconds},
+                   {"primary_mrays_per_second", camera_rays / render_seconds * 1e-6},
+                   {"secondary_mrays_per_second", std::max(traced_rays - camera_rays, 0.0) / render_seconds * 1e-6},
+                   {"shadow_mrays_per_second", shadow_rays / render_seconds * 1e-6}};
+
+    // the BBH construction time is only known if darts was compiled with the phase timers
+    double bbh_ns = stat_delta(before, after, "timers", "Time/Scene parsing/BBH construction", "wall_ns");
+    if (bbh_ns > 0.0)
+        result["bbh_build_seconds"] = bbh_ns * 1e-9;
+
+    return result;
+}
+
+/// Build a photon map of \p num_photons random photons, and perform \p num_queries k-nearest neighbor gathers in it
+json bench_photons(int num_photons, int num_queries)
+{
+    pcg32     rng;
+    PhotonMap photon_map;
+    photon_map.reserve(num_photons);
+    for (int i = 0; i < num_photons; ++i)
+    {
+        Vec3f pos{rng.nextFloat(), rng.nextFloat(), rng.nextFloat()};
+        photon_map.insert(pos, Photon(Vec3f(0.f, 0.f, 1.f), Color3f(1.f)));
+    }
+
+    std::vector<Vec3f> queries(num_queries);
+    for (auto &q : queries) q = Vec3f{rng.nextFloat(), rng.nextFloat(), rng.nextFloat()};
+
+    spdlog::stopwatch build_time;
+    photon_map.build();
+    double build_seconds = build_time.elapsed().count();
+
+    std::atomic<int64_t> found(0);
+    spdlog::stopwatch    gather_time;
+    parallel_for(blocked_range<int>(0, num_queries, 256),
+                 [&](blocked_range<int> range)
+                 {
+                     KNNSearch search(Vec3f(0.f), 0.01f, 50);
+                     int64_t   count = 0;
+                     for (auto i : range)
+                     {
+                         search.reset(queries[i]);
+                         photon_map.find(search);
+                         count += search.results.size();
+                     }
+                     found += count;
+                 });
+    double gather_seconds = gather_time.elapsed().count();
+
+    spdlog::debug("Found {} photons in {} gathers.", found.load(), num_queries);
+
+    return {{"build_mphotons_per_second", num_photons / build_seconds * 1e-6},
+            {"gather_kqueries_per_second", num_queries / gather_seconds * 1e-3}};
+}
+
+/// Whether smaller values of \p metric (the timings, as opposed to the throughputs) are better
+bool lower_is_better(const string &metric)
+{
+    return metric.size() > 8 && metric.compare(metric.size() - 8, 8, "_seconds") == 0;
+}
+
+/// Merge the measurements in \p result into \p best, keeping the better value of each metric
+void keep_best(json &best, const json &result)
+{
+    if (best.is_null())
+    {
+        best = result;
+        return;
+    }
+    for (auto &[metric, value] : result.items())
+    {
+        double v = value.get<double>(), b = best.value(metric, v);
+        best[metric] = lower_is_better(metric) ? std::min(v, b) : std::max(v, b);
+    }
+}
+
+} // namespace
+
+/**
+ * Renders a fixed set of scenes (and runs a photon map micro-benchmark) at several thread counts, reports the timings
+ * and ray throughputs, and optionally compares them to a baseline produced by an earlier run. Exits with failure if any
+ * measurement is slower than the baseline by more than a tolerance.
+ */
+int main(int argc, char **argv)
+{
+    vector<string>   scenefiles = {"example_scene0", "example_scene1", "example_scene2", "example_scene3"};
+    vector<uint32_t> thread_counts;
+    string           outfile, baseline_file;
+    int              spp         = 0;
+    int              repeats     = 1;
+    int              num_photons = 1 << 20;
+    float            tolerance   = 0.1f;
+    int              verbosity   = spdlog::level::warn;
+
+    CLI::App app{"\nRenders a fixed set of scenes at several thread counts, reports the scene loading times and ray "
+                 "throughputs, and compares them to a baseline.\n",
+                 "darts_bench"};
+
+    app.get_formatter()->column_width(35);
+
+    app.add_option("scenes", scenefiles,
+                   "The JSON scenefiles to benchmark (or strings \"example_sceneN\"); default: the four example "
+                   "scenes.");
+    app.add_option("-t,--threads", thread_counts,
+                   "Comma-separated thread counts to run each benchmark with; default: 1 and the number of detected "
+                   "cores.")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
+    app.add_option("-s,--spp", spp, "Override the number of samples per pixel of each scene.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("-r,--repeats", repeats, "Run each benchmark this many times and keep the best measurement.")
+        ->check(CLI::PositiveNumber);
+    app.add_option("-p,--photons", num_photons, "The number of photons in the photon map benchmark (0 to skip it).")
+        ->check(CLI::NonNegativeNumber);
+    app.add_option("-o,--outfile", outfile, "Write the measurements to this JSON file, e.g. to use as a baseline.");
+    app.add_option("-b,--baseline", baseline_file, "Compare the measurements to those in this JSON file.")
+        ->check(CLI::ExistingFile);
+    app.add_option("--tolerance", tolerance,
+                   "The fraction by which a measurement may be slower than the baseline before it counts as a "
+                   "regression; default: 0.1.")
+        ->check(CLI::NonNegativeNumber);
+    app.add_option("-v,--verbosity", verbosity,
+                   R"(Set verbosity threshold T with lower values meaning more verbose
+and higher values removing low-priority messages. All messages with
+severity >= T are displayed, where the severities are:
+    trace    = 0
+    debug    = 1
+    info     = 2
+    warn     = 3
+    err      = 4
+    critical = 5
+    off      = 6
+The default is 3 (warn).)")
+        ->check(CLI::Range(0, 6));
+
+    try
+    {
+        CLI11_PARSE(app, argc, argv);
+
+        darts_init(verbosity);
+
+        if (thread_counts.empty())
+            thread_counts = {1u, uint32_t(pool_size())};
+        std::sort(thread_counts.begin(), thread_counts.end());
+        thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+
+        // load all scene descriptions up front, so that the benchmarks don't include reading the files
+        std::vector<std::pair<string, json>> scenes;
+        for (auto &scenefile : scenefiles)
+        {
+            json j;
+            int  scene_number = 0;
+            if (sscanf(scenefile.c_str(), "example_scene%d", &scene_number) == 1)
+                j = create_example_scene(scene_number);
+            else
+            {
+                filesystem::path path(scenefile);
+                get_file_resolver().prepend(path.parent_path());
+
+                std::ifstream stream(scenefile, std::ifstream::in);
+                if (!stream.good())
+                    throw DartsException("Cannot open file: {}.", scenefile);
+                j = json::parse(stream, nullptr, true, true);
+            }
+            if (spp > 0)
+                j["sampler"]["samples"] = spp;
+            scenes.emplace_back(scenefile, j);
+        }
+
+        json results = json::object();
+        for (auto threads : thread_counts)
+        {
+            pool_set_size(nullptr, threads);
+            auto key = fmt::format("{} threads", threads);
+            fmt::print("Benchmarking with {} threads...\n", threads);
+
+            for (auto &[name, j] : scenes)
+            {
+                json best;
+                for (int r = 0; r < repeats; ++r) keep_best(best, bench_scene(j));
+                results[name][key] = best;
+            }
+
+            if (num_photons > 0)
+            {
+                json best;
+                for (int r = 0; r < repeats; ++r) keep_best(best, bench_photons(num_photons, num_photons / 16));
+                results["photon_map"][key] = best;
+            }
+        }
+        clear_stats();
+
+        json baseline;
+        if (!baseline_file.empty())
+        {
+            std::ifstream stream(baseline_file);
+            baseline = json::parse(stream);
+        }
+
+        // report each measurement, along with its speedup over the baseline
+        int regressions = 0;
+        for (auto &[name, runs] : results.items())
+        {
+            fmt::print("{}\n", name);
+            for (auto &[key, metrics] : runs.items())
+            {
+                fmt::print("  {}\n", key);
+                for (auto &[metric, value] : metrics.items())
+                {
+                    double v    = value.get<double>();
+                    string line = fmt::format("    {:<36}{:>12.4f}", metric, v);
+
+                    if (baseline.contains(name) && baseline[name].contains(key) && baseline[name][key].contains(metric))
+                    {
+                        double b       = baseline[name][key][metric].get<double>();
+                        double speedup = lower_is_better(metric) ? b / v : v / b;
+                        bool   slower  = speedup < 1.0 - tolerance;
+                        regressions += slower;
+                        line += fmt::format("  (baseline {:>12.4f}, speedup {:.3f}x){}", b, speedup,
+                                            slower ? " REGRESSION" : "");
+                    }
+                    fmt::print("{}\n", line);
+                }
+            }
+        }
+
+        if (!outfile.empty())
+        {
+            std::ofstream stream(outfile);
+            stream << results.dump(4) << std::endl;
+            if (!stream.good())
+                throw DartsException("Cannot write benchmark results to file: {}.", outfile);
+            spdlog::info("Wrote benchmark results to file \"{}\"", outfile);
+        }
+
+        if (regressions)
+            throw DartsException("{} measurements are more than {}% slower than the baseline!", regressions,
+                                 100.f * tolerance);
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::error("{}", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -13,6 +13,7 @@
 #include <darts/common.h>
 #include <darts/image.h>
 #include <darts/progress.h>
+#include <darts/sampler.h>
 #include <darts/sphere.h>
 #include <darts/surface_group.h>
 #include <darts/transform.h>
@@ -31,6 +32,7 @@ void    test_ray_sphere_intersection();
 void    test_sphere_image();
 void    test_materials();
 void    test_recursive_raytracing();
+Sampler &tutorial_sampler();
 
 int main(int argc, char **argv)
 {
@@ -515,7 +517,7 @@ void test_materials()
     {
         Ray3f   lambert_scattered;
         Color3f lambert_attenuation;
-        if (lambert_material->scatter(ray, hit, lambert_attenuation, lambert_scattered))
+        if (lambert_material->scatter(ray, hit, lambert_attenuation, lambert_scattered, tutorial_sampler()))
         {
             lambert_avg_cos += dot(normal, normalize(lambert_scattered.d));
             max_lambert_error = std::max({maxelem(abs(correct_origin - lambert_scattered.o)),
@@ -549,7 +551,7 @@ void test_materials()
     {
         Ray3f   metal_scattered;
         Color3f metal_attenuation;
-        if (metal_material->scatter(ray, hit, metal_attenuation, metal_scattered))
+        if (metal_material->scatter(ray, hit, metal_attenuation, metal_scattered, tutorial_sampler()))
         {
             metal_min_cos   = std::min(dot(reflected, normalize(metal_scattered.d)), metal_min_cos);
             max_metal_error = std::max({maxelem(abs(correct_origin - metal_scattered.o)),
@@ -641,7 +643,7 @@ Color3f recursive_color(const Ray3f &ray, const SurfaceGroup &scene, int depth)
     // Pseudo-code:
     //
     // if scene.intersect:
-    // 		if depth < max_depth and hit_material.scatter(....) is successful:
+    // 		if depth < max_depth and hit_material.scatter(..., tutorial_sampler()) is successful:
     //			recursive_color = call this function recursively with the scattered ray and increased depth
     //          return attenuation * recursive_color
     //		else
@@ -653,6 +655,13 @@ Color3f recursive_color(const Ray3f &ray, const SurfaceGroup &scene, int depth)
 
 }
 
+/// The source of random numbers for the materials in this (single-threaded) tutorial
+Sampler &tutorial_sampler()
+{
+    static auto sampler = DartsFactory<Sampler>::create(json{{"type", "independent"}, {"samples", 1}});
+    return *sampler;
+}
+
 Color3f vec2color(const Vec3f &dir)
 {
     return 0.5f * (dir + 1.f);
@@ -0,0 +1,121 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/denoiser.h>
+#include <darts/parallel.h>
+#include <darts/stats.h>
+
+STAT_TIMER("Time/Denoising", denoise_time);
+
+/**
+    A joint non-local means filter, which averages each pixel with those nearby pixels that look alike.
+
+    The weight of a neighbor falls off with the relative color difference of the patches around the two pixels, and
+    with the differences of their AOVs (if available), so the filter keeps edges between surfaces and texture details
+    that the AOVs see, while blurring away the noise. With a \c "patch_radius" of 0, it becomes a joint bilateral
+    filter.
+
+    Parameters:
+    - \c "radius": the radius of the window of neighbors, in pixels (default: 7)
+    - \c "patch_radius": the radius of the patches that are compared (default: 1)
+    - \c "strength": how different patches can be and still be averaged (default: 0.45)
+    - \c "sigma_albedo", \c "sigma_normal", \c "sigma_depth": the tolerances of the albedo difference, the normal
+      difference, and the relative depth difference (defaults: 0.1, 0.3, and 0.05)
+
+    \ingroup Integrators
+*/
+class NLMeansDenoiser : public Denoiser
+{
+public:
+    NLMeansDenoiser(const json &j = json::object());
+
+    Image3f denoise(const Image3f &color, const AOVBuffers *aovs) const override;
+
+protected:
+    int   m_radius       = 7;
+    int   m_patch_radius = 1;
+    float m_strength     = 0.45f;
+    float m_sigma_albedo = 0.1f;
+    float m_sigma_normal = 0.3f;
+    float m_sigma_depth  = 0.05f;
+};
+
+NLMeansDenoiser::NLMeansDenoiser(const json &j) : Denoiser(j)
+{
+    m_radius       = j.value("radius", m_radius);
+    m_patch_radius = j.value("patch_radius", m_patch_radius);
+    m_strength     = j.value("strength", m_strength);
+    m_sigma_albedo = j.value("sigma_albedo", m_sigma_albedo);
+    m_sigma_normal = j.value("sigma_normal", m_sigma_normal);
+    m_sigma_depth  = j.value("sigma_depth", m_sigma_depth);
+
+    if (m_radius < 0 || m_patch_radius < 0)
+        throw DartsException("'radius' and 'patch_radius' must not be negative, got {} and {}.", m_radius,
+                             m_patch_radius);
+    if (m_strength <= 0.f || m_sigma_albedo <= 0.f || m_sigma_normal <= 0.f || m_sigma_depth <= 0.f)
+        throw DartsException("'strength' and the 'sigma_*' parameters must be positive.");
+}
+
+Image3f NLMeansDenoiser::denoise(const Image3f &color, const AOVBuffers *aovs) const
+{
+    SCOPED_STAT_TIMER(denoise_time);
+
+    int  w = color.width(), h = color.height();
+    auto at = [w, h](const auto &image, int x, int y) { return image(clamp(x, 0, w - 1), clamp(y, 0, h - 1)); };
+
+    // the relative squared color difference of each pair of pixels is clamped, so single fireflies don't dominate
+    auto color_distance = [&](int x0, int y0, int x1, int y1)
+    {
+        float d = 0.f;
+        for (int py = -m_patch_radius; py <= m_patch_radius; ++py)
+            for (int px = -m_patch_radius; px <= m_patch_radius; ++px)
+            {
+                Color3f a = at(color, x0 + px, y0 + py), b = at(color, x1 + px, y1 + py);
+                Color3f s = a * a + b * b + 1e-4f;
+                d += std::min(la::sum((a - b) * (a - b) / s), 3.f);
+            }
+        return d / float(sqr(2 * m_patch_radius + 1));
+    };
+
+    float inv_strength = 1.f / sqr(m_strength), inv_albedo = 1.f / sqr(m_sigma_albedo),
+          inv_normal = 1.f / sqr(m_sigma_normal), inv_depth = 1.f / sqr(m_sigma_depth);
+
+    Image3f result(w, h);
+    parallel_for(blocked_range<int>(0, h, 4),
+                 [&](blocked_range<int> rows)
+                 {
+                     for (auto y : rows)
+                         for (int x = 0; x < w; ++x)
+                         {
+                             Color3f sum(0.f);
+                             float   total = 0.f;
+                             for (int qy = std::max(y - m_radius, 0); qy <= std::min(y + m_radius, h - 1); ++qy)
+                                 for (int qx = std::max(x - m_radius, 0); qx <= std::min(x + m_radius, w - 1); ++qx)
+                                 {
+                                     float e = color_distance(x, y, qx, qy) * inv_strength;
+                                     if (aovs)
+                                     {
+                                         float z0 = aovs->depth(x, y), z1 = aovs->depth(qx, qy);
+                                         e += length2(aovs->albedo(x, y) - aovs->albedo(qx, qy)) * inv_albedo;
+                                         e += length2(aovs->normal(x, y) - aovs->normal(qx, qy)) * inv_normal;
+                                         e += sqr((z0 - z1) / std::max(std::max(z0, z1), 1e-4f)) * inv_depth;
+                                     }
+                                     float weight = std::exp(-e);
+                                     sum += weight * color(qx, qy);
+                                     total += weight;
+                                 }
+                             result(x, y) = sum / total;
+                         }
+                 });
+    return result;
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Denoiser, NLMeansDenoiser, "nlmeans")
+
+/**
+    \file
+    \brief NLMeansDenoiser
+*/
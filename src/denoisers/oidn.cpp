@@ -0,0 +1,71 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/denoiser.h>
+#include <darts/stats.h>
+#include <OpenImageDenoise/oidn.hpp>
+
+STAT_TIMER("Time/Denoising with OIDN", oidn_time);
+
+/**
+    The ray tracing denoiser of Intel Open Image Denoise, which is only compiled with the \c USE_OIDN CMake option.
+
+    The albedo and normal AOVs are used as auxiliary images if available.
+
+    Parameters:
+    - \c "hdr": whether the image has a high dynamic range (default: true)
+
+    \ingroup Integrators
+*/
+class OIDNDenoiser : public Denoiser
+{
+public:
+    OIDNDenoiser(const json &j = json::object()) : Denoiser(j)
+    {
+        m_hdr = j.value("hdr", m_hdr);
+    }
+
+    Image3f denoise(const Image3f &color, const AOVBuffers *aovs) const override
+    {
+        SCOPED_STAT_TIMER(oidn_time);
+
+        int     w = color.width(), h = color.height();
+        Image3f result(w, h);
+
+        oidn::DeviceRef device = oidn::newDevice();
+        device.commit();
+
+        // OIDN doesn't write to its inputs, but only takes non-const pointers
+        auto data = [](const Image3f &image) { return const_cast<Color3f *>(&image(0)); };
+
+        oidn::FilterRef filter = device.newFilter("RT");
+        filter.setImage("color", data(color), oidn::Format::Float3, w, h);
+        if (aovs)
+        {
+            filter.setImage("albedo", data(aovs->albedo), oidn::Format::Float3, w, h);
+            filter.setImage("normal", data(aovs->normal), oidn::Format::Float3, w, h);
+        }
+        filter.setImage("output", &result(0), oidn::Format::Float3, w, h);
+        filter.set("hdr", m_hdr);
+        filter.commit();
+        filter.execute();
+
+        const char *message;
+        if (device.getError(message) != oidn::Error::None)
+            throw DartsException("OIDN failed to denoise the image: {}", message);
+        return result;
+    }
+
+protected:
+    bool m_hdr = true;
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Denoiser, OIDNDenoiser, "oidn")
+
+/**
+    \file
+    \brief OIDNDenoiser
+*/
@@ -0,0 +1,89 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/environment.h>
+#include <darts/spherical.h>
+#include <darts/stats.h>
+#include <filesystem/resolver.h>
+
+STAT_MEMORY_COUNTER("Memory/Environment maps", environment_bytes);
+
+Environment::Environment(const json &j)
+{
+    string filename = get_file_resolver().resolve(j.at("filename").get<string>()).str();
+    if (!m_image.load(filename))
+        throw DartsException("Cannot load environment map '{}'.", filename);
+
+    m_scale     = j.value("scale", m_scale);
+    m_xform     = j.value("transform", m_xform);
+    m_inv_xform = m_xform.inverse();
+
+    // weight the luminance of each row by sin(theta), the area of the sphere covered by its pixels
+    int           w = m_image.width(), h = m_image.height();
+    vector<float> func(w * h);
+    for (int y = 0; y < h; ++y)
+    {
+        float sin_theta = std::sin(M_PI * (y + 0.5f) / h);
+        for (int x = 0; x < w; ++x) func[m_image.index_1d(x, y)] = std::max(luminance(m_image(x, y)), 0.f) * sin_theta;
+    }
+    m_distribution = Distribution2D(func.data(), w, h);
+
+    environment_bytes += m_image.length() * sizeof(Color3f) + w * h * 2 * sizeof(float);
+    spdlog::info("Loaded {}x{} environment map '{}'.", w, h, filename);
+}
+
+Vec2i Environment::pixel(const Vec3f &dir) const
+{
+    // the rows of the image go from theta = 0 at the top to theta = pi at the bottom
+    Vec2f uv = Spherical::direction_to_spherical_coordinates(normalize(dir)) * Vec2f{INV_TWOPI, INV_PI};
+    return {clamp(int(uv.x * m_image.width()), 0, m_image.width() - 1),
+            clamp(int(uv.y * m_image.height()), 0, m_image.height() - 1)};
+}
+
+Color3f Environment::eval(const Vec3f &dir) const
+{
+    Vec2i p = pixel(m_inv_xform.vector(dir));
+    return m_scale * m_image(p.x, p.y);
+}
+
+Color3f Environment::sample(EmitterRecord &rec, const Vec2f &rv) const
+{
+    float pdf_uv;
+    Vec2f uv = m_distribution.sample_continuous(rv, &pdf_uv);
+
+    float sin_theta = std::sin(M_PI * uv.y);
+    if (pdf_uv == 0.f || sin_theta == 0.f)
+        return Color3f(0.f);
+
+    Vec3f local = Spherical::spherical_coordinates_to_direction(Vec2f{2 * M_PI * uv.x, M_PI * uv.y});
+
+    // convert the density from the unit square to solid angle
+    rec.emitter = nullptr;
+    rec.wi      = normalize(m_xform.vector(local));
+    rec.pdf     = pdf_uv / (2 * M_PI * M_PI * sin_theta);
+    rec.hit.t   = Ray3f::infinity;
+    rec.hit.p   = rec.o + rec.wi;
+    rec.hit.mat = nullptr;
+
+    Vec2i p = pixel(local);
+    return m_scale * m_image(p.x, p.y) / rec.pdf;
+}
+
+float Environment::pdf(const Vec3f &dir) const
+{
+    Vec3f local     = normalize(m_inv_xform.vector(dir));
+    float sin_theta = std::sqrt(std::max(1.f - local.z * local.z, 0.f));
+    if (sin_theta == 0.f)
+        return 0.f;
+
+    Vec2f uv = Spherical::direction_to_spherical_coordinates(local) * Vec2f{INV_TWOPI, INV_PI};
+    return m_distribution.pdf(uv) / (2 * M_PI * M_PI * sin_theta);
+}
+
+/**
+    \file
+    \brief Class #Environment
+*/
@@ -0,0 +1,139 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <cstring>
+#include <darts/dmesh.h>
+#include <darts/framebuffer.h>
+#include <darts/parallel.h>
+#include <darts/stats.h>
+
+STAT_MEMORY_COUNTER("Memory/Framebuffers", framebuffer_bytes);
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+size_t pixel_bytes(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::Half: return 3 * sizeof(uint16_t);
+    case PixelFormat::RGBE: return 4;
+    default: return sizeof(Color3f);
+    }
+}
+
+// the same encoding as the power of a Photon, which truncates the mantissas
+void encode_rgbe(const Color3f &c, uint8_t rgbe[4])
+{
+    Color3f power = max(c, Color3f(0.f));
+    float   max   = la::maxelem(power);
+    if (!(max >= 1e-32f) || !std::isfinite(max))
+    {
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int e;
+    max     = std::frexp(max, &e) * 256.0f / max;
+    rgbe[0] = (uint8_t)std::min(power.x * max, 255.f);
+    rgbe[1] = (uint8_t)std::min(power.y * max, 255.f);
+    rgbe[2] = (uint8_t)std::min(power.z * max, 255.f);
+    rgbe[3] = (uint8_t)clamp(e + 128, 1, 255);
+}
+
+// decode to the middle of the truncated interval, so the rounding is unbiased
+Color3f decode_rgbe(const uint8_t rgbe[4])
+{
+    if (rgbe[3] == 0)
+        return Color3f(0.f);
+    return (Color3f(rgbe[0], rgbe[1], rgbe[2]) + 0.5f) * std::ldexp(1.f, int(rgbe[3]) - (128 + 8));
+}
+
+} // namespace
+
+PixelFormat parse_pixel_format(const string &name)
+{
+    if (name == "float")
+        return PixelFormat::Float;
+    if (name == "half")
+        return PixelFormat::Half;
+    if (name == "rgbe")
+        return PixelFormat::RGBE;
+    throw DartsException("Unknown pixel format \"{}\", expecting \"float\", \"half\", or \"rgbe\".", name);
+}
+
+int max_blends(PixelFormat format)
+{
+    // a blend of weight 1/n moves the pixel by about 1/n of its value, which should stay a few units in the last place
+    // of the 11-bit half, and the 8-bit (truncated) RGBE mantissas
+    switch (format)
+    {
+    case PixelFormat::Half: return 256;
+    case PixelFormat::RGBE: return 32;
+    default: return 1 << 20;
+    }
+}
+
+Framebuffer::Framebuffer(const Vec2i &size, PixelFormat format) :
+    m_size(size), m_format(format), m_stride(pixel_bytes(format)), m_data(size_t(length()) * m_stride, 0)
+{
+    // all zero bytes decode to black in each of the formats
+    framebuffer_bytes += m_data.size();
+}
+
+Color3f Framebuffer::get(int i) const
+{
+    const uint8_t *p = &m_data[size_t(i) * m_stride];
+    switch (m_format)
+    {
+    case PixelFormat::Half:
+    {
+        uint16_t h[3];
+        std::memcpy(h, p, sizeof(h));
+        return Color3f(half_to_float(h[0]), half_to_float(h[1]), half_to_float(h[2]));
+    }
+    case PixelFormat::RGBE: return decode_rgbe(p);
+    default:
+    {
+        Color3f c;
+        std::memcpy(&c, p, sizeof(c));
+        return c;
+    }
+    }
+}
+
+void Framebuffer::set(int i, const Color3f &c)
+{
+    uint8_t *p = &m_data[size_t(i) * m_stride];
+    switch (m_format)
+    {
+    case PixelFormat::Half:
+    {
+        uint16_t h[3] = {float_to_half(c.x), float_to_half(c.y), float_to_half(c.z)};
+        std::memcpy(p, h, sizeof(h));
+        break;
+    }
+    case PixelFormat::RGBE: encode_rgbe(c, p); break;
+    default: std::memcpy(p, &c, sizeof(c)); break;
+    }
+}
+
+Image3f Framebuffer::image() const
+{
+    Image3f image(m_size.x, m_size.y);
+    parallel_for(blocked_range<int>(0, m_size.y, 16),
+                 [&](blocked_range<int> rows)
+                 {
+                     for (auto y : rows)
+                         for (int x = 0; x < m_size.x; ++x) image(x, y) = get(y * m_size.x + x);
+                 });
+    return image;
+}
+
+/**
+    \file
+    \brief Implementation of #Framebuffer
+*/
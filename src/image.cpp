@@ -4,10 +4,13 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <algorithm>
 #include <cctype>
 #include <darts/common.h>
 #include <darts/image.h>
+#include <darts/parallel.h>
 #include <darts/progress.h>
+#include <darts/stats.h>
 #include <iostream>
 #include <math.h>
 #include <sstream>
@@ -151,9 +154,13 @@ bool load(const string &filename, bool raw, Image<Color<N, float>> &image)
     return false;
 }
 
+STAT_TIMER("Time/Image writing", image_write_time);
+
 template <int N>
 bool save(const string &filename, float gain, const Image<Color<N, float>> &buffer)
 {
+    SCOPED_STAT_TIMER(image_write_time);
+
     string extension = get_file_extension(filename);
 
     transform(extension.begin(), extension.end(), extension.begin(),
@@ -172,13 +179,16 @@ bool save(const string &filename, float gain, const Image<Color<N, float>> &buff
 
         image.num_channels = N;
 
+        // split the channels, a block of rows per task
         std::vector<float> images[N];
-        for (auto i : range(N))
-        {
-            images[i].resize(buffer.length());
-            for (auto j : range(images[i].size()))
-                images[i][j] = buffer(j)[i];
-        }
+        for (auto i : range(N)) images[i].resize(buffer.length());
+        parallel_for(blocked_range<int>(0, buffer.height(), 16),
+                     [&](blocked_range<int> rows)
+                     {
+                         for (auto y : rows)
+                             for (auto x : range(buffer.width()))
+                                 for (auto i : range(N)) images[i][x + y * buffer.width()] = buffer(x, y)[i];
+                     });
 
         float *image_ptr[N];
         // first 3 channels are in BGR order, then A
@@ -234,28 +244,32 @@ bool save(const string &filename, float gain, const Image<Color<N, float>> &buff
     }
     else
     {
-        // convert floating-point image to 8-bit per channel
+        // convert floating-point image to 8-bit per channel, a block of rows per task
         vector<uint8_t> data(buffer.length() * N, 0);
-        for (auto y : range(buffer.height()))
-            for (auto x : range(buffer.width()))
-            {
-                int pixel_offset = N * (x + y * buffer.width());
+        parallel_for(blocked_range<int>(0, buffer.height(), 16),
+                     [&](blocked_range<int> rows)
+                     {
+                         for (auto y : rows)
+                             for (auto x : range(buffer.width()))
+                             {
+                                 int pixel_offset = N * (x + y * buffer.width());
 
-                Color3f cf{reinterpret_cast<const float *>(&buffer(x, y))};
-                cf *= gain;
+                                 Color3f cf{reinterpret_cast<const float *>(&buffer(x, y))};
+                                 cf *= gain;
 
-                // check for invalid colors and make them magenta
-                cf = la::all(la::isfinite(cf)) ? cf : Color3f{1.f, 0.f, 1.f};
+                                 // check for invalid colors and make them magenta
+                                 cf = la::all(la::isfinite(cf)) ? cf : Color3f{1.f, 0.f, 1.f};
 
-                Color3c cc{clamp(to_sRGB(cf), 0.f, 1.f) * 255};
+                                 Color3c cc{clamp(to_sRGB(cf), 0.f, 1.f) * 255};
 
-                data[pixel_offset + 0] = cc[0];
-                data[pixel_offset + 1] = cc[1];
-                data[pixel_offset + 2] = cc[2];
+                                 data[pixel_offset + 0] = cc[0];
+                                 data[pixel_offset + 1] = cc[1];
+                                 data[pixel_offset + 2] = cc[2];
 
-                if constexpr (N == 4)
-                    data[pixel_offset + 3] = clamp(buffer(x, y)[3], 0.f, 1.f) * 255;
-            }
+                                 if constexpr (N == 4)
+                                     data[pixel_offset + 3] = clamp(buffer(x, y)[3], 0.f, 1.f) * 255;
+                             }
+                     });
 
         if (extension == "png")
             return stbi_write_png(filename.c_str(), buffer.width(), buffer.height(), N, &data[0],
@@ -296,3 +310,53 @@ bool Image<Color4f>::save(const string &filename, float gain)
 {
     return ::save(filename, gain, *this);
 }
+
+bool save_exr_channels(const string &filename, int width, int height, vector<ExrChannel> channels)
+{
+    SCOPED_STAT_TIMER(image_write_time);
+
+    std::sort(channels.begin(), channels.end(), [](auto &a, auto &b) { return a.name < b.name; });
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+
+    EXRImage image;
+    InitEXRImage(&image);
+
+    int             n = int(channels.size());
+    vector<float *> image_ptr(n);
+    for (auto i : range(n))
+    {
+        if (channels[i].values.size() != size_t(width) * height)
+            throw DartsException("EXR channel \"{}\" has {} values instead of {}.", channels[i].name,
+                                 channels[i].values.size(), size_t(width) * height);
+        image_ptr[i] = channels[i].values.data();
+    }
+
+    image.num_channels = n;
+    image.images       = (uint8_t **)image_ptr.data();
+    image.width        = width;
+    image.height       = height;
+
+    vector<EXRChannelInfo> infos(n);
+    vector<int>            pixel_types(n, TINYEXR_PIXELTYPE_FLOAT), requested_pixel_types(n);
+    for (auto i : range(n))
+    {
+        strncpy(infos[i].name, channels[i].name.c_str(), 255);
+        requested_pixel_types[i] = channels[i].half ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT;
+    }
+    header.num_channels          = n;
+    header.channels              = infos.data();
+    header.pixel_types           = pixel_types.data();
+    header.requested_pixel_types = requested_pixel_types.data();
+    header.compression_type      = TINYEXR_COMPRESSIONTYPE_PIZ;
+
+    const char *err;
+    if (SaveEXRImageToFile(&image, &header, filename.c_str(), &err) != TINYEXR_SUCCESS)
+    {
+        spdlog::error("Error saving EXR image: {}", err);
+        FreeEXRErrorMessage(err);
+        return false;
+    }
+    return true;
+}
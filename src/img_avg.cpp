@@ -12,14 +12,31 @@
 #include <CLI/CLI.hpp>
 #include <darts/common.h>
 #include <darts/image.h>
+#include <darts/json.h>
+#include <darts/parallel.h>
+#include <fstream>
+#include <future>
+
+/// The weight of image \p filename: the samples per pixel in the description darts saves next to it, or 1 without one
+float image_weight(const string &filename)
+{
+    std::ifstream stream(filename + ".json");
+    if (!stream.good())
+        return 1.f;
+    return json::parse(stream).value("spp", 1.f);
+}
 
 /**
     Average a sequence of images
+
+    The images are streamed, loading the next one while the current one is added to the running (weighted) mean and
+    variance, so only two of them are in memory at once, no matter how many images are averaged.
  */
 int main(int argc, char **argv)
 {
-    string         outfile;
+    string         outfile, variance_file;
     vector<string> infiles;
+    vector<float>  weights;
     int            verbosity = spdlog::get_level();
 
     CLI::App app{"\nAverage a sequence of images and save the result to a new file."};
@@ -30,6 +47,13 @@ int main(int argc, char **argv)
 
     app.add_option("-o,--outfile", outfile,
                    fmt::format("Specify the output image filename (extension must be one of: {})", save_formats));
+    app.add_option("--variance", variance_file,
+                   "Also save the per-pixel (weighted) variance of the images to this file.");
+    app.add_option("-w,--weights", weights,
+                   "Comma-separated weights of the images (e.g. their samples per pixel); default: the samples per "
+                   "pixel in the description darts saves next to an image (\"image.exr.json\"), or 1.")
+        ->delimiter(',')
+        ->check(CLI::PositiveNumber);
     app.add_option("infiles", infiles, "The files to read in and average.")->required()->check(CLI::ExistingFile);
     app.add_option("-v,--verbosity", verbosity,
                    R"(Set verbosity threshold T with lower values meaning more verbose
@@ -53,35 +77,69 @@ The default is 2 (info).)")
 
         spdlog::info("Averaging {} images.", infiles.size());
 
-        Image3f average;
-        if (!average.load(infiles[0]))
-            throw DartsException("Cannot load image \"{}\".", infiles[0]);
-
-        average.reset(Color3f(0.f));
+        if (!weights.empty() && weights.size() != infiles.size())
+            throw DartsException("Got {} weights for {} images.", weights.size(), infiles.size());
 
-        for (int i = 0; i < infiles.size(); ++i)
+        auto load = [&infiles](size_t i)
         {
             Image3f image;
             if (!image.load(infiles[i]))
                 throw DartsException("Cannot load image {}: \"{}\".", i, infiles[i]);
+            return image;
+        };
 
-            if (image.width() != average.width() || image.height() != average.height())
-                throw DartsException("Image dimensions don't match. \"{}\" : ({}x{}) vs. \"{}\" ({}x{}).", infiles[0],
-                                     average.width(), average.height(), infiles[i], image.width(), image.height());
+        // West's weighted incremental algorithm for the mean and (population) variance of each pixel
+        Image3f mean, m2;
+        double  total_weight = 0.0;
 
-            for (auto y : range(average.height()))
-                for (auto x : range(average.width()))
-                    average(x, y) += image(x, y);
+        auto next = std::async(std::launch::async, load, 0);
+        for (size_t i = 0; i < infiles.size(); ++i)
+        {
+            Image3f image = next.get();
+            if (i + 1 < infiles.size())
+                next = std::async(std::launch::async, load, i + 1);
+
+            if (i == 0)
+            {
+                mean = Image3f(image.width(), image.height(), Color3f(0.f));
+                m2   = Image3f(image.width(), image.height(), Color3f(0.f));
+            }
+            else if (image.width() != mean.width() || image.height() != mean.height())
+                throw DartsException("Image dimensions don't match. \"{}\" : ({}x{}) vs. \"{}\" ({}x{}).", infiles[0],
+                                     mean.width(), mean.height(), infiles[i], image.width(), image.height());
+
+            float w = weights.empty() ? image_weight(infiles[i]) : weights[i];
+            total_weight += w;
+            float f = float(w / total_weight);
+
+            parallel_for(blocked_range<int>(0, mean.height(), 16),
+                         [&](blocked_range<int> rows)
+                         {
+                             for (auto y : rows)
+                                 for (auto x : range(mean.width()))
+                                 {
+                                     Color3f delta = image(x, y) - mean(x, y);
+                                     mean(x, y) += f * delta;
+                                     m2(x, y) += w * delta * (image(x, y) - mean(x, y));
+                                 }
+                         });
         }
 
-        for (auto y : range(average.height()))
-            for (auto x : range(average.width()))
-                average(x, y) /= float(infiles.size());
-
         if (!outfile.empty())
         {
             spdlog::info("Writing average image to '{}'.", outfile);
-            average.save(outfile);
+            mean.save(outfile);
+        }
+
+        if (!variance_file.empty())
+        {
+            parallel_for(blocked_range<int>(0, m2.length(), 1 << 14),
+                         [&](blocked_range<int> r)
+                         {
+                             for (auto i : r) m2(i) /= float(total_weight);
+                         });
+            spdlog::info("Writing variance image to '{}'.", variance_file);
+            m2.save(variance_file);
         }
     }
     catch (const std::exception &e)
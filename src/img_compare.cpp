@@ -12,6 +12,8 @@
 #include <CLI/CLI.hpp>
 #include <darts/common.h>
 #include <darts/image.h>
+#include <darts/parallel.h>
+#include <future>
 
 /**
  * Compares a test image to a reference image, outputs the difference, and exits with failure or success depending on
@@ -64,26 +66,39 @@ The default is 2 (info).)")
 
         spdlog::info("Comparing\n   test image:      {}\n   reference image: {}", test_filename, reference_filename);
 
-        Image3f test;
-        if (!test.load(test_filename))
-            throw DartsException("Cannot load test image!");
-        Image3f reference;
-        if (!reference.load(reference_filename))
-            throw DartsException("Cannot load reference image!");
+        // load both images concurrently
+        auto load = [](const string &filename, const char *what)
+        {
+            Image3f image;
+            if (!image.load(filename))
+                throw DartsException("Cannot load {} image!", what);
+            return image;
+        };
+        auto    loading_test = std::async(std::launch::async, load, test_filename, "test");
+        Image3f reference    = load(reference_filename, "reference");
+        Image3f test         = loading_test.get();
 
         if (test.width() != reference.width() || test.height() != reference.height())
             throw DartsException("Test image ({}x{}) and reference image ({}x{}) resolutions don't match!",
                                  test.width(), test.height(), reference.width(), reference.height());
 
-        Image3f diff(test.width(), test.height());
+        // compute the difference in parallel, summing each row separately so the result is deterministic
+        Image3f         diff(test.width(), test.height());
+        vector<Color3f> row_mad(test.height(), Color3f(0.f));
+        parallel_for(blocked_range<int>(0, test.height(), 16),
+                     [&](blocked_range<int> rows)
+                     {
+                         for (auto y : rows)
+                             for (auto x : range(test.width()))
+                             {
+                                 auto d = abs(test(x, y) - reference(x, y));
+                                 row_mad[y] += d;
+                                 diff(x, y) = d * multiplier;
+                             }
+                     });
+
         Color3f mad(0.f);
-        for (auto y : range(test.height()))
-            for (auto x : range(test.width()))
-            {
-                auto d = abs(test(x, y) - reference(x, y));
-                mad += d;
-                diff(x, y) = d * multiplier;
-            }
+        for (auto &m : row_mad) mad += m;
 
         mad /= diff.length();
 
@@ -0,0 +1,175 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+/**
+    \file
+    \brief Utility program to merge partial renderings (e.g. from different nodes of a cluster) into one image
+*/
+
+#include <CLI/CLI.hpp>
+#include <darts/array2d.h>
+#include <darts/box.h>
+#include <darts/common.h>
+#include <darts/image.h>
+#include <darts/json.h>
+#include <darts/parallel.h>
+#include <fstream>
+#include <future>
+
+/// An input image, along with the description of the rendering that darts saves next to it
+struct PartialImage
+{
+    string        filename;
+    Image3f       image;
+    Vec2i         resolution; ///< The resolution of the whole frame
+    Vec2i         offset;     ///< The position of #image within the frame
+    vector<Box2i> tiles;      ///< The rendered tiles, in frame coordinates
+    float         weight;     ///< The weight of each rendered pixel (its number of samples)
+};
+
+/// Load \p filename, and its description from <tt>filename.json</tt> if there is one
+PartialImage load_partial(const string &filename)
+{
+    PartialImage p;
+    p.filename = filename;
+    if (!p.image.load(filename))
+        throw DartsException("Cannot load image \"{}\".", filename);
+
+    // without a description, the image is a whole frame with unknown sample count
+    p.resolution = p.image.size();
+    p.offset     = Vec2i(0);
+    p.tiles      = {Box2i(Vec2i(0), p.image.size())};
+    p.weight     = 1.f;
+
+    std::ifstream stream(filename + ".json");
+    if (!stream.good())
+        return p;
+
+    json j       = json::parse(stream);
+    p.resolution = j.at("resolution").get<Vec2i>();
+    p.offset     = j.at("offset").get<Vec2i>();
+    p.weight     = j.at("spp").get<float>();
+    p.tiles.clear();
+    for (auto &t : j.at("tiles"))
+    {
+        auto c = t.get<vector<int>>();
+        if (c.size() != 4)
+            throw DartsException("Invalid tile in \"{}.json\": {}.", filename, t.dump());
+        p.tiles.emplace_back(Vec2i(c[0], c[1]), Vec2i(c[2], c[3]));
+    }
+
+    for (auto &tile : p.tiles)
+        if (!la::all(la::gequal(tile.min - p.offset, Vec2i(0))) ||
+            !la::all(la::lequal(tile.max - p.offset, p.image.size())))
+            throw DartsException("The tiles described in \"{}.json\" don't fit in the image.", filename);
+    return p;
+}
+
+/**
+    Merge partial renderings of a frame into one image.
+
+    Each pixel of the result is the average of the renderings that cover it, weighted by their number of samples per
+    pixel. The inputs are processed one at a time, loading the next input while the current one is accumulated, so
+    only two inputs are in memory at once.
+ */
+int main(int argc, char **argv)
+{
+    string         outfile;
+    vector<string> infiles;
+    int            verbosity = spdlog::get_level();
+
+    CLI::App app{"\nMerge partial renderings of a frame (e.g. rendered with darts --region, --tile-range, or different "
+                 "--seeds on the nodes of a cluster), weighting them by their samples per pixel.\n"
+                 "The description darts saves next to each image (in \"image.exr.json\") specifies which part of the "
+                 "frame the image covers, and with how many samples. Images without one cover the whole frame with "
+                 "equal weight."};
+
+    app.get_formatter()->column_width(35);
+
+    string save_formats = fmt::format("{}", fmt::join(Image3f::savable_formats(), ", "));
+
+    app.add_option("-o,--outfile", outfile,
+                   fmt::format("Specify the output image filename (extension must be one of: {})", save_formats))
+        ->required();
+    app.add_option("infiles", infiles, "The partial renderings to merge.")->required()->check(CLI::ExistingFile);
+    app.add_option("-v,--verbosity", verbosity,
+                   R"(Set verbosity threshold T with lower values meaning more verbose
+and higher values removing low-priority messages. All messages with
+severity >= T are displayed, where the severities are:
+    trace    = 0
+    debug    = 1
+    info     = 2
+    warn     = 3
+    err      = 4
+    critical = 5
+    off      = 6
+The default is 2 (info).)")
+        ->check(CLI::Range(0, 6));
+
+    try
+    {
+        CLI11_PARSE(app, argc, argv);
+
+        darts_init(verbosity);
+
+        spdlog::info("Merging {} images.", infiles.size());
+
+        Image3f        sum;
+        Array2d<float> weights;
+
+        auto next = std::async(std::launch::async, load_partial, infiles[0]);
+        for (size_t i = 0; i < infiles.size(); ++i)
+        {
+            PartialImage p = next.get();
+            if (i + 1 < infiles.size())
+                next = std::async(std::launch::async, load_partial, infiles[i + 1]);
+
+            if (i == 0)
+            {
+                sum     = Image3f(p.resolution.x, p.resolution.y, Color3f(0.f));
+                weights = Array2d<float>(p.resolution.x, p.resolution.y, 0.f);
+            }
+            else if (p.resolution != sum.size())
+                throw DartsException("Frame resolutions don't match. \"{}\" : ({}x{}) vs. \"{}\" ({}x{}).", infiles[0],
+                                     sum.width(), sum.height(), p.filename, p.resolution.x, p.resolution.y);
+
+            spdlog::info("Adding \"{}\" ({} tiles, weight {}).", p.filename, p.tiles.size(), p.weight);
+            for (auto &tile : p.tiles)
+                parallel_for(blocked_range<int>(tile.min.y, tile.max.y, 16),
+                             [&](blocked_range<int> rows)
+                             {
+                                 for (auto y : rows)
+                                     for (int x = tile.min.x; x < tile.max.x; ++x)
+                                     {
+                                         sum(x, y) += p.weight * p.image(x - p.offset.x, y - p.offset.y);
+                                         weights(x, y) += p.weight;
+                                     }
+                             });
+        }
+
+        int64_t missing = 0;
+        for (int i = 0; i < sum.length(); ++i)
+        {
+            if (weights(i) > 0.f)
+                sum(i) /= weights(i);
+            else
+                ++missing;
+        }
+        if (missing)
+            spdlog::warn("{} pixels are not covered by any of the images, leaving them black.", missing);
+
+        spdlog::info("Writing merged image to '{}'.", outfile);
+        if (!sum.save(outfile))
+            throw DartsException("Could not write image file \"{}\".", outfile);
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::error("{}", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
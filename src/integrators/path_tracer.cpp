@@ -0,0 +1,810 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/environment.h>
+#include <darts/integrator.h>
+#include <darts/materials.h>
+#include <darts/medium.h>
+#include <darts/sampling.h>
+#include <darts/scene.h>
+#include <darts/scratch.h>
+#include <darts/stats.h>
+#include <algorithm>
+#include <memory>
+
+STAT_INT_DISTRIBUTION("Integrator/Path length", path_length);
+STAT_PERCENT("Integrator/Paths terminated by Russian roulette", num_rr_terminations, num_paths);
+STAT_RATIO("Integrator/Paths per wavefront", num_wavefront_paths, num_wavefronts);
+STAT_PERCENT("Integrator/Occluded light samples", num_occluded_light_samples, num_light_samples);
+STAT_COUNTER("Integrator/Secondary rays sorted before tracing", num_sorted_rays);
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// Spread the lowest 9 bits of \p x apart, so that there are two zero bits between each of them
+uint32_t spread_bits(uint32_t x)
+{
+    x &= 0x1ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+/**
+    A 30-bit key that orders rays by the octant of their direction, and then by the Morton code of their origin within
+    \p bounds (quantized to 9 bits per axis).
+*/
+uint32_t ray_sort_key(const Ray3f &ray, const Box3f &bounds)
+{
+    Vec3f    extent = la::max(bounds.diagonal(), Vec3f(1e-20f));
+    uint32_t morton = 0;
+    for (int a = 0; a < 3; ++a)
+    {
+        float p = std::clamp((ray.o[a] - bounds.min[a]) / extent[a], 0.f, 1.f);
+        morton |= spread_bits(uint32_t(p * 511.f)) << a;
+    }
+    uint32_t octant = uint32_t(ray.d.x < 0.f) | uint32_t(ray.d.y < 0.f) << 1 | uint32_t(ray.d.z < 0.f) << 2;
+    return octant << 27 | morton;
+}
+
+} // namespace
+
+/**
+    An iterative path tracer that relies on the #Material::scatter() function of the materials.
+
+    Unlike Scene::recursive_color(), the path is traced in a loop, so the cost of a bounce does not grow with the path
+    length. After \c "rr_depth" bounces, paths are randomly terminated with a probability based on their throughput
+    (Russian roulette), and the throughput of the surviving paths is reweighted to keep the estimate unbiased.
+
+    Parameters:
+    - \c "max_bounces": the maximum number of bounces (default: 64)
+    - \c "rr_depth": the number of bounces before Russian roulette starts (default: 5; negative values disable it)
+    - \c "rr_max_prob": the maximum probability of a path surviving a roulette step (default: 0.95)
+
+    \ingroup Integrators
+*/
+class PathTracer : public Integrator
+{
+public:
+    PathTracer(const json &j = json::object());
+
+    Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const override;
+
+protected:
+    /// Randomly terminate a path after \p bounces bounces based on its \p throughput, reweighting survivors
+    bool roulette(Color3f &throughput, int bounces, Sampler &sampler) const
+    {
+        if (m_rr_depth < 0 || bounces < m_rr_depth)
+            return true;
+
+        float survival = std::min(maxelem(throughput), m_rr_max_prob);
+        if (sampler.next1f() >= survival)
+        {
+            ++num_rr_terminations;
+            return false;
+        }
+        throughput /= survival;
+        return true;
+    }
+
+    int   m_max_bounces = 64;
+    int   m_rr_depth    = 5;
+    float m_rr_max_prob = 0.95f;
+};
+
+PathTracer::PathTracer(const json &j) : Integrator(j)
+{
+    m_max_bounces = j.value("max_bounces", m_max_bounces);
+    m_rr_depth    = j.value("rr_depth", m_rr_depth);
+    m_rr_max_prob = j.value("rr_max_prob", m_rr_max_prob);
+
+    if (m_max_bounces < 0)
+        throw DartsException("'max_bounces' must not be negative, got {}.", m_max_bounces);
+    if (m_rr_max_prob <= 0.f || m_rr_max_prob > 1.f)
+        throw DartsException("'rr_max_prob' must be in (0, 1], got {}.", m_rr_max_prob);
+
+    // only the wavefront path tracer holds a wave of rays to sort, the others trace each path to completion
+    if (j.value("sort_rays", false) && j.value("type", "") != "wavefront_path_tracer")
+        spdlog::warn("Only the \"wavefront_path_tracer\" sorts its rays, ignoring 'sort_rays'.");
+}
+
+Color3f PathTracer::Li(const Scene &scene, Sampler &sampler, const Ray3f &ray_, AOVSample *aov) const
+{
+    Color3f radiance(0.f), throughput(1.f);
+    Ray3f   ray = ray_;
+    HitInfo hit;
+
+    ++num_paths;
+    int bounces = 0;
+    for (;; ++bounces)
+    {
+        bool found = scene.intersect(ray, hit);
+        if (aov && bounces == 0)
+            aov->record(ray, found ? &hit : nullptr);
+        if (!found)
+        {
+            radiance += throughput * scene.background(ray);
+            break;
+        }
+
+        // call the built-in materials without virtual calls
+        Color3f attenuation;
+        Ray3f   scattered;
+        bool    scatters = dispatch(hit.mat,
+                                    [&](auto mat)
+                                    {
+                                        radiance += throughput * mat->emitted(ray, hit);
+                                        if (bounces >= m_max_bounces ||
+                                            !mat->scatter(ray, hit, attenuation, scattered, sampler))
+                                            return false;
+                                        scattered.continue_footprint(ray, hit.t, mat->footprint_spread(hit));
+                                        return true;
+                                    });
+        if (!scatters)
+            break;
+        throughput *= attenuation;
+
+        // randomly terminate paths that carry little energy
+        if (!roulette(throughput, bounces, sampler))
+            break;
+
+        ray      = scattered;
+        ray.time = ray_.time; // the whole path travels at the time of the camera ray
+    }
+
+    path_length << bounces;
+    return radiance;
+}
+
+/**
+    A wavefront version of #PathTracer, which advances a whole batch of paths one bounce at a time.
+
+    Instead of tracing each path to completion, each bounce is split into stages that run over all active paths:
+    first all rays of the wave are intersected with the scene, then the hits are sorted by material so that each
+    material scatters a contiguous bucket of paths, and finally the surviving paths are compacted into the next
+    wave. This gives the traversal coherent batches of rays, and the calls into the materials of a bucket (see
+    #dispatch()) take the same branches.
+
+    The secondary rays of a wave are incoherent, so with \c "sort_rays" they are first reordered by the octant of their
+    direction and the Morton code of their origin. Consecutive rays then tend to traverse the same BBH nodes and test
+    the same primitives, which are still in cache from the previous ray. This pays off in scenes whose nodes and
+    meshes don't fit in the caches, and costs a sort of each wave in small ones. The other path tracers trace one path
+    at a time and have no such wave; sorting their rays would mean queueing them per tile and bounce, which is what
+    this integrator does.
+
+    It accepts the same parameters as #PathTracer, plus \c "batch_size", the number of camera rays per batch
+    (default: 4096), and \c "sort_rays" (default: false). The estimate is identical to the one of #PathTracer.
+
+    \ingroup Integrators
+*/
+class WavefrontPathTracer : public PathTracer
+{
+public:
+    WavefrontPathTracer(const json &j = json::object()) : PathTracer(j)
+    {
+        m_batch_size = j.value("batch_size", m_batch_size);
+        m_sort_rays  = j.value("sort_rays", m_sort_rays);
+        if (m_batch_size <= 0)
+            throw DartsException("'batch_size' must be positive, got {}.", m_batch_size);
+    }
+
+    int batch_size() const override
+    {
+        return m_batch_size;
+    }
+
+    void Li_batch(const Scene &scene, const vector<Sampler *> &samplers, const vector<Ray3f> &rays,
+                  vector<Color3f> &radiance, vector<AOVSample> *aovs = nullptr) const override;
+
+protected:
+    /// Intersect the (coherent) first \p n of \p rays with the scene in packets of consecutive rays
+    static void intersect_primary(const Scene &scene, const Ray3f *rays, size_t n, HitInfo *hits, uint8_t *found)
+    {
+        bool packet_found[Surface::max_packet_size];
+        for (size_t begin = 0; begin < n; begin += Surface::max_packet_size)
+        {
+            int count = int(std::min(n - begin, size_t(Surface::max_packet_size)));
+            scene.intersect_packet(&rays[begin], &hits[begin], packet_found, count);
+            for (int i = 0; i < count; ++i) found[begin + i] = packet_found[i];
+        }
+    }
+
+    /// Reorder the \p num_active paths \p active so that their rays (see #ray_sort_key()) are traced coherently
+    static void sort_rays(const Ray3f *ray, uint32_t *active, size_t num_active, const Box3f &bounds)
+    {
+        // sort the keys along with the path indices in their lower bits
+        ScratchArena::Scope scratch;
+        uint64_t           *keys = scratch.arena.alloc<uint64_t>(num_active);
+        for (size_t k = 0; k < num_active; ++k)
+            keys[k] = uint64_t(ray_sort_key(ray[active[k]], bounds)) << 32 | active[k];
+        std::sort(keys, keys + num_active);
+        for (size_t k = 0; k < num_active; ++k) active[k] = uint32_t(keys[k]);
+        num_sorted_rays += num_active;
+    }
+
+    int  m_batch_size = 4096;
+    bool m_sort_rays  = false;
+};
+
+void WavefrontPathTracer::Li_batch(const Scene &scene, const vector<Sampler *> &samplers, const vector<Ray3f> &rays,
+                                   vector<Color3f> &radiance, vector<AOVSample> *aovs) const
+{
+    size_t n = rays.size();
+    radiance.assign(n, Color3f(0.f));
+
+    // the state of all paths, indexed by the index of their camera ray. It lives in the thread's scratch arena, so
+    // rendering batch after batch doesn't allocate
+    ScratchArena::Scope scratch;
+    Ray3f              *ray        = scratch.arena.alloc<Ray3f>(n);
+    Color3f            *throughput = scratch.arena.alloc<Color3f>(n);
+    HitInfo            *hit        = scratch.arena.alloc<HitInfo>(n);
+    uint8_t            *found      = scratch.arena.alloc<uint8_t>(n);
+    std::uninitialized_copy(rays.begin(), rays.end(), ray);
+    std::uninitialized_fill_n(hit, n, HitInfo());
+    std::uninitialized_fill_n(throughput, n, Color3f(1.f));
+
+    // indices of the paths that are still being traced, and of those hitting a surface in the current wave
+    uint32_t *active = scratch.arena.alloc<uint32_t>(n), *hits = scratch.arena.alloc<uint32_t>(n);
+    size_t    num_active = n, num_hits = 0;
+    for (uint32_t i = 0; i < n; ++i) active[i] = i;
+    num_paths += n;
+
+    for (int bounces = 0; num_active > 0; ++bounces)
+    {
+        ++num_wavefronts;
+        num_wavefront_paths += num_active;
+
+        // stage 1: intersect the whole wave with the scene, and retire the paths escaping to the background
+        if (bounces == 0)
+        {
+            intersect_primary(scene, ray, n, hit, found);
+            if (aovs)
+                for (size_t i = 0; i < n; ++i) (*aovs)[i].record(ray[i], found[i] ? &hit[i] : nullptr);
+        }
+        else
+        {
+            if (m_sort_rays)
+                sort_rays(ray, active, num_active, scene.bounds());
+            for (size_t k = 0; k < num_active; ++k)
+            {
+                uint32_t i = active[k];
+                found[i]   = scene.intersect(ray[i], hit[i]);
+            }
+        }
+
+        num_hits = 0;
+        for (size_t k = 0; k < num_active; ++k)
+        {
+            uint32_t i = active[k];
+            if (found[i])
+                hits[num_hits++] = i;
+            else
+            {
+                radiance[i] += throughput[i] * scene.background(ray[i]);
+                path_length << bounces;
+            }
+        }
+
+        // stage 2: group the hits by material (and the materials by type), so each material processes a coherent
+        // bucket of paths
+        std::sort(hits, hits + num_hits,
+                  [hit](uint32_t a, uint32_t b)
+                  {
+                      const Material *ma = hit[a].mat, *mb = hit[b].mat;
+                      return ma->type() != mb->type() ? ma->type() < mb->type() : std::less<const Material *>()(ma, mb);
+                  });
+
+        // stage 3: accumulate emission, scatter, and compact the surviving paths into the next wave
+        num_active = 0;
+        for (size_t k = 0; k < num_hits; ++k)
+        {
+            uint32_t i = hits[k];
+
+            Color3f attenuation;
+            Ray3f   scattered;
+            bool    scatters = dispatch(hit[i].mat,
+                                        [&](auto mat)
+                                        {
+                                            radiance[i] += throughput[i] * mat->emitted(ray[i], hit[i]);
+                                            if (bounces >= m_max_bounces ||
+                                                !mat->scatter(ray[i], hit[i], attenuation, scattered, *samplers[i]))
+                                                return false;
+                                            scattered.continue_footprint(ray[i], hit[i].t,
+                                                                         mat->footprint_spread(hit[i]));
+                                            return true;
+                                        });
+            if (scatters)
+            {
+                throughput[i] *= attenuation;
+                if (roulette(throughput[i], bounces, *samplers[i]))
+                {
+                    scattered.time       = ray[i].time;
+                    ray[i]               = scattered;
+                    active[num_active++] = i;
+                    continue;
+                }
+            }
+            path_length << bounces;
+        }
+    }
+}
+
+/**
+    A path tracer that combines next-event estimation with BSDF sampling using multiple importance sampling.
+
+    At every non-specular vertex, one direction is sampled towards the lights (the emissive surfaces of the scene,
+    chosen with Scene::sample_emitter(), or the environment map) and tested for visibility with a shadow ray, and one
+    direction is sampled from the material to continue the path. Light reached by either strategy is weighted with
+    the power heuristic, so small emitters are found by light sampling while glossy reflections of large ones are
+    still found by BSDF sampling. Specular bounces can't be light sampled, so emission seen through them is counted
+    in full.
+
+    This relies on the Material::sample(), Material::eval() and Material::pdf() functions of the materials, as well
+    as on Surface::sample() and Surface::pdf() of the emitters. It accepts the same parameters as #PathTracer.
+
+    \ingroup Integrators
+*/
+class PathTracerMIS : public PathTracer
+{
+public:
+    PathTracerMIS(const json &j = json::object()) : PathTracer(j)
+    {
+    }
+
+    Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const override;
+
+protected:
+    /// The probability of sampling the environment map instead of the emissive surfaces: half, if there are both
+    static float environment_prob(const Scene &scene)
+    {
+        return scene.environment() ? (scene.is_emissive() ? 0.5f : 1.f) : 0.f;
+    }
+
+    /**
+        Estimate the light reflected along \p ray at \p hit by sampling a light and tracing a shadow ray.
+
+        \param env_prob    The probability of sampling the environment map instead of the emissive surfaces
+        \param visibility  Returns the transmittance along a shadow ray (black if the ray is occluded)
+        \return            The MIS-weighted reflected radiance (without the throughput of the path)
+    */
+    template <typename M, typename Visibility>
+    Color3f sample_light(const Scene &scene, Sampler &sampler, const Ray3f &ray, const HitInfo &hit, const M *mat,
+                         float env_prob, const Visibility &visibility) const;
+};
+
+template <typename M, typename Visibility>
+Color3f PathTracerMIS::sample_light(const Scene &scene, Sampler &sampler, const Ray3f &ray, const HitInfo &hit,
+                                    const M *mat, float env_prob, const Visibility &visibility) const
+{
+    float rv1 = sampler.next1f();
+    Vec2f rv  = sampler.next2f();
+
+    // choose between the environment and the emissive surfaces, and reuse rv1 to choose among the latter
+    EmitterRecord rec(hit.p);
+    Color3f       Le;
+    float         light_prob;
+    if (rv1 < env_prob)
+    {
+        Le         = scene.environment()->sample(rec, rv);
+        light_prob = env_prob;
+    }
+    else
+    {
+        rv1                  = (rv1 - env_prob) / (1.f - env_prob);
+        auto [emitter, prob] = scene.sample_emitter(rv1);
+        if (!emitter)
+            return Color3f(0.f);
+        Le         = emitter->sample(rec, rv);
+        light_prob = (1.f - env_prob) * prob;
+    }
+    if (light_prob == 0.f || rec.pdf == 0.f || maxelem(Le) <= 0.f)
+        return Color3f(0.f);
+
+    Color3f f = mat->eval(ray.d, rec.wi, hit);
+    if (maxelem(f) <= 0.f)
+        return Color3f(0.f);
+
+    ++num_light_samples;
+    Color3f Tr = visibility(Ray3f(hit.p, rec.wi, Ray3f::epsilon, (1.f - Ray3f::epsilon) * rec.hit.t, ray.time));
+    if (maxelem(Tr) <= 0.f)
+    {
+        ++num_occluded_light_samples;
+        return Color3f(0.f);
+    }
+
+    // Le is already divided by the density of the sample on the chosen light
+    float light_pdf = light_prob * rec.pdf;
+    return f * Tr * Le / light_prob * power_heuristic(light_pdf, mat->pdf(ray.d, rec.wi, hit));
+}
+
+Color3f PathTracerMIS::Li(const Scene &scene, Sampler &sampler, const Ray3f &ray_, AOVSample *aov) const
+{
+    const Environment *env       = scene.environment();
+    float              env_prob  = environment_prob(scene);
+    bool               has_light = env || scene.is_emissive();
+
+    // without media, shadow rays are either blocked or not
+    auto unoccluded = [&](const Ray3f &shadow) { return Color3f(scene.occluded(shadow) ? 0.f : 1.f); };
+
+    Color3f radiance(0.f), throughput(1.f);
+    Ray3f   ray = ray_;
+    HitInfo hit;
+    float   bsdf_pdf = 0.f;  // the density with which the previous vertex sampled ray.d
+    bool    specular = true; // whether ray.d couldn't have been light sampled (a camera ray or a specular bounce)
+
+    ++num_paths;
+    int bounces = 0;
+    for (;; ++bounces)
+    {
+        bool found = scene.intersect(ray, hit);
+        if (aov && bounces == 0)
+            aov->record(ray, found ? &hit : nullptr);
+        if (!found)
+        {
+            float weight = specular || !env ? 1.f : power_heuristic(bsdf_pdf, env_prob * env->pdf(ray.d));
+            radiance += throughput * weight * scene.background(ray);
+            break;
+        }
+
+        // call the built-in materials without virtual calls
+        bool scatters = dispatch(hit.mat,
+                                 [&](auto mat)
+                                 {
+                                     if (mat->is_emissive())
+                                     {
+                                         float weight =
+                                             specular ? 1.f
+                                                      : power_heuristic(bsdf_pdf,
+                                                                        (1.f - env_prob) * scene.pdf(ray.o, ray.d));
+                                         radiance += throughput * weight * mat->emitted(ray, hit);
+                                     }
+                                     if (bounces >= m_max_bounces)
+                                         return false;
+
+                                     ScatterRecord srec;
+                                     Vec2f         rv  = sampler.next2f();
+                                     float         rv1 = sampler.next1f();
+                                     if (!mat->sample(ray.d, hit, srec, rv, rv1))
+                                         return false;
+
+                                     if (srec.is_specular)
+                                     {
+                                         throughput *= srec.attenuation;
+                                         bsdf_pdf = 0.f;
+                                     }
+                                     else
+                                     {
+                                         if (has_light)
+                                             radiance += throughput * sample_light(scene, sampler, ray, hit, mat,
+                                                                                   env_prob, unoccluded);
+
+                                         bsdf_pdf = mat->pdf(ray.d, srec.wo, hit);
+                                         if (bsdf_pdf == 0.f)
+                                             return false;
+                                         throughput *= mat->eval(ray.d, srec.wo, hit) / bsdf_pdf;
+                                     }
+                                     specular = srec.is_specular;
+
+                                     Ray3f scattered(hit.p, srec.wo);
+                                     scattered.continue_footprint(ray, hit.t, mat->footprint_spread(hit));
+                                     scattered.time = ray.time; // the whole path travels at the time of the camera ray
+                                     ray            = scattered;
+                                     return true;
+                                 });
+        if (!scatters)
+            break;
+
+        // randomly terminate paths that carry little energy
+        if (!roulette(throughput, bounces, sampler))
+            break;
+    }
+
+    path_length << bounces;
+    return radiance;
+}
+
+/**
+    The media that a path is inside of, which are updated whenever the path crosses the surface of a medium.
+
+    Each Material can specify the Material::medium filling the inside of its surfaces. Entering such a surface pushes
+    its medium onto the stack, and leaving it removes the medium again, so nested and overlapping media (e.g. smoke
+    inside a glass) are tracked correctly as long as their surfaces are closed. The bottom of the stack is the medium
+    surrounding the camera.
+*/
+struct MediumStack
+{
+    /// Media nested deeper than this are ignored
+    static constexpr int max_depth = 8;
+
+    MediumStack(const Medium *outer)
+    {
+        if (outer)
+            media[size++] = outer;
+    }
+
+    /// The medium the path currently travels through, or nullptr for vacuum
+    const Medium *current() const
+    {
+        return size > 0 ? media[size - 1] : nullptr;
+    }
+
+    /// Update the stack for a path arriving at \p hit along \p wi and leaving along \p wo
+    void cross(const HitInfo &hit, const Vec3f &wi, const Vec3f &wo)
+    {
+        const Medium *medium = hit.mat->medium.get();
+        float         cos_i = dot(wi, hit.gn), cos_o = dot(wo, hit.gn);
+        // reflections stay on the same side of the surface
+        if (!medium || cos_i * cos_o <= 0.f)
+            return;
+
+        if (cos_o < 0.f)
+        {
+            if (size < max_depth)
+                media[size++] = medium;
+            return;
+        }
+        for (int i = size - 1; i >= 0; --i)
+            if (media[i] == medium)
+            {
+                std::copy(media + i + 1, media + size, media + i);
+                --size;
+                return;
+            }
+    }
+
+    const Medium *media[max_depth];
+    int           size = 0;
+};
+
+/**
+    A volumetric path tracer, which extends #PathTracerMIS to paths scattering inside participating media.
+
+    The path keeps track of the medium it travels through in a #MediumStack. Within a medium, the distance to the next
+    collision is sampled with Medium::sample_free_flight() in a single (hero) color channel, chosen at random for each
+    path. At each collision, the path is absorbed, scattered by the medium's phase function, or continues unchanged
+    (a null collision), with probabilities given by the coefficients of the hero channel. The path's contribution is
+    divided by the average of the probabilities of its samples in all three channels (spectral MIS), so chromatic
+    media don't cause color noise.
+
+    Next-event estimation happens at surface and medium vertices alike. Its shadow rays pass through the surfaces of
+    materials that only mark the boundary of a medium, and are attenuated with Medium::total_transmittance() (ratio
+    tracking) in each medium along the way.
+
+    It accepts the same parameters as #PathTracer, where \c "max_bounces" counts scattering events both at surfaces
+    and in media.
+
+    \ingroup Integrators
+*/
+class VolumePathTracer : public PathTracerMIS
+{
+public:
+    VolumePathTracer(const json &j = json::object()) : PathTracerMIS(j)
+    {
+    }
+
+    Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const override;
+
+protected:
+    /// The transmittance along the shadow ray \p ray starting within \p media, or black if a surface blocks it
+    Color3f transmittance(const Scene &scene, Ray3f ray, MediumStack media, Sampler &sampler) const;
+};
+
+Color3f VolumePathTracer::transmittance(const Scene &scene, Ray3f ray, MediumStack media, Sampler &sampler) const
+{
+    Color3f Tr(1.f);
+    HitInfo hit;
+    while (true)
+    {
+        bool found = scene.intersect(ray, hit);
+        if (found && !hit.mat->is_boundary())
+            return Color3f(0.f);
+
+        if (const Medium *medium = media.current())
+            Tr *= medium->total_transmittance(Ray3f(ray, ray.mint, found ? hit.t : ray.maxt), sampler);
+        if (!found || maxelem(Tr) <= 0.f)
+            return Tr;
+
+        // continue on the other side of the boundary
+        media.cross(hit, ray.d, ray.d);
+        ray = Ray3f(hit.p, ray.d, Ray3f::epsilon, ray.maxt - hit.t, ray.time);
+    }
+}
+
+Color3f VolumePathTracer::Li(const Scene &scene, Sampler &sampler, const Ray3f &ray_, AOVSample *aov) const
+{
+    const Environment *env       = scene.environment();
+    float              env_prob  = environment_prob(scene);
+    bool               has_light = env || scene.is_emissive();
+
+    Color3f     radiance(0.f), throughput(1.f);
+    Color3f     channel_pdf(1.f); // the relative density of the path's samples in each channel, normalized to mean 1
+    int         channel = std::min(int(sampler.next1f() * 3), 2); // the hero channel that distances are sampled in
+    MediumStack media(scene.medium());
+    Ray3f       ray = ray_;
+    HitInfo     hit;
+    Vec3f       vertex   = ray.o; // the last scattering vertex, where ray.d was sampled
+    float       bsdf_pdf = 0.f;   // the density with which that vertex sampled ray.d
+    bool        specular = true;  // whether ray.d couldn't have been light sampled
+
+    // fold the change of the path's contribution f and of its densities p into the throughput
+    auto weigh = [&](const Color3f &f, const Color3f &p)
+    {
+        channel_pdf *= p;
+        float mean = (channel_pdf.x + channel_pdf.y + channel_pdf.z) / 3.f;
+        throughput  = mean > 0.f ? throughput * f / mean : Color3f(0.f);
+        channel_pdf = mean > 0.f ? channel_pdf / mean : Color3f(0.f);
+    };
+
+    ++num_paths;
+    int bounces = 0;
+    while (true)
+    {
+        bool found = scene.intersect(ray, hit);
+        if (aov && !aov->recorded)
+            aov->record(ray, found ? &hit : nullptr);
+
+        // track through the current medium, until the path scatters in it or reaches the surface
+        HitInfo       mhit;
+        const Medium *medium    = media.current();
+        bool          scattered = false;
+        while (medium && !scattered)
+        {
+            Color3f f(1.f), p(1.f);
+            if (!medium->sample_free_flight(Ray3f(ray, ray.mint, found ? hit.t : ray.maxt), channel, sampler, mhit,
+                                            f, p))
+            {
+                weigh(f, p);
+                break;
+            }
+            weigh(f, p);
+
+            // choose the type of the collision in the hero channel
+            auto [sigma_a, sigma_s, sigma_n] = medium->coeffs(mhit.p);
+            Color3f majorant                 = sigma_a + sigma_s + sigma_n;
+            float   rv                       = sampler.next1f() * majorant[channel];
+            if (rv < sigma_a[channel])
+            {
+                path_length << bounces;
+                return radiance;
+            }
+            scattered = rv < sigma_a[channel] + sigma_s[channel];
+            Color3f sigma = scattered ? sigma_s : sigma_n;
+            weigh(sigma, sigma / majorant);
+
+            // null collisions continue along the same ray, whose closest surface hit stays the same
+            ray = Ray3f(ray, mhit.t, ray.maxt);
+        }
+        if (maxelem(throughput) <= 0.f)
+            break;
+
+        if (scattered)
+        {
+            if (bounces >= m_max_bounces)
+                break;
+
+            const Material *phase = medium->phase_function.get();
+            mhit.mat              = phase;
+            auto visibility       = [&](const Ray3f &shadow) { return transmittance(scene, shadow, media, sampler); };
+            if (has_light)
+                radiance += throughput * sample_light(scene, sampler, ray, mhit, phase, env_prob, visibility);
+
+            ScatterRecord srec;
+            Vec2f         rv  = sampler.next2f();
+            float         rv1 = sampler.next1f();
+            if (!phase->sample(ray.d, mhit, srec, rv, rv1))
+                break;
+            bsdf_pdf = phase->pdf(ray.d, srec.wo, mhit);
+            if (bsdf_pdf == 0.f)
+                break;
+            throughput *= phase->eval(ray.d, srec.wo, mhit) / bsdf_pdf;
+            specular = false;
+            vertex   = mhit.p;
+
+            Ray3f next(mhit.p, srec.wo);
+            next.continue_footprint(ray, mhit.t, phase->footprint_spread(mhit));
+            next.time = ray.time;
+            ray       = next;
+
+            if (!roulette(throughput, bounces, sampler))
+                break;
+            ++bounces;
+            continue;
+        }
+
+        if (!found)
+        {
+            float weight = specular || !env ? 1.f : power_heuristic(bsdf_pdf, env_prob * env->pdf(ray.d));
+            radiance += throughput * weight * scene.background(ray);
+            break;
+        }
+
+        // pass straight through the boundaries of media
+        if (hit.mat->is_boundary())
+        {
+            media.cross(hit, ray.d, ray.d);
+            ray = Ray3f(hit.p, ray.d, Ray3f::epsilon, Ray3f::infinity, ray.time);
+            continue;
+        }
+
+        // call the built-in materials without virtual calls
+        bool scatters = dispatch(hit.mat,
+                                 [&](auto mat)
+                                 {
+                                     if (mat->is_emissive())
+                                     {
+                                         float weight =
+                                             specular ? 1.f
+                                                      : power_heuristic(bsdf_pdf,
+                                                                        (1.f - env_prob) * scene.pdf(vertex, ray.d));
+                                         radiance += throughput * weight * mat->emitted(ray, hit);
+                                     }
+                                     if (bounces >= m_max_bounces)
+                                         return false;
+
+                                     ScatterRecord srec;
+                                     Vec2f         rv  = sampler.next2f();
+                                     float         rv1 = sampler.next1f();
+                                     if (!mat->sample(ray.d, hit, srec, rv, rv1))
+                                         return false;
+
+                                     if (srec.is_specular)
+                                     {
+                                         throughput *= srec.attenuation;
+                                         bsdf_pdf = 0.f;
+                                     }
+                                     else
+                                     {
+                                         // shadow rays leaving through the surface start in the media behind it
+                                         auto visibility = [&](const Ray3f &shadow)
+                                         {
+                                             MediumStack shadow_media = media;
+                                             shadow_media.cross(hit, ray.d, shadow.d);
+                                             return transmittance(scene, shadow, shadow_media, sampler);
+                                         };
+                                         if (has_light)
+                                             radiance += throughput * sample_light(scene, sampler, ray, hit, mat,
+                                                                                   env_prob, visibility);
+
+                                         bsdf_pdf = mat->pdf(ray.d, srec.wo, hit);
+                                         if (bsdf_pdf == 0.f)
+                                             return false;
+                                         throughput *= mat->eval(ray.d, srec.wo, hit) / bsdf_pdf;
+                                     }
+                                     specular = srec.is_specular;
+                                     vertex   = hit.p;
+                                     media.cross(hit, ray.d, srec.wo);
+
+                                     Ray3f next(hit.p, srec.wo);
+                                     next.continue_footprint(ray, hit.t, mat->footprint_spread(hit));
+                                     next.time = ray.time; // the whole path travels at the time of the camera ray
+                                     ray       = next;
+                                     return true;
+                                 });
+        if (!scatters)
+            break;
+
+        // randomly terminate paths that carry little energy
+        if (!roulette(throughput, bounces, sampler))
+            break;
+        ++bounces;
+    }
+
+    path_length << bounces;
+    return radiance;
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, PathTracer, "path_tracer")
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, WavefrontPathTracer, "wavefront_path_tracer")
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, PathTracerMIS, "path_tracer_mis")
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, VolumePathTracer, "volume_path_tracer")
+
+/**
+    \file
+    \brief PathTracer, WavefrontPathTracer, PathTracerMIS, and VolumePathTracer Integrators
+*/
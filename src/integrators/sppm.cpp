@@ -0,0 +1,625 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/cache.h>
+#include <darts/integrator.h>
+#include <darts/parallel.h>
+#include <darts/photon.h>
+#include <darts/progress.h>
+#include <darts/sampling.h>
+#include <darts/scene.h>
+#include <darts/stats.h>
+
+STAT_COUNTER("Integrator/SPPM photons traced", num_traced_photons);
+STAT_RATIO("Integrator/SPPM photons stored per traced photon", num_stored_photons, num_emitted_photons);
+STAT_RATIO("Integrator/SPPM photons gathered per visible point", num_gathered_photons, num_visible_points);
+STAT_MEMORY_COUNTER("Memory/SPPM pixels and photon map", sppm_memory);
+STAT_TIMER("Time/Rendering/SPPM camera paths", camera_path_time);
+STAT_TIMER("Time/Rendering/SPPM photon tracing", photon_trace_time);
+STAT_TIMER("Time/Rendering/SPPM photon gathering", gather_time);
+STAT_COUNTER("Integrator/Photon mapper radiance photons", num_radiance_photons);
+STAT_PERCENT("Integrator/Photon mapper gather rays finding a radiance photon", num_radiance_lookups_found,
+             num_radiance_lookups);
+STAT_TIMER("Time/Rendering/Photon mapper radiance photon precomputation", radiance_photon_time);
+STAT_TIMER("Time/Rendering/Photon mapper final gather", final_gather_time);
+
+/**
+    Stochastic progressive photon mapping, following Hachisuka and Jensen's "Stochastic Progressive Photon Mapping"
+    (SIGGRAPH Asia 2009).
+
+    Each iteration first traces one camera path per pixel through specular bounces, and records a *visible point* where
+    it reaches a non-specular surface. It then traces a fixed number of photons from the emitters into a photon map,
+    and gathers the photons around each visible point. Every pixel keeps its own gather radius, which shrinks as
+    photons accumulate, so the estimate converges to the correct solution as the number of iterations grows. The photon
+    map of an iteration is discarded before the next one, so memory use stays constant no matter how many photons are
+    traced in total.
+
+    The photons of an iteration are traced in parallel blocks, each seeded by the iteration and block index, so the
+    result does not depend on the number of threads, and different iterations could just as well be traced on
+    different machines.
+
+    The number of iterations is the number of samples per pixel of the scene.
+
+    Parameters:
+    - \c "photons_per_pass": the number of photons traced in each iteration (default: 100000)
+    - \c "radius": the initial gather radius (default: 0 to use 1/500th of the diagonal of the scene's bounds)
+    - \c "alpha": the fraction of new photons kept in each iteration, which controls how quickly the radii shrink
+      (default: 2/3)
+    - \c "max_bounces": the maximum number of bounces of camera and photon paths (default: 16)
+    - \c "rr_depth": the number of bounces before photons are terminated by Russian roulette (default: 3; negative
+      values disable it)
+    - \c "photon_index": the spatial index used to gather the photons: \c "kdtree" (a #PhotonMap, the default) or
+      \c "hash_grid" (a #PhotonHashGrid with cells the size of the largest radius, which is much cheaper to rebuild
+      in each iteration)
+
+    \note Only emitters that support Surface::sample_area() (quads, spheres and triangles) emit photons. Emission from
+    the background is only seen directly and through specular bounces.
+
+    \ingroup Integrators
+*/
+class SPPM : public Integrator
+{
+public:
+    SPPM(const json &j = json::object());
+
+    Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const override
+    {
+        throw DartsException("The 'sppm' integrator can only render whole images.");
+    }
+
+    bool renders_image() const override
+    {
+        return true;
+    }
+
+    Image3f render(const Scene &scene) const override;
+
+protected:
+    /// The state of a pixel, which persists across iterations, along with its visible point in the current one
+    struct Pixel
+    {
+        float   radius = 0.f;          ///< The current gather radius
+        float   N      = 0.f;          ///< The accumulated (fractional) number of photons
+        Color3f tau    = Color3f(0.f); ///< The accumulated flux, scaled to the current radius
+        Color3f Ld     = Color3f(0.f); ///< The sum of the emission seen directly along the camera paths
+
+        HitInfo hit;                 ///< The visible point of the current iteration
+        Vec3f   wi;                  ///< The direction of the camera ray arriving at #hit
+        Color3f beta = Color3f(0.f); ///< The throughput of the camera path up to #hit, or zero if there is none
+    };
+
+    /// Trace the camera \p ray through specular bounces, and record the resulting visible point in \p pixel
+    void trace_camera_path(const Scene &scene, Sampler &sampler, Ray3f ray, Pixel &pixel) const;
+
+    /// Trace the photons <tt>[begin, end)</tt> of \p iteration, and append the photons they deposit to \p photons
+    void trace_photons(const Scene &scene, uint32_t iteration, uint32_t begin, uint32_t end,
+                       PhotonMap::Nodes &photons) const;
+
+    /// Gather the photons stored in \p photons around the visible point of \p pixel, and shrink its radius
+    template <typename Index>
+    void gather(const Index &photons, Pixel &pixel) const;
+
+    static constexpr uint32_t photon_block_size = 1 << 14; ///< Number of photons traced by each parallel task
+
+    int   m_photons_per_pass = 100000;
+    float m_initial_radius   = 0.f;
+    float m_alpha            = 2.f / 3.f;
+    int   m_max_bounces      = 16;
+    int   m_rr_depth         = 3;
+    bool  m_hash_grid        = false; ///< Whether to store the photons in a #PhotonHashGrid instead of a #PhotonMap
+    int   m_radiance_stride  = 0;     ///< Add a radiance photon at every this many stored photons (0 for none)
+};
+
+SPPM::SPPM(const json &j) : Integrator(j)
+{
+    m_photons_per_pass = j.value("photons_per_pass", m_photons_per_pass);
+    m_initial_radius   = j.value("radius", m_initial_radius);
+    m_alpha            = j.value("alpha", m_alpha);
+    m_max_bounces      = j.value("max_bounces", m_max_bounces);
+    m_rr_depth         = j.value("rr_depth", m_rr_depth);
+
+    string index = j.value("photon_index", "kdtree");
+    if (index != "kdtree" && index != "hash_grid")
+        throw DartsException("'photon_index' must be either 'kdtree' or 'hash_grid', got '{}'.", index);
+    m_hash_grid = index == "hash_grid";
+
+    if (m_photons_per_pass <= 0)
+        throw DartsException("'photons_per_pass' must be positive, got {}.", m_photons_per_pass);
+    if (m_initial_radius < 0.f)
+        throw DartsException("'radius' must not be negative, got {}.", m_initial_radius);
+    if (m_alpha <= 0.f || m_alpha > 1.f)
+        throw DartsException("'alpha' must be in (0, 1], got {}.", m_alpha);
+    if (m_max_bounces < 0)
+        throw DartsException("'max_bounces' must not be negative, got {}.", m_max_bounces);
+}
+
+void SPPM::trace_camera_path(const Scene &scene, Sampler &sampler, Ray3f ray, Pixel &pixel) const
+{
+    Color3f beta(1.f);
+    HitInfo hit;
+    pixel.beta = Color3f(0.f);
+
+    for (int bounces = 0; bounces <= m_max_bounces; ++bounces)
+    {
+        if (!scene.intersect(ray, hit))
+        {
+            pixel.Ld += beta * scene.background(ray);
+            return;
+        }
+
+        pixel.Ld += beta * hit.mat->emitted(ray, hit);
+
+        ScatterRecord srec;
+        if (!hit.mat->sample(ray.d, hit, srec, sampler.next2f(), sampler.next1f()))
+            return;
+
+        if (!srec.is_specular)
+        {
+            // the photons are gathered here
+            pixel.hit  = hit;
+            pixel.wi   = ray.d;
+            pixel.beta = beta;
+            ++num_visible_points;
+            return;
+        }
+
+        beta *= srec.attenuation;
+        Ray3f scattered(hit.p, srec.wo, Ray3f::epsilon, Ray3f::infinity, ray.time);
+        scattered.continue_footprint(ray, hit.t, 0.f); // specular bounces keep the footprint
+        ray = scattered;
+    }
+}
+
+void SPPM::trace_photons(const Scene &scene, uint32_t iteration, uint32_t begin, uint32_t end,
+                         PhotonMap::Nodes &photons) const
+{
+    pcg32    rng((uint64_t(Scene::random_seed) << 32) | iteration, begin / photon_block_size);
+    uint32_t num_stored = 0;
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        ++num_emitted_photons;
+
+        float rv1                  = rng.nextFloat();
+        auto [emitter, light_prob] = scene.sample_emitter(rv1);
+        if (!emitter)
+            continue;
+
+        // emit the photon from a random point on the emitter, in a cosine-weighted direction about its normal
+        HitInfo hit;
+        float   area_pdf = emitter->sample_area(hit, Vec2f(rv1, rng.nextFloat()));
+        Vec3f   local    = sample_hemisphere_cosine(Vec2f(rng.nextFloat(), rng.nextFloat()));
+        float   dir_pdf  = sample_hemisphere_cosine_pdf(local);
+        if (area_pdf <= 0.f || dir_pdf <= 0.f)
+            continue;
+
+        auto [s, t] = coordinate_system(hit.gn);
+        Vec3f   dir = normalize(s * local.x + t * local.y + hit.gn * local.z);
+        Color3f power =
+            hit.mat->emitted(Ray3f(hit.p, -dir), hit) * std::abs(local.z) / (light_prob * area_pdf * dir_pdf);
+
+        ++num_traced_photons;
+        Ray3f ray(hit.p, dir);
+        if (scene.camera()->has_motion_blur())
+            ray.time = scene.camera()->sample_time(rng.nextFloat());
+        for (int bounces = 0; bounces < m_max_bounces; ++bounces)
+        {
+            if (!(la::maxelem(power) > 0.f) || !la::all(la::isfinite(power)) || !scene.intersect(ray, hit))
+                break;
+
+            ScatterRecord srec;
+            if (!hit.mat->sample(ray.d, hit, srec, Vec2f(rng.nextFloat(), rng.nextFloat()), rng.nextFloat()))
+                break;
+
+            Color3f prev_power = power;
+            if (srec.is_specular)
+                power *= srec.attenuation;
+            else
+            {
+                // deposit a photon on every non-specular surface, then continue the path
+                photons.emplace_back(hit.p, Photon(ray.d, power));
+                ++num_stored_photons;
+                if (m_radiance_stride > 0 && num_stored++ % uint32_t(m_radiance_stride) == 0)
+                    photons.emplace_back(hit.p, Photon::radiance_photon(dot(hit.gn, ray.d) < 0.f ? hit.gn : -hit.gn));
+
+                float pdf = hit.mat->pdf(ray.d, srec.wo, hit);
+                if (pdf <= 0.f)
+                    break;
+                power *= hit.mat->eval(ray.d, srec.wo, hit) / pdf;
+            }
+
+            // randomly terminate photons that lost most of their power at this bounce
+            if (m_rr_depth >= 0 && bounces >= m_rr_depth)
+            {
+                float survival = std::min(la::maxelem(power) / la::maxelem(prev_power), 0.95f);
+                if (rng.nextFloat() >= survival)
+                    break;
+                power /= survival;
+            }
+
+            ray = Ray3f(hit.p, srec.wo, Ray3f::epsilon, Ray3f::infinity, ray.time);
+        }
+    }
+}
+
+template <typename Index>
+void SPPM::gather(const Index &photons, Pixel &pixel) const
+{
+    if (!(la::maxelem(pixel.beta) > 0.f))
+        return;
+
+    // add up the photons within the radius, weighted by the BSDF (eval() includes the cosine towards the photon)
+    Color3f phi(0.f);
+    int     M = 0;
+    FixedRadiusProcess search(pixel.hit.p, pixel.radius * pixel.radius,
+                              [&](const SearchResult &result)
+                              {
+                                  Vec3f wp     = -result.photon->data.direction();
+                                  float cosine = std::abs(dot(pixel.hit.sn, wp));
+                                  if (cosine > 0.f)
+                                      phi += pixel.hit.mat->eval(pixel.wi, wp, pixel.hit) / cosine *
+                                             result.photon->data.power();
+                                  ++M;
+                              });
+    photons.find(search);
+    num_gathered_photons += M;
+
+    if (M == 0)
+        return;
+
+    // keep a fraction alpha of the new photons, and shrink the radius so the photon density stays the same
+    float N      = pixel.N + m_alpha * M;
+    float radius = pixel.radius * std::sqrt(N / (pixel.N + M));
+    pixel.tau    = (pixel.tau + pixel.beta * phi) * (radius * radius) / (pixel.radius * pixel.radius);
+    pixel.N      = N;
+    pixel.radius = radius;
+}
+
+Image3f SPPM::render(const Scene &scene) const
+{
+    Vec2i res = scene.camera()->resolution();
+
+    float initial_radius = m_initial_radius > 0.f ? m_initial_radius : length(scene.bounds().diagonal()) / 500.f;
+    vector<Pixel> pixels(size_t(res.x) * res.y);
+    for (auto &pixel : pixels) pixel.radius = initial_radius;
+
+    uint32_t num_blocks = (uint32_t(m_photons_per_pass) + photon_block_size - 1) / photon_block_size;
+    vector<PhotonMap::Nodes> buffers(num_blocks);
+    PhotonMap                photon_map;
+    PhotonHashGrid           hash_grid;
+
+    int iterations = scene.num_samples();
+    spdlog::info("Rendering {} SPPM iterations of {} photons, with an initial radius of {}.", iterations,
+                 m_photons_per_pass, initial_radius);
+
+    int completed = 0;
+    catch_interrupts();
+    {
+        Progress progress("Rendering", iterations);
+        for (int iteration = 0; iteration < iterations && !interrupted(); ++iteration, ++progress)
+        {
+            // 1. find the visible point of each pixel
+            {
+                SCOPED_STAT_TIMER(camera_path_time);
+                parallel_for(blocked_range<int>(0, res.y, 1),
+                             [&](blocked_range<int> r)
+                             {
+                                 auto sampler = scene.sampler()->clone();
+                                 for (auto y : r)
+                                     for (int x = 0; x < res.x; ++x)
+                                     {
+                                         sampler->start_pixel(x, y);
+                                         sampler->set_sample(iteration);
+                                         Ray3f ray = scene.camera_ray(x, y, *sampler);
+                                         trace_camera_path(scene, *sampler, ray, pixels[size_t(y) * res.x + x]);
+                                     }
+                             });
+            }
+
+            // 2. trace this iteration's photons
+            {
+                SCOPED_STAT_TIMER(photon_trace_time);
+                parallel_for(blocked_range<uint32_t>(0, num_blocks, 1),
+                             [&](blocked_range<uint32_t> r)
+                             {
+                                 for (auto b : r)
+                                     trace_photons(scene, uint32_t(iteration), b * photon_block_size,
+                                                   std::min(uint32_t(m_photons_per_pass), (b + 1) * photon_block_size),
+                                                   buffers[b]);
+                             });
+            }
+
+            // 3. build a fresh spatial index over the photons, and gather them at the visible points
+            SCOPED_STAT_TIMER(gather_time);
+            auto gather_all = [&](auto &photons)
+            {
+                sppm_memory = std::max(sppm_memory, int64_t(pixels.size() * sizeof(Pixel) +
+                                                            photons.nodes.capacity() * sizeof(PhotonMap::Node)));
+                parallel_for(blocked_range<size_t>(0, pixels.size(), size_t(res.x)),
+                             [&](blocked_range<size_t> r)
+                             {
+                                 for (auto i : r) gather(photons, pixels[i]);
+                             });
+            };
+
+            if (m_hash_grid)
+            {
+                // no gather reaches beyond one cell in each direction if the cells are as large as the largest radius
+                float max_radius = 0.f;
+                for (auto &pixel : pixels)
+                    if (la::maxelem(pixel.beta) > 0.f)
+                        max_radius = std::max(max_radius, pixel.radius);
+
+                hash_grid.clear();
+                hash_grid.merge(buffers);
+                hash_grid.build(max_radius > 0.f ? max_radius : initial_radius);
+                gather_all(hash_grid);
+            }
+            else
+            {
+                photon_map.clear();
+                photon_map.merge(buffers);
+                photon_map.build();
+                gather_all(photon_map);
+            }
+
+            ++completed;
+        }
+        progress.set_done();
+    }
+    catch_interrupts(false);
+
+    if (completed < iterations)
+        spdlog::warn("Rendering interrupted after {} of {} SPPM iterations.", completed, iterations);
+
+    Image3f image(res.x, res.y, Color3f(0.f));
+    if (completed == 0)
+        return image;
+
+    double num_photons = double(completed) * m_photons_per_pass;
+    for (int y = 0; y < res.y; ++y)
+        for (int x = 0; x < res.x; ++x)
+        {
+            const Pixel &pixel = pixels[size_t(y) * res.x + x];
+            image(x, y)        = pixel.Ld / float(completed) +
+                          pixel.tau / float(num_photons * M_PI * pixel.radius * pixel.radius);
+        }
+
+    return image;
+}
+
+/**
+    A two-pass photon mapper with a final gather that uses precomputed radiance photons, following Christensen's
+    "Faster Photon Map Global Illumination" (JGT 1999).
+
+    It first traces a single global photon map, and adds a radiance photon at every few stored photons. Once the map is
+    balanced, precompute_radiance_photons() estimates the irradiance at each radiance photon. Then, each camera path is
+    traced through specular bounces to its first non-specular surface, where the reflected radiance is estimated with
+    a final gather: a number of rays sampled from the material, which each look up the single nearest radiance photon
+    where they land (instead of a k-nearest-neighbor density estimate), and turn its irradiance into outgoing radiance
+    with the Material::reflectance() there.
+
+    Since photons are stored at their first bounce as well, the radiance photons include direct illumination, which is
+    therefore also estimated by the final gather.
+
+    The photon map does not depend on the camera, so if the cache is enabled (see #set_cache_dir()), it is stored
+    along with its radiance photons, keyed by Scene::lighting_hash() and the photon parameters. Later renderings of the
+    same scene from other views (e.g. the frames of a walkthrough) then load it instead of tracing it again.
+
+    It accepts the \c "max_bounces" and \c "rr_depth" parameters of #SPPM, and:
+    - \c "photons": the number of photons traced (default: 500000)
+    - \c "radiance_stride": add a radiance photon at every this many stored photons (default: 4)
+    - \c "gather_photons": the number of photons in each irradiance estimate (default: 64)
+    - \c "radius": the maximum radius of the irradiance estimates and radiance photon lookups (default: 0 to use
+      1/50th of the diagonal of the scene's bounds)
+    - \c "gather_rays": the number of final gather rays per camera path (default: 32). With 0, the radiance photons
+      are looked up directly at the visible points, which is useful to inspect the precomputed irradiance.
+
+    \note Gather rays treat every surface they hit as diffuse, so caustics are only seen directly from the camera and
+    through specular bounces of camera paths if \c "gather_rays" is 0.
+
+    \ingroup Integrators
+*/
+class PhotonMapper : public SPPM
+{
+public:
+    PhotonMapper(const json &j = json::object());
+
+    Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray, AOVSample *aov = nullptr) const override
+    {
+        throw DartsException("The 'photon_mapper' integrator can only render whole images.");
+    }
+
+    Image3f render(const Scene &scene) const override;
+
+protected:
+    /// The outgoing radiance at \p hit (reached by a ray in direction \p d) from the nearest radiance photon
+    Color3f lookup(const PhotonMap &photons, const Vec3f &d, const HitInfo &hit, float max_dist2) const;
+
+    /// Trace the photons into \p photons, balance it, and precompute its radiance photons
+    void build_photon_map(const Scene &scene, PhotonMap &photons, float max_dist2) const;
+
+    /// The radiance reflected towards the camera at the visible point of \p pixel, estimated with a final gather
+    Color3f final_gather(const Scene &scene, Sampler &sampler, const PhotonMap &photons, const Pixel &pixel,
+                         float max_dist2) const;
+
+    int m_gather_photons = 64;
+    int m_gather_rays    = 32;
+};
+
+PhotonMapper::PhotonMapper(const json &j) : SPPM(j)
+{
+    m_photons_per_pass = j.value("photons", 500000);
+    m_radiance_stride  = j.value("radiance_stride", 4);
+    m_gather_photons   = j.value("gather_photons", m_gather_photons);
+    m_gather_rays      = j.value("gather_rays", m_gather_rays);
+
+    if (m_photons_per_pass <= 0)
+        throw DartsException("'photons' must be positive, got {}.", m_photons_per_pass);
+    if (m_radiance_stride <= 0)
+        throw DartsException("'radiance_stride' must be positive, got {}.", m_radiance_stride);
+    if (m_gather_photons <= 0)
+        throw DartsException("'gather_photons' must be positive, got {}.", m_gather_photons);
+    if (m_gather_rays < 0)
+        throw DartsException("'gather_rays' must not be negative, got {}.", m_gather_rays);
+}
+
+Color3f PhotonMapper::lookup(const PhotonMap &photons, const Vec3f &d, const HitInfo &hit, float max_dist2) const
+{
+    ++num_radiance_lookups;
+    RadiancePhotonSearch search(hit.p, dot(hit.gn, d) < 0.f ? hit.gn : -hit.gn, max_dist2);
+    photons.find(search);
+    if (!search.photon)
+        return Color3f(0.f);
+
+    ++num_radiance_lookups_found;
+    return hit.mat->reflectance(hit) * float(M_1_PI) * search.photon->data.power();
+}
+
+Color3f PhotonMapper::final_gather(const Scene &scene, Sampler &sampler, const PhotonMap &photons, const Pixel &pixel,
+                                   float max_dist2) const
+{
+    if (m_gather_rays == 0)
+        return lookup(photons, pixel.wi, pixel.hit, max_dist2);
+
+    Color3f sum(0.f);
+    HitInfo hit;
+    for (int i = 0; i < m_gather_rays; ++i)
+    {
+        ScatterRecord srec;
+        if (!pixel.hit.mat->sample(pixel.wi, pixel.hit, srec, sampler.next2f(), sampler.next1f()))
+            continue;
+
+        Color3f weight = srec.attenuation;
+        if (!srec.is_specular)
+        {
+            float pdf = pixel.hit.mat->pdf(pixel.wi, srec.wo, pixel.hit);
+            if (pdf <= 0.f)
+                continue;
+            weight = pixel.hit.mat->eval(pixel.wi, srec.wo, pixel.hit) / pdf;
+        }
+
+        Ray3f ray(pixel.hit.p, srec.wo);
+        if (!scene.intersect(ray, hit))
+            sum += weight * scene.background(ray);
+        else
+            sum += weight * (hit.mat->emitted(ray, hit) + lookup(photons, ray.d, hit, max_dist2));
+    }
+    return sum / float(m_gather_rays);
+}
+
+void PhotonMapper::build_photon_map(const Scene &scene, PhotonMap &photons, float max_dist2) const
+{
+    uint32_t num_blocks = (uint32_t(m_photons_per_pass) + photon_block_size - 1) / photon_block_size;
+    vector<PhotonMap::Nodes> buffers(num_blocks);
+    {
+        SCOPED_STAT_TIMER(photon_trace_time);
+        parallel_for(blocked_range<uint32_t>(0, num_blocks, 1),
+                     [&](blocked_range<uint32_t> r)
+                     {
+                         for (auto b : r)
+                             trace_photons(scene, 0, b * photon_block_size,
+                                           std::min(uint32_t(m_photons_per_pass), (b + 1) * photon_block_size),
+                                           buffers[b]);
+                     });
+        photons.merge(buffers);
+        photons.build();
+    }
+
+    SCOPED_STAT_TIMER(radiance_photon_time);
+    // the power of each photon is relative to all emitted photons
+    float  scale        = 1.f / float(m_photons_per_pass);
+    size_t num_radiance = precompute_radiance_photons(photons, m_gather_photons, max_dist2, scale);
+    num_radiance_photons += int64_t(num_radiance);
+    spdlog::info("Stored {} photons, {} of which are radiance photons.", photons.size(), num_radiance);
+}
+
+Image3f PhotonMapper::render(const Scene &scene) const
+{
+    Vec2i res = scene.camera()->resolution();
+
+    // 1. trace the photon map, or load it from the cache if the lighting of the scene is the same as in a previous run
+    float     radius    = m_initial_radius > 0.f ? m_initial_radius : length(scene.bounds().diagonal()) / 50.f;
+    float     max_dist2 = radius * radius;
+    PhotonMap photons;
+    uint64_t  cache_key = 0;
+    bool      cached    = false;
+    if (scene.lighting_hash())
+    {
+        Hasher hasher;
+        hasher.add_pod(scene.lighting_hash()).add_pod(Scene::random_seed).add_pod(m_photons_per_pass);
+        hasher.add_pod(m_max_bounces).add_pod(m_rr_depth).add_pod(m_radiance_stride).add_pod(m_gather_photons);
+        hasher.add_pod(max_dist2);
+        cache_key = hasher.value();
+
+        CacheReader cache("photons", cache_key);
+        cached = cache.good() && photons.load(cache);
+        if (cached)
+            spdlog::info("Loaded {} photons from the cache.", photons.size());
+    }
+
+    if (!cached)
+    {
+        build_photon_map(scene, photons, max_dist2);
+        if (cache_key)
+        {
+            CacheWriter cache("photons", cache_key);
+            photons.save(cache);
+        }
+    }
+    sppm_memory = std::max(sppm_memory, int64_t(photons.nodes.capacity() * sizeof(PhotonMap::Node)));
+
+    // 2. trace the camera paths, and estimate the radiance at their visible points with a final gather
+    SCOPED_STAT_TIMER(final_gather_time);
+    int     spp = scene.num_samples();
+    Image3f image(res.x, res.y, Color3f(0.f));
+    catch_interrupts();
+    {
+        Progress progress("Rendering", res.y);
+        parallel_for(blocked_range<int>(0, res.y, 1),
+                     [&](blocked_range<int> r)
+                     {
+                         auto sampler = scene.sampler()->clone();
+                         for (auto y : r)
+                         {
+                             if (interrupted())
+                                 return;
+                             for (int x = 0; x < res.x; ++x)
+                             {
+                                 Color3f sum(0.f);
+                                 for (int s = 0; s < spp; ++s)
+                                 {
+                                     sampler->start_pixel(x, y);
+                                     sampler->set_sample(s);
+                                     Pixel pixel;
+                                     trace_camera_path(scene, *sampler, scene.camera_ray(x, y, *sampler), pixel);
+                                     sum += pixel.Ld;
+                                     if (la::maxelem(pixel.beta) > 0.f)
+                                         sum += pixel.beta * final_gather(scene, *sampler, photons, pixel, max_dist2);
+                                 }
+                                 image(x, y) = sum / float(spp);
+                             }
+                             ++progress;
+                         }
+                     });
+        progress.set_done();
+    }
+    bool was_interrupted = interrupted();
+    catch_interrupts(false);
+
+    if (was_interrupted)
+        spdlog::warn("Rendering interrupted, some rows of the image are missing.");
+
+    return image;
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, SPPM, "sppm")
+DARTS_REGISTER_CLASS_IN_FACTORY(Integrator, PhotonMapper, "photon_mapper")
+
+/**
+    \file
+    \brief SPPM Integrator
+*/
@@ -0,0 +1,193 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/low_discrepancy.h>
+#include <pcg32.h>
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// The primitive polynomial and initial direction numbers of one Sobol dimension
+struct SobolInit
+{
+    uint32_t s;    ///< Degree of the primitive polynomial
+    uint32_t a;    ///< Coefficients of the polynomial, excluding the leading and trailing ones
+    uint32_t m[6]; ///< The initial direction numbers
+};
+
+// Dimensions 2 and above from Joe and Kuo's "new-joe-kuo-6.21201" table (the first dimension is the van der Corput
+// sequence).
+constexpr SobolInit sobol_init[num_sobol_dimensions - 1] = {
+    {1, 0, {1}},                     //
+    {2, 1, {1, 3}},                  //
+    {3, 1, {1, 3, 1}},               //
+    {3, 2, {1, 1, 1}},               //
+    {4, 1, {1, 1, 3, 3}},            //
+    {4, 4, {1, 3, 5, 13}},           //
+    {5, 2, {1, 1, 5, 5, 17}},        //
+    {5, 4, {1, 1, 5, 5, 5}},         //
+    {5, 7, {1, 1, 7, 11, 19}},       //
+    {5, 11, {1, 1, 5, 1, 1}},        //
+    {5, 13, {1, 1, 1, 3, 11}},       //
+    {5, 14, {1, 3, 5, 5, 31}},       //
+    {6, 1, {1, 3, 3, 9, 7, 49}},     //
+    {6, 13, {1, 1, 1, 15, 21, 21}},  //
+    {6, 16, {1, 3, 1, 13, 27, 49}}}; //
+
+/// Compute the direction numbers at compile time
+struct SobolDirections
+{
+    uint32_t v[num_sobol_dimensions][32] = {};
+
+    constexpr SobolDirections()
+    {
+        for (uint32_t i = 0; i < 32; ++i) v[0][i] = 1u << (31 - i);
+
+        for (int d = 1; d < num_sobol_dimensions; ++d)
+        {
+            const SobolInit &init = sobol_init[d - 1];
+            uint32_t        *dir  = v[d];
+            for (uint32_t i = 0; i < init.s; ++i) dir[i] = init.m[i] << (31 - i);
+
+            // the recurrence defined by the primitive polynomial
+            for (uint32_t i = init.s; i < 32; ++i)
+            {
+                dir[i] = dir[i - init.s] ^ (dir[i - init.s] >> init.s);
+                for (uint32_t k = 1; k < init.s; ++k)
+                    if ((init.a >> (init.s - 1 - k)) & 1)
+                        dir[i] ^= dir[i - k];
+            }
+        }
+    }
+};
+
+constexpr SobolDirections directions;
+
+/**
+    Generate the ranks of a tileable blue-noise mask with Ulichney's void-and-cluster method ("The void-and-cluster
+    method for dither array generation", 1993).
+
+    The energy of a pixel is the sum of a Gaussian of its toroidal distance to all pixels in the current binary pattern,
+    so the unset pixel with the lowest energy is the center of the largest void, and the set pixel with the highest
+    energy the center of the tightest cluster.
+*/
+vector<uint32_t> void_and_cluster()
+{
+    constexpr int   n     = blue_noise_size;
+    constexpr int   count = n * n;
+    constexpr float sigma = 1.5f;
+
+    // the Gaussian of all toroidal offsets
+    vector<float> kernel(count);
+    for (int dy = 0; dy < n; ++dy)
+        for (int dx = 0; dx < n; ++dx)
+        {
+            int x = std::min(dx, n - dx), y = std::min(dy, n - dy);
+            kernel[dy * n + dx] = std::exp(-float(x * x + y * y) / (2.f * sigma * sigma));
+        }
+
+    vector<char>  pattern(count, false);
+    vector<float> energy(count, 0.f);
+    auto          toggle = [&](int p, bool on)
+    {
+        pattern[p]  = on;
+        float sign  = on ? 1.f : -1.f;
+        int   px    = p % n, py = p / n;
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x)
+                energy[y * n + x] += sign * kernel[((y - py + n) % n) * n + (x - px + n) % n];
+    };
+    auto tightest_cluster = [&]()
+    {
+        int best = -1;
+        for (int p = 0; p < count; ++p)
+            if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+                best = p;
+        return best;
+    };
+    auto largest_void = [&]()
+    {
+        int best = -1;
+        for (int p = 0; p < count; ++p)
+            if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+                best = p;
+        return best;
+    };
+
+    // a random initial pattern of a tenth of the pixels, relaxed by moving the tightest cluster into the largest void
+    // until that doesn't change anything anymore
+    const int ones = count / 10;
+    pcg32     rng;
+    for (int placed = 0; placed < ones;)
+        if (int p = int(rng.nextUInt(count)); !pattern[p])
+        {
+            toggle(p, true);
+            ++placed;
+        }
+    for (int i = 0; i < count; ++i)
+    {
+        int cluster = tightest_cluster();
+        toggle(cluster, false);
+        int gap = largest_void();
+        toggle(gap, true);
+        if (gap == cluster)
+            break;
+    }
+
+    // rank the initial pattern by removing its tightest clusters first, and then rank the remaining pixels by filling
+    // the largest voids (the tightest clusters of unset pixels are the largest voids, since the energies add up to a
+    // constant)
+    vector<uint32_t> ranks(count);
+    auto             initial_pattern = pattern;
+    auto             initial_energy  = energy;
+    for (int rank = ones - 1; rank >= 0; --rank)
+    {
+        int p    = tightest_cluster();
+        ranks[p] = rank;
+        toggle(p, false);
+    }
+    pattern = initial_pattern;
+    energy  = initial_energy;
+    for (int rank = ones; rank < count; ++rank)
+    {
+        int p    = largest_void();
+        ranks[p] = rank;
+        toggle(p, true);
+    }
+    return ranks;
+}
+
+} // namespace
+
+uint32_t blue_noise(int x, int y, uint32_t seed)
+{
+    // the ranks as 32-bit fixed point values in the centers of their strata
+    static const vector<uint32_t> mask = []()
+    {
+        auto ranks = void_and_cluster();
+        for (auto &r : ranks) r = uint32_t(((2 * uint64_t(r) + 1) << 31) / ranks.size());
+        return ranks;
+    }();
+
+    constexpr int n     = blue_noise_size;
+    uint32_t      shift = hash_combine(seed, 0x9e3779b9u);
+    int           mx    = int((uint32_t(x) + shift) % n);
+    int           my    = int((uint32_t(y) + (shift >> 16)) % n);
+    return mask[my * n + mx];
+}
+
+const uint32_t (&sobol_directions)[num_sobol_dimensions][32] = directions.v;
+
+const uint32_t halton_primes[num_halton_dimensions] = {
+    2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,  59,  61,  67,  71,  73,  79,
+    83,  89,  97,  101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193,
+    197, 199, 211, 223, 227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+
+/**
+    \file
+    \brief Tables for the low-discrepancy sequences
+*/
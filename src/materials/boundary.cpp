@@ -0,0 +1,59 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/factory.h>
+#include <darts/material.h>
+#include <darts/scene.h>
+
+/**
+    An invisible surface that only marks the boundary of a #Medium, e.g. the bounding box of a cloud.
+
+    Give it the \c "medium" filling the inside of the surface. Light passes straight through the surface, so
+    integrators that don't support media simply ignore it.
+
+    \ingroup Materials
+*/
+class MediumBoundary : public Material
+{
+public:
+    MediumBoundary(const json &j = json::object()) : Material(j)
+    {
+    }
+
+    bool is_boundary() const override
+    {
+        return true;
+    }
+
+    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                 Sampler &sampler) const override
+    {
+        attenuation = Color3f(1.f);
+        scattered   = Ray3f(hit.p, ray.d);
+        return true;
+    }
+
+    bool sample(const Vec3f &wi, const HitInfo &hit, ScatterRecord &srec, const Vec2f &rv, float rv1) const override
+    {
+        srec.attenuation = Color3f(1.f);
+        srec.wo          = wi;
+        srec.is_specular = true;
+        return true;
+    }
+
+    /// The rays passing through keep their footprint
+    float footprint_spread(const HitInfo &hit) const override
+    {
+        return 0.f;
+    }
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Material, MediumBoundary, "boundary")
+
+/**
+    \file
+    \brief MediumBoundary Material
+*/
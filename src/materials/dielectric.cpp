@@ -5,28 +5,22 @@
 */
 
 #include <darts/factory.h>
-#include <darts/material.h>
+#include <darts/materials.h>
 #include <darts/scene.h>
 
-/// A smooth dielectric surface that reflects and refracts light according to the specified index of refraction #ior.
-/// \ingroup Materials
-class Dielectric : public Material
+Dielectric::Dielectric(const json &j) : Material(j)
 {
-public:
-    Dielectric(const json &j = json::object());
-
-    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const override;
-
-
-    float ior; ///< The (relative) index of refraction of the material
-};
+    m_type = MaterialType::Dielectric;
+    update(j);
+}
 
-Dielectric::Dielectric(const json &j) : Material(j)
+void Dielectric::update(const json &j)
 {
     ior = j.value("ior", ior);
 }
 
-bool Dielectric::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const
+bool Dielectric::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                         Sampler &sampler) const
 {
     // TODO: Implement dielectric scattering
     return false;
@@ -5,28 +5,16 @@
 */
 
 #include <darts/factory.h>
-#include <darts/material.h>
+#include <darts/materials.h>
 #include <darts/scene.h>
 
-/// A material that emits light equally in all directions from the front side of a surface. \ingroup Materials
-class DiffuseLight : public Material
+DiffuseLight::DiffuseLight(const json &j) : Material(j)
 {
-public:
-    DiffuseLight(const json &j = json::object());
-
-    /// Returns a constant Color3f if the ray hits the surface on the front side.
-    Color3f emitted(const Ray3f &ray, const HitInfo &hit) const override;
-
-    bool is_emissive() const override
-    {
-        return true;
-    }
-
-
-    Color3f emit; ///< The emissive color of the light
-};
+    m_type = MaterialType::DiffuseLight;
+    update(j);
+}
 
-DiffuseLight::DiffuseLight(const json &j) : Material(j)
+void DiffuseLight::update(const json &j)
 {
     emit = j.value("emit", emit);
 }
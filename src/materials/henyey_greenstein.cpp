@@ -0,0 +1,97 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/factory.h>
+#include <darts/material.h>
+#include <darts/sampler.h>
+#include <darts/scene.h>
+
+/**
+    The Henyey-Greenstein phase function, to be used as the \c "phase function" of a #Medium.
+
+    The asymmetry parameter \c "g" in (-1, 1) is the average cosine of the scattering angle: positive values scatter
+    light forward, negative values backward, and 0 (the default) scatters light equally in all directions.
+
+    Like a #Material, the phase function is evaluated at a (medium) hit point, with \c wi the direction the light
+    travels in before scattering. Since it importance samples the phase function exactly, #sample() sets the
+    attenuation to 1.
+
+    \ingroup Materials
+*/
+class HenyeyGreenstein : public Material
+{
+public:
+    HenyeyGreenstein(const json &j = json::object()) : Material(j)
+    {
+        update(j);
+    }
+
+    void update(const json &j) override
+    {
+        m_g = clamp(j.value("g", m_g), -0.99f, 0.99f);
+    }
+
+    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                 Sampler &sampler) const override
+    {
+        ScatterRecord srec;
+        Vec2f         rv = sampler.next2f();
+        if (!sample(ray.d, hit, srec, rv, 0.f))
+            return false;
+        attenuation = srec.attenuation;
+        scattered   = Ray3f(hit.p, srec.wo);
+        return true;
+    }
+
+    bool sample(const Vec3f &wi, const HitInfo &hit, ScatterRecord &srec, const Vec2f &rv, float rv1) const override
+    {
+        // invert the CDF of the cosine of the scattering angle
+        float cos_theta;
+        if (std::abs(m_g) < 1e-3f)
+            cos_theta = 1.f - 2.f * rv.x;
+        else
+        {
+            float s   = (1.f - m_g * m_g) / (1.f - m_g + 2.f * m_g * rv.x);
+            cos_theta = clamp((1.f + m_g * m_g - s * s) / (2.f * m_g), -1.f, 1.f);
+        }
+        float sin_theta = std::sqrt(std::max(0.f, 1.f - cos_theta * cos_theta));
+        float phi       = 2.f * M_PI * rv.y;
+
+        Vec3f d          = normalize(wi);
+        auto [s, t]      = coordinate_system(d);
+        srec.wo          = sin_theta * std::cos(phi) * s + sin_theta * std::sin(phi) * t + cos_theta * d;
+        srec.attenuation = Color3f(1.f);
+        srec.is_specular = false;
+        return true;
+    }
+
+    Color3f eval(const Vec3f &wi, const Vec3f &scattered, const HitInfo &hit) const override
+    {
+        return Color3f(phase(dot(normalize(wi), normalize(scattered))));
+    }
+
+    float pdf(const Vec3f &wi, const Vec3f &scattered, const HitInfo &hit) const override
+    {
+        return phase(dot(normalize(wi), normalize(scattered)));
+    }
+
+protected:
+    /// The phase function's density for the cosine \p cos_theta of the scattering angle
+    float phase(float cos_theta) const
+    {
+        float denom = 1.f + m_g * m_g - 2.f * m_g * cos_theta;
+        return INV_FOURPI * (1.f - m_g * m_g) / (denom * std::sqrt(denom));
+    }
+
+    float m_g = 0.f; ///< The asymmetry parameter
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Material, HenyeyGreenstein, "henyey_greenstein")
+
+/**
+    \file
+    \brief HenyeyGreenstein phase function
+*/
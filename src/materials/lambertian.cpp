@@ -5,30 +5,26 @@
 */
 
 #include <darts/factory.h>
-#include <darts/material.h>
+#include <darts/materials.h>
 #include <darts/scene.h>
 
-/// A perfectly diffuse (%Lambertian) material. \ingroup Materials
-class Lambertian : public Material
+Lambertian::Lambertian(const json &j) : Material(j)
 {
-public:
-    Lambertian(const json &j = json::object());
-
-    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const override;
-
-
-    Color3f albedo = Color3f(0.8f); ///< The diffuse color (fraction of light that is reflected per color channel).
-};
+    m_type = MaterialType::Lambertian;
+    update(j);
+}
 
-Lambertian::Lambertian(const json &j) : Material(j)
+void Lambertian::update(const json &j)
 {
-    albedo = j.value("albedo", albedo);
+    if (j.contains("albedo"))
+        albedo = parse_texture(j["albedo"]);
 }
 
-bool Lambertian::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const
+bool Lambertian::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                         Sampler &sampler) const
 {
     // TODO: Implement Lambertian reflection
-    //       You should assign the albedo to ``attenuation'', and
+    //       You should assign the albedo (albedo->value(hit)) to ``attenuation'', and
     //       you should assign the scattered ray to ``scattered''
     //       The origin of the scattered ray should be at the hit point,
     //       and the scattered direction is the shading normal plus a random
@@ -36,11 +32,11 @@ bool Lambertian::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuat
 
     //       You can get the hit point using hit.p, and the shading normal using hit.sn
 
-    //       Hint: You can use the function random_in_unit_sphere() to get a random
+    //       Hint: You can use the function random_in_unit_sphere(sampler) to get a random
     //       point in a sphere. IMPORTANT: You want to add a random point *on*
     //       a sphere, not *in* the sphere (the text book gets this wrong)
     //       If you normalize the point, you can force it to be on the sphere always, so
-    //       add normalize(random_in_unit_sphere()) to your shading normal
+    //       add normalize(random_in_unit_sphere(sampler)) to your shading normal
     return false;
 }
 
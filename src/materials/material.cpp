@@ -6,12 +6,15 @@
 
 #include <darts/factory.h>
 #include <darts/material.h>
+#include <darts/medium.h>
 #include <darts/scene.h>
 #include <darts/surface.h>
 
 
 Material::Material(const json &j)
 {
+    if (j.contains("medium"))
+        medium = DartsFactory<Medium>::find(j, "medium");
 }
 
 float fresnel_dielectric(float cos_theta_i, float eta_i, float eta_t)
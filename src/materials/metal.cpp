@@ -5,30 +5,24 @@
 */
 
 #include <darts/factory.h>
-#include <darts/material.h>
+#include <darts/materials.h>
 #include <darts/scene.h>
 
-/// A metallic material that reflects light into the (potentially rough) mirror reflection direction.
-/// \ingroup Materials
-class Metal : public Material
+Metal::Metal(const json &j) : Material(j)
 {
-public:
-    Metal(const json &j = json::object());
-
-    bool scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const override;
-
-
-    Color3f albedo = Color3f(0.8f); ///< The reflective color (fraction of light that is reflected per color channel).
-    float   roughness = 0.f; ///< A value between 0 and 1 indicating how smooth vs. rough the reflection should be.
-};
+    m_type = MaterialType::Metal;
+    update(j);
+}
 
-Metal::Metal(const json &j) : Material(j)
+void Metal::update(const json &j)
 {
-    albedo    = j.value("albedo", albedo);
+    if (j.contains("albedo"))
+        albedo = parse_texture(j["albedo"]);
     roughness = clamp(j.value("roughness", roughness), 0.f, 1.f);
 }
 
-bool Metal::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered) const
+bool Metal::scatter(const Ray3f &ray, const HitInfo &hit, Color3f &attenuation, Ray3f &scattered,
+                    Sampler &sampler) const
 {
     // TODO: Implement metal reflection
     //       This function proceeds similar to the lambertian material, except that the
@@ -7,15 +7,136 @@
 #include <darts/medium.h>
 #include <darts/sampler.h>
 #include <darts/scene.h>
+#include <darts/stats.h>
 #include <filesystem/resolver.h>
+#include <atomic>
 #include <limits>
+#include <optional>
+#include <type_traits>
 #include <nanovdb/util/GridStats.h>
 #include <nanovdb/util/IO.h>
 #include <nanovdb/util/Ray.h>
 #include <nanovdb/util/SampleFromVoxels.h>
 
-/// A medium with density defined by a NanoVDB grid.
-/// \ingroup Media
+STAT_MEMORY_COUNTER("Memory/Majorant grids", majorant_grid_bytes);
+STAT_RATIO("Media/Density lookups per ratio-tracking estimate", num_ratio_lookups, num_ratio_estimates);
+STAT_RATIO("Media/Majorant cells per traversal", num_majorant_cells, num_majorant_traversals);
+
+/**
+    A coarse grid of local density upper bounds over the index space of a NanoVDB grid.
+
+    Each cell covers a brick of voxels and stores the maximum density that trilinear interpolation can produce within
+    it. Tracking against these local majorants (instead of the maximum density of the whole grid) keeps the number of
+    null collisions low in sparse grids containing a few dense regions.
+*/
+struct MajorantGrid
+{
+    Vec3i         res{0};          ///< Number of cells along each axis
+    Vec3f         origin{0.f};     ///< Index-space position of the corner of cell (0,0,0)
+    float         brick_size = 16; ///< Number of voxels along each side of a cell
+    vector<float> max_density;     ///< The majorant density of each cell, x varying fastest
+
+    float &cell(int x, int y, int z)
+    {
+        return max_density[(z * res.y + y) * res.x + x];
+    }
+
+    float cell(int x, int y, int z) const
+    {
+        return max_density[(z * res.y + y) * res.x + x];
+    }
+
+    /// The majorant density at index-space position \p p
+    float lookup(const Vec3f &p) const
+    {
+        Vec3i c{(p - origin) / brick_size};
+        if (la::any(la::less(c, Vec3i{0})) || la::any(la::gequal(c, res)))
+            return 0.f;
+        return cell(c.x, c.y, c.z);
+    }
+
+    /// Raise the majorant of all cells overlapping the index-space box <tt>[lo, hi]</tt> to at least \p density
+    void enclose(const Vec3f &lo, const Vec3f &hi, float density)
+    {
+        Vec3i c0 = max(Vec3i{(lo - origin) / brick_size}, Vec3i{0});
+        Vec3i c1 = min(Vec3i{(hi - origin) / brick_size}, res - 1);
+        for (int z = c0.z; z <= c1.z; ++z)
+            for (int y = c0.y; y <= c1.y; ++y)
+                for (int x = c0.x; x <= c1.x; ++x) cell(x, y, z) = std::max(cell(x, y, z), density);
+    }
+
+    /**
+        Walk along the index-space ray <tt>o + t d</tt>, for \p t in <tt>[mint, maxt]</tt>, through the cells of the
+        grid using a 3D DDA.
+
+        Calls \p visit(t0, t1, density) for each segment of the ray within a cell, in front-to-back order, until it
+        returns false.
+    */
+    template <typename Visit>
+    void traverse(const Vec3f &o, const Vec3f &d, float mint, float maxt, Visit &&visit) const
+    {
+        // clip the ray to the bounds of the grid
+        Vec3f lo = origin, hi = origin + Vec3f(res) * brick_size;
+        for (int a = 0; a < 3; ++a)
+        {
+            float inv_d = 1.f / d[a];
+            float t0 = (lo[a] - o[a]) * inv_d, t1 = (hi[a] - o[a]) * inv_d;
+            if (t0 > t1)
+                std::swap(t0, t1);
+            mint = std::max(mint, t0);
+            maxt = std::min(maxt, t1);
+        }
+        if (!(mint < maxt))
+            return;
+
+        ++num_majorant_traversals;
+
+        // set up the DDA at the entry point
+        Vec3f p = (o + mint * d - origin) / brick_size;
+        Vec3i cell_idx, step;
+        Vec3f t_next, t_delta;
+        for (int a = 0; a < 3; ++a)
+        {
+            cell_idx[a] = clamp(int(p[a]), 0, res[a] - 1);
+            if (d[a] == 0.f)
+            {
+                step[a]    = 0;
+                t_next[a]  = std::numeric_limits<float>::infinity();
+                t_delta[a] = std::numeric_limits<float>::infinity();
+                continue;
+            }
+            step[a]        = d[a] > 0.f ? 1 : -1;
+            float boundary = origin[a] + (cell_idx[a] + (d[a] > 0.f ? 1 : 0)) * brick_size;
+            t_next[a]      = (boundary - o[a]) / d[a];
+            t_delta[a]     = brick_size / std::abs(d[a]);
+        }
+
+        float t = mint;
+        while (true)
+        {
+            ++num_majorant_cells;
+            int   axis  = t_next.x < t_next.y ? (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+            float t_end = std::min(t_next[axis], maxt);
+            if (!visit(t, t_end, cell(cell_idx.x, cell_idx.y, cell_idx.z)) || t_end >= maxt)
+                return;
+
+            t = t_end;
+            cell_idx[axis] += step[axis];
+            if (cell_idx[axis] < 0 || cell_idx[axis] >= res[axis])
+                return;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
+
+/**
+    A medium with density defined by a NanoVDB grid.
+
+    Free-flight sampling and transmittance estimation use delta and ratio tracking against a #MajorantGrid, whose
+    cells span \c "majorant brick size" voxels (16 by default) along each side.
+
+    \ingroup Media
+*/
 class NanoVDBMedium : public Medium
 {
 public:
@@ -28,19 +149,54 @@ public:
     Color3f total_transmittance(const Ray3f &ray, Sampler &sampler) const override;
 
 protected:
+    using Accessor = nanovdb::FloatGrid::AccessorType;
+    using Lookup   = nanovdb::SampleFromVoxels<Accessor, 1, false>;
+
+    /**
+        The state shared by all steps of delta or ratio tracking along one ray.
+
+        Holds the ray in index space, so each step only needs to evaluate <tt>o + t d</tt>, and a NanoVDB accessor whose
+        node cache makes the many nearby lookups along the ray cheap.
+    */
+    struct TrackingContext
+    {
+        TrackingContext(const NanoVDBMedium &medium, const Ray3f &ray);
+
+        /// The density at distance \p t along the ray
+        float density(float t)
+        {
+            Vec3f x = o + t * d;
+            return lookup(nanovdb::Vec3f(x.x, x.y, x.z));
+        }
+
+        Vec3f    o, d; ///< The ray in index space (with the parametrization of the original ray)
+        Accessor accessor;
+        Lookup   lookup;
+    };
+
+    /// Build #m_majorants from the statistics stored in the nodes of the NanoVDB tree
+    void build_majorants();
+
+    /// Look up the density at index-space point \p p through an accessor that each thread keeps between calls
+    float cached_density(const nanovdb::Vec3f &p) const;
+
+    uint64_t                                 m_id;                  ///< Unique id, identifying the per-thread caches
+    MajorantGrid                             m_majorants;           ///< Local density upper bounds
     Color3f                                  m_sigma_s{0.8f};       ///< scattering coefficient
     Color3f                                  m_sigma_a{0.2f};       ///< absorption coefficient
     Color3f                                  m_total;               ///< total coefficient (absorption+scattering+null)
     Transform                                m_xform = Transform(); ///< Transformation to place the grid in the scene
+    Transform                                m_inv_xform;           ///< Cached inverse of #m_xform
     Box3f                                    m_bbox;                ///< The bounds, local space
     nanovdb::GridHandle<nanovdb::HostBuffer> m_density_handle;
     const nanovdb::FloatGrid                *m_density_grid = nullptr;
-
-    using Lookup = nanovdb::SampleFromVoxels<nanovdb::FloatGrid::TreeType, 1, false>;
 };
 
 NanoVDBMedium::NanoVDBMedium(const json &j) : Medium(j)
 {
+    static std::atomic<uint64_t> num_media{0};
+    m_id = ++num_media;
+
     std::string filename, path;
     try
     {
@@ -75,9 +231,13 @@ NanoVDBMedium::NanoVDBMedium(const json &j) : Medium(j)
         throw DartsException("nanovdb: {}: \"{}\".", path, e.what());
     }
 
-    m_xform   = j.value("transform", m_xform);
-    m_sigma_a = j.value("sigma_a", m_sigma_a);
-    m_sigma_s = j.value("sigma_s", m_sigma_s);
+    m_xform                = j.value("transform", m_xform);
+    m_inv_xform            = m_xform.inverse();
+    m_sigma_a              = j.value("sigma_a", m_sigma_a);
+    m_sigma_s              = j.value("sigma_s", m_sigma_s);
+    m_majorants.brick_size = j.value("majorant brick size", m_majorants.brick_size);
+    if (m_majorants.brick_size < 1.f)
+        throw DartsException("\"majorant brick size\" must be at least 1 voxel, got {}.", m_majorants.brick_size);
 
     // auto bbox = m_density_grid->worldBBox();
     // m_bbox.enclose(Vec3f{bbox.min()[0], bbox.min()[1], bbox.min()[2]});
@@ -94,6 +254,8 @@ NanoVDBMedium::NanoVDBMedium(const json &j) : Medium(j)
     m_density_grid->tree().extrema(min, max);
     m_total = Vec3f(max * (m_sigma_s + m_sigma_a));
 
+    build_majorants();
+
     spdlog::info(
         R"(NanoVDBMedium info:
     filename                    : {}
@@ -106,52 +268,183 @@ NanoVDBMedium::NanoVDBMedium(const json &j) : Medium(j)
     max density                 : {}
     bbox min                    : {}
     bbox max                    : {}
+    majorant grid               : {}
     xform : {})",
         filename, m_sigma_a, m_sigma_s, m_total, m_density_handle.gridMetaData()->activeVoxelCount(),
-        toStr(m_density_handle.gridMetaData()->gridType()), min, max, m_bbox.min, m_bbox.max,
+        toStr(m_density_handle.gridMetaData()->gridType()), min, max, m_bbox.min, m_bbox.max, m_majorants.res,
         indent(fmt::format("{}", m_xform.m), string("    xform : ").length()));
 }
 
+void NanoVDBMedium::build_majorants()
+{
+    // cover the active voxels, plus the one voxel margin that trilinear interpolation reaches out of them
+    auto  ibox = m_density_grid->indexBBox();
+    Vec3f lo{float(ibox.min()[0]) - 1.f, float(ibox.min()[1]) - 1.f, float(ibox.min()[2]) - 1.f};
+    Vec3f hi{float(ibox.max()[0]) + 2.f, float(ibox.max()[1]) + 2.f, float(ibox.max()[2]) + 2.f};
+
+    m_majorants.origin = lo;
+    m_majorants.res    = max(Vec3i{ceil((hi - lo) / m_majorants.brick_size)}, Vec3i{1});
+    m_majorants.max_density.assign(product(m_majorants.res), 0.f);
+    majorant_grid_bytes += m_majorants.max_density.size() * sizeof(float);
+
+    // the leaf nodes store the maximum of the values they contain
+    auto enclose = [this](const nanovdb::Coord &ijk, float dim, float value)
+    {
+        Vec3f origin{float(ijk[0]), float(ijk[1]), float(ijk[2])};
+        m_majorants.enclose(origin - 1.f, origin + dim, value);
+    };
+
+    auto &tree = m_density_grid->tree();
+    auto *leaf = tree.getFirstNode<0>();
+    for (uint32_t i = 0; i < tree.nodeCount(0); ++i)
+        enclose(leaf[i].origin(), float(leaf[i].DIM), leaf[i].maximum());
+
+    // the maximum of an internal node also covers its children, so enclose only the region of each active tile, with
+    // that tile's own value
+    auto enclose_tiles = [&](auto &node)
+    {
+        constexpr float tile_dim = float(std::decay_t<decltype(node)>::ChildNodeType::DIM);
+        for (auto it = node.valueMask().beginOn(); it; ++it)
+        {
+            auto ijk = node.offsetToGlobalCoord(*it);
+            enclose(ijk, tile_dim, node.getValue(ijk));
+        }
+    };
+
+    auto *lower = tree.getFirstNode<1>();
+    for (uint32_t i = 0; i < tree.nodeCount(1); ++i) enclose_tiles(lower[i]);
+
+    auto *upper = tree.getFirstNode<2>();
+    for (uint32_t i = 0; i < tree.nodeCount(2); ++i) enclose_tiles(upper[i]);
+
+    // tiles at the root level are not visited above, so fall back to the global majorant if anything was missed
+    float min_density, max_density;
+    tree.extrema(min_density, max_density);
+    float max_majorant = *std::max_element(m_majorants.max_density.begin(), m_majorants.max_density.end());
+    if (max_majorant < max_density)
+    {
+        spdlog::warn("NanoVDBMedium: the majorant grid misses some of the density, using a single global majorant.");
+        std::fill(m_majorants.max_density.begin(), m_majorants.max_density.end(), max_density);
+    }
+}
+
+NanoVDBMedium::TrackingContext::TrackingContext(const NanoVDBMedium &medium, const Ray3f &ray) :
+    accessor(medium.m_density_grid->getAccessor()), lookup(accessor)
+{
+    Ray3f r   = medium.m_inv_xform.ray(ray);
+    auto  o_i = medium.m_density_grid->worldToIndexF(nanovdb::Vec3f(r.o.x, r.o.y, r.o.z));
+    auto  d_i = medium.m_density_grid->worldToIndexDirF(nanovdb::Vec3f(r.d.x, r.d.y, r.d.z));
+    o         = Vec3f{o_i[0], o_i[1], o_i[2]};
+    d         = Vec3f{d_i[0], d_i[1], d_i[2]};
+}
+
+float NanoVDBMedium::cached_density(const nanovdb::Vec3f &p) const
+{
+    // integrators query coeffs() at consecutive collisions along a ray, so keeping the accessor (and its node cache)
+    // around between calls avoids descending the tree from the root each time
+    struct ThreadCache
+    {
+        uint64_t                medium_id = 0;
+        std::optional<Accessor> accessor;
+        std::optional<Lookup>   lookup;
+    };
+    thread_local ThreadCache cache;
+    if (cache.medium_id != m_id)
+    {
+        cache.lookup.reset();
+        cache.accessor.emplace(m_density_grid->getAccessor());
+        cache.lookup.emplace(*cache.accessor);
+        cache.medium_id = m_id;
+    }
+    return (*cache.lookup)(p);
+}
+
 std::tuple<Color3f, Color3f, Color3f> NanoVDBMedium::coeffs(const Vec3f &p_) const
 {
-    Vec3f          p       = m_xform.inverse().point(p_);
+    Vec3f          p       = m_inv_xform.point(p_);
     nanovdb::Vec3f p_index = m_density_grid->worldToIndexF(nanovdb::Vec3f(p.x, p.y, p.z));
-    Lookup         sampler = Lookup(m_density_grid->tree());
-    float          d       = sampler(p_index);
+    float          d       = cached_density(p_index);
 
-    return std::make_tuple(d * m_sigma_a, d * m_sigma_s, m_total - (m_sigma_a + m_sigma_s) * d);
+    // the null coefficient fills the gap to the local majorant used for tracking
+    float majorant = m_majorants.lookup(Vec3f{p_index[0], p_index[1], p_index[2]});
+    return std::make_tuple(d * m_sigma_a, d * m_sigma_s, (m_sigma_a + m_sigma_s) * std::max(majorant - d, 0.f));
 }
 
 bool NanoVDBMedium::sample_free_flight(const Ray3f &ray, int channel, Sampler &sampler, HitInfo &hit, Color3f &f,
                                        Color3f &p) const
 {
-    // transform ray into volume's space
-    Ray3f r = m_xform.inverse().ray(ray);
+    TrackingContext ctx(*this, ray);
+
+    // delta tracking against the piecewise-constant majorant: sample an optical depth in the chosen channel, and find
+    // where the ray accumulates it while walking through the majorant cells
+    Color3f sigma_t      = m_sigma_a + m_sigma_s;
+    float   target       = -std::log(1.f - sampler.next1f());
+    Color3f optical_depth(0.f);
+    bool    collided = false;
+    m_majorants.traverse(ctx.o, ctx.d, ray.mint, ray.maxt,
+                         [&](float t0, float t1, float density)
+                         {
+                             Color3f majorant = sigma_t * density;
+                             float   depth    = majorant[channel] * (t1 - t0);
+                             if (majorant[channel] <= 0.f || depth < target)
+                             {
+                                 target -= depth;
+                                 optical_depth += majorant * (t1 - t0);
+                                 return true;
+                             }
 
-    // convert to a NanoVDB ray, and check intersection
-    auto world_ray =
-        nanovdb::Ray<float>(nanovdb::Vec3f(r.o.x, r.o.y, r.o.z), nanovdb::Vec3f(r.d.x, r.d.y, r.d.z), r.mint, r.maxt);
+                             float t = t0 + target / majorant[channel];
+                             optical_depth += majorant * (t - t0);
+                             hit.t = t;
+                             f *= exp(-optical_depth);
+                             p *= majorant * exp(-optical_depth);
+                             collided = true;
+                             return false;
+                         });
 
-    // clip grid-space ray to bounding box
-    if (!world_ray.clip(m_density_grid->worldBBox()))
+    if (collided)
     {
-        hit.t = ray.maxt;
         hit.p = ray(hit.t);
-        return false; // ray does not hit any of the medium
-    }
-    else
-    {
-        // TODO: implement this function if you want to support nanovdb media. Since we are using the null-scattering
-        // framework, this can be quite similar to what you would do in HomogeneousMedium::sample_free_flight()
-        return false;
+        return true;
     }
+
+    // passed through the medium: the probability of that is the transmittance of the majorant
+    hit.t = ray.maxt;
+    hit.p = ray(hit.t);
+    f *= exp(-optical_depth);
+    p *= exp(-optical_depth);
+    return false;
 }
 
 Color3f NanoVDBMedium::total_transmittance(const Ray3f &ray, Sampler &sampler) const
 {
-    // TODO: implement this function if you want to support nanovdb media. This can be identical to
-    // HomogeneousMedium::total_transmittance()
-    return Color3f{1.f};
+    ++num_ratio_estimates;
+
+    TrackingContext ctx(*this, ray);
+
+    // ratio tracking with a majorant shared by all channels, so a single walk estimates the transmittance of each
+    Color3f sigma_t   = m_sigma_a + m_sigma_s;
+    float   sigma_max = maxelem(sigma_t);
+    Color3f transmittance(1.f);
+    float   target = -std::log(1.f - sampler.next1f());
+    m_majorants.traverse(ctx.o, ctx.d, ray.mint, ray.maxt,
+                         [&](float t0, float t1, float density)
+                         {
+                             float majorant = sigma_max * density;
+                             float t        = t0;
+                             while (majorant > 0.f && majorant * (t1 - t) >= target)
+                             {
+                                 t += target / majorant;
+                                 ++num_ratio_lookups;
+                                 transmittance *= 1.f - sigma_t * ctx.density(t) / majorant;
+                                 target = -std::log(1.f - sampler.next1f());
+                                 if (maxelem(transmittance) <= 0.f)
+                                     return false;
+                             }
+                             target -= majorant * (t1 - t);
+                             return true;
+                         });
+    return max(transmittance, Color3f(0.f));
 }
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Medium, NanoVDBMedium, "nanovdb")
@@ -0,0 +1,154 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <atomic>
+#include <darts/numa.h>
+#include <darts/parallel.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+bool             g_numa_replication = false;
+thread_local int g_numa_node        = -1; ///< The NUMA node the calling thread is pinned to
+
+/// Parse a Linux CPU list like "0-7,16-23" into the CPU indices
+vector<int> parse_cpu_list(const string &list)
+{
+    vector<int>       cpus;
+    std::stringstream stream(list);
+    string            range;
+    while (std::getline(stream, range, ','))
+    {
+        int first = 0, last = 0;
+        int n     = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n == 1)
+            last = first;
+        if (n >= 1)
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+vector<vector<int>> detect_numa_nodes()
+{
+    vector<vector<int>> nodes;
+#if defined(__linux__)
+    for (int n = 0;; ++n)
+    {
+        std::ifstream file(fmt::format("/sys/devices/system/node/node{}/cpulist", n));
+        if (!file.good())
+            break;
+        string list;
+        std::getline(file, list);
+        if (auto cpus = parse_cpu_list(list); !cpus.empty())
+            nodes.push_back(cpus);
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        nodes.emplace_back(std::max(1u, std::thread::hardware_concurrency()));
+        for (int cpu = 0; cpu < int(nodes[0].size()); ++cpu) nodes[0][cpu] = cpu;
+    }
+    return nodes;
+}
+
+/// Restrict the calling thread to \p cpus, returning false if that isn't supported
+bool pin_current_thread(const vector<int> &cpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+} // namespace
+
+const vector<vector<int>> &numa_nodes()
+{
+    static const vector<vector<int>> nodes = detect_numa_nodes();
+    return nodes;
+}
+
+int numa_node()
+{
+    return g_numa_node;
+}
+
+void pin_pool_threads(const string &mode)
+{
+    if (mode == "none")
+        return;
+    if (mode != "core" && mode != "socket")
+        throw DartsException("Unrecognized thread pinning mode \"{}\", expected \"none\", \"core\", or \"socket\".",
+                             mode);
+
+    auto &nodes = numa_nodes();
+
+    // spread the threads round-robin over the nodes, so that all nodes share the load even with few threads
+    std::atomic<int>  next_thread(0);
+    std::atomic<bool> failed(false);
+    for_each_thread(
+        [&]()
+        {
+            int   thread = next_thread++;
+            int   node   = thread % int(nodes.size());
+            auto &cpus   = nodes[node];
+            bool  pinned = mode == "core" ? pin_current_thread({cpus[(thread / nodes.size()) % cpus.size()]})
+                                          : pin_current_thread(cpus);
+            if (pinned)
+                g_numa_node = node;
+            else
+                failed = true;
+        });
+
+    if (failed)
+        spdlog::warn("Could not pin all threads to CPUs on this platform.");
+    else
+        spdlog::info("Pinned {} threads to {} across {} NUMA node(s).", next_thread.load(),
+                     mode == "core" ? "individual CPUs" : "the CPUs of their node", nodes.size());
+}
+
+void set_numa_replication(bool enable)
+{
+    g_numa_replication = enable && numa_nodes().size() > 1;
+    if (enable && !g_numa_replication)
+        spdlog::info("The machine has a single NUMA node, so the BBHs are not replicated.");
+}
+
+bool numa_replication()
+{
+    return g_numa_replication;
+}
+
+void run_on_numa_node(int node, const std::function<void()> &func)
+{
+    std::thread thread(
+        [&]()
+        {
+            pin_current_thread(numa_nodes()[node]);
+            func();
+        });
+    thread.join();
+}
+
+/**
+    \file
+    \brief Implementation of the NUMA utilities
+*/
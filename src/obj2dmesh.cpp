@@ -0,0 +1,88 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+/**
+    \file
+    \brief Utility program to convert OBJ files to the binary mesh format
+*/
+
+#include <CLI/CLI.hpp>
+#include <darts/factory.h>
+#include <darts/mesh.h>
+#include <fstream>
+#include <set>
+
+/**
+    Convert an OBJ file to the binary mesh format described in dmesh.h
+ */
+int main(int argc, char **argv)
+{
+    string infile, outfile;
+    bool   quantize  = false;
+    int    verbosity = spdlog::get_level();
+
+    CLI::App app{"\nConvert an OBJ file to a binary mesh (.dmesh) file, which darts can load much faster.\n"
+                 "The material names of the faces are kept, and are looked up in the scene when the mesh is loaded."};
+
+    app.get_formatter()->column_width(35);
+
+    app.add_option("infile", infile, "The OBJ file to convert.")->required()->check(CLI::ExistingFile);
+    app.add_option("-o,--outfile", outfile, "The binary mesh file to write; default: infile with a .dmesh extension.");
+    app.add_flag("-q,--quantize", quantize, "Quantize the vertex positions to 16 bits within the mesh bounds.");
+    app.add_option("-v,--verbosity", verbosity,
+                   R"(Set verbosity threshold T with lower values meaning more verbose
+and higher values removing low-priority messages. All messages with
+severity >= T are displayed, where the severities are:
+    trace    = 0
+    debug    = 1
+    info     = 2
+    warn     = 3
+    err      = 4
+    critical = 5
+    off      = 6
+The default is 2 (info).)")
+        ->check(CLI::Range(0, 6));
+
+    try
+    {
+        CLI11_PARSE(app, argc, argv);
+
+        darts_init(verbosity);
+
+        if (outfile.empty())
+            outfile = infile.substr(0, infile.find_last_of('.')) + ".dmesh";
+
+        // the mesh only keeps the names of materials that exist, so declare a placeholder for each one in the file
+        std::set<string> material_names;
+        std::ifstream    is(infile);
+        for (string line; std::getline(is, line);)
+        {
+            auto start = line.find_first_not_of(" \t");
+            if (start == string::npos || line.compare(start, 7, "usemtl ") != 0)
+                continue;
+            auto name_start = line.find_first_not_of(" \t", start + 7);
+            auto name_end   = line.find_last_not_of(" \t\r");
+            if (name_start != string::npos && name_end >= name_start)
+                material_names.insert(line.substr(name_start, name_end - name_start + 1));
+        }
+        auto placeholder = DartsFactory<Material>::create(json{{"type", "lambertian"}});
+        for (auto &name : material_names) DartsFactory<Material>::register_instance(name, placeholder);
+
+        Mesh mesh(json{{"filename", infile}, {"material", {{"type", "lambertian"}}}});
+
+        spdlog::info("Writing {} vertices, {} normals, {} texture coordinates, {} faces, and {} materials to '{}'.",
+                     mesh.vs.size(), mesh.ns.size(), mesh.uvs.size(), mesh.Fv.size(), mesh.material_names.size() - 1,
+                     outfile);
+        mesh.save_dmesh(outfile, quantize);
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::error("{}", e.what());
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
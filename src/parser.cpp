@@ -3,10 +3,18 @@
 
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
+#include <darts/cache.h>
+#include <darts/environment.h>
 #include <darts/factory.h>
+#include <darts/integrator.h>
+#include <darts/medium.h>
+#include <darts/parallel.h>
 #include <darts/scene.h>
 #include <darts/sphere.h>
 #include <darts/stats.h>
+#include <exception>
+#include <filesystem/resolver.h>
+#include <fstream>
 
 // anonymous namespace for variables/functions local to this file
 namespace
@@ -25,15 +33,191 @@ string check_key(const string &key, const string &parent, const json &j)
     }
 }
 
+/// Collect the names that the surface specification \p j defines, and the names of the surfaces it refers to
+void surface_names(const json &j, set<string> &defined, set<string> &referenced)
+{
+    if (j.is_object())
+    {
+        if (auto it = j.find("name"); it != j.end() && it->is_string())
+            defined.insert(it->get<string>());
+        if (auto it = j.find("surface"); it != j.end() && it->is_string())
+            referenced.insert(it->get<string>());
+    }
+    if (j.is_structured())
+        for (auto &v : j) surface_names(v, defined, referenced);
+}
+
+/// Add the signatures of all files that \p j (recursively) refers to with a \c "filename" to \p hasher
+void hash_files(const json &j, Hasher &hasher)
+{
+    if (j.is_object())
+        if (auto it = j.find("filename"); it != j.end() && it->is_string())
+            hasher.add_pod(file_signature(get_file_resolver().resolve(it->get<string>()).str()));
+    if (j.is_structured())
+        for (auto &v : j) hash_files(v, hasher);
+}
+
+/// Stands in for the scene while a top-level surface is created, collecting the surfaces it adds to its parent
+struct SurfaceCollector : public Surface
+{
+    vector<shared_ptr<Surface>> children;
+
+    void add_child(shared_ptr<Surface> surface) override
+    {
+        children.push_back(surface);
+    }
+
+    Box3f bounds() const override
+    {
+        return Box3f();
+    }
+};
+
 } // namespace
 
 STAT_COUNTER("Scene/Materials", num_materials_created);
+STAT_COUNTER("Scene/Media", num_media_created);
 STAT_COUNTER("Scene/Surfaces", num_surfaces_created);
+STAT_COUNTER("Scene/Sampled emitters", num_sampled_emitters);
+STAT_COUNTER("Scene/Surfaces created while streaming the file", num_surfaces_streamed);
+STAT_TIMER("Time/Scene parsing", parse_time);
+STAT_TIMER("Time/Scene parsing/Surfaces", surface_parse_time);
 
 void Scene::parse(const json &j)
 {
+    SCOPED_STAT_TIMER(parse_time);
     spdlog::info("Parsing scene ...");
 
+    parse_settings(j);
+
+    Hasher surfaces_hash;
+    if (j.contains("surfaces"))
+        parse_surfaces(j["surfaces"], j, surfaces_hash);
+
+    finish_parsing(j, surfaces_hash);
+
+    spdlog::info("done parsing scene.");
+}
+
+json Scene::parse_file(const string &filename)
+{
+    std::ifstream stream(filename, std::ifstream::in);
+    if (!stream.good())
+        throw DartsException("Cannot open file: {}.", filename);
+
+    // the surfaces are created in batches of this many, so only one batch of their json is kept in memory
+    constexpr size_t batch_size = 1024;
+
+    json               j, preamble = json::object(), batch = json::array();
+    string             key;                    // the top-level key whose value is being read
+    bool               streaming      = false; // whether the surfaces are created as they are read
+    bool               after_surfaces = false; // whether another top-level field followed "surfaces"
+    std::exception_ptr error;
+    Hasher             surfaces_hash;
+
+    // create the batch of read surfaces, remembering the first error instead of throwing it through the parser
+    auto flush = [&]()
+    {
+        if (!error && !batch.empty())
+        {
+            try
+            {
+                num_surfaces_streamed += batch.size();
+                parse_surfaces(batch, preamble, surfaces_hash);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+        batch = json::array();
+    };
+
+    auto callback = [&](int depth, json::parse_event_t event, json &parsed)
+    {
+        using Event = json::parse_event_t;
+        bool done   = event == Event::object_end || event == Event::array_end || event == Event::value;
+
+        if (depth == 1 && event == Event::key)
+        {
+            after_surfaces = after_surfaces || key == "surfaces";
+            key            = parsed.get<string>();
+        }
+        else if (depth == 1 && event == Event::array_start && key == "surfaces" && !after_surfaces)
+        {
+            // everything that surfaces can refer to has been read by now, provided that "surfaces" comes last
+            try
+            {
+                parse_settings(preamble);
+                streaming = true;
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+        else if (depth == 1 && done && key != "surfaces")
+            preamble[key] = parsed;
+        else if (depth == 2 && done && key == "surfaces" && streaming && !after_surfaces && !error)
+        {
+            // take the surface out of the json, so the array never holds more than one element
+            batch.push_back(std::move(parsed));
+            if (batch.size() >= batch_size)
+                flush();
+            return false;
+        }
+        return true;
+    };
+
+    {
+        SCOPED_STAT_TIMER(parse_time);
+        spdlog::info("Parsing scene file \"{}\" ...", filename);
+        j = json::parse(stream, callback,
+                        /* allow exceptions */ true,
+                        /* ignore_comments */ true);
+        flush();
+    }
+
+    if (!streaming)
+    {
+        // a file of tests is left to the caller
+        if (j.contains("type") && j["type"] == "tests")
+            return j;
+
+        // no surfaces were created yet, so the json is complete
+        parse(j);
+        return j;
+    }
+
+    if (after_surfaces)
+    {
+        // the fields following the surfaces might have been needed to create them, so start over
+        spdlog::info("Parsing scene file \"{}\" again as a whole, since \"surfaces\" is not its last field.", filename);
+        std::ifstream again(filename, std::ifstream::in);
+        j = json::parse(again, nullptr, true, true);
+        parse(j);
+        return j;
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    {
+        SCOPED_STAT_TIMER(parse_time);
+        finish_parsing(j, surfaces_hash);
+    }
+    spdlog::info("done parsing scene.");
+    return j;
+}
+
+void Scene::parse_settings(const json &j)
+{
+    //
+    // named instances are only visible within the scene that declared them, not in later frames of a batch
+    //
+    DartsFactory<Medium>::clear_instances();
+    DartsFactory<Material>::clear_instances();
+    DartsFactory<Surface>::clear_instances();
 
     //
     // check for and parse the camera specification
@@ -49,6 +233,54 @@ void Scene::parse(const json &j)
     if (j.contains("sampler") && j["sampler"].contains("samples"))
         m_num_samples = j["sampler"]["samples"];
 
+    //
+    // create the sampler that provides the random numbers during rendering (each tile uses its own clone)
+    //
+    {
+        json s = j.value("sampler", json::object());
+        if (!s.contains("type"))
+            s["type"] = "independent";
+        s["samples"]   = m_num_samples;
+        m_sampler      = DartsFactory<Sampler>::create(s);
+        m_sampler_spec = s;
+        m_sampler->set_base_seed(random_seed);
+    }
+
+    //
+    // read the tile size and tile ordering used to distribute the rendering across threads
+    //
+    if (j.contains("sampler"))
+    {
+        m_tile_size  = j["sampler"].value("tile_size", m_tile_size);
+        m_tile_order = j["sampler"].value("tile_order", m_tile_order);
+        if (m_tile_size <= 0)
+            throw DartsException("'tile_size' must be positive, got {}.", m_tile_size);
+        if (m_tile_order != "hilbert" && m_tile_order != "spiral" && m_tile_order != "scanline")
+            throw DartsException("Unknown 'tile_order' \"{}\". Expected one of \"hilbert\", \"spiral\", or "
+                                 "\"scanline\".",
+                                 m_tile_order);
+
+        // read the (optional) adaptive sampling parameters
+        m_target_error  = j["sampler"].value("target_error", m_target_error);
+        m_min_samples   = j["sampler"].value("min_samples", m_min_samples);
+        m_round_samples = j["sampler"].value("round_samples", m_round_samples);
+        if (m_target_error < 0.f)
+            throw DartsException("'target_error' must not be negative, got {}.", m_target_error);
+        if (m_min_samples < 2 || m_round_samples < 1)
+            throw DartsException("Adaptive sampling needs 'min_samples' >= 2 and 'round_samples' >= 1, got {} and {}.",
+                                 m_min_samples, m_round_samples);
+
+        // the format of the accumulation buffers: more compact formats make very large renderings fit in memory
+        if (j["sampler"].contains("framebuffer"))
+            m_framebuffer_format = parse_pixel_format(j["sampler"]["framebuffer"].get<string>());
+    }
+
+    //
+    // create the integrator (if none is specified, fall back to Scene::recursive_color())
+    //
+    if (j.contains("integrator"))
+        m_integrator = DartsFactory<Integrator>::create(j["integrator"]);
+
     //
     // create the scene-wide acceleration structure so we can put other surfaces into it
     //
@@ -63,8 +295,32 @@ void Scene::parse(const json &j)
     //
     if (j.contains("background"))
     {
-        m_background  = j["background"].get<Color3f>();
+        if (j["background"].is_object())
+        {
+            const json &b = j["background"];
+            if (b.value("type", "") != "environment")
+                throw DartsException("A background object needs to be of type \"environment\" here:\n{}", b.dump(4));
+            m_environment = make_shared<Environment>(b);
+        }
+        else
+            m_background = j["background"].get<Color3f>();
+    }
+
+    //
+    // parse media, which materials and the camera can refer to by name. Their phase functions need to be specified
+    // inline, since materials are only parsed afterwards
+    //
+    if (j.contains("media"))
+    {
+        for (auto &m : j["media"])
+        {
+            auto medium = DartsFactory<Medium>::create(m);
+            DartsFactory<Medium>::register_instance(check_key("name", "medium", m), medium);
+            ++num_media_created;
+        }
     }
+    if (j["camera"].contains("medium"))
+        m_medium = DartsFactory<Medium>::find(j["camera"], "medium");
 
     //
     // parse materials
@@ -79,25 +335,76 @@ void Scene::parse(const json &j)
             ++num_materials_created;
         }
     }
+}
 
-    //
-    // parse surfaces
-    //
-    if (j.contains("surfaces"))
+void Scene::parse_surfaces(const json &specs, const json &j, Hasher &surfaces_hash)
+{
+    SCOPED_STAT_TIMER(surface_parse_time);
+
+    // The surfaces are created and built concurrently, in batches of consecutive entries that don't refer to surfaces
+    // named within the same batch (those are only registered once they exist). Each batch is then added to the scene
+    // in file order, so the scene doesn't depend on which task finishes first.
+    for (size_t begin = 0, end; begin < specs.size(); begin = end)
     {
-        for (auto &s : j["surfaces"])
+        set<string> batch_names;
+        for (end = begin; end < specs.size(); ++end)
+        {
+            set<string> defined, referenced;
+            surface_names(specs[end], defined, referenced);
+            if (end > begin && std::any_of(referenced.begin(), referenced.end(),
+                                           [&](const string &name) { return batch_names.count(name) > 0; }))
+                break;
+            batch_names.insert(defined.begin(), defined.end());
+        }
+
+        vector<SurfaceCollector>    collected(end - begin);
+        vector<shared_ptr<Surface>> surfaces(end - begin);
+        vector<std::exception_ptr>  errors(end - begin);
+        parallel_for(blocked_range<size_t>(begin, end, 1),
+                     [&](blocked_range<size_t> r)
+                     {
+                         for (auto i : r)
+                         {
+                             try
+                             {
+                                 auto &surface = surfaces[i - begin];
+                                 surface       = DartsFactory<Surface>::create(specs[i]);
+                                 surface->add_to_parent(&collected[i - begin], surface, j);
+                                 surface->build(); // in case this top-level surface is a group, build it now
+                             }
+                             catch (...)
+                             {
+                                 errors[i - begin] = std::current_exception();
+                             }
+                         }
+                     });
+
+        for (size_t i = begin; i < end; ++i)
         {
-            auto surface = DartsFactory<Surface>::create(s);
-            surface->add_to_parent(this, surface, j);
-            surface->build(); // in case this top-level surface is a group, build it now
+            if (errors[i - begin])
+                std::rethrow_exception(errors[i - begin]);
+
+            // named surfaces can be looked up later, e.g. to move them in the render server mode of darts
+            if (specs[i].contains("name"))
+                DartsFactory<Surface>::register_instance(specs[i]["name"].get<string>(), surfaces[i - begin]);
+            for (auto &child : collected[i - begin].children) add_child(child);
             ++num_surfaces_created;
+
+            if (cache_enabled())
+            {
+                surfaces_hash.add(specs[i].dump());
+                hash_files(specs[i], surfaces_hash);
+            }
         }
     }
+}
 
+void Scene::finish_parsing(const json &j, const Hasher &surfaces_hash)
+{
     // set of all fields we'd expect to see at the top level of a darts scene
     // some of these are not yet supported, but we include them to be future-proof
-    set<string> toplevel_fields{"integrator",  "media",  "materials", "surfaces",
-                                "accelerator", "camera", "sampler",   "background"};
+    set<string> toplevel_fields{"integrator", "media",   "materials",  "surfaces", "accelerator",
+                                "camera",     "sampler", "background", "denoiser"};
 
     // now loop through all keys in the json file to see if there are any that we don't recognize
     for (auto it = j.begin(); it != j.end(); ++it)
@@ -105,5 +412,23 @@ void Scene::parse(const json &j)
             throw DartsException("Unsupported field '{}' here:\n{}", it.key(), it.value().dump(4));
 
     m_surfaces->build();
-    spdlog::info("done parsing scene.");
+    num_sampled_emitters += m_surfaces->num_emitters(); // nested groups sample their own emitters, so aren't counted
+
+    //
+    // hash everything but the view and the rendering method, so view-independent data can be cached. The surfaces
+    // were hashed while they were created, since a streamed scene file doesn't keep their json
+    //
+    if (cache_enabled())
+    {
+        json lighting = json::object();
+        for (auto it = j.begin(); it != j.end(); ++it)
+            if (it.key() != "camera" && it.key() != "sampler" && it.key() != "integrator" && it.key() != "surfaces")
+                lighting[it.key()] = it.value();
+
+        Hasher hasher = surfaces_hash;
+        hasher.add(lighting.dump());
+        hash_files(lighting, hasher);
+        hasher.add_pod(m_camera->shutter()); // photons are traced at times within the camera's shutter interval
+        m_lighting_hash = hasher.value();
+    }
 }
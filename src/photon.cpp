@@ -3,6 +3,7 @@
 
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
+#include <darts/parallel.h>
 #include <darts/photon.h>
 
 bool  Photon::m_precomp_table_ready = Photon::initialize();
@@ -32,6 +33,8 @@ Photon::Photon(const Vec3f &dir, const Color3f &power)
     if (!la::all(gequal(power, 0.f) & la::isfinite(power)))
         spdlog::warn("Creating an invalid photon with power: {}", power);
 
+    flags = 0;
+
     // Convert the direction into an approximate spherical coordinate format to reduce storage requirements
     theta = (uint8_t)std::min(255, (int)(std::acos(dir.z) * (256.0f / M_PI)));
 
@@ -59,3 +62,69 @@ Photon::Photon(const Vec3f &dir, const Color3f &power)
         rgbe[3] = e + 128; // Exponent value in bias format
     }
 }
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// A k-nearest-neighbor search over the ordinary photons that arrive at the front side of a surface with #normal
+struct IrradianceSearch : public KNNSearch
+{
+    Vec3f normal;
+
+    IrradianceSearch(float md2, unsigned max_count) : KNNSearch(Vec3f(0.f), md2, max_count), normal(0.f)
+    {
+    }
+
+    void check(const PhotonMap::Node &photon)
+    {
+        check(photon, length2(photon.position - query_position));
+    }
+
+    void check(const PhotonMap::Node &photon, float dist2)
+    {
+        if (!photon.data.is_radiance_photon() && dot(photon.data.direction(), normal) < 0.f)
+            KNNSearch::check(photon, dist2);
+    }
+};
+
+} // namespace
+
+size_t precompute_radiance_photons(PhotonMap &photons, int k, float max_dist2, float scale)
+{
+    vector<uint32_t> indices;
+    for (uint32_t i = 0; i < photons.size(); ++i)
+        if (photons.nodes[i].data.is_radiance_photon())
+            indices.push_back(i);
+
+    // estimate all irradiances before storing any, so the searches only ever read the photon map
+    vector<Color3f> irradiance(indices.size(), Color3f(0.f));
+    parallel_for(blocked_range<size_t>(0, indices.size(), 1024),
+                 [&](blocked_range<size_t> r)
+                 {
+                     IrradianceSearch search(max_dist2, unsigned(k));
+                     for (auto i : r)
+                     {
+                         const auto &node = photons.nodes[indices[i]];
+                         search.normal    = node.data.direction();
+                         search.reset(node.position);
+                         photons.find(search);
+                         if (search.results.empty())
+                             continue;
+
+                         // the radius of the estimate is the distance to the farthest photon found, if there were k
+                         Color3f power(0.f);
+                         for (auto &result : search.results) power += result.photon->data.power();
+                         irradiance[i] = power * scale / (float(M_PI) * search.max_dist2);
+                     }
+                 });
+
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        Photon &photon = photons.nodes[indices[i]].data;
+        Photon  stored(photon.direction(), irradiance[i]);
+        std::copy(stored.rgbe, stored.rgbe + 4, photon.rgbe);
+    }
+
+    return indices.size();
+}
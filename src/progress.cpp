@@ -45,6 +45,12 @@ namespace
 std::atomic<bool> received_signal(false);
 std::atomic<bool> monitoring_signal(false);
 
+// A flag that, when set, means SIGINT was received while interrupts were being caught.
+std::atomic<bool> received_interrupt(false);
+
+// A flag that, when set, means new progress bars are silent.
+std::atomic<bool> progress_silent(false);
+
 // Determine the width of the terminal we're running on.
 int terminal_width()
 {
@@ -104,17 +110,54 @@ void signal_handler(int sig)
 }
 #endif
 
+void interrupt_handler(int sig)
+{
+    if (sig == SIGINT)
+    {
+        // a second Ctrl-C terminates right away
+        if (received_interrupt.exchange(true))
+        {
+            signal(SIGINT, SIG_DFL);
+            raise(SIGINT);
+        }
+        signal(SIGINT, interrupt_handler);
+    }
+}
+
 } // namespace
 
-Progress::Progress(const string &title, int64_t totalWork) : m_title(title), m_num_steps(totalWork), m_steps_done(0)
+void catch_interrupts(bool enable)
+{
+    received_interrupt = false;
+    signal(SIGINT, enable ? interrupt_handler : SIG_DFL);
+}
+
+bool interrupted()
+{
+    return received_interrupt;
+}
+
+void set_progress_silent(bool silent)
+{
+    progress_silent = silent;
+}
+
+Progress::Progress(const string &title, int64_t totalWork, bool silent) :
+    m_title(title), m_num_steps(totalWork), m_steps_done(0)
 {
-    fflush(stdout);
     m_exit = false;
 
     // zero total work doesn't make sense. use a busy progress instead.
     if (m_num_steps == 0)
         m_num_steps = -3000;
 
+    // a silent progress bar just counts the steps
+    m_silent = silent || progress_silent || spdlog::get_level() > spdlog::level::info;
+    if (m_silent)
+        return;
+
+    fflush(stdout);
+
 #ifdef SIGWINCH
     if (!monitoring_signal.exchange(true))
         signal(SIGWINCH, signal_handler);
@@ -216,6 +259,9 @@ void Progress::set_done()
     m_steps_done = m_num_steps;
     m_exit       = true;
 
+    if (m_silent)
+        return;
+
     if (m_update_thread.joinable())
         m_update_thread.join();
 
@@ -0,0 +1,78 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/low_discrepancy.h>
+#include <darts/sampler.h>
+#include <darts/sampling.h>
+
+/**
+    %HaltonSampler - generates points of the Halton sequence, with random digit scrambling.
+
+    Dimension \c i of the sequence is the radical inverse of the sample index in the \c i-th prime base. Each pixel
+    randomly shifts the digits of each dimension by amounts derived from the pixel coordinates and the base seed,
+    which decorrelates neighboring pixels without destroying the stratification of the sequence.
+
+    Dimensions beyond #num_halton_dimensions reuse the prime bases, with an offset sample index.
+
+    \ingroup Samplers
+*/
+class HaltonSampler : public Sampler
+{
+public:
+    HaltonSampler(const json &j)
+    {
+        m_sample_count = j.at("samples").get<int>();
+    }
+
+    /// Create an exact clone of the current instance
+    std::unique_ptr<Sampler> clone() const override
+    {
+        return std::make_unique<HaltonSampler>(*this);
+    }
+
+    void seed(int x, int y) override
+    {
+        Sampler::seed(x, y);
+        m_pixel_seed = hash_combine(hash2d(x, y), m_base_seed);
+    }
+
+    /// Each pixel uses its own scrambled sequence, starting at the first sample
+    void start_pixel(int x, int y) override
+    {
+        seed(x, y);
+    }
+
+    float next1f() override
+    {
+        return sample(m_current_dimension++);
+    }
+
+    Vec2f next2f() override
+    {
+        float f1 = sample(m_current_dimension);
+        float f2 = sample(m_current_dimension + 1);
+        m_current_dimension += 2;
+        return {f1, f2};
+    }
+
+protected:
+    /// Dimension \p dim of the current sample
+    float sample(uint32_t dim) const
+    {
+        uint32_t block = dim / num_halton_dimensions;
+        uint32_t index = m_current_sample + (block ? hash_combine(m_pixel_seed, block) >> 8 : 0u);
+        return radical_inverse(index, dim % num_halton_dimensions, hash_combine(m_pixel_seed, dim) | 1u);
+    }
+
+    uint32_t m_pixel_seed = 0;
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Sampler, HaltonSampler, "halton")
+
+/**
+    \file
+    \brief HaltonSampler Sampler
+*/
@@ -38,6 +38,8 @@ public:
         cloned->m_current_dimension = m_current_dimension;
 
         cloned->m_rng = m_rng;
+        cloned->m_x   = m_x;
+        cloned->m_y   = m_y;
         return std::move(cloned);
     }
 
@@ -50,9 +52,24 @@ public:
     void seed(int x, int y) override
     {
         Sampler::seed(x, y);
+        m_x = x;
+        m_y = y;
         m_rng.seed(m_base_seed + x, m_base_seed + y);
     }
 
+    /// Each pixel uses its own random number stream
+    void start_pixel(int x, int y) override
+    {
+        seed(x, y);
+    }
+
+    /// Reseed the random number generator so each sample of a pixel uses its own, reproducible, random numbers
+    void set_sample(uint32_t index) override
+    {
+        Sampler::set_sample(index);
+        m_rng.seed((uint64_t(index) << 32) + m_base_seed + m_x, m_base_seed + m_y);
+    }
+
     float next1f() override
     {
         m_current_dimension++;
@@ -73,6 +90,7 @@ protected:
     }
 
     pcg32 m_rng;
+    int   m_x = 0, m_y = 0; ///< The pixel or region passed to #seed()
 };
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Sampler, IndependentSampler, "independent")
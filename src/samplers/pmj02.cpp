@@ -0,0 +1,76 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/low_discrepancy.h>
+#include <darts/sampler.h>
+#include <darts/sampling.h>
+
+/**
+    %PMJ02Sampler - generates padded progressive multi-jittered (0,2) points.
+
+    Every prefix of a progressive multi-jittered (0,2) sequence whose length is a power of two is stratified in all
+    two-dimensional elementary intervals: it is jittered, multi-jittered, and (0,2)-stratified at the same time. We
+    generate such points stochastically by Owen scrambling the first two Sobol dimensions, which form a (0,2)-sequence.
+
+    Instead of using higher-dimensional points, each call to #next1f() or #next2f() uses an independently scrambled
+    and shuffled copy of the sequence ("padding"). This ensures that every one- and two-dimensional projection of the
+    samples is well stratified, without the correlation between dimensions that higher Sobol dimensions may have.
+
+    \ingroup Samplers
+*/
+class PMJ02Sampler : public Sampler
+{
+public:
+    PMJ02Sampler(const json &j)
+    {
+        m_sample_count = j.at("samples").get<int>();
+    }
+
+    /// Create an exact clone of the current instance
+    std::unique_ptr<Sampler> clone() const override
+    {
+        return std::make_unique<PMJ02Sampler>(*this);
+    }
+
+    void seed(int x, int y) override
+    {
+        Sampler::seed(x, y);
+        m_pixel_seed = hash_combine(hash2d(x, y), m_base_seed);
+    }
+
+    /// Each pixel uses its own scrambled sequence, starting at the first sample
+    void start_pixel(int x, int y) override
+    {
+        seed(x, y);
+    }
+
+    float next1f() override
+    {
+        uint32_t seed  = hash_combine(m_pixel_seed, m_current_dimension++);
+        uint32_t index = nested_uniform_scramble(m_current_sample, seed);
+        return bits_to_float(nested_uniform_scramble(sobol(index, 0), hash_combine(seed, 0)));
+    }
+
+    Vec2f next2f() override
+    {
+        uint32_t seed  = hash_combine(m_pixel_seed, m_current_dimension);
+        uint32_t index = nested_uniform_scramble(m_current_sample, seed);
+        float    f1    = bits_to_float(nested_uniform_scramble(sobol(index, 0), hash_combine(seed, 0)));
+        float    f2    = bits_to_float(nested_uniform_scramble(sobol(index, 1), hash_combine(seed, 1)));
+        m_current_dimension += 2;
+        return {f1, f2};
+    }
+
+protected:
+    uint32_t m_pixel_seed = 0;
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Sampler, PMJ02Sampler, "pmj02")
+
+/**
+    \file
+    \brief PMJ02Sampler Sampler
+*/
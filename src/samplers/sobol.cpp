@@ -0,0 +1,94 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/low_discrepancy.h>
+#include <darts/sampler.h>
+#include <darts/sampling.h>
+
+/**
+    %SobolSampler - generates Owen-scrambled Sobol points.
+
+    Each pixel uses the same Sobol sequence, but it is decorrelated from the neighboring pixels by hash-based Owen
+    scrambling (seeded by the pixel coordinates and the base seed), both of the point coordinates and of the order of
+    the samples. This keeps the excellent stratification of the Sobol sequence within each pixel, for any power-of-two
+    number of samples, while turning structured aliasing into noise.
+
+    Dimensions beyond #num_sobol_dimensions reuse the Sobol dimensions, with a differently shuffled sample order.
+
+    With <tt>"blue_noise": true</tt>, all pixels instead share the same scrambled sequence, and each pixel toroidally
+    shifts each dimension of it by the value of a blue-noise mask (see #blue_noise()). Each pixel still gets a
+    stratified point set, but the errors of neighboring pixels are negatively correlated: at low sample counts (e.g.
+    previews with 1-16 samples per pixel) the noise is spread as blue noise, which looks much smoother than white noise
+    of the same magnitude.
+
+    \ingroup Samplers
+*/
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler(const json &j)
+    {
+        m_sample_count = j.at("samples").get<int>();
+        m_blue_noise   = j.value("blue_noise", m_blue_noise);
+    }
+
+    /// Create an exact clone of the current instance
+    std::unique_ptr<Sampler> clone() const override
+    {
+        return std::make_unique<SobolSampler>(*this);
+    }
+
+    void seed(int x, int y) override
+    {
+        Sampler::seed(x, y);
+        m_x          = x;
+        m_y          = y;
+        m_pixel_seed = m_blue_noise ? m_base_seed : hash_combine(hash2d(x, y), m_base_seed);
+    }
+
+    /// Each pixel uses its own scrambled sequence, starting at the first sample
+    void start_pixel(int x, int y) override
+    {
+        seed(x, y);
+    }
+
+    float next1f() override
+    {
+        return bits_to_float(sample(m_current_dimension++));
+    }
+
+    Vec2f next2f() override
+    {
+        float f1 = bits_to_float(sample(m_current_dimension));
+        float f2 = bits_to_float(sample(m_current_dimension + 1));
+        m_current_dimension += 2;
+        return {f1, f2};
+    }
+
+protected:
+    /// Dimension \p dim of the current sample, as 32-bit fixed point
+    uint32_t sample(uint32_t dim) const
+    {
+        uint32_t block_seed = hash_combine(m_pixel_seed, dim / num_sobol_dimensions);
+        uint32_t index      = nested_uniform_scramble(m_current_sample, block_seed);
+        uint32_t point      = sobol(index, dim % num_sobol_dimensions);
+        uint32_t value      = nested_uniform_scramble(point, hash_combine(block_seed, dim));
+
+        // the shift wraps around in fixed point (a Cranley-Patterson rotation)
+        return m_blue_noise ? value + blue_noise(m_x, m_y, hash_combine(m_base_seed, dim)) : value;
+    }
+
+    uint32_t m_pixel_seed = 0;
+    int      m_x = 0, m_y = 0;     ///< The current pixel
+    bool     m_blue_noise = false; ///< Whether to decorrelate the pixels with a blue-noise mask
+};
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Sampler, SobolSampler, "sobol")
+
+/**
+    \file
+    \brief SobolSampler Sampler
+*/
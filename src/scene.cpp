@@ -4,14 +4,118 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/environment.h>
+#include <darts/integrator.h>
+#include <darts/parallel.h>
 #include <darts/scene.h>
 #include <darts/progress.h>
+#include <darts/sampling.h>
 #include <darts/stats.h>
 #include <fstream>
 #include <spdlog/sinks/stdout_sinks.h>
+#include <spdlog/stopwatch.h>
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// Convert distance \p d along a Hilbert curve covering an \p n x \p n grid (n a power of two) to grid coordinates
+Vec2i hilbert_to_xy(int n, int d)
+{
+    Vec2i p(0, 0);
+    for (int s = 1; s < n; s *= 2)
+    {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0)
+        {
+            if (rx == 1)
+                p = Vec2i(s - 1) - p;
+            std::swap(p.x, p.y);
+        }
+        p += Vec2i(s * rx, s * ry);
+        d /= 4;
+    }
+    return p;
+}
+
+/**
+    Split a \p size image into square tiles with side length \p tile_size.
+
+    The tiles are returned in the order they should be rendered: along a Hilbert curve (for coherent memory access
+    between consecutive tiles), in a spiral from the image center outwards (so the interesting part of the image
+    shows up first), or in plain scanline order. Tiles along the right and bottom image borders are clipped.
+
+    The returned boxes store the inclusive lower and exclusive upper pixel coordinates of each tile.
+*/
+vector<Box2i> generate_tiles(const Vec2i &size, int tile_size, const string &order)
+{
+    Vec2i num_tiles = (size + tile_size - 1) / tile_size;
+
+    vector<Vec2i> coords;
+    coords.reserve(num_tiles.x * num_tiles.y);
+    if (order == "hilbert")
+    {
+        int n = 1;
+        while (n < max(num_tiles.x, num_tiles.y)) n *= 2;
+
+        for (int d = 0; d < n * n; ++d)
+        {
+            Vec2i t = hilbert_to_xy(n, d);
+            if (t.x < num_tiles.x && t.y < num_tiles.y)
+                coords.push_back(t);
+        }
+    }
+    else
+    {
+        for (auto y : range(num_tiles.y))
+            for (auto x : range(num_tiles.x)) coords.push_back(Vec2i(x, y));
+
+        if (order == "spiral")
+        {
+            // sort by concentric square ring around the center tile, and then by angle within each ring
+            Vec2f center = Vec2f(num_tiles - 1) * 0.5f;
+            auto  key    = [&center](const Vec2i &t)
+            {
+                Vec2f d = Vec2f(t) - center;
+                return std::make_pair(int(std::ceil(max(std::abs(d.x), std::abs(d.y)))), std::atan2(d.y, d.x));
+            };
+            std::stable_sort(coords.begin(), coords.end(),
+                             [&key](const Vec2i &a, const Vec2i &b) { return key(a) < key(b); });
+        }
+    }
+
+    vector<Box2i> tiles;
+    tiles.reserve(coords.size());
+    for (auto &t : coords) tiles.emplace_back(t * tile_size, la::min((t + 1) * tile_size, size));
+    return tiles;
+}
+
+/// The number of pixels covered by \p tiles
+int64_t num_tile_pixels(const vector<Box2i> &tiles)
+{
+    int64_t pixels = 0;
+    for (auto &tile : tiles) pixels += la::product(tile.max - tile.min);
+    return pixels;
+}
+
+/// Finalize and print out the statistics gathered during rendering
+void report_stats()
+{
+    // the statistics are thread-local, so we need to gather them from each thread in the pool
+    for_each_thread(accumulate_thread_stats);
+    spdlog::info(stats_report());
+    clear_stats();
+}
+
+} // namespace
 
 
 STAT_RATIO("Integrator/Number of NaN pixel samples", num_NaN_samples, num_pixel_samples);
+STAT_INT_DISTRIBUTION("Integrator/Adaptive samples per pixel", adaptive_spp);
+STAT_PERCENT("Integrator/Adaptively converged pixels", num_converged_pixels, num_adaptive_pixels);
+STAT_TIMER("Time/Rendering", render_time);
+STAT_TIMER("Time/Rendering/Tiles", tile_render_time);
 
 uint32_t Scene::random_seed = 53;
 
@@ -27,17 +131,31 @@ Scene::~Scene()
 
 Color3f Scene::background(const Ray3f &ray) const
 {
-    return m_background;
+    return m_environment ? m_environment->eval(ray.d) : m_background;
 }
 
 bool Scene::intersect(const Ray3f &ray, HitInfo &hit) const
 {
     ++g_num_traced_rays;
+    ++g_render_cost.rays;
     return m_surfaces->intersect(ray, hit);
 }
 
+void Scene::intersect_packet(const Ray3f *rays, HitInfo *hits, bool *found, int count) const
+{
+    g_num_traced_rays += count;
+    g_render_cost.rays += count;
+    m_surfaces->intersect_packet(rays, hits, found, count);
+}
+
+bool Scene::occluded(const Ray3f &ray) const
+{
+    ++g_num_shadow_rays;
+    return m_surfaces->occluded(ray);
+}
+
 // compute the color corresponding to a ray by raytracing
-Color3f Scene::recursive_color(const Ray3f &ray, int depth) const
+Color3f Scene::recursive_color(const Ray3f &ray, int depth, Sampler &sampler) const
 {
     constexpr int max_depth = 64;
     put_your_code_here("Assignment 1: Insert your recursive_color() code here");
@@ -49,8 +167,9 @@ Color3f Scene::recursive_color(const Ray3f &ray, int depth) const
     //
     // if scene.intersect:
     //      get emitted color (hint: you can use hit.mat->emitted)
-    // 		if depth < max_depth and hit_material.scatter(....) is successful:
+    // 		if depth < max_depth and hit_material.scatter(..., sampler) is successful:
     //			recursive_color = call this function recursively with the scattered ray and increased depth
+    //                            (for motion blur, the scattered ray should keep the time of the incoming ray)
     //          return emitted color + attenuation * recursive_color
     //		else
     //			return emitted color;
@@ -58,37 +177,540 @@ Color3f Scene::recursive_color(const Ray3f &ray, int depth) const
     // 		return background color (hint: look at background())
 }
 
+pair<const Surface *, float> Scene::sample_emitter(float &rv1) const
+{
+    // the groups know whether they contain any emitters since they were built
+    if (!m_surfaces->is_emissive())
+        return {nullptr, 0.f};
+
+    // descend through nested groups until we reach an individual surface
+    const Surface *surface = m_surfaces.get();
+    float          prob    = 1.f;
+    while (true)
+    {
+        auto [child, child_prob] = surface->sample_child(rv1);
+        if (child == surface)
+            break;
+        surface = child;
+        prob *= child_prob;
+    }
+
+    // groups without emitters choose among all their children
+    if (!surface->is_emissive())
+        return {nullptr, 0.f};
+    return {surface, prob};
+}
+
+Ray3f Scene::camera_ray(int x, int y, Sampler &sampler) const
+{
+    Vec2f pixel   = Vec2f(float(x), float(y)) + sampler.next2f();
+    Vec2f lens_rv = sampler.next2f();
+    float time    = m_camera->has_motion_blur() ? m_camera->sample_time(sampler.next1f()) : 0.f;
+    return m_camera->generate_ray(pixel, lens_rv, time);
+}
+
+Color3f Scene::sample_pixel(int x, int y, Sampler &sampler, AOVSample *aov) const
+{
+    RenderCost before = g_render_cost;
+    auto       start  = std::chrono::steady_clock::now();
+
+    Ray3f   ray   = camera_ray(x, y, sampler);
+    Color3f color = m_integrator ? m_integrator->Li(*this, sampler, ray, aov) : recursive_color(ray, 0, sampler);
+
+    // the cost excludes the extra intersection below, which only serves the AOVs
+    if (aov)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        aov->cost    = g_render_cost - before;
+        aov->time_ns = float(std::chrono::duration<double, std::nano>(elapsed).count());
+    }
+
+    if (aov && !aov->recorded)
+    {
+        HitInfo hit;
+        aov->record(ray, intersect(ray, hit) ? &hit : nullptr);
+    }
+    return color;
+}
+
+void Scene::render_tile(Image3f &sum, const Box2i &tile, int first_sample, int num_samples, AOVBuffers *aovs) const
+{
+    SCOPED_STAT_TIMER(tile_render_time);
+
+    if (m_integrator && m_integrator->batch_size() > 0)
+        return render_tile_batched(sum, tile, first_sample, num_samples, aovs);
+
+    // each tile gets its own copy of the sampler, so threads never share random number state
+    auto sampler = m_sampler->clone();
+
+    for (int y = tile.min.y; y < tile.max.y; ++y)
+        for (int x = tile.min.x; x < tile.max.x; ++x)
+        {
+            sampler->start_pixel(x, y);
+            Color3f pixel_sum(0.f);
+            for (int s = 0; s < num_samples; ++s)
+            {
+                sampler->set_sample(first_sample + s);
+                AOVSample aov;
+                Color3f   c = sample_pixel(x, y, *sampler, aovs ? &aov : nullptr);
+                if (aovs)
+                    aovs->add(x, y, aov);
+
+                ++num_pixel_samples;
+                if (la::any(la::isnan(c)))
+                {
+                    ++num_NaN_samples;
+                    continue;
+                }
+                pixel_sum += c;
+            }
+            sum(x, y) += pixel_sum;
+        }
+}
+
+void Scene::render_tile_batched(Image3f &sum, const Box2i &tile, int first_sample, int num_samples,
+                                AOVBuffers *aovs) const
+{
+    Vec2i   size      = tile.max - tile.min;
+    int64_t num_paths = int64_t(size.x) * size.y * num_samples;
+    int64_t batch     = std::min(int64_t(m_integrator->batch_size()), num_paths);
+
+    // every path in a batch needs its own sampler, since the integrator advances all of them in lockstep
+    vector<unique_ptr<Sampler>> owned(batch);
+    vector<Sampler *>           samplers(batch);
+    for (int64_t i = 0; i < batch; ++i)
+    {
+        owned[i]    = m_sampler->clone();
+        samplers[i] = owned[i].get();
+    }
+
+    vector<Ray3f>     rays;
+    vector<Vec2i>     pixels;
+    vector<Color3f>   radiance;
+    vector<AOVSample> aov_samples;
+    for (int64_t begin = 0; begin < num_paths; begin += batch)
+    {
+        int64_t n = std::min(batch, num_paths - begin);
+        rays.resize(n);
+        pixels.resize(n);
+        for (int64_t i = 0; i < n; ++i)
+        {
+            // all samples of a pixel are consecutive, so nearby paths start out coherent
+            int64_t path  = begin + i;
+            int64_t index = path / num_samples;
+            pixels[i]     = tile.min + Vec2i(int(index % size.x), int(index / size.x));
+            samplers[i]->start_pixel(pixels[i].x, pixels[i].y);
+            samplers[i]->set_sample(first_sample + int(path % num_samples));
+            rays[i] = camera_ray(pixels[i].x, pixels[i].y, *samplers[i]);
+        }
+
+        if (aovs)
+            aov_samples.assign(n, AOVSample());
+        m_integrator->Li_batch(*this, samplers, rays, radiance, aovs ? &aov_samples : nullptr);
+
+        for (int64_t i = 0; i < n; ++i)
+        {
+            if (aovs)
+            {
+                // fall back to intersecting the camera ray again if the integrator didn't record the AOVs
+                if (!aov_samples[i].recorded)
+                {
+                    HitInfo hit;
+                    aov_samples[i].record(rays[i], intersect(rays[i], hit) ? &hit : nullptr);
+                }
+                aovs->add(pixels[i].x, pixels[i].y, aov_samples[i]);
+            }
+
+            ++num_pixel_samples;
+            if (la::any(la::isnan(radiance[i])))
+            {
+                ++num_NaN_samples;
+                continue;
+            }
+            sum(pixels[i].x, pixels[i].y) += radiance[i];
+        }
+    }
+}
+
+bool Scene::render_pass(Image3f &sum, const vector<Box2i> &tiles, int first_sample, int num_samples,
+                        Progress &progress, AOVBuffers *aovs) const
+{
+    std::atomic<bool> complete(true);
+
+    // Hand out a single tile per task. The pool's workers grab the next unclaimed tile as soon as they finish their
+    // current one, so threads that are stuck on expensive tiles (caustics, glass) do not hold up the rest of the frame.
+    parallel_for(blocked_range<uint32_t>(0, uint32_t(tiles.size()), 1),
+                 [&](blocked_range<uint32_t> r)
+                 {
+                     for (auto t : r)
+                     {
+                         // skip the remaining tiles once the user asks us to stop
+                         if (interrupted())
+                         {
+                             complete = false;
+                             continue;
+                         }
+
+                         const Box2i &tile = tiles[t];
+                         render_tile(sum, tile, first_sample, num_samples, aovs);
+                         progress += int64_t(la::product(tile.max - tile.min)) * num_samples;
+                     }
+                 });
+
+    return complete;
+}
+
+void Scene::set_render_region(const Box2i &region, int first_tile, int last_tile)
+{
+    m_partial    = true;
+    m_region     = region;
+    m_first_tile = std::max(first_tile, 0);
+    m_last_tile  = last_tile;
+    if (m_region.is_empty() || (m_last_tile >= 0 && m_last_tile <= m_first_tile))
+        throw DartsException("The region to render is empty.");
+}
+
+void Scene::set_camera(const json &j)
+{
+    m_camera = make_shared<Camera>(j);
+}
+
+void Scene::set_num_samples(int spp)
+{
+    if (spp < 1)
+        throw DartsException("The number of samples per pixel must be positive, got {}.", spp);
+    m_num_samples             = spp;
+    m_sampler_spec["samples"] = spp;
+    m_sampler                 = DartsFactory<Sampler>::create(m_sampler_spec);
+    m_sampler->set_base_seed(random_seed);
+}
+
+vector<Box2i> Scene::render_tiles() const
+{
+    auto tiles = generate_tiles(m_camera->resolution(), m_tile_size, m_tile_order);
+    if (!m_partial)
+        return tiles;
+
+    // clip the tiles to the region. The tiles are still generated for the whole image, so the tiles of different
+    // regions line up, and so that the tile order (and therefore the tile range) doesn't depend on the region
+    vector<Box2i> clipped;
+    for (auto &tile : tiles)
+    {
+        Box2i t(la::max(tile.min, m_region.min), la::min(tile.max, m_region.max));
+        if (la::all(la::less(t.min, t.max)))
+            clipped.push_back(t);
+    }
+
+    int last = m_last_tile < 0 ? int(clipped.size()) : std::min(m_last_tile, int(clipped.size()));
+    if (m_first_tile >= last)
+        throw DartsException("The region to render contains only {} tiles, none of which are in the tile range "
+                             "[{}, {}).",
+                             clipped.size(), m_first_tile, m_last_tile);
+    return vector<Box2i>(clipped.begin() + m_first_tile, clipped.begin() + last);
+}
+
 // raytrace an image
-Image3f Scene::raytrace() const
+Image3f Scene::raytrace(AOVBuffers *aovs) const
 {
+    if (m_integrator && m_integrator->renders_image())
+    {
+        if (m_partial)
+            spdlog::warn("The integrator renders whole images by itself, ignoring the region to render.");
+        if (aovs)
+            spdlog::warn("The integrator renders whole images by itself, so the AOVs stay black.");
+        Image3f image;
+        {
+            SCOPED_STAT_TIMER(render_time);
+            image = m_integrator->render(*this);
+        }
+        report_stats();
+        return image;
+    }
+
+    if (m_target_error > 0.f)
+    {
+        if (aovs)
+            spdlog::warn("Adaptive sampling doesn't support AOVs, so they stay black.");
+        return raytrace_adaptive();
+    }
+    if (aovs && aovs->has_costs() && m_integrator && m_integrator->batch_size() > 0)
+        spdlog::warn("The integrator traces paths in interleaved batches, so the cost heatmaps stay black.");
+
     // allocate an image of the proper size
-    auto image = Image3f(m_camera->resolution().x, m_camera->resolution().y);
+    auto image = Image3f(m_camera->resolution().x, m_camera->resolution().y, Color3f(0.f));
 
-    put_your_code_here("Assignment 1: insert your raytrace() code here");
+    auto tiles = render_tiles();
+    spdlog::info("Rendering {} tiles of size {}x{} in {} order.", tiles.size(), m_tile_size, m_tile_size,
+                 m_tile_order);
 
-    // TODO: Render the image, similar to the tutorial
-    // Pseudo-code:
-    //
-    // foreach image row (go over image height)
-    //     foreach pixel in the row (go over image width)
-    //         init accumulated color to zero
-    //         repeat m_num_samples times:
-    //             compute a random point within the pixel (you can just add a random number between 0 and 1
-    //                                                      to the pixel coordinate. You can use randf() for
-    //                                                      this)
-    //             compute camera ray
-    //             accumulate color raytraced with the ray (by calling recursive_color)
-    //         divide color by the number of pixel samples
-
-    // Hint: you can create a Progress object (progress.h) to provide a
-    // progress bar during rendering.
-
-    // the code below finalizes and prints out the statistics gathered during rendering
-    accumulate_thread_stats();
-    spdlog::info(stats_report());
-    clear_stats();
+    {
+        SCOPED_STAT_TIMER(render_time);
+        Progress progress("Rendering", num_tile_pixels(tiles) * m_num_samples);
+        render_pass(image, tiles, 0, m_num_samples, progress, aovs);
+        progress.set_done();
+    }
+
+    for (int i = 0; i < image.length(); ++i) image(i) /= float(m_num_samples);
+    if (aovs)
+    {
+        aovs->scale(1.f / float(m_num_samples));
+        aovs->recorded = true;
+    }
+
+    report_stats();
 
     // return the ray-traced image
     return image;
 }
 
+Image3f Scene::raytrace_progressive(const ProgressiveOptions &options, const ImageCallback &update,
+                                    int *samples_done, AOVBuffers *aovs) const
+{
+    if (m_integrator && m_integrator->renders_image())
+    {
+        spdlog::warn("The integrator renders whole images by itself, ignoring the progressive rendering options.");
+        if (samples_done)
+            *samples_done = m_num_samples;
+        return raytrace(aovs);
+    }
+
+    auto        res = m_camera->resolution();
+    Framebuffer mean(res, m_framebuffer_format); // the average of all passes so far
+    auto        pass  = Image3f(res.x, res.y);
+    auto        tiles = render_tiles();
+
+    if (m_target_error > 0.f)
+        spdlog::warn("Adaptive sampling is not supported in progressive mode, ignoring 'target_error'.");
+    if (aovs && aovs->has_costs() && m_integrator && m_integrator->batch_size() > 0)
+        spdlog::warn("The integrator traces paths in interleaved batches, so the cost heatmaps stay black.");
+
+    int pass_samples = std::clamp(options.pass_samples, 1, m_num_samples);
+    int num_passes   = (m_num_samples + pass_samples - 1) / pass_samples;
+    spdlog::info("Rendering {} tiles of size {}x{} in {} order, in {} passes of {} samples per pixel.", tiles.size(),
+                 m_tile_size, m_tile_size, m_tile_order, num_passes, pass_samples);
+
+    // The passes are summed up in pass (in floats) until they make up a large enough share of the samples for the
+    // rounding of a compact framebuffer not to swallow their blend. With floats, every pass is blended right away
+    int  spp = 0, pending = 0; // pending counts the samples per pixel summed up in pass, which are part of spp
+    auto fold = [&]()
+    {
+        float weight = float(pending) / float(spp);
+        parallel_for(blocked_range<int>(0, pass.length(), 4096),
+                     [&](blocked_range<int> r)
+                     {
+                         for (auto i : r) mean.blend(i, pass(i) / float(pending), weight);
+                     });
+        pending = 0;
+    };
+    auto average = [&]()
+    {
+        auto image = mean.image();
+        if (pending > 0)
+        {
+            float weight = float(pending) / float(spp);
+            parallel_for(blocked_range<int>(0, image.length(), 4096),
+                         [&](blocked_range<int> r)
+                         {
+                             for (auto i : r) image(i) = lerp(image(i), pass(i) / float(pending), weight);
+                         });
+        }
+        return image;
+    };
+
+    catch_interrupts();
+    {
+        SCOPED_STAT_TIMER(render_time);
+        Progress          progress("Rendering", num_tile_pixels(tiles) * m_num_samples);
+        spdlog::stopwatch timer;
+        double            last_update = 0.0, pass_duration = 0.0;
+        int               passes_since_update = 0;
+
+        for (int p = 0; p < num_passes; ++p)
+        {
+            double start = timer.elapsed().count();
+            if (options.time_budget > 0.f && start + pass_duration > options.time_budget)
+            {
+                spdlog::info("Stopping after {} samples per pixel to stay within the time budget.", spp);
+                break;
+            }
+
+            int n = std::min(pass_samples, m_num_samples - spp);
+            if (pending == 0)
+                pass.reset(Color3f(0.f));
+            // the AOVs barely change after the first pass, so they are only recorded in it
+            if (!render_pass(pass, tiles, spp, n, progress, p == 0 ? aovs : nullptr))
+            {
+                // the incomplete pass can't be told apart from the passes summed up with it
+                spp -= pending;
+                spdlog::warn("Rendering interrupted after {} samples per pixel; discarding the incomplete pass{}.", spp,
+                             pending > 0 ? fmt::format(" and the {} samples per pixel summed up with it", pending)
+                                         : "");
+                pending = 0;
+                break;
+            }
+            if (p == 0 && aovs)
+            {
+                aovs->scale(1.f / float(n));
+                aovs->recorded = true;
+            }
+            spp += n;
+            pending += n;
+            if (int64_t(pending) * max_blends(mean.format()) >= spp)
+                fold();
+
+            double now    = timer.elapsed().count();
+            pass_duration = now - start;
+            ++passes_since_update;
+
+            // the final image is returned instead
+            if (!update || spp == m_num_samples)
+                continue;
+
+            if ((options.save_passes > 0 && passes_since_update >= options.save_passes) ||
+                (options.save_seconds > 0.f && now - last_update >= options.save_seconds))
+            {
+                auto image = average();
+                update(image, spp);
+                last_update         = timer.elapsed().count();
+                passes_since_update = 0;
+            }
+        }
+
+        progress.set_done();
+    }
+    catch_interrupts(false);
+
+    report_stats();
+
+    if (samples_done)
+        *samples_done = spp;
+    return average();
+}
+
+Image3f Scene::raytrace_adaptive() const
+{
+    // avoid division by zero, and demanding excessive precision, in nearly black pixels
+    constexpr float min_luminance = 1e-2f;
+
+    /// Running statistics of the samples taken in a single pixel
+    struct PixelStats
+    {
+        float mean = 0.f;   ///< Mean luminance of the samples
+        float m2   = 0.f;   ///< Sum of squared differences from #mean
+        int   n    = 0;     ///< Number of samples
+        bool  done = false; ///< Whether this pixel has converged or exhausted its sample budget
+    };
+
+    auto res   = m_camera->resolution();
+    auto tiles = render_tiles();
+    spdlog::info("Rendering {} tiles of size {}x{} in {} order, adaptively with a target relative error of {} "
+                 "({} to {} samples per pixel).",
+                 tiles.size(), m_tile_size, m_tile_size, m_tile_order, m_target_error,
+                 std::min(m_min_samples, m_num_samples), m_num_samples);
+
+    // each round is blended into the framebuffer separately, so a compact one limits the useful number of rounds
+    int max_rounds = 1 + (std::max(m_num_samples - m_min_samples, 0) + m_round_samples - 1) / m_round_samples;
+    if (max_rounds > max_blends(m_framebuffer_format))
+        spdlog::warn("The noisiest pixels may take {} rounds of samples, but the framebuffer format only resolves "
+                     "about {}; increase 'round_samples' or use the \"float\" framebuffer.",
+                     max_rounds, max_blends(m_framebuffer_format));
+
+    vector<PixelStats> pixels(res.x * res.y);
+    Framebuffer        color(res, m_framebuffer_format); // the mean color of the samples in each pixel
+
+    // indices of the tiles that still contain pixels that are not done
+    vector<uint32_t> active(tiles.size());
+    for (uint32_t t = 0; t < active.size(); ++t) active[t] = t;
+
+    {
+        SCOPED_STAT_TIMER(render_time);
+        Progress progress("Rendering", num_tile_pixels(tiles) * m_num_samples);
+        for (int round = 0; !active.empty(); ++round)
+        {
+            vector<uint8_t> tile_done(active.size(), 0);
+            parallel_for(blocked_range<uint32_t>(0, uint32_t(active.size()), 1),
+                         [&](blocked_range<uint32_t> r)
+                         {
+                             for (auto i : r)
+                             {
+                                 uint32_t     t    = active[i];
+                                 const Box2i &tile = tiles[t];
+
+                                 // each tile gets its own copy of the sampler, so threads never share its state
+                                 auto sampler = m_sampler->clone();
+
+                                 bool all_done = true;
+                                 for (int y = tile.min.y; y < tile.max.y; ++y)
+                                     for (int x = tile.min.x; x < tile.max.x; ++x)
+                                     {
+                                         PixelStats &px = pixels[y * res.x + x];
+                                         if (px.done)
+                                             continue;
+
+                                         sampler->start_pixel(x, y);
+
+                                         int     n = std::min(round == 0 ? m_min_samples : m_round_samples,
+                                                              m_num_samples - px.n);
+                                         Color3f sum(0.f);
+                                         for (int s = 0; s < n; ++s)
+                                         {
+                                             sampler->set_sample(px.n);
+                                             Color3f c = sample_pixel(x, y, *sampler);
+
+                                             // treat NaN samples as black, just like raytrace()
+                                             ++num_pixel_samples;
+                                             if (la::any(la::isnan(c)))
+                                             {
+                                                 ++num_NaN_samples;
+                                                 c = Color3f(0.f);
+                                             }
+
+                                             // Welford's update of the running mean and variance
+                                             sum += c;
+                                             float l     = luminance(c);
+                                             float delta = l - px.mean;
+                                             px.mean += delta / float(++px.n);
+                                             px.m2 += delta * (l - px.mean);
+                                         }
+                                         if (n > 0)
+                                             color.blend(y * res.x + x, sum / float(n), float(n) / float(px.n));
+                                         progress += n;
+
+                                         // the relative standard error of the mean
+                                         float error = px.n > 1 ? std::sqrt(px.m2 / float(px.n - 1) / float(px.n)) /
+                                                                      std::max(px.mean, min_luminance)
+                                                                : 0.f;
+                                         bool converged = px.n >= m_min_samples && error <= m_target_error;
+                                         if (converged || px.n >= m_num_samples)
+                                         {
+                                             px.done = true;
+                                             progress += m_num_samples - px.n;
+                                             adaptive_spp << px.n;
+                                             ++num_adaptive_pixels;
+                                             if (converged)
+                                                 ++num_converged_pixels;
+                                         }
+                                         else
+                                             all_done = false;
+                                     }
+                                 tile_done[i] = all_done;
+                             }
+                         });
+
+            // only keep the tiles that are still noisy, so all threads work on those in the next round
+            vector<uint32_t> still_active;
+            for (size_t i = 0; i < active.size(); ++i)
+                if (!tile_done[i])
+                    still_active.push_back(active[i]);
+            active.swap(still_active);
+        }
+
+        progress.set_done();
+    }
+
+    auto image = color.image();
+
+    report_stats();
+
+    return image;
+}
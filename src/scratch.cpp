@@ -0,0 +1,72 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <darts/scratch.h>
+#include <darts/stats.h>
+
+STAT_MEMORY_COUNTER("Memory/Scratch arenas", scratch_bytes);
+STAT_INT_DISTRIBUTION("Scratch arenas/Peak bytes per scope", scratch_peak);
+
+ScratchArena &ScratchArena::local()
+{
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+ScratchArena::Scope::Scope() : arena(ScratchArena::local()), m_block(arena.m_block), m_offset(arena.m_offset)
+{
+    ++arena.m_depth;
+}
+
+ScratchArena::Scope::~Scope()
+{
+    arena.m_block  = m_block;
+    arena.m_offset = m_offset;
+    if (--arena.m_depth == 0)
+    {
+        scratch_peak << int64_t(arena.m_peak);
+        arena.m_peak = 0;
+    }
+}
+
+void *ScratchArena::allocate(size_t bytes, size_t align)
+{
+    for (;; ++m_block, m_offset = 0)
+    {
+        if (m_block == m_blocks.size())
+        {
+            // grow geometrically, so a thread settles on a handful of blocks
+            size_t size = std::max(m_blocks.empty() ? initial_block_size : 2 * m_blocks.back().size, bytes + align);
+            m_blocks.push_back({std::unique_ptr<std::byte[]>(new std::byte[size]), size});
+            scratch_bytes += size;
+        }
+
+        // skip to the next block (which may have to be created) if the allocation doesn't fit in this one
+        Block    &block = m_blocks[m_block];
+        uintptr_t base  = reinterpret_cast<uintptr_t>(block.data.get());
+        size_t    start = ((base + m_offset + align - 1) & ~uintptr_t(align - 1)) - base;
+        if (start + bytes <= block.size)
+        {
+            m_offset = start + bytes;
+            m_peak   = std::max(m_peak, used());
+            return block.data.get() + start;
+        }
+    }
+}
+
+size_t ScratchArena::used() const
+{
+    size_t bytes = m_offset;
+    for (size_t b = 0; b < m_block && b < m_blocks.size(); ++b) bytes += m_blocks[b].size;
+    return bytes;
+}
+
+/**
+    \file
+    \brief Implementation of #ScratchArena
+*/
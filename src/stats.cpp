@@ -10,12 +10,19 @@
         SPDX: Apache-2.0
 */
 
+#include <atomic>
+#include <ctime>
 #include <darts/common.h>
 #include <darts/stats.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
 // Statistics Local Variables
 static std::vector<StatRegisterer::AccumFunc> *stat_funcs;
 static StatsAccumulator                        stats_accumulator;
+static StatsAccumulator                        cleared_stats; ///< Everything cleared by clear_stats(), for stats_json()
 
 void accumulate_thread_stats()
 {
@@ -24,6 +31,33 @@ void accumulate_thread_stats()
     StatRegisterer::call_callbacks(stats_accumulator);
 }
 
+int64_t thread_cpu_time_ns()
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    // FILETIMEs count in units of 100 ns
+    auto to_ns = [](const FILETIME &t) { return int64_t((uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 100; };
+    return to_ns(kernel) + to_ns(user);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    // fall back to the CPU time of the whole process
+    return int64_t(double(std::clock()) * (1e9 / CLOCKS_PER_SEC));
+#endif
+}
+
+int stat_thread_index()
+{
+    static std::atomic<int> next_index(0);
+    thread_local int        index = next_index++;
+    return index;
+}
+
 void StatRegisterer::call_callbacks(StatsAccumulator &accum)
 {
     for (AccumFunc func : *stat_funcs)
@@ -57,6 +91,12 @@ struct StatsAccumulator::Stats
     std::map<std::string, Distribution<double>>        float_distributions;
     std::map<std::string, std::pair<int64_t, int64_t>> percentages;
     std::map<std::string, std::pair<int64_t, int64_t>> ratios;
+    struct Timer
+    {
+        int64_t                wall_ns = 0, cpu_ns = 0, count = 0;
+        std::map<int, int64_t> thread_wall_ns; ///< The wall-clock time spent on each thread
+    };
+    std::map<std::string, Timer> timers;
 };
 
 void StatsAccumulator::report_counter(const char *name, int64_t val)
@@ -104,13 +144,33 @@ void StatsAccumulator::report_float_distribution(const char *name, double sum, i
     distrib.max = std::max(distrib.max, max);
 }
 
+void StatsAccumulator::report_timer(const char *name, int thread, int64_t wall_ns, int64_t cpu_ns, int64_t count)
+{
+    if (count == 0)
+        return;
+    Stats::Timer &timer = stats->timers[name];
+    timer.wall_ns += wall_ns;
+    timer.cpu_ns += cpu_ns;
+    timer.count += count;
+    timer.thread_wall_ns[thread] += wall_ns;
+}
+
 std::string stats_report()
 {
     return stats_accumulator.report();
 }
 
+nlohmann::json stats_json()
+{
+    StatsAccumulator total;
+    total.merge(cleared_stats);
+    total.merge(stats_accumulator);
+    return total.to_json();
+}
+
 void clear_stats()
 {
+    cleared_stats.merge(stats_accumulator);
     stats_accumulator.clear();
 }
 
@@ -256,6 +316,43 @@ std::string StatsAccumulator::report()
                                      fmt::format(fg(fmt::color::dim_gray), " ({:.2f}x)", (double)num / (double)denom));
     }
 
+    // sort the timers by their components, so that each timer is directly followed by its sub-phases
+    std::vector<std::pair<std::vector<std::string>, const Stats::Timer *>> timers;
+    for (auto &timer : stats->timers) timers.emplace_back(split_string(timer.first, '/'), &timer.second);
+    std::sort(timers.begin(), timers.end());
+    for (auto &[comps, timer] : timers)
+    {
+        std::string category = comps.size() > 1 ? comps.front() : std::string();
+        size_t      depth    = comps.size() > 1 ? comps.size() - 2 : 0;
+        std::string title    = std::string(2 * depth, ' ') + comps.back();
+        to_print[category].push_back(
+            fmt::format(fmt::emphasis::italic, "{:<42}", title) +
+            fmt::format(fg(fmt::color::cornflower_blue), "{:>12.3f}", timer->wall_ns * 1e-6) +
+            fmt::format(fg(fmt::color::dim_gray), " ms wall, ") +
+            fmt::format(fg(fmt::color::cornflower_blue), "{:.3f}", timer->cpu_ns * 1e-6) +
+            fmt::format(fg(fmt::color::dim_gray), " ms CPU ({} calls)", timer->count));
+
+        if (timer->thread_wall_ns.size() < 2)
+            continue;
+
+        // break the wall-clock time down by thread, a few threads per line
+        std::string line;
+        int         on_line = 0;
+        for (auto &[thread, wall_ns] : timer->thread_wall_ns)
+        {
+            line += fmt::format(fg(fmt::color::dim_gray), "  #{:<3} ", thread) +
+                    fmt::format("{:>10.3f}", wall_ns * 1e-6);
+            if (++on_line == 4)
+            {
+                to_print[category].push_back(std::string(2 * depth + 2, ' ') + line);
+                line.clear();
+                on_line = 0;
+            }
+        }
+        if (on_line)
+            to_print[category].push_back(std::string(2 * depth + 2, ' ') + line);
+    }
+
     for (auto &categories : to_print)
     {
         dest += fmt::format(fmt::emphasis::italic | fmt::emphasis::bold, "  {}\n", categories.first);
@@ -268,6 +365,76 @@ std::string StatsAccumulator::report()
     return dest;
 }
 
+nlohmann::json StatsAccumulator::to_json() const
+{
+    nlohmann::json j = nlohmann::json::object();
+
+    // make sure all kinds of statistics are present, even if empty, so consumers don't need to check
+    for (auto kind :
+         {"counters", "memory", "int_distributions", "float_distributions", "percentages", "ratios", "timers"})
+        j[kind] = nlohmann::json::object();
+
+    for (auto &[name, val] : stats->counters) j["counters"][name] = val;
+    for (auto &[name, bytes] : stats->memory_counters) j["memory"][name] = bytes;
+
+    auto distribution = [](const auto &d)
+    {
+        return nlohmann::json{{"sum", d.sum},
+                              {"count", d.count},
+                              {"min", d.min},
+                              {"max", d.max},
+                              {"avg", d.count ? double(d.sum) / double(d.count) : 0.0}};
+    };
+    for (auto &[name, d] : stats->int_distributions)
+        if (d.count)
+            j["int_distributions"][name] = distribution(d);
+    for (auto &[name, d] : stats->float_distributions)
+        if (d.count)
+            j["float_distributions"][name] = distribution(d);
+
+    auto fraction = [](const std::pair<int64_t, int64_t> &f, double scale)
+    {
+        return nlohmann::json{{"num", f.first},
+                              {"denom", f.second},
+                              {"value", f.second ? scale * double(f.first) / double(f.second) : 0.0}};
+    };
+    for (auto &[name, f] : stats->percentages) j["percentages"][name] = fraction(f, 100.0);
+    for (auto &[name, f] : stats->ratios) j["ratios"][name] = fraction(f, 1.0);
+
+    for (auto &[name, timer] : stats->timers)
+    {
+        nlohmann::json threads = nlohmann::json::object();
+        for (auto &[thread, wall_ns] : timer.thread_wall_ns) threads[std::to_string(thread)] = wall_ns;
+        j["timers"][name] = {{"wall_ns", timer.wall_ns},
+                             {"cpu_ns", timer.cpu_ns},
+                             {"count", timer.count},
+                             {"thread_wall_ns", threads}};
+    }
+
+    return j;
+}
+
+void StatsAccumulator::merge(const StatsAccumulator &other)
+{
+    const Stats &o = *other.stats;
+    for (auto &[name, val] : o.counters) stats->counters[name] += val;
+    for (auto &[name, val] : o.memory_counters) stats->memory_counters[name] += val;
+    for (auto &[name, d] : o.int_distributions)
+        report_int_distribution(name.c_str(), d.sum, d.count, d.min, d.max);
+    for (auto &[name, d] : o.float_distributions)
+        report_float_distribution(name.c_str(), d.sum, d.count, d.min, d.max);
+    for (auto &[name, f] : o.percentages) report_percentage(name.c_str(), f.first, f.second);
+    for (auto &[name, f] : o.ratios) report_ratio(name.c_str(), f.first, f.second);
+    for (auto &[name, timer] : o.timers)
+    {
+        Stats::Timer &t = stats->timers[name];
+        t.wall_ns += timer.wall_ns;
+        t.cpu_ns += timer.cpu_ns;
+        t.count += timer.count;
+        for (auto &[thread, wall_ns] : timer.thread_wall_ns) t.thread_wall_ns[thread] += wall_ns;
+    }
+}
+
 void StatsAccumulator::clear()
 {
     stats->counters.clear();
@@ -276,4 +443,5 @@ void StatsAccumulator::clear()
     stats->float_distributions.clear();
     stats->percentages.clear();
     stats->ratios.clear();
+    stats->timers.clear();
 }
@@ -4,146 +4,471 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/bbh.h>
+#include <darts/cache.h>
+#include <darts/numa.h>
 #include <darts/parallel.h>
 #include <darts/progress.h>
 #include <darts/sampling.h>
+#include <darts/sphere.h>
 #include <darts/stats.h>
 #include <darts/surface_group.h>
+#include <darts/triangle.h>
+#include <atomic>
+#include <cassert>
 #include <future>
+#include <new>
 
-struct BBHNode;
-
-// STAT_MEMORY_COUNTER("Memory/BBH", treeBytes);
+STAT_MEMORY_COUNTER("Memory/BBH", tree_bytes);
+STAT_RATIO("BBH/Node bytes per primitive", node_bytes, node_prims);
 STAT_RATIO("BBH/Surfaces per leaf node", total_surfaces, total_leaf_nodes);
 STAT_COUNTER("BBH/Interior nodes", interior_nodes);
 STAT_COUNTER("BBH/Leaf nodes", leaf_nodes);
-STAT_RATIO("BBH/Nodes visited per ray", bbh_nodes_visited, total_rays);
+STAT_TIMER("Time/Scene parsing/BBH construction", bbh_build_time);
+STAT_COUNTER("BBH/Refits", num_refits);
+STAT_COUNTER("BBH/Rebuilds after refitting", num_refit_rebuilds);
+STAT_PERCENT("BBH/Spheres rejected by leaf batch test", num_batch_rejected_spheres, num_batch_tested_spheres);
+STAT_RATIO("BBH/References per primitive (SBVH)", num_sbvh_references, num_sbvh_primitives);
+STAT_COUNTER("BBH/Spatial splits (SBVH)", num_spatial_splits);
+
+/// A node of the temporary tree created while building the BBH (before it is flattened)
+struct BBHBuildNode
+{
+    Box3f         bbox;                           ///< The bounding box of this node
+    BBHBuildNode *children[2] = {nullptr, nullptr}; ///< The children of an interior node (owned by the node pool)
+    uint32_t      first_prim  = 0;                  ///< leaf: index of the first BBHPrimInfo
+    uint32_t      num_prims   = 0;                  ///< leaf: number of surfaces, or 0 for interior nodes
+    int           axis        = 0;                  ///< interior: the axis along which the children were split
+    uint32_t      num_nodes   = 1;                  ///< Number of nodes in this subtree (including this one)
+};
+
+static_assert(std::is_trivially_destructible_v<BBHBuildNode>, "The node pool never destroys the nodes.");
+
+/// The number of levels of the build tree below (and including) \p node
+static int build_depth(const BBHBuildNode *node)
+{
+    if (node->num_prims > 0)
+        return 1;
+    return 1 + std::max(build_depth(node->children[0]), build_depth(node->children[1]));
+}
+
+/**
+    The memory for all nodes of the temporary build tree.
+
+    A binary tree over n primitives never has more than 2n - 1 nodes, so that many are allocated at once, and the
+    whole tree is released at once after it has been flattened. Only the memory of the nodes that are actually created
+    is ever touched.
+*/
+struct BBHBuildNodePool
+{
+    explicit BBHBuildNodePool(uint32_t capacity) :
+        nodes(static_cast<BBHBuildNode *>(::operator new(capacity * sizeof(BBHBuildNode)))), capacity(capacity)
+    {
+    }
+    ~BBHBuildNodePool()
+    {
+        ::operator delete(nodes);
+    }
+
+    /// Reserve \p count consecutive nodes
+    BBHBuildNode *reserve(uint32_t count)
+    {
+        uint32_t first = used.fetch_add(count, std::memory_order_relaxed);
+        assert(first + count <= capacity && "The build tree outgrew its node pool.");
+        return nodes + first;
+    }
+
+    BBHBuildNode         *nodes;
+    uint32_t              capacity; ///< The number of nodes that #nodes has room for
+    std::atomic<uint32_t> used{0};
+};
+
+/**
+    Hands out the nodes of (a subtree of) the build tree.
+
+    Subtrees that are built serially reserve enough nodes from the pool for their worst case up front, and then take
+    them one after the other without touching the pool's (shared) counter again. The nodes above them, which are built
+    concurrently, are reserved one at a time.
+*/
+struct BBHNodeAllocator
+{
+    BBHBuildNodePool &pool;
+    BBHBuildNode     *next = nullptr; ///< The next node reserved for this subtree, or nullptr to reserve each node
+
+    /// Create the allocator for a subtree over \p n primitives
+    BBHNodeAllocator(BBHBuildNodePool &pool, uint32_t n) :
+        pool(pool), next(n < BBHTree::parallel_build_threshold ? pool.reserve(2 * n - 1) : nullptr)
+    {
+    }
+
+    BBHBuildNode *create()
+    {
+        return new (next ? next++ : pool.reserve(1)) BBHBuildNode();
+    }
+};
 
 /// An axis-aligned bounding box hierarchy acceleration structure. \ingroup Surfaces
 struct BBH : public SurfaceGroup
 {
-    shared_ptr<BBHNode> root;
-    enum class SplitMethod
+    BBHTree                 tree;  ///< The hierarchy over #prims
+    NumaReplicas<BBHTree>   trees; ///< Copies of #tree on the other NUMA nodes
+    vector<const Surface *> prims; ///< The surfaces referenced by the leaves, in leaf order
+
+    /**
+        The world-space spheres among #prims (see Sphere::is_world_space()), in structure-of-arrays form and leaf
+        order. Other surfaces have a negative radius. Leaves test rays against all of their spheres at once with these,
+        and only call into the spheres that the ray actually hits.
+    */
+    struct Spheres
     {
-        SAH,
-        Middle,
-        Equal
-    } split_method    = SplitMethod::Middle;
-    int max_leaf_size = 1;
+        vector<float> x, y, z, radius;
+    } spheres;
+    bool has_spheres = false; ///< Whether any of #prims is a world-space sphere
 
     BBH(const json &j = json::object());
 
     /// Construct the BBH (must be called before @ref intersect)
     void build() override;
 
+    /// Refit the tree to the new bounds of the surfaces, rebuilding it if that degrades it too much
+    void refit() override;
+
     /// Intersect a ray against all surfaces registered with the Accelerator
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+
+    /// Determine whether the ray hits any of the surfaces, stopping at the first hit
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Intersect a packet of rays, sharing the traversal of the BBH among them
+    void intersect_packet(const Ray3f *rays, HitInfo *hits, bool *found, int count) const override;
+
+protected:
+    /// Fill #spheres from the current #prims
+    void gather_spheres();
+
+    /**
+        Call \p visit for the primitives <tt>[first, first + count)</tt> of a leaf that \p ray may hit.
+
+        World-space spheres are first tested in batches using #spheres, and only visited if the ray may hit them within
+        [mint, maxt]; all other primitives are always visited. The batch test only culls, so \p visit still calls into
+        the visited spheres.
+
+        \param visit  Callable with signature <tt>bool(uint32_t i)</tt>, called with the index of the primitive.
+                      Returning true stops the loop
+        \return       True if \p visit stopped the loop
+    */
+    template <typename Visit>
+    bool visit_leaf(uint32_t first, uint32_t count, const Ray3f &ray, Visit &&visit) const;
+
+    /// Intersect a ray with the BBH transformed by \p xform (either #m_xform, or the motion at the time of the ray)
+    bool intersect(const Ray3f &ray, HitInfo &hit, const Transform &xform) const;
+
+    /// Like #occluded(), with the BBH transformed by \p xform
+    bool occluded(const Ray3f &ray, const Transform &xform) const;
 };
 
+static_assert(BBHTree::max_packet_size == Surface::max_packet_size, "Packet sizes of BBHTree and Surface must match.");
 
-/// A lighter-weight version of SurfaceGroup for BBH leaf nodes that need to store multiple surfaces, but which don't
-/// need to store additional information like a transform or explicitly stored bounds.
-struct BBHLeaf : public Surface
+BBH::BBH(const json &j) : SurfaceGroup(j)
 {
-public:
-    bool intersect(const Ray3f &ray_, HitInfo &hit) const override
+    tree.parse(j);
+}
+
+void BBH::build()
+{
+    SurfaceGroup::build();
+
+    tree.clear();
+    trees.clear();
+    prims.clear();
+
+    if (m_surfaces.empty())
     {
-        // copy the ray so we can modify the tmax values as we traverse
-        Ray3f ray          = ray_;
-        bool  hit_anything = false;
+        spdlog::info("BBH contains no surfaces.");
+        return;
+    }
+
+    // compute the bounds and centroids of all surfaces once, in parallel
+    vector<BBHPrimInfo> prim_info(m_surfaces.size());
+    parallel_for(blocked_range<uint32_t>(0, uint32_t(m_surfaces.size()), 1024),
+                 [&](blocked_range<uint32_t> r)
+                 {
+                     for (auto i : r)
+                     {
+                         prim_info[i].bbox     = m_surfaces[i]->bounds();
+                         prim_info[i].centroid = prim_info[i].bbox.center();
+                         prim_info[i].index    = i;
+                     }
+                 });
 
-        // This is a linear intersection test that iterates over all primitives
-        // within the scene. It's the most naive intersection test and hence very
-        // slow if you have many primitives.
-        for (auto surface : surfaces)
+    // the tree only depends on the build parameters and the bounds of the surfaces, so use those as the cache key
+    uint64_t cache_key = 0;
+    bool     cached    = false;
+    if (cache_enabled())
+    {
+        Hasher hasher;
+        hasher.add_pod(tree.split_method).add_pod(tree.max_leaf_size).add_pod(tree.width).add_pod(tree.sbvh_budget);
+        hasher.add_pod(tree.compress);
+        for (auto &info : prim_info) hasher.add_pod(info.bbox);
+        cache_key = hasher.value();
+
+        CacheReader cache("bbh", cache_key);
+        vector<uint32_t> order;
+        if (cache.good() && tree.load(cache))
         {
-            if (surface->intersect(ray, hit))
+            // spatial splits reference some surfaces more than once
+            cache.read(order);
+            if (cache.good() && order.size() >= prim_info.size())
             {
-                hit_anything = true;
-                ray.maxt     = hit.t;
+                prim_info.resize(order.size());
+                for (size_t i = 0; i < order.size(); ++i) prim_info[i].index = order[i];
+                cached = true;
+                spdlog::info("Loaded BBH from the cache.");
             }
+            else
+                tree.clear();
         }
-
-        // record closest intersection
-        return hit_anything;
     }
 
-    Box3f bounds() const override
+    if (!cached)
     {
-        Box3f b;
-        for (auto &s : surfaces)
-            b.enclose(s->bounds());
+        // triangles can be clipped exactly, the bounds of all other surfaces are just clipped to the split planes
+        auto clip = [this](uint32_t i, const Box3f &box)
+        {
+            if (auto triangle = dynamic_cast<const Triangle *>(m_surfaces[i].get()))
+                return triangle->clipped_bounds(box);
+            Box3f bbox = m_surfaces[i]->bounds();
+            bbox.clip(box);
+            return bbox;
+        };
+
+        Progress progress("Building BBH", m_surfaces.size());
+        tree.build(prim_info, progress, clip);
+        progress.set_done();
 
-        return b;
+        if (cache_key)
+        {
+            vector<uint32_t> order(prim_info.size());
+            for (size_t i = 0; i < prim_info.size(); ++i) order[i] = prim_info[i].index;
+
+            CacheWriter cache("bbh", cache_key);
+            tree.save(cache);
+            cache.write(order);
+        }
     }
 
-    vector<shared_ptr<Surface>> surfaces; ///< All children
-};
+    // the leaves reference consecutive ranges of prim_info, so it directly provides the order of the surfaces
+    prims.resize(prim_info.size());
+    for (size_t i = 0; i < prim_info.size(); ++i) prims[i] = m_surfaces[prim_info[i].index].get();
+    tree_bytes += prims.size() * sizeof(const Surface *);
+    gather_spheres();
+    trees.replicate(tree);
+
+    spdlog::info("BBH contains {} surfaces in {} {}-wide nodes ({:.2f} MB).", m_surfaces.size(), tree.num_nodes(),
+                 tree.width, tree.size() / (1024.f * 1024.f));
+}
 
-/// A node of an axis-aligned bounding box hierarchy. \ingroup Surfaces
-struct BBHNode : public Surface
+void BBH::gather_spheres()
 {
-    Box3f               bbox;        ///< The bounding box of this node
-    shared_ptr<Surface> left_child;  ///< Pointer to left child
-    shared_ptr<Surface> right_child; ///< Pointer to right child
+    has_spheres = false;
+    for (auto *v : {&spheres.x, &spheres.y, &spheres.z, &spheres.radius}) v->assign(prims.size(), -1.f);
+    for (size_t i = 0; i < prims.size(); ++i)
+        if (auto sphere = dynamic_cast<const Sphere *>(prims[i]); sphere && sphere->is_world_space())
+        {
+            const Vec3f &c    = sphere->world_center();
+            spheres.x[i]      = c.x;
+            spheres.y[i]      = c.y;
+            spheres.z[i]      = c.z;
+            spheres.radius[i] = sphere->world_radius();
+            has_spheres       = true;
+        }
+    if (!has_spheres)
+        for (auto *v : {&spheres.x, &spheres.y, &spheres.z, &spheres.radius}) vector<float>().swap(*v);
+}
 
-    BBHNode(vector<shared_ptr<Surface>> surfaces, Progress &progress, int depth = 0);
+template <typename Visit>
+bool BBH::visit_leaf(uint32_t first, uint32_t count, const Ray3f &ray, Visit &&visit) const
+{
+    if (!has_spheres)
+    {
+        for (uint32_t i = first; i < first + count; ++i)
+            if (visit(i))
+                return true;
+        return false;
+    }
 
-    ~BBHNode();
+    // cull the spheres the ray misses, for a batch of spheres at a time in a loop that the compiler can vectorize
+    constexpr uint32_t batch = 8;
+    float              a     = length2(ray.d);
+    for (uint32_t begin = first; begin < first + count; begin += batch)
+    {
+        uint32_t n = std::min(batch, first + count - begin);
+        bool     candidate[batch];
+        for (uint32_t k = 0; k < batch; ++k)
+        {
+            uint32_t i         = std::min(begin + k, uint32_t(prims.size() - 1)); // stay within the arrays
+            float    ox        = ray.o.x - spheres.x[i], oy = ray.o.y - spheres.y[i], oz = ray.o.z - spheres.z[i];
+            float    r         = spheres.radius[i];
+            float    half_b    = ox * ray.d.x + oy * ray.d.y + oz * ray.d.z;
+            float    c         = ox * ox + oy * oy + oz * oz - r * r;
+            float    disc      = half_b * half_b - a * c;
+            float    sqrt_disc = std::sqrt(std::max(disc, 0.f));
+            float    t0        = (-half_b - sqrt_disc) / a, t1 = (-half_b + sqrt_disc) / a;
+            candidate[k] = r < 0.f || (disc >= 0.f && ((t0 >= ray.mint && t0 <= ray.maxt) ||
+                                                       (t1 >= ray.mint && t1 <= ray.maxt)));
+        }
 
-    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+        for (uint32_t k = 0; k < n; ++k)
+        {
+            uint32_t i = begin + k;
+            if (spheres.radius[i] >= 0.f)
+            {
+                ++num_batch_tested_spheres;
+                if (!candidate[k])
+                    ++num_batch_rejected_spheres;
+            }
+            if (candidate[k] && visit(i))
+                return true;
+        }
+    }
+    return false;
+}
+
+void BBH::refit()
+{
+    SurfaceGroup::refit();
+    if (prims.empty())
+        return;
 
-    Box3f bounds() const override
+    vector<Box3f> bounds(prims.size());
+    parallel_for(blocked_range<uint32_t>(0, uint32_t(prims.size()), 1024),
+                 [&](blocked_range<uint32_t> r)
+                 {
+                     for (auto i : r) bounds[i] = prims[i]->bounds();
+                 });
+    tree.refit(bounds);
+    gather_spheres();
+    trees.replicate(tree);
+    ++num_refits;
+
+    float cost = tree.sah_cost();
+    if (cost > tree.refit_threshold * tree.build_cost)
     {
-        return bbox;
+        spdlog::info("Refitting the BBH increased its SAH cost from {:.2f} to {:.2f}, rebuilding it.", tree.build_cost,
+                     cost);
+        ++num_refit_rebuilds;
+        build();
     }
-};
+}
 
-BBHNode::BBHNode(vector<shared_ptr<Surface>> surfaces, Progress &progress, int depth)
+bool BBH::intersect(const Ray3f &ray, HitInfo &hit) const
 {
-    // TODO: Implement BBH construction, following chapter 2 of the book.
-    // Hints:
-    //     -- To get a random number in [0, n-1], you can use int(randf()*n)
-    //     -- To sort a list of surfaces based on some sorting criterion, you can use std::sort and lambdas, like so:
-    //
-    //          std::sort(surfaces.begin(), surfaces.end(), [&](const Surface *a, const Surface *b) {
-    //              return isASmallerThanB(a, b);
-    //          });
-    //
-    //     For example, to sort them based on centroid along an axis, you could do
-    //
-    //          return a->bounds().center()[axis] < b->bounds().center()[axis]
-    //
-    //     -- To split a list (in C++: a 'vector') of things into two lists so that the first list has the first
-    //     k elements of the original list, and the other list has the rest of the elements, you can do
-    //          std::vector<Surface*> listA, listB
-    //          listA.insert(listA.end(), originalList.begin(), originalList.begin() + k);
-    //          listB.insert(listB.end(), originalList.begin() + k, originalList.end();
-    //
-    //     -- After construction, you need to compute the bounding box of this BBH node and assign it to bbox
-    //     -- You can get the bounding box of a surface using surf->bounds();
-    //     -- To take the union of two boxes, look at Box2f::enclose()
-    put_your_code_here("Insert your BBH construction code here");
+    if (prims.empty())
+        return false;
+
+    // only moving BBHs need to compute their transform for each ray
+    return m_motion.is_animated() ? intersect(ray, hit, m_motion.at(ray.time)) : intersect(ray, hit, m_xform);
 }
 
+bool BBH::intersect(const Ray3f &ray_, HitInfo &hit, const Transform &xform) const
+{
+    // transform the ray (most BBHs are not transformed at all)
+    auto ray = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
 
-BBHNode::~BBHNode()
+    bool hit_something = trees.local(tree).intersect(ray,
+                                                     [&](uint32_t first, uint32_t count, Ray3f &r)
+                                                     {
+                                                         bool hit_leaf = false;
+                                                         visit_leaf(first, count, r,
+                                                                    [&](uint32_t i)
+                                                                    {
+                                                                        if (prims[i]->intersect(r, hit))
+                                                                        {
+                                                                            hit_leaf = true;
+                                                                            r.maxt   = hit.t;
+                                                                        }
+                                                                        return false;
+                                                                    });
+                                                         return hit_leaf;
+                                                     });
+
+    if (hit_something && !xform.is_identity())
+    {
+        // transform the hit information back
+        hit.p  = xform.point(hit.p);
+        hit.gn = normalize(xform.normal(hit.gn));
+        hit.sn = normalize(xform.normal(hit.sn));
+    }
+    return hit_something;
+}
+
+void BBH::intersect_packet(const Ray3f *rays_, HitInfo *hits, bool *found, int count) const
 {
+    for (int i = 0; i < count; ++i) found[i] = false;
+    if (prims.empty())
+        return;
+
+    // the rays of a packet may see a moving BBH at different places
+    if (m_motion.is_animated())
+    {
+        for (int i = 0; i < count; ++i) found[i] = intersect(rays_[i], hits[i]);
+        return;
+    }
+
+    // transform the rays
+    Transform inv = m_xform.inverse();
+    Ray3f     rays[BBHTree::max_packet_size];
+    for (int i = 0; i < count; ++i) rays[i] = inv.is_identity() ? rays_[i] : inv.ray(rays_[i]);
+
+    trees.local(tree).intersect_packet(rays, count,
+                                       [&](uint32_t first, uint32_t num, Ray3f &r, int lane)
+                                       {
+                                           bool hit_leaf = false;
+                                           visit_leaf(first, num, r,
+                                                      [&](uint32_t i)
+                                                      {
+                                                          if (prims[i]->intersect(r, hits[lane]))
+                                                          {
+                                                              hit_leaf = true;
+                                                              r.maxt   = hits[lane].t;
+                                                          }
+                                                          return false;
+                                                      });
+                                           found[lane] = found[lane] || hit_leaf;
+                                           return hit_leaf;
+                                       });
+
+    // transform the hit information back
+    for (int i = 0; i < count && !m_xform.is_identity(); ++i)
+        if (found[i])
+        {
+            hits[i].p  = m_xform.point(hits[i].p);
+            hits[i].gn = normalize(m_xform.normal(hits[i].gn));
+            hits[i].sn = normalize(m_xform.normal(hits[i].sn));
+        }
 }
 
-bool BBHNode::intersect(const Ray3f &ray_, HitInfo &hit) const
+bool BBH::occluded(const Ray3f &ray) const
 {
-    ++bbh_nodes_visited;
-    // TODO: Implement BBH intersection, following chapter 2 of the book.
-    put_your_code_here("Insert your BBH intersection code here");
-    return false;
+    if (prims.empty())
+        return false;
+
+    return m_motion.is_animated() ? occluded(ray, m_motion.at(ray.time)) : occluded(ray, m_xform);
 }
 
-BBH::BBH(const json &j) : SurfaceGroup(j)
+bool BBH::occluded(const Ray3f &ray_, const Transform &xform) const
 {
-    // These values aren't used in the base code right now - but you can use these for when you want to extend the basic
-    // BBH functionality
+    auto ray = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
+    return trees.local(tree).occluded(ray,
+                                      [&](uint32_t first, uint32_t count, Ray3f &r)
+                                      {
+                                          return visit_leaf(first, count, r,
+                                                            [&](uint32_t i) { return prims[i]->occluded(r); });
+                                      });
+}
 
+void BBHTree::parse(const json &j)
+{
     max_leaf_size = j.value("max_leaf_size", max_leaf_size);
 
     string sm = j.value("split_method", "equal");
@@ -156,39 +481,793 @@ BBH::BBH(const json &j) : SurfaceGroup(j)
     else if (sm == "equal")
         // Split so that an equal number of objects are on either side
         split_method = SplitMethod::Equal;
+    else if (sm == "sbvh")
+        // Surface-area heuristic, also splitting the bounds of primitives that straddle the split plane
+        split_method = SplitMethod::SBVH;
     else
     {
         spdlog::error("Unrecognized split_method \"{}\". Using \"equal\" instead.", sm);
         split_method = SplitMethod::Equal;
     }
+
+    width = j.value("width", width);
+    if (width != 2 && width != 4 && width != 8)
+        throw DartsException("BBH 'width' must be 2, 4, or 8, got {}.", width);
+
+    compress = j.value("compress", compress);
+    if (compress && width == 2)
+        throw DartsException("BBH 'compress' requires a 'width' of 4 or 8.");
+
+    refit_threshold = j.value("refit_threshold", refit_threshold);
+
+    sbvh_budget = j.value("sbvh_budget", sbvh_budget);
+    if (sbvh_budget < 1.f)
+        throw DartsException("BBH 'sbvh_budget' must be at least 1, got {}.", sbvh_budget);
+
+    if (max_leaf_size < 1 || max_leaf_size > std::numeric_limits<uint16_t>::max())
+        throw DartsException("'max_leaf_size' must be between 1 and {}, got {}.",
+                             std::numeric_limits<uint16_t>::max(), max_leaf_size);
 }
 
-void BBH::build()
+void BBHTree::clear()
+{
+    nodes.clear();
+    nodes4.clear();
+    nodes8.clear();
+    qnodes4.clear();
+    qnodes8.clear();
+}
+
+void BBHTree::save(CacheWriter &cache) const
+{
+    cache.write(int32_t(width));
+    cache.write(compress);
+    cache.write(num_prims);
+    cache.write(nodes);
+    cache.write(nodes4);
+    cache.write(nodes8);
+    cache.write(qnodes4);
+    cache.write(qnodes8);
+}
+
+bool BBHTree::load(CacheReader &cache)
+{
+    int32_t w = 0;
+    bool    c = false;
+    cache.read(w);
+    cache.read(c);
+    cache.read(num_prims);
+    cache.read(nodes);
+    cache.read(nodes4);
+    cache.read(nodes8);
+    cache.read(qnodes4);
+    cache.read(qnodes8);
+    if (!cache.good() || w != width || c != compress)
+    {
+        clear();
+        return false;
+    }
+    tree_bytes += size();
+    node_bytes += size();
+    node_prims += num_prims;
+    build_cost = sah_cost();
+    return true;
+}
+
+void BBHTree::build(vector<BBHPrimInfo> &prim_info, Progress &progress, const ClipFunc &clip)
+{
+    SCOPED_STAT_TIMER(bbh_build_time);
+
+    clear();
+    num_prims = uint32_t(prim_info.size());
+    if (prim_info.empty())
+        return;
+
+    // each of the (at most max_refs) references ends up in a single leaf, so the pool bound holds for the SBVH too
+    uint32_t n        = uint32_t(prim_info.size());
+    uint32_t max_refs = split_method == SplitMethod::SBVH ? std::max(n, uint32_t(double(n) * sbvh_budget)) : n;
+    BBHBuildNodePool pool(2 * max_refs - 1);
+    BBHNodeAllocator alloc(pool, max_refs);
+    auto             root = split_method == SplitMethod::SBVH ? build_sbvh(alloc, prim_info, max_refs, clip, progress)
+                                                              : build_recursive(alloc, prim_info, 0, n, progress);
+
+    // the traversal stacks hold at most one entry per level (per child of a wide node), and are not checked
+    if (int depth = build_depth(root); depth > max_depth)
+        throw DartsException("The BBH over {} primitives is {} levels deep, but can be at most {} levels deep.", n,
+                             depth, max_depth);
+
+    // compact the temporary tree into a linear array
+    if (width == 4 && compress)
+        flatten_wide(root, qnodes4);
+    else if (width == 4)
+        flatten_wide(root, nodes4);
+    else if (width == 8 && compress)
+        flatten_wide(root, qnodes8);
+    else if (width == 8)
+        flatten_wide(root, nodes8);
+    else
+    {
+        nodes.reserve(root->num_nodes);
+        flatten(root);
+    }
+    tree_bytes += size();
+    node_bytes += size();
+    node_prims += num_prims;
+    build_cost = sah_cost();
+}
+
+/// Update the bounds of all children in \p wide_nodes from the bounds of the leaf primitives
+template <typename Node>
+static void refit_wide(vector<Node> &wide_nodes, const vector<Box3f> &prim_bounds)
+{
+    constexpr int N = Node::width;
+
+    // the children of each node are stored after it, so visiting the nodes backwards visits children first
+    for (size_t n = wide_nodes.size(); n-- > 0;)
+    {
+        Node &node = wide_nodes[n];
+        Box3f bounds[N];
+        for (int i = 0; i < N; ++i)
+        {
+            if (!node.used(i))
+                continue;
+
+            if (node.count[i] > 0)
+                for (uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; ++p)
+                    bounds[i].enclose(prim_bounds[p]);
+            else
+                for (int c = 0; c < N; ++c) bounds[i].enclose(wide_nodes[node.child[i]].bounds(c));
+        }
+        node.set_bounds(bounds);
+    }
+}
+
+/// The SAH cost of \p wide_nodes, relative to the area of the root
+template <typename Node>
+static float sah_cost_wide(const vector<Node> &wide_nodes)
+{
+    float cost = 0.f, root_area = 0.f;
+    for (size_t n = 0; n < wide_nodes.size(); ++n)
+    {
+        const Node &node = wide_nodes[n];
+        Box3f       bbox;
+        for (int i = 0; i < Node::width; ++i)
+            if (node.used(i))
+            {
+                bbox.enclose(node.bounds(i));
+                if (node.count[i] > 0)
+                    cost += node.count[i] * node.bounds(i).area();
+            }
+        cost += BBHTree::sah_traversal_cost * bbox.area();
+        if (n == 0)
+            root_area = bbox.area();
+    }
+    return root_area > 0.f ? cost / root_area : 0.f;
+}
+
+void BBHTree::refit(const vector<Box3f> &prim_bounds)
+{
+    if (width == 4)
+        return compress ? refit_wide(qnodes4, prim_bounds) : refit_wide(nodes4, prim_bounds);
+    else if (width == 8)
+        return compress ? refit_wide(qnodes8, prim_bounds) : refit_wide(nodes8, prim_bounds);
+
+    // the children of each node are stored after it, so visiting the nodes backwards visits children first
+    for (size_t n = nodes.size(); n-- > 0;)
+    {
+        LinearBBHNode &node = nodes[n];
+        node.bbox           = Box3f();
+        if (node.num_prims > 0)
+            for (uint32_t p = node.prims_offset; p < node.prims_offset + node.num_prims; ++p)
+                node.bbox.enclose(prim_bounds[p]);
+        else
+        {
+            node.bbox.enclose(nodes[n + 1].bbox);
+            node.bbox.enclose(nodes[node.second_child_offset].bbox);
+        }
+    }
+}
+
+float BBHTree::sah_cost() const
+{
+    if (width == 4)
+        return compress ? sah_cost_wide(qnodes4) : sah_cost_wide(nodes4);
+    else if (width == 8)
+        return compress ? sah_cost_wide(qnodes8) : sah_cost_wide(nodes8);
+
+    if (nodes.empty() || nodes[0].bbox.area() <= 0.f)
+        return 0.f;
+
+    float cost = 0.f;
+    for (auto &node : nodes)
+        cost += node.num_prims > 0 ? node.num_prims * node.bbox.area() : sah_traversal_cost * node.bbox.area();
+    return cost / nodes[0].bbox.area();
+}
+
+BBHBuildNode *BBHTree::build_recursive(BBHNodeAllocator &alloc, vector<BBHPrimInfo> &prim_info, uint32_t begin,
+                                       uint32_t end, Progress &progress, bool report) const
 {
-    Progress progress("Building BBH", m_surfaces.size());
-    if (!m_surfaces.empty())
-        root = make_shared<BBHNode>(m_surfaces, progress);
+    auto     node = alloc.create();
+    uint32_t n    = end - begin;
+
+    // compute the bounding box of this node and of all surface centroids
+    Box3f centroid_bounds;
+    for (uint32_t i = begin; i < end; ++i)
+    {
+        node->bbox.enclose(prim_info[i].bbox);
+        centroid_bounds.enclose(prim_info[i].centroid);
+    }
+
+    auto make_leaf = [&]()
+    {
+        node->first_prim = begin;
+        node->num_prims  = n;
+        if (report)
+            progress += n;
+        return node;
+    };
+
+    if (n == 1)
+        return make_leaf();
+
+    // split along the axis with the largest centroid extent
+    int         axis = la::argmax(centroid_bounds.diagonal());
+    const float cmin = centroid_bounds.min[axis], cmax = centroid_bounds.max[axis];
+
+    // the SAH decides on its own whether a leaf is worthwhile, the other methods create one whenever allowed
+    if (int(n) <= max_leaf_size && (cmax <= cmin || split_method != SplitMethod::SAH))
+        return make_leaf();
+
+    uint32_t mid          = begin + n / 2;
+    auto     first        = prim_info.begin() + begin;
+    auto     last         = prim_info.begin() + end;
+    bool     need_nth_mid = true;
+
+    if (cmax > cmin && split_method == SplitMethod::Middle)
+    {
+        float pmid = 0.5f * (cmin + cmax);
+        mid        = uint32_t(std::partition(first, last, [&](const BBHPrimInfo &p) { return p.centroid[axis] < pmid; }) -
+                       prim_info.begin());
+        // fall back to an equal split if all centroids ended up on one side
+        need_nth_mid = mid == begin || mid == end;
+    }
+    else if (cmax > cmin && split_method == SplitMethod::SAH && n > 2)
+    {
+        // bin the centroids along the split axis
+        struct Bin
+        {
+            Box3f    bbox;
+            uint32_t count = 0;
+        } bins[num_sah_bins];
+
+        const float scale  = num_sah_bins / (cmax - cmin);
+        auto        bin_of = [&](const BBHPrimInfo &p)
+        { return std::min(int((p.centroid[axis] - cmin) * scale), num_sah_bins - 1); };
+
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            Bin &b = bins[bin_of(prim_info[i])];
+            b.count++;
+            b.bbox.enclose(prim_info[i].bbox);
+        }
+
+        // sweep from the right to get the area and count of everything right of each split plane
+        float    right_area[num_sah_bins - 1];
+        uint32_t right_count[num_sah_bins - 1];
+        Box3f    right_box;
+        uint32_t count = 0;
+        for (int i = num_sah_bins - 1; i > 0; --i)
+        {
+            right_box.enclose(bins[i].bbox);
+            count += bins[i].count;
+            right_area[i - 1]  = right_box.area();
+            right_count[i - 1] = count;
+        }
+
+        // sweep from the left to evaluate the cost of splitting after each bin
+        Box3f    left_box;
+        uint32_t left_count = 0;
+        int      best_split = -1;
+        float    best_cost  = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < num_sah_bins - 1; ++i)
+        {
+            left_box.enclose(bins[i].bbox);
+            left_count += bins[i].count;
+            if (left_count == 0 || right_count[i] == 0)
+                continue;
+
+            float cost = left_count * left_box.area() + right_count[i] * right_area[i];
+            if (cost < best_cost)
+            {
+                best_cost  = cost;
+                best_split = i;
+            }
+        }
+        best_cost = sah_traversal_cost + best_cost / node->bbox.area();
+
+        // create a leaf if it is cheaper than the best split and we are allowed to
+        if (int(n) <= max_leaf_size && float(n) <= best_cost)
+            return make_leaf();
+
+        if (best_split >= 0)
+        {
+            mid = uint32_t(std::partition(first, last, [&](const BBHPrimInfo &p) { return bin_of(p) <= best_split; }) -
+                           prim_info.begin());
+            need_nth_mid = false;
+        }
+    }
+    else if (int(n) <= max_leaf_size)
+        return make_leaf();
+
+    if (need_nth_mid)
+    {
+        mid = begin + n / 2;
+        std::nth_element(first, prim_info.begin() + mid, last,
+                         [axis](const BBHPrimInfo &a, const BBHPrimInfo &b)
+                         { return a.centroid[axis] < b.centroid[axis]; });
+    }
+
+    node->axis = axis;
+
+    // build the two children, concurrently if this subtree is large enough to be worth it
+    if (n >= parallel_build_threshold)
+        parallel_for(blocked_range<uint32_t>(0, 2, 1),
+                     [&](blocked_range<uint32_t> r)
+                     {
+                         for (auto c : r)
+                         {
+                             uint32_t         b = c == 0 ? begin : mid, e = c == 0 ? mid : end;
+                             BBHNodeAllocator child_alloc(alloc.pool, e - b);
+                             node->children[c] = build_recursive(child_alloc, prim_info, b, e, progress);
+                         }
+                     });
     else
-        root = nullptr;
-    progress.set_done();
-    spdlog::info("BBH contains {} surfaces.", m_surfaces.size());
+    {
+        node->children[0] = build_recursive(alloc, prim_info, begin, mid, progress, false);
+        node->children[1] = build_recursive(alloc, prim_info, mid, end, progress, false);
+        if (report)
+            progress += n;
+    }
+
+    node->num_nodes = 1 + node->children[0]->num_nodes + node->children[1]->num_nodes;
+    return node;
+}
+
+/// The surface area of \p box, or 0 if it is empty
+static float safe_area(const Box3f &box)
+{
+    return box.is_empty() ? 0.f : box.area();
 }
 
-bool BBH::intersect(const Ray3f &ray_, HitInfo &hit) const
+/**
+    Builds a BBH with spatial splits, as proposed by Stich et al. in "Spatial Splits in Bounding Volume Hierarchies".
+
+    Besides the binned object splits of the SAH, each node may be split by a plane that cuts through the references
+    straddling it: both children then reference such a primitive, with its bounds clipped to their side of the plane.
+    This tightens the nodes around large or long, thin primitives, which would otherwise overlap many of their
+    neighbors. Spatial splits are only tried where the children of the best object split overlap noticeably, and only
+    while the number of references stays within the budget.
+*/
+struct SBVHBuilder
+{
+    /// The best object split of a node: a partition of its references by their binned centroids
+    struct ObjectSplit
+    {
+        int   axis = 0, bin = -1; ///< The split is after bin #bin along #axis (-1 if there is none)
+        float cmin = 0.f, scale = 0.f;
+        float cost = std::numeric_limits<float>::infinity(); ///< The unnormalized SAH cost of the children
+        Box3f left, right;
+
+        int bin_of(const BBHPrimInfo &p) const
+        {
+            return std::min(int((p.centroid[axis] - cmin) * scale), BBHTree::num_sah_bins - 1);
+        }
+    };
+
+    /**
+        The best spatial split of a node: a plane orthogonal to #axis after bin #bin of the node's spatial bins.
+
+        References are assigned to the bins with #bin_at() both when the split is evaluated and when it is carried
+        out, so that the children get exactly the references (and duplicates) that the split was chosen for.
+    */
+    struct SpatialSplit
+    {
+        int   axis = 0, bin = -1; ///< The split is after bin #bin along #axis (-1 if there is none)
+        float bmin = 0.f, width = 0.f;
+        float cost = std::numeric_limits<float>::infinity(); ///< The unnormalized SAH cost of the children
+
+        /// The bin containing coordinate \p x along #axis
+        int bin_at(float x) const
+        {
+            return std::clamp(int((x - bmin) / width), 0, BBHTree::num_sah_bins - 1);
+        }
+
+        /// The position of the splitting plane along #axis
+        float position() const
+        {
+            return bmin + (bin + 1) * width;
+        }
+    };
+
+    const BBHTree           &tree;
+    const BBHTree::ClipFunc &clip;
+    BBHNodeAllocator        &alloc;
+    Progress                &progress;
+    vector<BBHPrimInfo>      leaf_refs;      ///< The references of the leaves created so far, in leaf order
+    float                    root_area = 0.f;
+    uint32_t                 max_refs  = 0;   ///< The budget of references
+    uint32_t                 num_refs  = 0;   ///< The number of references so far (including all duplicates)
+    uint32_t                 num_prims = 0;   ///< The number of primitives, which the progress bar counts up to
+    uint32_t                 reported  = 0;   ///< The steps reported to #progress so far
+
+    /// Build the subtree over \p refs, which is released before building the children
+    BBHBuildNode *build(vector<BBHPrimInfo> &refs, int depth);
+
+    /// The bounds of the part of \p ref inside \p box
+    Box3f clipped(const BBHPrimInfo &ref, Box3f box) const
+    {
+        box.clip(ref.bbox);
+        if (clip && !box.is_empty())
+            box.clip(clip(ref.index, box));
+        return box;
+    }
+
+    ObjectSplit  find_object_split(const vector<BBHPrimInfo> &refs, const Box3f &centroid_bounds) const;
+    SpatialSplit find_spatial_split(const vector<BBHPrimInfo> &refs, const Box3f &bbox) const;
+
+    /// Distribute \p refs to the two sides of \p split, returning false if it would leave a side empty or exceed
+    /// the budget of references
+    bool split_references(const vector<BBHPrimInfo> &refs, const Box3f &bbox, const SpatialSplit &split,
+                          vector<BBHPrimInfo> &left, vector<BBHPrimInfo> &right);
+};
+
+SBVHBuilder::ObjectSplit SBVHBuilder::find_object_split(const vector<BBHPrimInfo> &refs,
+                                                        const Box3f              &centroid_bounds) const
 {
-    ++total_rays;
-    if (!root)
+    constexpr int num_bins = BBHTree::num_sah_bins;
+
+    ObjectSplit split;
+    split.axis = la::argmax(centroid_bounds.diagonal());
+    split.cmin = centroid_bounds.min[split.axis];
+    float cmax = centroid_bounds.max[split.axis];
+    if (cmax <= split.cmin)
+        return split;
+    split.scale = num_bins / (cmax - split.cmin);
+
+    Box3f    bin_box[num_bins];
+    uint32_t bin_count[num_bins] = {};
+    for (auto &ref : refs)
+    {
+        int b = split.bin_of(ref);
+        bin_count[b]++;
+        bin_box[b].enclose(ref.bbox);
+    }
+
+    // sweep from the right to get the bounds and count of everything right of each split plane
+    Box3f    right_box[num_bins - 1], box;
+    uint32_t right_count[num_bins - 1], count = 0;
+    for (int i = num_bins - 1; i > 0; --i)
+    {
+        box.enclose(bin_box[i]);
+        count += bin_count[i];
+        right_box[i - 1]   = box;
+        right_count[i - 1] = count;
+    }
+
+    // sweep from the left to evaluate the cost of splitting after each bin
+    Box3f    left_box;
+    uint32_t left_count = 0;
+    for (int i = 0; i < num_bins - 1; ++i)
+    {
+        left_box.enclose(bin_box[i]);
+        left_count += bin_count[i];
+        if (left_count == 0 || right_count[i] == 0)
+            continue;
+
+        float cost = left_count * safe_area(left_box) + right_count[i] * safe_area(right_box[i]);
+        if (cost < split.cost)
+        {
+            split.cost  = cost;
+            split.bin   = i;
+            split.left  = left_box;
+            split.right = right_box[i];
+        }
+    }
+    return split;
+}
+
+SBVHBuilder::SpatialSplit SBVHBuilder::find_spatial_split(const vector<BBHPrimInfo> &refs, const Box3f &bbox) const
+{
+    constexpr int num_bins = BBHTree::num_sah_bins;
+
+    SpatialSplit split;
+    split.axis    = la::argmax(bbox.diagonal());
+    int   axis    = split.axis;
+    float bmin    = bbox.min[axis];
+    float width   = (bbox.max[axis] - bmin) / num_bins;
+    auto  bin_box = [&](int b)
+    {
+        Box3f slab = bbox;
+        if (b > 0)
+            slab.min[axis] = bmin + b * width;
+        if (b < num_bins - 1)
+            slab.max[axis] = bmin + (b + 1) * width;
+        return slab;
+    };
+    if (width <= 0.f)
+        return split;
+    split.bmin  = bmin;
+    split.width = width;
+
+    // clip each reference to the bins it overlaps, counting where it enters and where it exits
+    Box3f    bins[num_bins];
+    uint32_t entries[num_bins] = {}, exits[num_bins] = {};
+    for (auto &ref : refs)
+    {
+        int first = split.bin_at(ref.bbox.min[axis]), last = split.bin_at(ref.bbox.max[axis]);
+        if (first == last)
+            bins[first].enclose(ref.bbox);
+        else
+            for (int b = first; b <= last; ++b) bins[b].enclose(clipped(ref, bin_box(b)));
+        entries[first]++;
+        exits[last]++;
+    }
+
+    // sweep from the right as for object splits: references right of a plane are those that exit after it
+    Box3f    right_box[num_bins - 1], box;
+    uint32_t right_count[num_bins - 1], count = 0;
+    for (int i = num_bins - 1; i > 0; --i)
+    {
+        box.enclose(bins[i]);
+        count += exits[i];
+        right_box[i - 1]   = box;
+        right_count[i - 1] = count;
+    }
+
+    // references left of a plane are those that enter before it, the ones counted on both sides are duplicated
+    Box3f    left_box;
+    uint32_t left_count = 0, n = uint32_t(refs.size());
+    for (int i = 0; i < num_bins - 1; ++i)
+    {
+        left_box.enclose(bins[i]);
+        left_count += entries[i];
+        if (left_count == 0 || right_count[i] == 0 || num_refs + left_count + right_count[i] - n > max_refs)
+            continue;
+
+        float cost = left_count * safe_area(left_box) + right_count[i] * safe_area(right_box[i]);
+        if (cost < split.cost)
+        {
+            split.cost = cost;
+            split.bin  = i;
+        }
+    }
+    return split;
+}
+
+bool SBVHBuilder::split_references(const vector<BBHPrimInfo> &refs, const Box3f &bbox, const SpatialSplit &split,
+                                   vector<BBHPrimInfo> &left, vector<BBHPrimInfo> &right)
+{
+    int   axis      = split.axis;
+    float position  = split.position();
+    Box3f left_box  = bbox;
+    Box3f right_box = bbox;
+    left_box.max[axis] = right_box.min[axis] = position;
+
+    // classify the references by their bins exactly as find_spatial_split() counted them
+    uint32_t duplicates = 0;
+    for (auto &ref : refs)
+    {
+        if (split.bin_at(ref.bbox.max[axis]) <= split.bin)
+            left.push_back(ref);
+        else if (split.bin_at(ref.bbox.min[axis]) > split.bin)
+            right.push_back(ref);
+        else
+        {
+            // the reference straddles the plane: clip it to both sides, dropping it from a side that it misses
+            BBHPrimInfo l = ref, r = ref;
+            l.bbox        = clipped(ref, left_box);
+            r.bbox        = clipped(ref, right_box);
+            l.centroid    = l.bbox.center();
+            r.centroid    = r.bbox.center();
+            if (!l.bbox.is_empty())
+                left.push_back(l);
+            if (!r.bbox.is_empty())
+                right.push_back(r);
+            if (l.bbox.is_empty() && r.bbox.is_empty())
+                (ref.centroid[axis] < position ? left : right).push_back(ref);
+            else if (!l.bbox.is_empty() && !r.bbox.is_empty())
+                ++duplicates;
+        }
+    }
+
+    // fall back to the object split rather than overrun the budget (and with it the node pool)
+    if (left.empty() || right.empty() || num_refs + duplicates > max_refs)
+    {
+        left.clear();
+        right.clear();
         return false;
+    }
+    num_refs += duplicates;
+    return true;
+}
 
-    // transform the ray
-    auto ray           = m_xform.inverse().ray(ray_);
-    bool hit_something = root->intersect(ray, hit);
+BBHBuildNode *SBVHBuilder::build(vector<BBHPrimInfo> &refs, int depth)
+{
+    auto     node = alloc.create();
+    uint32_t n    = uint32_t(refs.size());
 
-    // transform the hit information back
-    hit.p = m_xform.point(hit.p);
-    hit.gn = normalize(m_xform.normal(hit.gn));
-    hit.sn = normalize(m_xform.normal(hit.sn));
-    return hit_something;
+    Box3f centroid_bounds;
+    for (auto &ref : refs)
+    {
+        node->bbox.enclose(ref.bbox);
+        centroid_bounds.enclose(ref.centroid);
+    }
+
+    auto make_leaf = [&]()
+    {
+        node->first_prim = uint32_t(leaf_refs.size());
+        node->num_prims  = n;
+        leaf_refs.insert(leaf_refs.end(), refs.begin(), refs.end());
+
+        // duplicated references would overshoot the progress bar, which counts primitives
+        uint32_t steps = std::min(n, num_prims - reported);
+        reported += steps;
+        progress += steps;
+        return node;
+    };
+
+    if (n == 1)
+        return make_leaf();
+
+    float        node_area = safe_area(node->bbox);
+    ObjectSplit  object    = find_object_split(refs, centroid_bounds);
+    SpatialSplit spatial;
+
+    // only try a spatial split where the object split leaves the children overlapping, and if the budget allows
+    Box3f overlap = object.left;
+    overlap.clip(object.right);
+    if (object.bin < 0 || safe_area(overlap) > tree.sbvh_alpha * root_area)
+        if (depth < BBHTree::sbvh_max_depth && num_refs < max_refs)
+            spatial = find_spatial_split(refs, node->bbox);
+
+    // create a leaf if it is cheaper than the best split and we are allowed to
+    float best_cost = std::min(object.cost, spatial.cost);
+    if (int(n) <= tree.max_leaf_size &&
+        (node_area <= 0.f || float(n) <= BBHTree::sah_traversal_cost + best_cost / node_area))
+        return make_leaf();
+
+    vector<BBHPrimInfo> left, right;
+    if (spatial.cost < object.cost && split_references(refs, node->bbox, spatial, left, right))
+    {
+        node->axis = spatial.axis;
+        ++num_spatial_splits;
+    }
+    else
+    {
+        auto mid = refs.begin() + n / 2;
+        if (object.bin >= 0)
+            mid = std::partition(refs.begin(), refs.end(),
+                                 [&](const BBHPrimInfo &p) { return object.bin_of(p) <= object.bin; });
+        else
+            // all centroids coincide: fall back to an equal split
+            std::nth_element(refs.begin(), mid, refs.end(),
+                             [axis = object.axis](const BBHPrimInfo &a, const BBHPrimInfo &b)
+                             { return a.centroid[axis] < b.centroid[axis]; });
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+        node->axis = object.axis;
+    }
+
+    vector<BBHPrimInfo>().swap(refs);
+    node->children[0] = build(left, depth + 1);
+    node->children[1] = build(right, depth + 1);
+    node->num_nodes   = 1 + node->children[0]->num_nodes + node->children[1]->num_nodes;
+    return node;
+}
+
+BBHBuildNode *BBHTree::build_sbvh(BBHNodeAllocator &alloc, vector<BBHPrimInfo> &prim_info, uint32_t max_refs,
+                                  const ClipFunc &clip, Progress &progress) const
+{
+    Box3f bbox;
+    for (auto &info : prim_info) bbox.enclose(info.bbox);
+
+    SBVHBuilder builder{*this, clip, alloc, progress};
+    builder.root_area = safe_area(bbox);
+    builder.max_refs  = max_refs;
+    builder.num_refs  = builder.num_prims = uint32_t(prim_info.size());
+    builder.leaf_refs.reserve(prim_info.size());
+
+    auto root = builder.build(prim_info, 0);
+
+    num_sbvh_primitives += builder.num_prims;
+    num_sbvh_references += builder.leaf_refs.size();
+    prim_info.swap(builder.leaf_refs);
+    return root;
+}
+
+uint32_t BBHTree::flatten(const BBHBuildNode *node)
+{
+    uint32_t index = uint32_t(nodes.size());
+    nodes.emplace_back();
+    nodes[index].bbox      = node->bbox;
+    nodes[index].num_prims = uint16_t(node->num_prims);
+
+    if (node->num_prims > 0)
+    {
+        ++leaf_nodes;
+        ++total_leaf_nodes;
+        total_surfaces += node->num_prims;
+        nodes[index].prims_offset = node->first_prim;
+    }
+    else
+    {
+        ++interior_nodes;
+        nodes[index].axis = uint8_t(node->axis);
+        flatten(node->children[0]); // the first child is stored right after its parent
+        nodes[index].second_child_offset = flatten(node->children[1]);
+    }
+
+    return index;
+}
+
+template <typename Node>
+uint32_t BBHTree::flatten_wide(const BBHBuildNode *node, vector<Node> &wide_nodes)
+{
+    constexpr int N = Node::width;
+
+    uint32_t index = uint32_t(wide_nodes.size());
+    wide_nodes.emplace_back();
+    ++interior_nodes;
+
+    // gather up to N children by repeatedly opening the interior child with the largest surface area
+    vector<const BBHBuildNode *> children;
+    if (node->num_prims > 0)
+        children.push_back(node); // a leaf at the root of the tree
+    else
+        children = {node->children[0], node->children[1]};
+
+    while (int(children.size()) < N)
+    {
+        int   best      = -1;
+        float best_area = -1.f;
+        for (int i = 0; i < int(children.size()); ++i)
+            if (children[i]->num_prims == 0 && children[i]->bbox.area() > best_area)
+            {
+                best      = i;
+                best_area = children[i]->bbox.area();
+            }
+        if (best < 0)
+            break;
+
+        const BBHBuildNode *opened = children[best];
+        children[best]             = opened->children[0];
+        children.push_back(opened->children[1]);
+    }
+
+    Box3f bounds[N];
+    for (int i = 0; i < int(children.size()); ++i)
+    {
+        const BBHBuildNode *c = children[i];
+        uint32_t            child;
+        if (c->num_prims > 0)
+        {
+            ++leaf_nodes;
+            ++total_leaf_nodes;
+            total_surfaces += c->num_prims;
+            child = c->first_prim;
+        }
+        else
+            child = flatten_wide(c, wide_nodes);
+
+        // wide_nodes may have been reallocated by the recursive call above
+        bounds[i]                  = c->bbox;
+        wide_nodes[index].child[i] = child;
+        wide_nodes[index].count[i] = uint16_t(c->num_prims);
+    }
+    // compressed nodes quantize all children relative to their union, so the bounds are set all at once
+    wide_nodes[index].set_bounds(bounds);
+
+    return index;
 }
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Surface, BBH, "bbh")
@@ -202,4 +1281,4 @@ DARTS_REGISTER_CLASS_IN_FACTORY(SurfaceGroup, BBH, "bbh")
 /**
     \file
     \brief BBH SurfaceGroup
-*/
\ No newline at end of file
+*/
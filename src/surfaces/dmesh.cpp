@@ -0,0 +1,371 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <atomic>
+#include <darts/dmesh.h>
+#include <darts/mapped_file.h>
+#include <darts/mesh.h>
+#include <darts/parallel.h>
+#include <fstream>
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+constexpr size_t dmesh_alignment = 16;
+
+size_t align_offset(size_t offset)
+{
+    return (offset + dmesh_alignment - 1) / dmesh_alignment * dmesh_alignment;
+}
+
+constexpr size_t block_size = 1 << 16;
+
+/// The number of blocks that #for_each_block() splits \p count elements into
+size_t num_blocks(size_t count)
+{
+    return (count + block_size - 1) / block_size;
+}
+
+/// Run \p f(begin, end, block) over blocks of <tt>[0, count)</tt> in parallel
+template <typename F>
+void for_each_block(size_t count, F &&f)
+{
+    parallel_for(blocked_range<size_t>(0, num_blocks(count), 1),
+                 [&](blocked_range<size_t> range)
+                 {
+                     for (auto b : range) f(b * block_size, std::min(count, (b + 1) * block_size), b);
+                 });
+}
+
+template <typename Index>
+void write_indices(std::ostream &os, const vector<Vec3i> &faces)
+{
+    vector<Index> indices(3 * faces.size());
+    for (size_t f = 0; f < faces.size(); ++f)
+        for (int c = 0; c < 3; ++c) indices[3 * f + c] = faces[f][c] < 0 ? Index(-1) : Index(faces[f][c]);
+    os.write(reinterpret_cast<const char *>(indices.data()), indices.size() * sizeof(Index));
+}
+
+} // namespace
+
+void Mesh::load_dmesh(const json &j, const string &filename)
+{
+    MappedFile  file(filename);
+    DMeshHeader header;
+    if (file.size() < sizeof(header))
+        throw DartsException("'{}' is not a binary mesh file.", filename);
+    std::memcpy(&header, file.begin(), sizeof(header));
+    if (std::memcmp(header.magic, DMeshHeader().magic, sizeof(header.magic)) != 0)
+        throw DartsException("'{}' is not a binary mesh file.", filename);
+    if (header.version != dmesh_version)
+        throw DartsException("Binary mesh file '{}' has version {}, but only version {} is supported.", filename,
+                             header.version, dmesh_version);
+
+    bool   quantized  = header.flags & DMeshQuantizedPositions;
+    size_t index_size = header.flags & DMeshShortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    // the start of section s, which is expected to hold count elements of the given size, or null if it is absent
+    auto section = [&](DMeshSection s, size_t count, size_t element_size) -> const char *
+    {
+        uint64_t offset = header.offsets[s];
+        if (offset == 0)
+            return nullptr;
+        if (offset % dmesh_alignment || offset > file.size() || count * element_size > file.size() - offset)
+            throw DartsException("Binary mesh file '{}' is truncated or corrupt.", filename);
+        return file.begin() + offset;
+    };
+
+    auto positions = section(DMeshPositions, header.num_vertices, quantized ? 3 * sizeof(uint16_t) : sizeof(Vec3f));
+    auto normals   = section(DMeshNormals, header.num_normals, sizeof(uint32_t));
+    auto texcoords = section(DMeshUVs, header.num_uvs, 2 * sizeof(uint16_t));
+    auto v_indices = section(DMeshVertexIndices, header.num_faces, 3 * index_size);
+    auto n_indices = section(DMeshNormalIndices, header.num_faces, 3 * index_size);
+    auto t_indices = section(DMeshUVIndices, header.num_faces, 3 * index_size);
+    auto m_indices = section(DMeshMaterialIndices, header.num_faces, index_size);
+    auto names     = section(DMeshMaterialNames, header.num_materials, sizeof(uint32_t));
+    if (!positions || !v_indices)
+        throw DartsException("Binary mesh file '{}' has no positions or faces.", filename);
+
+    // look up the materials by name, the first one is the default material
+    vector<uint32_t>      material_remap(std::max(header.num_materials, 1u), 0u);
+    string                material_prefix = j.value("material prefix", "");
+    map<string, uint32_t> material_map;
+    for (uint32_t m = 0; names && m < header.num_materials; ++m)
+    {
+        uint32_t length;
+        if (size_t(file.end() - names) < sizeof(length))
+            throw DartsException("Binary mesh file '{}' is truncated or corrupt.", filename);
+        std::memcpy(&length, names, sizeof(length));
+        names += sizeof(length);
+        if (size_t(file.end() - names) < length)
+            throw DartsException("Binary mesh file '{}' is truncated or corrupt.", filename);
+        if (m > 0)
+            material_remap[m] = material_index(material_prefix + string(names, length), material_map);
+        names += length;
+    }
+
+    // decode the vertex data, and transform it into world space
+    Vec3f bounds_min(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]);
+    Vec3f bounds_extent = (Vec3f(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]) - bounds_min) /
+                          65535.f;
+
+    vs.resize(header.num_vertices);
+    vector<Box3f> block_bbox_o(num_blocks(vs.size())), block_bbox_w(block_bbox_o.size());
+    for_each_block(vs.size(),
+                   [&](size_t begin, size_t end, size_t block)
+                   {
+                       for (size_t i = begin; i < end; ++i)
+                       {
+                           Vec3f p;
+                           if (quantized)
+                           {
+                               uint16_t q[3];
+                               std::memcpy(q, positions + i * sizeof(q), sizeof(q));
+                               p = bounds_min + Vec3f(q[0], q[1], q[2]) * bounds_extent;
+                           }
+                           else
+                               std::memcpy(&p, positions + i * sizeof(Vec3f), sizeof(Vec3f));
+
+                           block_bbox_o[block].enclose(p);
+                           vs[i] = xform.is_identity() ? p : xform.point(p);
+                           block_bbox_w[block].enclose(vs[i]);
+                       }
+                   });
+    for (size_t b = 0; b < block_bbox_o.size(); ++b)
+    {
+        bbox_o.enclose(block_bbox_o[b]);
+        bbox_w.enclose(block_bbox_w[b]);
+    }
+
+    if (normals)
+    {
+        ns.resize(header.num_normals);
+        for_each_block(ns.size(),
+                       [&](size_t begin, size_t end, size_t)
+                       {
+                           for (size_t i = begin; i < end; ++i)
+                           {
+                               uint32_t bits;
+                               std::memcpy(&bits, normals + i * sizeof(bits), sizeof(bits));
+                               Vec3f n = decode_octahedral(bits);
+                               ns[i]   = xform.is_identity() ? n : normalize(xform.normal(n));
+                           }
+                       });
+    }
+
+    if (texcoords)
+    {
+        uvs.resize(header.num_uvs);
+        for_each_block(uvs.size(),
+                       [&](size_t begin, size_t end, size_t)
+                       {
+                           for (size_t i = begin; i < end; ++i)
+                           {
+                               uint16_t h[2];
+                               std::memcpy(h, texcoords + i * sizeof(h), sizeof(h));
+                               uvs[i] = Vec2f(half_to_float(h[0]), half_to_float(h[1]));
+                           }
+                       });
+    }
+
+    // decode the indices, checking that they are in range
+    std::atomic<bool> invalid(false);
+    auto              read_index = [&](const char *data, size_t i, size_t count, bool may_be_missing)
+    {
+        uint32_t index;
+        if (index_size == sizeof(uint16_t))
+        {
+            uint16_t short_index;
+            std::memcpy(&short_index, data + i * sizeof(uint16_t), sizeof(uint16_t));
+            index = short_index == uint16_t(-1) ? uint32_t(-1) : short_index;
+        }
+        else
+            std::memcpy(&index, data + i * sizeof(uint32_t), sizeof(uint32_t));
+
+        if (index == uint32_t(-1) && may_be_missing)
+            return -1;
+        if (index >= count)
+        {
+            invalid = true;
+            return 0;
+        }
+        return int(index);
+    };
+
+    auto read_faces = [&](const char *data, vector<Vec3i> &faces, size_t count, bool may_be_missing)
+    {
+        if (!data)
+            return;
+        faces.resize(header.num_faces);
+        for_each_block(faces.size(),
+                       [&](size_t begin, size_t end, size_t)
+                       {
+                           for (size_t f = begin; f < end; ++f)
+                               for (int c = 0; c < 3; ++c)
+                                   faces[f][c] = read_index(data, 3 * f + c, count, may_be_missing);
+                       });
+    };
+
+    read_faces(v_indices, Fv, vs.size(), false);
+    read_faces(n_indices, Fn, ns.size(), true);
+    read_faces(t_indices, Ft, uvs.size(), true);
+
+    Fm.assign(header.num_faces, 0u);
+    if (m_indices)
+        for_each_block(Fm.size(),
+                       [&](size_t begin, size_t end, size_t)
+                       {
+                           for (size_t f = begin; f < end; ++f)
+                               Fm[f] = material_remap[read_index(m_indices, f, material_remap.size(), false)];
+                       });
+
+    if (invalid)
+        throw DartsException("Binary mesh file '{}' contains out-of-range indices.", filename);
+}
+
+void Mesh::save_dmesh(const string &filename, bool quantize_positions) const
+{
+    if (vs.size() >= uint32_t(-1) || Fv.size() >= uint32_t(-1))
+        throw DartsException("Mesh is too large to store in a binary mesh file.");
+
+    DMeshHeader header;
+    header.num_vertices  = uint32_t(vs.size());
+    header.num_normals   = uint32_t(ns.size());
+    header.num_uvs       = uint32_t(uvs.size());
+    header.num_faces     = uint32_t(Fv.size());
+    header.num_materials = uint32_t(material_names.size());
+
+    Box3f bounds;
+    for (auto &v : vs) bounds.enclose(v);
+    for (int a = 0; a < 3; ++a)
+    {
+        header.bounds_min[a] = vs.empty() ? 0.f : bounds.min[a];
+        header.bounds_max[a] = vs.empty() ? 0.f : bounds.max[a];
+    }
+
+    if (quantize_positions)
+        header.flags |= DMeshQuantizedPositions;
+    // the largest 16-bit value is reserved for missing indices
+    size_t max_count = std::max({vs.size(), ns.size(), uvs.size(), material_names.size()});
+    if (max_count < uint16_t(-1))
+        header.flags |= DMeshShortIndices;
+    size_t index_size = header.flags & DMeshShortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    // expand the compacted per-face indices again
+    vector<Vec3i>    normal_faces, uv_faces;
+    vector<uint32_t> material_faces(Fv.size());
+    for (uint32_t f = 0; f < Fv.size(); ++f)
+    {
+        if (normals_use_vertex_indices || !Fn.empty())
+            normal_faces.push_back(normal_indices(f));
+        if (uvs_use_vertex_indices || !Ft.empty())
+            uv_faces.push_back(uv_indices(f));
+        material_faces[f] = face_materials[f];
+    }
+
+    size_t names_size = 0;
+    for (auto &name : material_names) names_size += sizeof(uint32_t) + name.size();
+
+    // lay out the sections
+    size_t section_sizes[DMeshNumSections] = {vs.size() * (quantize_positions ? 3 * sizeof(uint16_t) : sizeof(Vec3f)),
+                                              ns.size() * sizeof(uint32_t),
+                                              uvs.size() * 2 * sizeof(uint16_t),
+                                              Fv.size() * 3 * index_size,
+                                              normal_faces.size() * 3 * index_size,
+                                              uv_faces.size() * 3 * index_size,
+                                              material_faces.size() * index_size,
+                                              names_size};
+    size_t offset                          = align_offset(sizeof(header));
+    for (int s = 0; s < DMeshNumSections; ++s)
+    {
+        if (!section_sizes[s])
+            continue;
+        header.offsets[s] = offset;
+        offset            = align_offset(offset + section_sizes[s]);
+    }
+
+    std::ofstream os(filename, std::ios::binary);
+    if (!os)
+        throw DartsException("Cannot open binary mesh file '{}' for writing.", filename);
+
+    auto write = [&os](const auto &value) { os.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+    auto pad   = [&os](DMeshSection s, const DMeshHeader &h)
+    {
+        while (size_t(os.tellp()) < h.offsets[s]) os.put(0);
+    };
+
+    write(header);
+
+    pad(DMeshPositions, header);
+    Vec3f scale = la::select(equal(bounds.diagonal(), 0.f), 0.f, 65535.f / bounds.diagonal());
+    for (auto &v : vs)
+    {
+        if (quantize_positions)
+        {
+            Vec3f    q = (v - bounds.min) * scale;
+            uint16_t quantized[3];
+            for (int a = 0; a < 3; ++a) quantized[a] = uint16_t(std::clamp(std::round(q[a]), 0.f, 65535.f));
+            write(quantized);
+        }
+        else
+            write(v);
+    }
+
+    if (header.offsets[DMeshNormals])
+    {
+        pad(DMeshNormals, header);
+        for (auto &n : ns) write(encode_octahedral(n));
+    }
+
+    if (header.offsets[DMeshUVs])
+    {
+        pad(DMeshUVs, header);
+        for (auto &uv : uvs)
+        {
+            uint16_t h[2] = {float_to_half(uv.x), float_to_half(uv.y)};
+            write(h);
+        }
+    }
+
+    const vector<Vec3i> *face_indices[3] = {&Fv, &normal_faces, &uv_faces};
+    for (int i = 0; i < 3; ++i)
+    {
+        auto s = DMeshSection(DMeshVertexIndices + i);
+        if (!header.offsets[s])
+            continue;
+        pad(s, header);
+        if (index_size == sizeof(uint16_t))
+            write_indices<uint16_t>(os, *face_indices[i]);
+        else
+            write_indices<uint32_t>(os, *face_indices[i]);
+    }
+
+    if (header.offsets[DMeshMaterialIndices])
+    {
+        pad(DMeshMaterialIndices, header);
+        for (auto m : material_faces)
+            if (index_size == sizeof(uint16_t))
+                write(uint16_t(m));
+            else
+                write(uint32_t(m));
+    }
+
+    pad(DMeshMaterialNames, header);
+    for (auto &name : material_names)
+    {
+        write(uint32_t(name.size()));
+        os.write(name.data(), name.size());
+    }
+
+    if (!os)
+        throw DartsException("Cannot write binary mesh file '{}'.", filename);
+}
+
+/**
+    \file
+    \brief Reading and writing #Mesh objects in the binary mesh format
+*/
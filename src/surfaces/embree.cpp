@@ -0,0 +1,411 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/factory.h>
+#include <darts/stats.h>
+#include <darts/surface_group.h>
+#include <darts/triangle.h>
+#include <embree4/rtcore.h>
+#include <limits>
+#include <unordered_map>
+
+STAT_COUNTER("Embree/Triangles", num_embree_triangles);
+STAT_COUNTER("Embree/User primitives", num_embree_user_prims);
+STAT_PERCENT("Embree/Triangle hits rejected by darts", num_rejected_triangle_hits, num_triangle_hits);
+STAT_TIMER("Time/Scene parsing/Embree construction", embree_build_time);
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// The Embree device shared by all Embree accelerators, created on first use
+RTCDevice embree_device()
+{
+    static RTCDevice device = []()
+    {
+        RTCDevice d = rtcNewDevice(nullptr);
+        if (!d)
+            throw DartsException("Could not create the Embree device (error {}).", int(rtcGetDeviceError(nullptr)));
+        rtcSetDeviceErrorFunction(
+            d, [](void *, RTCError code, const char *message)
+            { spdlog::error("Embree error {}: {}", int(code), message ? message : ""); },
+            nullptr);
+        return d;
+    }();
+    return device;
+}
+
+/// The darts surfaces behind the primitives of one Embree geometry, indexed by Embree's primitive ID
+struct GeometryPrims
+{
+    vector<const Surface *> prims;
+};
+
+/**
+    Passed through Embree to the callbacks, which record the closest hit in darts' own format.
+
+    Embree only passes a pointer to #context to the callbacks, so it must be the first member.
+*/
+struct QueryContext
+{
+    RTCRayQueryContext context;
+    const Ray3f       *ray;           ///< The (local-space) darts ray, with its time and footprint
+    HitInfo           *hit = nullptr; ///< The closest hit so far, or nullptr for shadow rays
+    float              maxt;          ///< The distance to the closest hit accepted so far
+};
+
+RTCRay to_embree(const Ray3f &ray)
+{
+    RTCRay r;
+    r.org_x = ray.o.x;
+    r.org_y = ray.o.y;
+    r.org_z = ray.o.z;
+    r.tnear = ray.mint;
+    r.dir_x = ray.d.x;
+    r.dir_y = ray.d.y;
+    r.dir_z = ray.d.z;
+    r.time  = 0.f; // the geometries don't move, moving surfaces are bounded over their whole motion
+    r.tfar  = ray.maxt;
+    r.mask  = ~0u;
+    r.id    = 0;
+    r.flags = 0;
+    return r;
+}
+
+/**
+    Embree's triangle test is only used to find candidate hits, which darts then confirms with its own triangle
+    intersection routine (recording its HitInfo). Candidates that darts disagrees with (e.g. on an edge) are rejected,
+    so Embree continues the traversal, and the result is always a hit that darts itself would report.
+*/
+void triangle_filter(const RTCFilterFunctionNArguments *args)
+{
+    auto ctx      = reinterpret_cast<QueryContext *>(args->context);
+    auto geometry = static_cast<const GeometryPrims *>(args->geometryUserPtr);
+    auto ray      = reinterpret_cast<const RTCRay *>(args->ray);
+    auto triangle = geometry->prims[reinterpret_cast<const RTCHit *>(args->hit)->primID];
+
+    ++num_triangle_hits;
+    ++g_render_cost.prims_tested;
+    Ray3f r(*ctx->ray, ray->tnear, ctx->maxt);
+    if (ctx->hit ? !triangle->intersect(r, *ctx->hit) : !triangle->occluded(r))
+    {
+        ++num_rejected_triangle_hits;
+        args->valid[0] = 0;
+        return;
+    }
+
+    if (ctx->hit)
+        ctx->maxt = ctx->hit->t;
+}
+
+void user_bounds(const RTCBoundsFunctionArguments *args)
+{
+    auto  geometry = static_cast<const GeometryPrims *>(args->geometryUserPtr);
+    Box3f box      = geometry->prims[args->primID]->bounds();
+
+    args->bounds_o->lower_x = box.min.x;
+    args->bounds_o->lower_y = box.min.y;
+    args->bounds_o->lower_z = box.min.z;
+    args->bounds_o->upper_x = box.max.x;
+    args->bounds_o->upper_y = box.max.y;
+    args->bounds_o->upper_z = box.max.z;
+}
+
+void user_intersect(const RTCIntersectFunctionNArguments *args)
+{
+    if (!args->valid[0])
+        return;
+
+    auto ctx      = reinterpret_cast<QueryContext *>(args->context);
+    auto geometry = static_cast<const GeometryPrims *>(args->geometryUserPtr);
+    auto rayhit   = reinterpret_cast<RTCRayHit *>(args->rayhit);
+
+    ++g_render_cost.prims_tested;
+    HitInfo hit;
+    if (!geometry->prims[args->primID]->intersect(Ray3f(*ctx->ray, rayhit->ray.tnear, rayhit->ray.tfar), hit))
+        return;
+
+    rayhit->ray.tfar      = hit.t;
+    rayhit->hit.u         = 0.f;
+    rayhit->hit.v         = 0.f;
+    rayhit->hit.Ng_x      = hit.gn.x;
+    rayhit->hit.Ng_y      = hit.gn.y;
+    rayhit->hit.Ng_z      = hit.gn.z;
+    rayhit->hit.primID    = args->primID;
+    rayhit->hit.geomID    = args->geomID;
+    rayhit->hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+    *ctx->hit             = hit;
+    ctx->maxt             = hit.t;
+}
+
+void user_occluded(const RTCOccludedFunctionNArguments *args)
+{
+    if (!args->valid[0])
+        return;
+
+    auto ctx      = reinterpret_cast<QueryContext *>(args->context);
+    auto geometry = static_cast<const GeometryPrims *>(args->geometryUserPtr);
+    auto ray      = reinterpret_cast<RTCRay *>(args->ray);
+
+    ++g_render_cost.prims_tested;
+    if (geometry->prims[args->primID]->occluded(Ray3f(*ctx->ray, ray->tnear, ray->tfar)))
+        ray->tfar = -std::numeric_limits<float>::infinity();
+}
+
+} // namespace
+
+/**
+    An acceleration structure that hands the ray traversal to Intel's Embree library.
+
+    The triangles of each mesh become an Embree triangle geometry, so they are traversed and tested with Embree's
+    vectorized kernels (on x86 and ARM). All other surfaces (spheres, quads, meshes with their own \c "accelerator",
+    nested groups, ...) become Embree user geometries that call back into their darts intersection routines. Either
+    way, the HitInfo is computed by darts, so shading is identical to the #BBH, which makes this accelerator both a
+    fast alternative and a reference for the correctness and performance of the native BBH.
+
+    It is only compiled with the \c USE_EMBREE CMake option, and is selected with <tt>"accelerator": {"type":
+    "embree"}</tt>. Parameters:
+    - \c "quality": the build quality of Embree's BVH: \c "low", \c "medium" (the default), or \c "high"
+
+    \ingroup Surfaces
+*/
+class Embree : public SurfaceGroup
+{
+public:
+    Embree(const json &j = json::object());
+    ~Embree();
+
+    /// Hand the surfaces to Embree and build its BVH
+    void build() override;
+
+    /// Rebuild Embree's BVH over the new bounds of the surfaces
+    void refit() override;
+
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+
+    bool occluded(const Ray3f &ray) const override;
+
+protected:
+    /// Release the Embree scene
+    void release();
+
+    /// Intersect a ray with the scene transformed by \p xform (either #m_xform, or the motion at the time of the ray)
+    bool intersect(const Ray3f &ray, HitInfo &hit, const Transform &xform) const;
+
+    /// Like #occluded(), with the scene transformed by \p xform
+    bool occluded(const Ray3f &ray, const Transform &xform) const;
+
+    RTCScene              m_scene   = nullptr;
+    RTCBuildQuality       m_quality = RTC_BUILD_QUALITY_MEDIUM;
+    vector<GeometryPrims> m_geometries; ///< The darts surfaces of each Embree geometry, indexed by its geometry ID
+};
+
+Embree::Embree(const json &j) : SurfaceGroup(j)
+{
+    string quality = j.value("quality", "medium");
+    if (quality == "low")
+        m_quality = RTC_BUILD_QUALITY_LOW;
+    else if (quality == "medium")
+        m_quality = RTC_BUILD_QUALITY_MEDIUM;
+    else if (quality == "high")
+        m_quality = RTC_BUILD_QUALITY_HIGH;
+    else
+        throw DartsException("Unrecognized Embree 'quality' \"{}\", expected \"low\", \"medium\", or \"high\".",
+                             quality);
+}
+
+Embree::~Embree()
+{
+    release();
+}
+
+void Embree::release()
+{
+    if (m_scene)
+        rtcReleaseScene(m_scene);
+    m_scene = nullptr;
+    m_geometries.clear();
+}
+
+void Embree::build()
+{
+    SurfaceGroup::build();
+    release();
+
+    if (m_surfaces.empty())
+    {
+        spdlog::info("Embree scene contains no surfaces.");
+        return;
+    }
+
+    SCOPED_STAT_TIMER(embree_build_time);
+
+    // group the triangles by mesh, and collect all other surfaces into a single user geometry
+    std::unordered_map<const Mesh *, vector<const Triangle *>> meshes;
+    vector<const Mesh *>                                       mesh_order; // keeps the geometry IDs deterministic
+    GeometryPrims                                              others;
+    for (auto &surface : m_surfaces)
+        if (auto triangle = dynamic_cast<const Triangle *>(surface.get()))
+        {
+            auto &triangles = meshes[triangle->mesh()];
+            if (triangles.empty())
+                mesh_order.push_back(triangle->mesh());
+            triangles.push_back(triangle);
+        }
+        else
+            others.prims.push_back(surface.get());
+
+    // the geometries point into m_geometries, so it must not be reallocated once they are created
+    m_geometries.reserve(mesh_order.size() + 1);
+
+    RTCDevice device = embree_device();
+    m_scene          = rtcNewScene(device);
+    rtcSetSceneBuildQuality(m_scene, m_quality);
+    rtcSetSceneFlags(m_scene, RTC_SCENE_FLAG_ROBUST);
+
+    for (auto mesh : mesh_order)
+    {
+        auto &triangles = meshes[mesh];
+
+        RTCGeometry geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetGeometryBuildQuality(geometry, m_quality);
+
+        // the vertices of meshes are already in world space
+        auto vertices = static_cast<Vec3f *>(rtcSetNewGeometryBuffer(geometry, RTC_BUFFER_TYPE_VERTEX, 0,
+                                                                      RTC_FORMAT_FLOAT3, sizeof(Vec3f),
+                                                                      mesh->vs.size()));
+        std::copy(mesh->vs.begin(), mesh->vs.end(), vertices);
+
+        auto indices = static_cast<uint32_t *>(rtcSetNewGeometryBuffer(
+            geometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(uint32_t), triangles.size()));
+        auto &prims  = m_geometries.emplace_back().prims;
+        for (size_t i = 0; i < triangles.size(); ++i)
+        {
+            Vec3i face         = mesh->Fv[triangles[i]->face()];
+            indices[3 * i + 0] = uint32_t(face.x);
+            indices[3 * i + 1] = uint32_t(face.y);
+            indices[3 * i + 2] = uint32_t(face.z);
+            prims.push_back(triangles[i]);
+        }
+        num_embree_triangles += triangles.size();
+
+        rtcSetGeometryUserData(geometry, &m_geometries.back());
+        rtcSetGeometryIntersectFilterFunction(geometry, triangle_filter);
+        rtcSetGeometryOccludedFilterFunction(geometry, triangle_filter);
+        rtcCommitGeometry(geometry);
+        rtcAttachGeometryByID(m_scene, geometry, unsigned(m_geometries.size() - 1));
+        rtcReleaseGeometry(geometry);
+    }
+
+    if (!others.prims.empty())
+    {
+        num_embree_user_prims += others.prims.size();
+        m_geometries.push_back(std::move(others));
+
+        RTCGeometry geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_USER);
+        rtcSetGeometryUserPrimitiveCount(geometry, unsigned(m_geometries.back().prims.size()));
+        rtcSetGeometryUserData(geometry, &m_geometries.back());
+        rtcSetGeometryBoundsFunction(geometry, user_bounds, nullptr);
+        rtcSetGeometryIntersectFunction(geometry, user_intersect);
+        rtcSetGeometryOccludedFunction(geometry, user_occluded);
+        rtcCommitGeometry(geometry);
+        rtcAttachGeometryByID(m_scene, geometry, unsigned(m_geometries.size() - 1));
+        rtcReleaseGeometry(geometry);
+    }
+
+    rtcCommitScene(m_scene);
+
+    spdlog::info("Embree scene contains {} surfaces in {} geometries.", m_surfaces.size(), m_geometries.size());
+}
+
+void Embree::refit()
+{
+    // Embree refits its BVH when the geometries are committed again, but rebuilding is simpler and as fast
+    SurfaceGroup::refit();
+    build();
+}
+
+bool Embree::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    if (!m_scene)
+        return false;
+
+    // only moving groups need to compute their transform for each ray
+    return m_motion.is_animated() ? intersect(ray, hit, m_motion.at(ray.time)) : intersect(ray, hit, m_xform);
+}
+
+bool Embree::intersect(const Ray3f &ray_, HitInfo &hit, const Transform &xform) const
+{
+    // transform the ray (most groups are not transformed at all)
+    auto ray = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
+
+    QueryContext ctx;
+    rtcInitRayQueryContext(&ctx.context);
+    ctx.ray  = &ray;
+    ctx.hit  = &hit;
+    ctx.maxt = ray.maxt;
+
+    RTCIntersectArguments args;
+    rtcInitIntersectArguments(&args);
+    args.context = &ctx.context;
+
+    RTCRayHit rayhit;
+    rayhit.ray        = to_embree(ray);
+    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    rtcIntersect1(m_scene, &rayhit, &args);
+
+    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+        return false;
+
+    if (!xform.is_identity())
+    {
+        // transform the hit information back
+        hit.p  = xform.point(hit.p);
+        hit.gn = normalize(xform.normal(hit.gn));
+        hit.sn = normalize(xform.normal(hit.sn));
+    }
+    return true;
+}
+
+bool Embree::occluded(const Ray3f &ray) const
+{
+    if (!m_scene)
+        return false;
+
+    return m_motion.is_animated() ? occluded(ray, m_motion.at(ray.time)) : occluded(ray, m_xform);
+}
+
+bool Embree::occluded(const Ray3f &ray_, const Transform &xform) const
+{
+    auto ray = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
+
+    QueryContext ctx;
+    rtcInitRayQueryContext(&ctx.context);
+    ctx.ray  = &ray;
+    ctx.maxt = ray.maxt;
+
+    RTCOccludedArguments args;
+    rtcInitOccludedArguments(&args);
+    args.context = &ctx.context;
+
+    RTCRay r = to_embree(ray);
+    rtcOccluded1(m_scene, &r, &args);
+
+    // Embree sets tfar to -infinity if anything blocks the ray
+    return r.tfar < 0.f;
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Surface, Embree, "embree")
+// register in both the Surface and SurfaceGroup factories, just like the BBH
+namespace
+{
+DARTS_REGISTER_CLASS_IN_FACTORY(SurfaceGroup, Embree, "embree")
+}
+
+/**
+    \file
+    \brief Class #Embree
+*/
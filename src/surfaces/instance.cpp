@@ -0,0 +1,135 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/factory.h>
+#include <darts/stats.h>
+#include <darts/surface_group.h>
+
+STAT_COUNTER("Scene/Instances", num_instances);
+STAT_COUNTER("Scene/Instance prototypes", num_prototypes);
+
+/**
+    A transformed reference to a shared prototype Surface.
+
+    The prototype is built once (by default into its own #BBH) and can then be placed many times in the scene, each
+    time with a different transform, without duplicating its geometry. The top-level accelerator of the scene is then
+    built over the bounds of the instances.
+
+    The \c "surface" field either contains the json specification of the prototype, or the name of a previously
+    specified prototype. If the specification contains a \c "name" field, the prototype is registered under this name
+    for use by later instances:
+
+    \code{.json}
+    {"type": "instance", "transform": ..., "surface": {"name": "tree", "type": "mesh", "filename": "tree.obj"}},
+    {"type": "instance", "transform": ..., "surface": "tree"}
+    \endcode
+
+    The optional \c "accelerator" field specifies the SurfaceGroup that the prototype is built into.
+
+    For motion blur, an instance can move from its \c "transform" to an \c "end_transform" during the shutter
+    interval. Since its bounds enclose the whole motion, the accelerator of the scene is still only built once.
+
+    \note Instances do not support emitter sampling, so emissive geometry should not be instanced.
+
+    \ingroup Surfaces
+*/
+class Instance : public XformedSurface
+{
+public:
+    Instance(const json &j = json::object());
+
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
+
+    Box3f local_bounds() const override
+    {
+        return m_prototype->bounds();
+    }
+
+    void set_transform(const Transform &xform) override
+    {
+        XformedSurface::set_transform(xform);
+        m_inv_xform = xform.inverse();
+    }
+
+protected:
+    /// Intersect the prototype, placed by \p xform (whose inverse is \p inv_xform)
+    bool intersect(const Ray3f &ray, HitInfo &hit, const Transform &xform, const Transform &inv_xform) const;
+
+    shared_ptr<const Surface> m_prototype; ///< The shared geometry, specified in its own local space
+    Transform                 m_inv_xform; ///< Cached inverse of #m_xform
+};
+
+Instance::Instance(const json &j) : XformedSurface(j), m_inv_xform(m_xform.inverse())
+{
+    parse_motion(j);
+
+    auto it = j.find("surface");
+    if (it == j.end())
+        throw DartsException("Missing 'surface' on 'instance' specification:\n{}", j.dump(4));
+
+    if (it->is_string())
+        m_prototype = DartsFactory<Surface>::find(j, "surface");
+    else if (it->is_object())
+    {
+        // build the prototype into its own acceleration structure
+        json group        = j.value("accelerator", json{{"type", "bbh"}});
+        group["children"] = json::array({*it});
+        auto prototype    = DartsFactory<SurfaceGroup>::create(group);
+        prototype->build();
+        ++num_prototypes;
+
+        if (it->contains("name"))
+        {
+            string name = (*it)["name"].get<string>();
+            DartsFactory<Surface>::register_instance(name, prototype);
+            spdlog::info("registering instance prototype with name {}", name);
+        }
+        m_prototype = prototype;
+    }
+    else
+        throw DartsException("Type mismatch: Expecting either a surface definition or surface name here:\n{}",
+                             j.dump(4));
+
+    ++num_instances;
+}
+
+bool Instance::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    if (!m_motion.is_animated())
+        return intersect(ray, hit, m_xform, m_inv_xform);
+
+    Transform xform = m_motion.at(ray.time);
+    return intersect(ray, hit, xform, xform.inverse());
+}
+
+bool Instance::intersect(const Ray3f &ray_, HitInfo &hit, const Transform &xform, const Transform &inv_xform) const
+{
+    // transform the ray into the local space of the prototype
+    auto ray = inv_xform.ray(ray_);
+    if (!m_prototype->intersect(ray, hit))
+        return false;
+
+    // transform the hit information back
+    hit.p  = xform.point(hit.p);
+    hit.gn = normalize(xform.normal(hit.gn));
+    hit.sn = normalize(xform.normal(hit.sn));
+    return true;
+}
+
+bool Instance::occluded(const Ray3f &ray) const
+{
+    if (!m_motion.is_animated())
+        return m_prototype->occluded(m_inv_xform.ray(ray));
+    return m_prototype->occluded(m_motion.at(ray.time).inverse().ray(ray));
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Surface, Instance, "instance")
+
+/**
+    \file
+    \brief Instance Surface
+*/
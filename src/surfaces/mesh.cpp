@@ -4,8 +4,11 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/cache.h>
 #include <darts/factory.h>
+#include <darts/mapped_file.h>
 #include <darts/mesh.h>
+#include <darts/parallel.h>
 #include <darts/progress.h>
 #include <darts/stats.h>
 #include <darts/triangle.h>
@@ -18,6 +21,155 @@
 
 STAT_RATIO("Geometry/Triangles per mesh", num_triangles, num_tri_meshes);
 STAT_MEMORY_COUNTER("Memory/Triangles", triangle_bytes);
+STAT_MEMORY_COUNTER("Memory/Triangle surfaces", triangle_surface_bytes);
+STAT_MEMORY_COUNTER("Memory/Mesh BBHs", mesh_bbh_bytes);
+STAT_COUNTER("Intersections/Packed triangle tests", num_tri_packet_tests);
+STAT_TIMER("Time/Scene parsing/Mesh loading", mesh_load_time);
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+/// A cursor over the characters <tt>[p, end)</tt> of a line-based text format
+struct TextCursor
+{
+    const char *p, *end;
+
+    bool is_space(char c) const
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    void skip_space()
+    {
+        while (p < end && is_space(*p)) ++p;
+    }
+
+    /// Whether only whitespace is left on the current line
+    bool at_eol()
+    {
+        skip_space();
+        return p >= end || *p == '\n';
+    }
+
+    /// Move to the beginning of the next line
+    void next_line()
+    {
+        while (p < end && *p != '\n') ++p;
+        if (p < end)
+            ++p;
+    }
+
+    /// Return the next whitespace-delimited token on the current line
+    std::string_view token()
+    {
+        skip_space();
+        const char *begin = p;
+        while (p < end && *p != '\n' && !is_space(*p)) ++p;
+        return std::string_view(begin, p - begin);
+    }
+
+    /// Return the rest of the current line, without surrounding whitespace
+    std::string_view rest_of_line()
+    {
+        skip_space();
+        const char *begin = p;
+        while (p < end && *p != '\n') ++p;
+        const char *last = p;
+        while (last > begin && is_space(last[-1])) --last;
+        return std::string_view(begin, last - begin);
+    }
+
+    bool parse_int(int &i)
+    {
+        bool neg = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            ++p;
+        if (p >= end || !std::isdigit(*p))
+            return false;
+        int64_t v = 0;
+        while (p < end && std::isdigit(*p)) v = std::min<int64_t>(v * 10 + (*p++ - '0'), INT32_MAX);
+        i = int(neg ? -v : v);
+        return true;
+    }
+
+    bool parse_float(float &f)
+    {
+        // powers of ten that are exactly representable as doubles
+        static const double exact_pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                             1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+        skip_space();
+        bool neg = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            ++p;
+
+        // accumulate the significant digits, which is plenty of precision for a float
+        double mantissa = 0.0;
+        int    exponent = 0, digits = 0;
+        for (; p < end && std::isdigit(*p); ++p, ++digits)
+            mantissa = mantissa * 10.0 + (*p - '0');
+        if (p < end && *p == '.')
+            for (++p; p < end && std::isdigit(*p); ++p, ++digits, --exponent)
+                mantissa = mantissa * 10.0 + (*p - '0');
+        if (!digits)
+            return false;
+
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            ++p;
+            int e = 0;
+            if (!parse_int(e))
+                return false;
+            exponent += std::clamp(e, -1000, 1000);
+        }
+
+        double v = std::abs(exponent) < 23   ? (exponent < 0 ? mantissa / exact_pow10[-exponent]
+                                                             : mantissa * exact_pow10[exponent])
+                                               : mantissa * std::pow(10.0, exponent);
+        f        = float(neg ? -v : v);
+        return true;
+    }
+
+    /// Parse a face vertex of the form \c v, \c v/t, \c v//n, or \c v/t/n, setting missing indices to 0
+    bool parse_face_vertex(Vec3i &vtn)
+    {
+        vtn = Vec3i(0);
+        skip_space();
+        if (!parse_int(vtn[0]))
+            return false;
+        for (int k = 1; k < 3 && p < end && *p == '/'; ++k)
+        {
+            ++p;
+            if (p < end && *p != '/' && !is_space(*p) && *p != '\n' && !parse_int(vtn[k]))
+                return false;
+        }
+        return true;
+    }
+};
+
+/// A part of an OBJ file, starting at the beginning of a line and ending after a newline, that is parsed by one task
+struct ObjChunk
+{
+    const char *begin, *end;
+
+    // the number of elements in this chunk, counted by the first pass
+    size_t lines = 0, vs = 0, ns = 0, uvs = 0, faces = 0, faces_with_ns = 0, faces_with_uvs = 0;
+
+    vector<string> usemtl; ///< The (prefixed) material names of the \c usemtl statements, in order
+
+    // the offsets of this chunk's elements in the mesh, computed from the counts of the preceding chunks
+    size_t           first_line = 0, first_v = 0, first_n = 0, first_uv = 0, first_face = 0;
+    uint32_t         material = 0; ///< The material index at the beginning of the chunk
+    vector<uint32_t> usemtl_index; ///< The material index of each \c usemtl statement
+
+    Box3f  bbox_o, bbox_w;
+    string error; ///< The first parse error in this chunk, if any
+};
+
+LoadedAssets<Mesh> loaded_meshes;
+
+} // namespace
 
 Mesh::Mesh(const json &j)
 {
@@ -25,20 +177,93 @@ Mesh::Mesh(const json &j)
 
     std::ifstream is(filename);
     if (is.fail())
-        throw DartsException("Unable to open OBJ file '{}'!", filename);
+        throw DartsException("Unable to open mesh file '{}'!", filename);
 
     Progress progress(fmt ::format("Loading '{}'", filename));
 
     xform = j.value("transform", xform);
+
+    if (j.contains("accelerator"))
+    {
+        const json &a = j["accelerator"];
+        if (a.value("type", "bbh") != "bbh")
+            throw DartsException("Meshes only support a \"bbh\" accelerator, got \"{}\".", a["type"].get<string>());
+        use_bbh    = true;
+        use_packed = a.value("packed", use_packed);
+        bbh.parse(a);
+    }
+    // create a default material used for any faces that don't have a material set
+    // this will be the material with index 0
+    auto default_material = DartsFactory<Material>::find(j);
+    materials.push_back(default_material);
+    material_names.push_back("");
+
+    // the keys depend on all the mesh parameters and on the OBJ file itself
+    load_key = Hasher().add(j.dump()).add_pod(file_signature(filename)).value();
+    if (cache_enabled())
+        cache_key = load_key;
+
+    bool reused = false;
+    {
+        SCOPED_STAT_TIMER(mesh_load_time);
+        if ((reused = reuse_loaded()))
+            spdlog::info("Reused mesh '{}' loaded for another scene.", filename);
+        else if (cache_key && load_cached(j))
+            spdlog::info("Loaded mesh '{}' from the cache.", filename);
+        else if (filesystem::path(filename).extension() == "dmesh")
+            load_dmesh(j, filename);
+        else if (j.value("loader", "parallel") == "tinyobj")
+            load_obj(is, j, filename);
+        else
+            load_obj_parallel(j, filename);
+    }
+
+    progress.set_done();
+
+    // compute object_to_texture space transform
+    auto d           = bbox_o.diagonal();
+    auto m           = mul(scaling_matrix(la::select(equal(d, 0.f), 1.f, 1.f / d)), translation_matrix(-bbox_o.min));
+    object_to_texture = Transform(m);
+
+    spdlog::debug(
+        R"(
+    # of vertices         = {}
+    # of normals          = {}
+    # of texcoords        = {}
+    # of vertex indices   = {}
+    # of normal indices   = {}
+    # of texcoord indices = {}
+    # of materials        = {}
+    xform : {}"
+    min: {}
+    max: {}
+    bottom: {}
+
+)",
+        vs.size(), ns.size(), uvs.size(), Fv.size(), Fn.size(), Ft.size(), materials.size(),
+        indent(fmt::format("{}", xform.m), string("    xform : ").length()), bbox_w.min, bbox_w.max,
+        (bbox_w.min + bbox_w.max) / 2.f - Vec3f(0, bbox_w.diagonal()[1] / 2.f, 0));
+
+    // the indices of a reused mesh are already compacted
+    if (!reused)
+        compact_indices();
+
+    ++num_tri_meshes;
+    num_triangles += Fv.size();
+    triangle_bytes += size();
+}
+
+void Mesh::load_obj(std::istream &is, const json &j, const string &filename)
+{
     string warn;
     string err;
 
     struct UserData
     {
-        Mesh            *mesh;
-        uint32_t         current_material_idx;
-        map<string, int> material_map;
-        string           material_prefix;
+        Mesh                 *mesh;
+        uint32_t              current_material_idx;
+        map<string, uint32_t> material_map;
+        string                material_prefix;
     } data;
 
     data.mesh                 = this;
@@ -48,11 +273,6 @@ Mesh::Mesh(const json &j)
     if (data.material_prefix != "")
         spdlog::info("Prepending the string \"{}\" to all mesh material names", data.material_prefix);
 
-    // create a default material used for any faces that don't have a material set
-    // this will be the material with index 0
-    auto default_material = DartsFactory<Material>::find(j);
-    materials.push_back(default_material);
-
     tinyobj::callback_t cb;
 
     cb.vertex_cb = [](void *user_data, float x, float y, float z, float w)
@@ -144,94 +364,715 @@ Mesh::Mesh(const json &j)
     };
 
     cb.usemtl_cb = [](void *user_data, const char *name, int material_idx)
+    {
+        UserData *data = reinterpret_cast<UserData *>(user_data);
+
+        data->current_material_idx = data->mesh->material_index(data->material_prefix + name, data->material_map);
+    };
+
+    cb.mtllib_cb = [](void *user_data, const tinyobj::material_t *materials, int num_materials)
     {
         UserData *data = reinterpret_cast<UserData *>(user_data);
         Mesh     *mesh = data->mesh;
+    };
 
-        string full_name = data->material_prefix + name;
+    bool ret = tinyobj::LoadObjWithCallback(is, cb, &data, nullptr, &warn, &err);
 
-        // check if we've already added a material with this name to the mesh
-        auto it = data->material_map.find(full_name);
-        if (it != data->material_map.end())
-            data->current_material_idx = it->second;
-        else
+    if (!warn.empty())
+        spdlog::warn("{}\n", warn);
+
+    if (!err.empty() || !ret)
+        throw DartsException("Unable to open OBJ file '{}'!\n\t{}", filename, err);
+}
+
+uint32_t Mesh::material_index(const string &name, map<string, uint32_t> &material_map)
+{
+    // check if we've already added a material with this name to the mesh
+    auto it = material_map.find(name);
+    if (it != material_map.end())
+        return it->second;
+
+    // try to find a material with the given name in the scene description and add it to the mesh's materials
+    try
+    {
+        materials.push_back(DartsFactory<Material>::find(json::object({{"material", name}})));
+        material_names.push_back(name);
+        return material_map[name] = uint32_t(materials.size() - 1);
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::warn("When parsing OBJ file: {}\n\tUsing default material instead.\n", e.what());
+        return material_map[name] = 0;
+    }
+}
+
+void Mesh::load_obj_parallel(const json &j, const string &filename)
+{
+    MappedFile file(filename);
+    string     material_prefix = j.value("material prefix", "");
+    if (material_prefix != "")
+        spdlog::info("Prepending the string \"{}\" to all mesh material names", material_prefix);
+
+    // split the file into chunks of whole lines
+    constexpr size_t chunk_size = 1 << 22;
+    vector<ObjChunk> chunks;
+    for (const char *begin = file.begin(); begin < file.end();)
+    {
+        TextCursor cursor{std::min(begin + chunk_size, file.end()), file.end()};
+        if (cursor.p > begin && cursor.p[-1] != '\n')
+            cursor.next_line();
+        chunks.push_back(ObjChunk());
+        chunks.back().begin = begin;
+        chunks.back().end   = cursor.p;
+        begin               = cursor.p;
+    }
+
+    // Both passes go over the chunks in parallel. The first one only counts the elements of each chunk, so that the
+    // mesh's arrays can be allocated at their final size, and each chunk knows where its elements go. The second one
+    // then parses the elements straight into place.
+    auto parse_chunk = [&](ObjChunk &chunk, bool store)
+    {
+        TextCursor cursor{chunk.begin, chunk.end};
+        size_t     line = chunk.first_line, v = 0, n = 0, uv = 0, face = 0, mtl = 0;
+        uint32_t   material = chunk.material;
+        Vec3i      corners[3];
+
+        auto fail = [&](const string &what)
+        {
+            if (chunk.error.empty())
+                chunk.error = fmt::format("line {}: {}", line + 1, what);
+        };
+
+        // convert a raw OBJ index (1-based, or negative to count back from the last element) to a 0-based one
+        auto fix_index = [&](int raw, size_t count_so_far, size_t total)
         {
-            // try to find a material with the given name in the scene description and add it to the mesh's materials
-            try
+            int64_t index = raw > 0 ? int64_t(raw) - 1 : int64_t(count_so_far) + raw;
+            if (index < 0 || index >= int64_t(total))
+            {
+                fail(fmt::format("index {} is out of range", raw));
+                return 0;
+            }
+            return int(index);
+        };
+
+        for (; cursor.p < cursor.end; cursor.next_line(), ++line)
+        {
+            auto keyword = cursor.token();
+            if (keyword == "v")
+            {
+                Vec3f p;
+                if (!cursor.parse_float(p.x) || !cursor.parse_float(p.y) || !cursor.parse_float(p.z))
+                    fail("invalid vertex position");
+                else if (store)
+                {
+                    chunk.bbox_o.enclose(p);
+                    Vec3f &world = vs[chunk.first_v + v];
+                    world        = xform.point(p);
+                    chunk.bbox_w.enclose(world);
+                }
+                ++v;
+            }
+            else if (keyword == "vn")
+            {
+                Vec3f n_;
+                if (!cursor.parse_float(n_.x) || !cursor.parse_float(n_.y) || !cursor.parse_float(n_.z))
+                    fail("invalid vertex normal");
+                else if (store && !ns.empty())
+                    ns[chunk.first_n + n] = normalize(xform.normal(n_));
+                ++n;
+            }
+            else if (keyword == "vt")
+            {
+                Vec2f t;
+                if (!cursor.parse_float(t.x))
+                    fail("invalid texture coordinate");
+                else if (!cursor.parse_float(t.y))
+                    t.y = 0.f;
+                if (store && !uvs.empty())
+                    uvs[chunk.first_uv + uv] = t;
+                ++uv;
+            }
+            else if (keyword == "f")
             {
-                data->mesh->materials.push_back(
-                    DartsFactory<Material>::find(json::object({{"material", string(full_name)}})));
-                data->material_map[full_name] = data->current_material_idx = data->mesh->materials.size() - 1;
+                // triangulate the polygon as a fan around its first vertex
+                int num_corners = 0;
+                for (; !cursor.at_eol(); ++num_corners)
+                {
+                    Vec3i &corner = corners[std::min(num_corners, 2)];
+                    if (num_corners >= 3)
+                        corners[1] = corners[2];
+                    if (!cursor.parse_face_vertex(corner))
+                    {
+                        fail("invalid face");
+                        break;
+                    }
+                    if (num_corners < 2)
+                        continue;
+
+                    bool has_n  = corners[0][2] && corners[1][2] && corners[2][2];
+                    bool has_uv = corners[0][1] && corners[1][1] && corners[2][1];
+                    if (!store)
+                    {
+                        chunk.faces_with_ns += has_n;
+                        chunk.faces_with_uvs += has_uv;
+                    }
+                    else
+                    {
+                        size_t f = chunk.first_face + face;
+                        for (int c = 0; c < 3; ++c)
+                        {
+                            Fv[f][c] = fix_index(corners[c][0], chunk.first_v + v, vs.size());
+                            if (!Fn.empty())
+                                Fn[f][c] = has_n ? fix_index(corners[c][2], chunk.first_n + n, ns.size()) : -1;
+                            if (!Ft.empty())
+                                Ft[f][c] = has_uv ? fix_index(corners[c][1], chunk.first_uv + uv, uvs.size()) : -1;
+                        }
+                        Fm[f] = material;
+                    }
+                    ++face;
+                }
+                if (num_corners < 3)
+                    fail("polygons must have at least 3 vertices");
             }
-            catch (const std::exception &e)
+            else if (keyword == "usemtl")
             {
-                spdlog::warn("When parsing OBJ file: {}\n\tUsing default material instead.\n", e.what());
-                data->material_map[full_name] = data->current_material_idx = 0;
+                if (store)
+                    material = chunk.usemtl_index[mtl++];
+                else
+                    chunk.usemtl.push_back(material_prefix + string(cursor.rest_of_line()));
             }
+            // everything else (comments, groups, smoothing groups, material libraries, ...) is ignored
+        }
+
+        if (!store)
+        {
+            chunk.lines = line - chunk.first_line;
+            chunk.vs    = v;
+            chunk.ns    = n;
+            chunk.uvs   = uv;
+            chunk.faces = face;
         }
     };
 
-    cb.mtllib_cb = [](void *user_data, const tinyobj::material_t *materials, int num_materials)
+    auto parse_chunks = [&](bool store)
     {
-        UserData *data = reinterpret_cast<UserData *>(user_data);
-        Mesh     *mesh = data->mesh;
+        parallel_for(blocked_range<size_t>(0, chunks.size(), 1),
+                     [&](blocked_range<size_t> range)
+                     {
+                         for (auto c : range) parse_chunk(chunks[c], store);
+                     });
+        for (auto &chunk : chunks)
+            if (!chunk.error.empty())
+                throw DartsException("Unable to parse OBJ file '{}', {}", filename, chunk.error);
     };
 
-    bool ret = tinyobj::LoadObjWithCallback(is, cb, &data, nullptr, &warn, &err);
+    parse_chunks(false);
 
-    progress.set_done();
+    // compute where the elements of each chunk go, and look up the materials in order
+    size_t                num_ns_faces = 0, num_uv_faces = 0;
+    ObjChunk              total;
+    map<string, uint32_t> material_map;
+    for (auto &chunk : chunks)
+    {
+        chunk.first_line = total.lines;
+        chunk.first_v    = total.vs;
+        chunk.first_n    = total.ns;
+        chunk.first_uv   = total.uvs;
+        chunk.first_face = total.faces;
+        chunk.material   = total.material;
+        for (auto &name : chunk.usemtl)
+            chunk.usemtl_index.push_back(total.material = material_index(name, material_map));
 
-    // compute object_to_texture space transform
-    auto d           = bbox_o.diagonal();
-    auto m           = mul(scaling_matrix(la::select(equal(d, 0.f), 1.f, 1.f / d)), translation_matrix(-bbox_o.min));
-    object_to_texture = Transform(m);
+        total.lines += chunk.lines;
+        total.vs += chunk.vs;
+        total.ns += chunk.ns;
+        total.uvs += chunk.uvs;
+        total.faces += chunk.faces;
+        num_ns_faces += chunk.faces_with_ns;
+        num_uv_faces += chunk.faces_with_uvs;
+    }
 
-    if (!warn.empty())
-        spdlog::warn("{}\n", warn);
+    if (total.faces > size_t(INT32_MAX) || total.vs > size_t(INT32_MAX))
+        throw DartsException("OBJ file '{}' has too many faces or vertices.", filename);
 
-    if (!err.empty() || !ret)
-        throw DartsException("Unable to open OBJ file '{}'!\n\t{}", filename, err);
+    // allocate everything at its final size, and drop the attributes that no face uses
+    vs.resize(total.vs);
+    ns.resize(num_ns_faces ? total.ns : 0);
+    uvs.resize(num_uv_faces ? total.uvs : 0);
+    Fv.resize(total.faces);
+    Fn.resize(num_ns_faces ? total.faces : 0);
+    Ft.resize(num_uv_faces ? total.faces : 0);
+    Fm.resize(total.faces);
 
-    spdlog::debug(
-        R"(
-    # of vertices         = {}
-    # of normals          = {}
-    # of texcoords        = {}
-    # of vertex indices   = {}
-    # of normal indices   = {}
-    # of texcoord indices = {}
-    # of materials        = {}
-    xform : {}"
-    min: {}
-    max: {}
-    bottom: {}
+    parse_chunks(true);
 
-)",
-        vs.size(), ns.size(), uvs.size(), Fv.size(), Fn.size(), Ft.size(), materials.size(),
-        indent(fmt::format("{}", xform.m), string("    xform : ").length()), bbox_w.min, bbox_w.max,
-        (bbox_w.min + bbox_w.max) / 2.f - Vec3f(0, bbox_w.diagonal()[1] / 2.f, 0));
+    for (auto &chunk : chunks)
+    {
+        bbox_o.enclose(chunk.bbox_o);
+        bbox_w.enclose(chunk.bbox_w);
+    }
+}
 
-    ++num_tri_meshes;
-    num_triangles += Fv.size();
-    triangle_bytes += size();
+void MaterialIndices::assign(const vector<uint32_t> &indices)
+{
+    *this = MaterialIndices();
+
+    uint32_t max_index = 0;
+    bool     uniform   = true;
+    for (auto i : indices)
+    {
+        max_index = std::max(max_index, i);
+        uniform   = uniform && i == indices.front();
+    }
+
+    if (uniform)
+        m_uniform = indices.empty() ? 0 : indices.front();
+    else if (max_index <= std::numeric_limits<uint8_t>::max())
+    {
+        m_bytes = 1;
+        m_u8.assign(indices.begin(), indices.end());
+    }
+    else if (max_index <= std::numeric_limits<uint16_t>::max())
+    {
+        m_bytes = 2;
+        m_u16.assign(indices.begin(), indices.end());
+    }
+    else
+    {
+        m_bytes = 4;
+        m_u32 = indices;
+    }
+}
+
+void Mesh::compact_indices()
+{
+    size_t before = size();
+
+    if (!Fn.empty() && Fn == Fv)
+    {
+        vector<Vec3i>().swap(Fn);
+        normals_use_vertex_indices = true;
+    }
+    if (!Ft.empty() && Ft == Fv)
+    {
+        vector<Vec3i>().swap(Ft);
+        uvs_use_vertex_indices = true;
+    }
+
+    face_materials.assign(Fm);
+    vector<uint32_t>().swap(Fm);
+
+    spdlog::debug("Compacted the per-face indices of the mesh from {} to {} bytes.", before, size());
+}
+
+void Mesh::discard_data()
+{
+    vs.clear();
+    ns.clear();
+    uvs.clear();
+    Fv.clear();
+    Fn.clear();
+    Ft.clear();
+    Fm.clear();
+    face_materials             = MaterialIndices();
+    normals_use_vertex_indices = uvs_use_vertex_indices = false;
+    bbox_o = bbox_w = Box3f();
+    bbh.clear();
+    bbh_faces.clear();
+    packed = PackedTriangles();
+    materials.resize(1);
+    material_names.resize(1);
+    cached = false;
+}
+
+Mesh::~Mesh()
+{
+    loaded_meshes.remove(load_key, this);
+}
+
+bool Mesh::reuse_loaded()
+{
+    bool found = loaded_meshes.reuse(load_key,
+                                     [this](const Mesh &other)
+                                     {
+                                         vs                         = other.vs;
+                                         ns                         = other.ns;
+                                         uvs                        = other.uvs;
+                                         Fv                         = other.Fv;
+                                         Fn                         = other.Fn;
+                                         Ft                         = other.Ft;
+                                         face_materials             = other.face_materials;
+                                         normals_use_vertex_indices = other.normals_use_vertex_indices;
+                                         uvs_use_vertex_indices     = other.uvs_use_vertex_indices;
+                                         bbox_o                     = other.bbox_o;
+                                         bbox_w                     = other.bbox_w;
+                                         material_names             = other.material_names;
+                                         bbh                        = other.bbh;
+                                         bbh_faces                  = other.bbh_faces;
+                                         packed                     = other.packed;
+                                         cached                     = other.cached;
+                                     });
+    if (!found)
+        return false;
+
+    // the materials belong to the other scene, look them up again by name
+    try
+    {
+        for (size_t i = 1; i < material_names.size(); ++i)
+            materials.push_back(DartsFactory<Material>::find(json::object({{"material", material_names[i]}})));
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::warn("Reused mesh references a missing material, reloading it.\n\t{}", e.what());
+        discard_data();
+        return false;
+    }
+
+    mesh_bbh_bytes += bbh.size() + bbh_faces.size() * sizeof(uint32_t) + packed.size();
+    return true;
+}
+
+bool Mesh::load_cached(const json &j)
+{
+    CacheReader cache("mesh", cache_key);
+    if (!cache.good())
+        return false;
+
+    // discard anything read so far, so the mesh can be loaded from the OBJ file instead
+    auto fail = [this]()
+    {
+        discard_data();
+        return false;
+    };
+
+    cache.read(vs);
+    cache.read(ns);
+    cache.read(uvs);
+    cache.read(Fv);
+    cache.read(Fn);
+    cache.read(Ft);
+    cache.read(normals_use_vertex_indices);
+    cache.read(uvs_use_vertex_indices);
+    cache.read(Fm);
+    cache.read(bbox_o);
+    cache.read(bbox_w);
+    uint64_t num_materials = 0;
+    cache.read(num_materials);
+    material_names.resize(num_materials);
+    for (auto &name : material_names) cache.read(name);
+    bool has_bbh = false;
+    cache.read(has_bbh);
+    if (has_bbh)
+    {
+        if (!bbh.load(cache))
+            return fail();
+        cache.read(bbh_faces);
+        for (int a = 0; a < 3; ++a)
+        {
+            cache.read(packed.v0[a]);
+            cache.read(packed.e1[a]);
+            cache.read(packed.e2[a]);
+        }
+    }
+    if (!cache.good())
+        return fail();
+
+    // the materials are not cached, look them up again by name
+    try
+    {
+        for (size_t i = 1; i < material_names.size(); ++i)
+            materials.push_back(DartsFactory<Material>::find(json::object({{"material", material_names[i]}})));
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::warn("Cached mesh references a missing material, reloading it.\n\t{}", e.what());
+        return fail();
+    }
+
+    mesh_bbh_bytes += bbh.size() + bbh_faces.size() * sizeof(uint32_t) + packed.size();
+
+    cached = true;
+    return true;
+}
+
+void Mesh::save_cached() const
+{
+    CacheWriter cache("mesh", cache_key);
+    cache.write(vs);
+    cache.write(ns);
+    cache.write(uvs);
+    cache.write(Fv);
+    cache.write(Fn);
+    cache.write(Ft);
+    cache.write(normals_use_vertex_indices);
+    cache.write(uvs_use_vertex_indices);
+    vector<uint32_t> material_indices(Fv.size());
+    for (uint32_t f = 0; f < Fv.size(); ++f) material_indices[f] = face_materials[f];
+    cache.write(material_indices);
+    cache.write(bbox_o);
+    cache.write(bbox_w);
+    cache.write(uint64_t(material_names.size()));
+    for (auto &name : material_names) cache.write(name);
+    cache.write(!bbh.empty());
+    if (!bbh.empty())
+    {
+        bbh.save(cache);
+        cache.write(bbh_faces);
+        for (int a = 0; a < 3; ++a)
+        {
+            cache.write(packed.v0[a]);
+            cache.write(packed.e1[a]);
+            cache.write(packed.e2[a]);
+        }
+    }
 }
 
 size_t Mesh::size() const
 {
     return vs.capacity() * sizeof(Vec3f) + ns.capacity() * sizeof(Vec3f) + uvs.capacity() * sizeof(Vec2f) +
            Fv.capacity() * sizeof(Vec3i) + Fn.capacity() * sizeof(Vec3i) + Ft.capacity() * sizeof(Vec3i) +
-           Fm.capacity() * sizeof(uint32_t);
+           Fm.capacity() * sizeof(uint32_t) + face_materials.size();
 }
 
 void Mesh::add_to_parent(Surface *parent, shared_ptr<Surface> self, const json &j)
 {
     auto mesh = std::dynamic_pointer_cast<Mesh>(self);
+    if (!mesh || mesh->empty())
+        return;
+
+    // emissive meshes need to be split into triangles so that each face can be sampled as an emitter
+    if (use_bbh && is_emissive())
+    {
+        spdlog::warn("Mesh has emissive materials, adding individual triangles instead of using an internal BBH.");
+        use_bbh = false;
+    }
 
-    if (!mesh && mesh->empty())
+    if (use_bbh)
+    {
+        parent->add_child(self);
         return;
+    }
+
+    for (auto &triangle : create_triangles(mesh)) parent->add_child(triangle);
+    triangle_surface_bytes += mesh->Fv.size() * sizeof(Triangle);
+}
+
+void Mesh::build()
+{
+    bool changed = false;
+    if (use_bbh && bbh.empty() && !empty())
+    {
+        build_bbh();
+        changed = true;
+    }
+    if (use_bbh)
+        bbh_replicas.replicate(bbh);
+
+    if (cache_key && (!cached || changed))
+    {
+        save_cached();
+        cached = true;
+    }
+
+    // only offer the mesh to other scenes once it is complete, so they never copy a BBH under construction
+    if (load_key)
+        loaded_meshes.add(load_key, this);
+}
+
+void Mesh::build_bbh()
+{
+    vector<BBHPrimInfo> prim_info(Fv.size());
+    parallel_for(blocked_range<uint32_t>(0, uint32_t(Fv.size()), 4096),
+                 [&](blocked_range<uint32_t> r)
+                 {
+                     for (auto i : r)
+                     {
+                         prim_info[i].bbox     = face_bounds(i);
+                         prim_info[i].centroid = prim_info[i].bbox.center();
+                         prim_info[i].index    = i;
+                     }
+                 });
+
+    {
+        Progress progress("Building mesh BBH", Fv.size());
+        bbh.build(prim_info, progress,
+                  [this](uint32_t face, const Box3f &box) { return clipped_face_bounds(face, box); });
+        progress.set_done();
+    }
+
+    bbh_faces.resize(prim_info.size());
+    for (size_t i = 0; i < prim_info.size(); ++i) bbh_faces[i] = prim_info[i].index;
+
+    // store the geometry of the faces in leaf order, so that each leaf is a contiguous range of this data
+    for (int a = 0; a < 3; ++a)
+    {
+        packed.v0[a].resize(bbh_faces.size());
+        packed.e1[a].resize(bbh_faces.size());
+        packed.e2[a].resize(bbh_faces.size());
+    }
+    for (size_t i = 0; i < bbh_faces.size(); ++i)
+    {
+        const Vec3i &f  = Fv[bbh_faces[i]];
+        Vec3f        v0 = vs[f.x], e1 = vs[f.y] - v0, e2 = vs[f.z] - v0;
+        for (int a = 0; a < 3; ++a)
+        {
+            packed.v0[a][i] = v0[a];
+            packed.e1[a][i] = e1[a];
+            packed.e2[a][i] = e2[a];
+        }
+    }
+
+    mesh_bbh_bytes += bbh.size() + bbh_faces.size() * sizeof(uint32_t) + packed.size();
+    spdlog::info("Mesh BBH contains {} triangles in {} nodes ({:.2f} MB).", Fv.size(), bbh.num_nodes(),
+                 bbh.size() / (1024.f * 1024.f));
+}
+
+bool Mesh::intersect(const Ray3f &ray_, HitInfo &hit) const
+{
+    if (!use_bbh)
+        throw DartsException("Mesh::intersect() requires the mesh to use an internal BBH.");
+
+    Ray3f ray = ray_;
+    return bbh_replicas.local(bbh).intersect(ray, [&](uint32_t first, uint32_t count, Ray3f &r)
+                                             { return intersect_leaf(first, count, r, &hit); });
+}
+
+bool Mesh::occluded(const Ray3f &ray_) const
+{
+    if (!use_bbh)
+        throw DartsException("Mesh::occluded() requires the mesh to use an internal BBH.");
+
+    Ray3f ray = ray_;
+    return bbh_replicas.local(bbh).occluded(ray, [&](uint32_t first, uint32_t count, Ray3f &r)
+                                            { return intersect_leaf(first, count, r, nullptr); });
+}
+
+bool Mesh::intersect_leaf(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const
+{
+    return use_packed ? intersect_packed(first, count, ray, hit) : intersect_faces(first, count, ray, hit);
+}
 
-    for (auto index : range(mesh->Fv.size()))
-        parent->add_child(make_shared<Triangle>(j, mesh, int(index)));
+bool Mesh::intersect_faces(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const
+{
+    HitInfo any_hit;
+    bool    found = false;
+    for (uint32_t i = first; i < first + count; ++i)
+        if (intersect_face(bbh_faces[i], ray, hit ? *hit : any_hit, this))
+        {
+            if (!hit)
+                return true;
+            ray.maxt = hit->t;
+            found    = true;
+        }
+    return found;
+}
+
+bool Mesh::intersect_packed(uint32_t first, uint32_t count, Ray3f &ray, HitInfo *hit) const
+{
+    constexpr int W = packet_width;
+
+    num_tri_packet_tests += count;
+    g_num_total_intersection_tests += count;
+
+    float    best_t = ray.maxt, best_u = 0.f, best_v = 0.f;
+    uint32_t best   = std::numeric_limits<uint32_t>::max();
+
+    // Moller-Trumbore, evaluated for W triangles at a time
+    for (uint32_t base = first; base < first + count; base += W)
+    {
+        const int n = int(std::min<uint32_t>(W, first + count - base));
+        float     t[W], u[W], v[W];
+        bool      valid[W];
+        for (int j = 0; j < W; ++j)
+        {
+            // clamp the index for the lanes past the end of the leaf, these are masked out below
+            uint32_t i = base + std::min(j, n - 1);
+
+            float e1x = packed.e1[0][i], e1y = packed.e1[1][i], e1z = packed.e1[2][i];
+            float e2x = packed.e2[0][i], e2y = packed.e2[1][i], e2z = packed.e2[2][i];
+
+            // pvec = d x e2
+            float px = ray.d.y * e2z - ray.d.z * e2y;
+            float py = ray.d.z * e2x - ray.d.x * e2z;
+            float pz = ray.d.x * e2y - ray.d.y * e2x;
+
+            float det     = e1x * px + e1y * py + e1z * pz;
+            float inv_det = 1.f / det;
+
+            // tvec = o - v0
+            float tx = ray.o.x - packed.v0[0][i];
+            float ty = ray.o.y - packed.v0[1][i];
+            float tz = ray.o.z - packed.v0[2][i];
+
+            // qvec = tvec x e1
+            float qx = ty * e1z - tz * e1y;
+            float qy = tz * e1x - tx * e1z;
+            float qz = tx * e1y - ty * e1x;
+
+            u[j] = (tx * px + ty * py + tz * pz) * inv_det;
+            v[j] = (ray.d.x * qx + ray.d.y * qy + ray.d.z * qz) * inv_det;
+            t[j] = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+            valid[j] = j < n && det != 0.f && u[j] >= 0.f && v[j] >= 0.f && u[j] + v[j] <= 1.f && t[j] >= ray.mint &&
+                       t[j] <= best_t;
+        }
+
+        for (int j = 0; j < W; ++j)
+            if (valid[j] && t[j] <= best_t)
+            {
+                if (!hit)
+                    return true;
+
+                best_t = t[j];
+                best_u = u[j];
+                best_v = v[j];
+                best   = base + j;
+            }
+    }
+
+    if (best == std::numeric_limits<uint32_t>::max())
+        return false;
+
+    // only now fetch the shading information, for the closest hit
+    ray.maxt = best_t;
+    fill_hit(bbh_faces[best], best_t, best_u, best_v, ray, *hit);
+    return true;
+}
+
+void Mesh::fill_hit(uint32_t face, float t, float u, float v, const Ray3f &ray, HitInfo &hit) const
+{
+    Vec3f p0 = vs[Fv[face].x], p1 = vs[Fv[face].y], p2 = vs[Fv[face].z];
+    Vec3f gn = normalize(cross(p1 - p0, p2 - p0));
+
+    // interpolate the per-vertex normals and texture coordinates, if available
+    Vec3f sn = gn;
+    Vec3i fn = normal_indices(face);
+    if (fn.x >= 0 && fn.y >= 0 && fn.z >= 0)
+        sn = normalize((1.f - u - v) * ns[fn.x] + u * ns[fn.y] + v * ns[fn.z]);
+
+    Vec2f uv(u, v);
+    Vec3i ft = uv_indices(face);
+    hit.uv_width = 0.f;
+    if (ft.x >= 0 && ft.y >= 0 && ft.z >= 0)
+    {
+        uv           = (1.f - u - v) * uvs[ft.x] + u * uvs[ft.y] + v * uvs[ft.z];
+        hit.uv_width = triangle_uv_width(ray, t, gn, p0, p1, p2, &uvs[ft.x], &uvs[ft.y], &uvs[ft.z]);
+    }
+
+    hit.t   = t;
+    hit.p   = ray(t);
+    hit.gn  = gn;
+    hit.sn  = sn;
+    hit.uv  = uv;
+    hit.mat = face_material(face);
+}
+
+bool Mesh::is_emissive() const
+{
+    for (auto &m : materials)
+        if (m && m->is_emissive())
+            return true;
+    return false;
 }
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Surface, Mesh, "mesh")
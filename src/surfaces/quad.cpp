@@ -13,12 +13,43 @@ public:
     Quad(const json &j = json::object());
 
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
     Box3f local_bounds() const override;
     Color3f sample(EmitterRecord &rec, const Vec2f &rv) const override;
     float   pdf(const Vec3f &o, const Vec3f &v) const override;
+    float   sample_area(HitInfo &hit, const Vec2f &rv) const override;
+
+    float area() const override
+    {
+        return 4 * length(cross(m_xform.vector({m_size.x, 0, 0}), m_xform.vector({0, m_size.y, 0})));
+    }
+
+    void set_transform(const Transform &xform) override
+    {
+        XformedSurfaceWithMaterial::set_transform(xform);
+        update_world_space();
+    }
 
 protected:
+    /// Precompute the world-space parallelogram (#m_center, #m_u, #m_v) if the transform is affine
+    void update_world_space();
+
+    /**
+        Find where \p ray hits the quad.
+
+        \param [out] t      The ray parameter of the hit
+        \param [out] local  The local-space (x,y) coordinates of the hit
+        \return             True if the ray hits the quad within [mint, maxt]
+    */
+    bool find_hit(const Ray3f &ray, float &t, Vec2f &local) const;
+
     Vec2f m_size = Vec2f(1.f); ///< The extent of the quad in the (x,y) plane
+
+    bool  m_world_space = false; ///< Whether rays can be intersected with the world-space parallelogram directly
+    Vec3f m_center;              ///< World-space center of the quad, if #m_world_space
+    Vec3f m_u, m_v;              ///< World-space half edges along the local x and y axes, if #m_world_space
+    Vec3f m_w;                   ///< <tt>n / |n|^2</tt> with <tt>n = m_u x m_v</tt>, to find local coordinates
+    Vec3f m_normal;              ///< The world-space normal
 };
 
 Quad::Quad(const json &j) : XformedSurfaceWithMaterial(j)
@@ -26,22 +57,55 @@ Quad::Quad(const json &j) : XformedSurfaceWithMaterial(j)
     m_size = j.value("size", m_size);
     m_size /= 2.f;
 
+    update_world_space();
 }
 
-STAT_RATIO("Intersections/Quad intersection tests per hit", num_quad_tests, num_quad_hits);
+void Quad::update_world_space()
+{
+    m_normal = normalize(m_xform.normal({0, 0, 1}));
 
-bool Quad::intersect(const Ray3f &ray, HitInfo &hit) const
+    // affine transforms map the quad to a parallelogram, which rays can be intersected with without transforming them
+    m_world_space = !m_motion.is_animated() && m_xform.is_affine();
+    if (m_world_space)
+    {
+        m_center = m_xform.point(Vec3f(0.f));
+        m_u      = m_xform.vector({m_size.x, 0, 0});
+        m_v      = m_xform.vector({0, m_size.y, 0});
+        Vec3f n  = cross(m_u, m_v);
+        m_w      = n / length2(n);
+
+        // degenerate quads can't be hit anyway, but would divide by zero
+        m_world_space = length2(n) > 0.f;
+    }
+}
+
+bool Quad::find_hit(const Ray3f &ray, float &t, Vec2f &local) const
 {
-    ++g_num_total_intersection_tests;
-    ++num_quad_tests;
+    if (m_world_space)
+    {
+        // intersect the plane of the parallelogram, and find the hit's coordinates along the (non-orthogonal) edges
+        float denom = dot(m_w, ray.d);
+        if (denom == 0)
+            return false;
+        t = dot(m_w, m_center - ray.o) / denom;
+        if (t < ray.mint || t > ray.maxt)
+            return false;
+
+        Vec3f q     = ray(t) - m_center;
+        float alpha = dot(m_w, cross(q, m_v)), beta = dot(m_w, cross(m_u, q));
+        if (std::abs(alpha) > 1.f || std::abs(beta) > 1.f)
+            return false;
+        local = Vec2f{alpha * m_size.x, beta * m_size.y};
+        return true;
+    }
 
-    // compute ray intersection (and ray parameter), continue if not hit
+    // compute ray intersection (and ray parameter) in local space, continue if not hit
     auto tray = m_xform.inverse().ray(ray);
     if (tray.d.z == 0)
         return false;
-    auto t = -tray.o.z / tray.d.z;
-    auto p = tray(t);
+    t = -tray.o.z / tray.d.z;
 
+    auto p = tray(t);
     if (m_size.x < std::abs(p.x) || m_size.y < std::abs(p.y))
         return false;
 
@@ -49,17 +113,48 @@ bool Quad::intersect(const Ray3f &ray, HitInfo &hit) const
     if (t < tray.mint || t > tray.maxt)
         return false;
 
-    // project hitpoint onto plane to reduce floating-point error
-    p.z = 0;
+    local = Vec2f{p.x, p.y};
+    return true;
+}
+
+STAT_RATIO("Intersections/Quad intersection tests per hit", num_quad_tests, num_quad_hits);
+
+bool Quad::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    ++g_num_total_intersection_tests;
+    ++num_quad_tests;
+
+    float t;
+    Vec2f local;
+    if (!find_hit(ray, t, local))
+        return false;
+
+    // the point on the plane (rather than the ray) reduces floating-point error
+    Vec3f p{local.x, local.y, 0.f};
 
     // if hit, set intersection record values
-    hit.t = t;
-    hit.p  = m_xform.point(p);
-    hit.gn = hit.sn = normalize(m_xform.normal({0, 0, 1}));
+    hit.t  = t;
+    hit.p  = m_world_space ? m_center + local.x / m_size.x * m_u + local.y / m_size.y * m_v : m_xform.point(p);
+    hit.gn = hit.sn = m_normal;
     hit.mat         = m_material.get();
     // TODO: Compute proper UV coordinates
     // Keep in mind that in darts we consider the origin of uv texture space to be in the bottom-left corner
-    hit.uv = Vec2f{0.f, 0.f};
+    hit.uv       = Vec2f{0.f, 0.f};
+    hit.uv_width = 0.f;
+
+    ++num_quad_hits;
+    return true;
+}
+
+bool Quad::occluded(const Ray3f &ray) const
+{
+    ++g_num_total_intersection_tests;
+    ++num_quad_tests;
+
+    float t;
+    Vec2f local;
+    if (!find_hit(ray, t, local))
+        return false;
 
     ++num_quad_hits;
     return true;
@@ -82,22 +177,29 @@ Color3f Quad::sample(EmitterRecord &rec, const Vec2f &rv) const
     rec.wi /= rec.hit.t;
 
     // convert to solid angle measure
-    float area   = 4 * length(cross(m_xform.vector({m_size.x, 0, 0}), m_xform.vector({0, m_size.y, 0})));
     float cosine = std::abs(dot(rec.hit.gn, rec.wi));
-    rec.pdf      = dist2 / (cosine * area);
+    rec.pdf      = dist2 / (cosine * area());
 
     return rec.hit.mat->emitted(Ray3f(rec.o, rec.wi), rec.hit) / rec.pdf;
 }
 
+float Quad::sample_area(HitInfo &hit, const Vec2f &rv) const
+{
+    hit.p   = m_xform.point({(2 * rv.x - 1) * m_size.x, (2 * rv.y - 1) * m_size.y, 0});
+    hit.gn  = hit.sn = normalize(m_xform.normal({0, 0, 1}));
+    hit.uv  = rv;
+    hit.mat = m_material.get();
+    return 1.f / area();
+}
+
 float Quad::pdf(const Vec3f &o, const Vec3f &v) const
 {
     HitInfo hit;
     if (this->intersect(Ray3f(o, v), hit))
     {
-        float area             = 4 * length(cross(m_xform.vector({m_size.x, 0, 0}), m_xform.vector({0, m_size.y, 0})));
         float distance_squared = hit.t * hit.t * length2(v);
         float cosine           = std::abs(dot(v, hit.gn) / length(v));
-        return distance_squared / (cosine * area);
+        return distance_squared / (cosine * area());
     }
     else
         return 0;
@@ -4,17 +4,38 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/sampling.h>
 #include <darts/sphere.h>
 #include <darts/stats.h>
 
 Sphere::Sphere(float radius, shared_ptr<const Material> material, const Transform &xform) :
     XformedSurfaceWithMaterial(material, xform), m_radius(radius)
 {
+    update_world_space();
 }
 
 Sphere::Sphere(const json &j) : XformedSurfaceWithMaterial(j)
 {
     m_radius = j.value("radius", m_radius);
+    update_world_space();
+}
+
+void Sphere::set_transform(const Transform &xform)
+{
+    XformedSurfaceWithMaterial::set_transform(xform);
+    update_world_space();
+}
+
+void Sphere::update_world_space()
+{
+    // rotations, translations and uniform scalings keep the sphere a sphere, so there is no need to transform the rays
+    float scale;
+    m_world_space = !m_motion.is_animated() && m_xform.is_similarity(&scale);
+    if (m_world_space)
+    {
+        m_center       = m_xform.point(Vec3f(0.f));
+        m_world_radius = scale * m_radius;
+    }
 }
 
 STAT_RATIO("Intersections/Sphere intersection tests per hit", num_sphere_tests, num_sphere_hits);
@@ -24,6 +45,8 @@ bool Sphere::intersect(const Ray3f &ray, HitInfo &hit) const
     ++g_num_total_intersection_tests;
     ++num_sphere_tests;
     // TODO: Assignment 1: Implement ray-sphere intersection
+    //       If the sphere is_world_space(), you can skip transforming the ray into the sphere's local space, and
+    //       intersect it with the sphere of radius m_world_radius around m_center instead
 
     put_your_code_here("Assignment 1: Insert your ray-sphere intersection code here");
     return false;
@@ -56,6 +79,32 @@ Box3f Sphere::local_bounds() const
     return Box3f{Vec3f{-m_radius}, Vec3f{m_radius}};
 }
 
+Box3f Sphere::bounds() const
+{
+    if (m_world_space)
+        return Box3f{m_center - Vec3f{m_world_radius}, m_center + Vec3f{m_world_radius}};
+    return XformedSurfaceWithMaterial::bounds();
+}
+
+float Sphere::area() const
+{
+    // average the areas of the circles spanned by each pair of transformed axes
+    Vec3f r = {length(m_xform.vector({m_radius, 0, 0})), length(m_xform.vector({0, m_radius, 0})),
+               length(m_xform.vector({0, 0, m_radius}))};
+    return 4.f * M_PI * (r.x * r.y + r.y * r.z + r.z * r.x) / 3.f;
+}
+
+float Sphere::sample_area(HitInfo &hit, const Vec2f &rv) const
+{
+    Vec3f d = sample_sphere(rv);
+    hit.p   = m_xform.point(m_radius * d);
+    hit.gn = hit.sn = normalize(m_xform.normal(d));
+    hit.uv          = rv;
+    hit.mat         = m_material.get();
+
+    // convert the density on the unit sphere to one with respect to the (transformed) surface area
+    return sample_sphere_pdf() * 4.f * M_PI / area();
+}
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Surface, Sphere, "sphere")
 
@@ -14,18 +14,25 @@ XformedSurface::XformedSurface(const json &j)
 
 Box3f XformedSurface::bounds() const
 {
-    return m_xform.box(local_bounds());
+    return m_motion.is_animated() ? m_motion.motion_bounds(local_bounds()) : m_xform.box(local_bounds());
+}
+
+void XformedSurface::parse_motion(const json &j)
+{
+    if (j.contains("end_transform"))
+        m_motion = AnimatedTransform(m_xform, j["end_transform"].get<Transform>());
 }
 
 
 XformedSurfaceWithMaterial::XformedSurfaceWithMaterial(const json &j) : XformedSurface(j)
 {
     m_material = DartsFactory<Material>::find(j);
+    m_emissive = m_material && m_material->is_emissive();
 }
 
-bool XformedSurfaceWithMaterial::is_emissive() const
+float XformedSurfaceWithMaterial::power() const
 {
-    return m_material && m_material->is_emissive();
+    return is_emissive() ? luminance(m_material->average_emitted()) * area() : 0.f;
 }
 
 
@@ -4,10 +4,16 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/progress.h>
+#include <darts/stats.h>
 #include <darts/surface_group.h>
 
+STAT_RATIO("Scene/Emitters visited per light BBH query", num_light_tree_visits, num_light_tree_queries);
+
 SurfaceGroup::SurfaceGroup(const json &j) : XformedSurface(j)
 {
+    parse_motion(j);
+
     //
     // parse the children
     //
@@ -26,13 +32,106 @@ void SurfaceGroup::add_child(shared_ptr<Surface> surface)
 {
     m_surfaces.push_back(surface);
     m_bounds.enclose(m_surfaces.back()->bounds());
+
+    // the emitter distribution is outdated now
+    m_emissive = false;
+    m_emitters.clear();
+    m_emitter_dist = AliasTable();
+    m_light_tree.clear();
+}
+
+void SurfaceGroup::build()
+{
+    m_emissive = false;
+    m_emitters.clear();
+    m_emitter_dist = AliasTable();
+    m_light_tree.clear();
+
+    if (m_surfaces.empty())
+        return;
+
+    // collect the emissive children, or fall back to choosing among all the children uniformly
+    vector<float> weights;
+    for (auto &surface : m_surfaces)
+    {
+        float power = surface->power();
+        if (power > 0.f)
+        {
+            m_emitters.push_back(surface.get());
+            weights.push_back(power);
+        }
+    }
+    m_emissive = !m_emitters.empty();
+    if (!m_emissive)
+    {
+        for (auto &surface : m_surfaces) m_emitters.push_back(surface.get());
+        weights.assign(m_emitters.size(), 1.f);
+    }
+
+    if (m_emissive && m_emitters.size() >= light_tree_threshold)
+    {
+        vector<BBHPrimInfo> prim_info(m_emitters.size());
+        for (uint32_t i = 0; i < m_emitters.size(); ++i)
+        {
+            prim_info[i].bbox     = m_emitters[i]->bounds();
+            prim_info[i].centroid = prim_info[i].bbox.center();
+            prim_info[i].index    = i;
+        }
+
+        m_light_tree.split_method  = BBHTree::SplitMethod::SAH;
+        m_light_tree.max_leaf_size = 4;
+
+        // nested groups build their own (usually small) light BBHs, which would each flash up a progress bar
+        Progress progress("Building light BBH", m_emitters.size(),
+                          m_emitters.size() < BBHTree::parallel_build_threshold);
+        m_light_tree.build(prim_info, progress);
+        progress.set_done();
+
+        // store the emitters and their weights in the leaf order of the tree
+        vector<const Surface *> emitters(m_emitters.size());
+        vector<float>           ordered_weights(m_emitters.size());
+        for (size_t i = 0; i < prim_info.size(); ++i)
+        {
+            emitters[i]        = m_emitters[prim_info[i].index];
+            ordered_weights[i] = weights[prim_info[i].index];
+        }
+        m_emitters.swap(emitters);
+        weights.swap(ordered_weights);
+    }
+
+    m_emitter_dist = AliasTable(weights);
+}
+
+void SurfaceGroup::refit()
+{
+    m_bounds = Box3f();
+    for (auto &surface : m_surfaces)
+    {
+        surface->refit();
+        m_bounds.enclose(surface->bounds());
+    }
+
+    if (!m_light_tree.empty())
+    {
+        vector<Box3f> bounds(m_emitters.size());
+        for (size_t i = 0; i < m_emitters.size(); ++i) bounds[i] = m_emitters[i]->bounds();
+        m_light_tree.refit(bounds);
+    }
+}
+
+float SurfaceGroup::power() const
+{
+    float sum = 0.f;
+    for (auto &surface : m_surfaces) sum += surface->power();
+    return sum;
 }
 
 bool SurfaceGroup::intersect(const Ray3f &ray_, HitInfo &hit) const
 {
-    // transform the ray into local object space
-    auto ray          = m_xform.inverse().ray(ray_);
-    bool hit_anything = false;
+    // transform the ray into local object space (most groups are not transformed at all)
+    Transform xform        = transform_at(ray_.time);
+    auto      ray          = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
+    bool      hit_anything = false;
 
     // This is a linear intersection test that iterates over all primitives
     // within the scene. It's the most naive intersection test and hence very
@@ -47,14 +146,30 @@ bool SurfaceGroup::intersect(const Ray3f &ray_, HitInfo &hit) const
     }
 
     // transform the hit information back
-    hit.p  = m_xform.point(hit.p);
-    hit.gn = normalize(m_xform.normal(hit.gn));
-    hit.sn = normalize(m_xform.normal(hit.sn));
+    if (hit_anything && !xform.is_identity())
+    {
+        hit.p  = xform.point(hit.p);
+        hit.gn = normalize(xform.normal(hit.gn));
+        hit.sn = normalize(xform.normal(hit.sn));
+    }
 
     // record closest intersection
     return hit_anything;
 }
 
+bool SurfaceGroup::occluded(const Ray3f &ray_) const
+{
+    // transform the ray into local object space
+    Transform xform = transform_at(ray_.time);
+    auto      ray   = xform.is_identity() ? ray_ : xform.inverse().ray(ray_);
+
+    for (auto &surface : m_surfaces)
+        if (surface->occluded(ray))
+            return true;
+
+    return false;
+}
+
 Box3f SurfaceGroup::local_bounds() const
 {
     return m_bounds;
@@ -65,6 +180,13 @@ pair<const Surface *, float> SurfaceGroup::sample_child(float &rv1) const
     if (m_surfaces.size() == 0)
         throw DartsException("SurfaceGroup::sample_child(): No children were defined!");
 
+    if (!m_emitter_dist.empty())
+    {
+        // choose proportionally to power, and reuse the random number
+        uint32_t index = m_emitter_dist.sample(rv1);
+        return {m_emitters[index], m_emitter_dist.pmf(index)};
+    }
+
     // choose a surface uniformly, and reuse the random number
     float sx    = rv1 * m_surfaces.size();
     int   index = clamp((int)sx, 0, (int)m_surfaces.size() - 1);
@@ -75,11 +197,21 @@ pair<const Surface *, float> SurfaceGroup::sample_child(float &rv1) const
 
 float SurfaceGroup::child_prob() const
 {
-    return 1.f / m_surfaces.size();
+    return 1.f / (m_emitters.empty() ? m_surfaces.size() : m_emitters.size());
 }
 
 float SurfaceGroup::pdf(const Vec3f &o, const Vec3f &v) const
 {
+    if (!m_light_tree.empty())
+        return light_tree_pdf(o, v);
+
+    if (!m_emitter_dist.empty())
+    {
+        float sum = 0.f;
+        for (uint32_t i = 0; i < m_emitters.size(); ++i) sum += m_emitter_dist.pmf(i) * m_emitters[i]->pdf(o, v);
+        return sum;
+    }
+
     float weight = 1.0f / m_surfaces.size();
     float sum    = 0.f;
     for (auto surface : m_surfaces)
@@ -87,6 +219,25 @@ float SurfaceGroup::pdf(const Vec3f &o, const Vec3f &v) const
     return sum;
 }
 
+float SurfaceGroup::light_tree_pdf(const Vec3f &o, const Vec3f &v) const
+{
+    ++num_light_tree_queries;
+
+    // an emitter can only generate the direction v if the ray towards it hits its bounds, so visit all leaves that the
+    // ray reaches without ever shortening it
+    float sum = 0.f;
+    Ray3f ray(o, v);
+    m_light_tree.intersect(ray,
+                           [&](uint32_t first, uint32_t count, Ray3f &)
+                           {
+                               num_light_tree_visits += count;
+                               for (uint32_t i = first; i < first + count; ++i)
+                                   sum += m_emitter_dist.pmf(i) * m_emitters[i]->pdf(o, v);
+                               return false;
+                           });
+    return sum;
+}
+
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Surface, SurfaceGroup, "group")
 
@@ -6,11 +6,12 @@
 
 #include <darts/factory.h>
 #include <darts/mesh.h>
+#include <darts/sampling.h>
 #include <darts/stats.h>
 #include <darts/triangle.h>
 
-
-Triangle::Triangle(const json &j) : m_face_idx(0)
+/// Parse a single triangle, as a (one-face) mesh along with the triangle that refers to it
+static shared_ptr<Surface> create_single_triangle(const json &j)
 {
     // "positions" field is required
     if (!j.contains("positions") || !j.at("positions").is_array() || j.at("positions").size() != 3)
@@ -49,48 +50,92 @@ Triangle::Triangle(const json &j) : m_face_idx(0)
             spdlog::warn("optional \"uvs\" field should be an array of three Vec2s, skipping");
     }
 
-    m_mesh = mesh;
+    mesh->compact_indices();
+    return create_triangles(mesh)[0];
+}
+
+Triangle::Triangle(const Mesh *mesh, uint32_t tri_number) :
+    m_mesh(mesh), m_face_idx(tri_number),
+    m_emissive(mesh->face_material(tri_number) && mesh->face_material(tri_number)->is_emissive())
+{
 }
 
-Triangle::Triangle(const json &j, shared_ptr<const Mesh> mesh, uint32_t tri_number) :
-    m_mesh(mesh), m_face_idx(tri_number)
+vector<shared_ptr<Surface>> create_triangles(shared_ptr<const Mesh> mesh)
 {
+    struct Triangles
+    {
+        shared_ptr<const Mesh> mesh;
+        vector<Triangle>       faces;
+    };
+
+    auto triangles  = make_shared<Triangles>();
+    triangles->mesh = mesh;
+    triangles->faces.reserve(mesh->Fv.size());
+    for (auto index : range(mesh->Fv.size())) triangles->faces.emplace_back(mesh.get(), uint32_t(index));
+
+    vector<shared_ptr<Surface>> result;
+    result.reserve(triangles->faces.size());
+    for (auto &t : triangles->faces) result.emplace_back(triangles, &t);
+    return result;
 }
 
 STAT_RATIO("Intersections/Triangle intersection tests per hit", num_tri_tests, num_tri_hits);
 
 bool Triangle::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return m_mesh->intersect_face(m_face_idx, ray, hit, this);
+}
+
+float Triangle::power() const
+{
+    if (!is_emissive())
+        return 0.f;
+
+    float area = 0.5f * length(cross(vertex(1) - vertex(0), vertex(2) - vertex(0)));
+    return luminance(m_mesh->face_material(m_face_idx)->average_emitted()) * area;
+}
+
+float Triangle::sample_area(HitInfo &hit, const Vec2f &rv) const
+{
+    Vec3f p0 = vertex(0), p1 = vertex(1), p2 = vertex(2);
+    Vec3f p  = sample_triangle(p0, p1, p2, rv);
+
+    // recover the barycentric coordinates of p, so that the mesh can fill in the hit information
+    Vec3f n  = cross(p1 - p0, p2 - p0);
+    float n2 = length2(n);
+    if (!(n2 > 0.f))
+        return 0.f;
+    float u = dot(cross(p - p0, p2 - p0), n) / n2;
+    float v = dot(cross(p1 - p0, p - p0), n) / n2;
+    m_mesh->fill_hit(m_face_idx, 0.f, u, v, Ray3f(p, n), hit);
+    return sample_triangle_pdf(p0, p1, p2);
+}
+
+bool Mesh::intersect_face(uint32_t face, const Ray3f &ray, HitInfo &hit, const Surface *surface) const
 {
     ++num_tri_tests;
 
-    auto iv0 = m_mesh->Fv[m_face_idx].x, iv1 = m_mesh->Fv[m_face_idx].y, iv2 = m_mesh->Fv[m_face_idx].z;
-    auto p0 = m_mesh->vs[iv0], p1 = m_mesh->vs[iv1], p2 = m_mesh->vs[iv2];
+    auto iv0 = Fv[face].x, iv1 = Fv[face].y, iv2 = Fv[face].z;
+    auto p0 = vs[iv0], p1 = vs[iv1], p2 = vs[iv2];
 
     const Vec3f *n0 = nullptr, *n1 = nullptr, *n2 = nullptr;
-    if (m_mesh->Fn.size() > m_face_idx)
+    Vec3i        fn = normal_indices(face);
+    if (fn.x >= 0 && fn.y >= 0 && fn.z >= 0)
     {
-        auto in0 = m_mesh->Fn[m_face_idx].x, in1 = m_mesh->Fn[m_face_idx].y, in2 = m_mesh->Fn[m_face_idx].z;
-        if (in0 >= 0 && in1 >= 0 && in2 >= 0)
-        {
-            n0 = &m_mesh->ns[in0];
-            n1 = &m_mesh->ns[in1];
-            n2 = &m_mesh->ns[in2];
-        }
+        n0 = &ns[fn.x];
+        n1 = &ns[fn.y];
+        n2 = &ns[fn.z];
     }
     const Vec2f *t0 = nullptr, *t1 = nullptr, *t2 = nullptr;
-    if (m_mesh->Ft.size() > m_face_idx)
+    Vec3i        ft = uv_indices(face);
+    if (ft.x >= 0 && ft.y >= 0 && ft.z >= 0)
     {
-        auto it0 = m_mesh->Ft[m_face_idx].x, it1 = m_mesh->Ft[m_face_idx].y, it2 = m_mesh->Ft[m_face_idx].z;
-        if (it0 >= 0 && it1 >= 0 && it2 >= 0)
-        {
-            t0 = &m_mesh->uvs[it0];
-            t1 = &m_mesh->uvs[it1];
-            t2 = &m_mesh->uvs[it2];
-        }
+        t0 = &uvs[ft.x];
+        t1 = &uvs[ft.y];
+        t2 = &uvs[ft.z];
     }
 
-    return single_triangle_intersect(ray, p0, p1, p2, n0, n1, n2, t0, t1, t2, hit,
-                                     m_mesh->materials[m_mesh->Fm[m_face_idx]].get(), this, m_mesh.get());
+    return single_triangle_intersect(ray, p0, p1, p2, n0, n1, n2, t0, t1, t2, hit, face_material(face), surface, this);
 }
 
 // Ray-Triangle intersection
@@ -151,18 +196,37 @@ bool single_triangle_intersect(const Ray3f &ray, const Vec3f &p0, const Vec3f &p
     hit.sn  = sn;
     hit.uv  = Vec2f(u, v);
     hit.mat = material;
+
+    hit.uv_width = triangle_uv_width(ray, t, gn, p0, p1, p2, t0, t1, t2);
     ++num_tri_hits;
     return true;
 }
 
+float triangle_uv_width(const Ray3f &ray, float t, const Vec3f &gn, const Vec3f &p0, const Vec3f &p1, const Vec3f &p2,
+                        const Vec2f *t0, const Vec2f *t1, const Vec2f *t2)
+{
+    if (!ray.has_footprint() || t0 == nullptr || t1 == nullptr || t2 == nullptr)
+        return 0.f;
+
+    float world_area = length(cross(p1 - p0, p2 - p0));
+    float uv_area    = std::abs(cross(*t1 - *t0, *t2 - *t0));
+    float cos_theta  = std::max(std::abs(dot(gn, normalize(ray.d))), 0.01f);
+    return world_area > 0.f ? ray.footprint(t) * std::sqrt(uv_area / world_area) / cos_theta : 0.f;
+}
+
 Box3f Triangle::bounds() const
+{
+    return m_mesh->face_bounds(m_face_idx);
+}
+
+Box3f Mesh::face_bounds(uint32_t face) const
 {
     // all mesh vertices have already been transformed to world space,
     // so just bound the triangle vertices
     Box3f result;
-    result.enclose(vertex(0));
-    result.enclose(vertex(1));
-    result.enclose(vertex(2));
+    result.enclose(vs[Fv[face].x]);
+    result.enclose(vs[Fv[face].y]);
+    result.enclose(vs[Fv[face].z]);
 
     // if the triangle lies in an axis-aligned plane, expand the box a bit
     auto diag = result.diagonal();
@@ -177,8 +241,64 @@ Box3f Triangle::bounds() const
     return result;
 }
 
+Box3f Mesh::clipped_face_bounds(uint32_t face, const Box3f &box) const
+{
+    // clip the triangle against the six planes of the box (Sutherland-Hodgman), each of which adds at most one vertex
+    Vec3f poly[9] = {vs[Fv[face].x], vs[Fv[face].y], vs[Fv[face].z]}, clipped[9];
+    int   n       = 3;
+    for (int a = 0; a < 3; ++a)
+        for (int side = 0; side < 2; ++side)
+        {
+            float plane  = side == 0 ? box.min[a] : box.max[a];
+            auto  inside = [&](const Vec3f &p) { return side == 0 ? p[a] >= plane : p[a] <= plane; };
+
+            int m = 0;
+            for (int i = 0; i < n; ++i)
+            {
+                const Vec3f &p = poly[i], &q = poly[(i + 1) % n];
+                if (inside(p))
+                    clipped[m++] = p;
+                if (inside(p) != inside(q))
+                {
+                    // the edge crosses the plane, so add the crossing (snapped onto the plane)
+                    Vec3f x      = p + (q - p) * ((plane - p[a]) / (q[a] - p[a]));
+                    x[a]         = plane;
+                    clipped[m++] = x;
+                }
+            }
 
-DARTS_REGISTER_CLASS_IN_FACTORY(Surface, Triangle, "triangle")
+            n = m;
+            if (n == 0)
+                return Box3f();
+            std::copy(clipped, clipped + n, poly);
+        }
+
+    Box3f result;
+    for (int i = 0; i < n; ++i) result.enclose(poly[i]);
+
+    // pad thin boxes like face_bounds(), without growing beyond the bounds of the whole face
+    auto diag = result.diagonal();
+    for (int i = 0; i < 3; ++i)
+    {
+        if (diag[i] < 1e-4f)
+        {
+            result.min[i] -= 5e-5f;
+            result.max[i] += 5e-5f;
+        }
+    }
+    result.clip(face_bounds(face));
+    return result;
+}
+
+
+// a single triangle needs to own the mesh it refers to, so it cannot be registered with DARTS_REGISTER_CLASS_IN_FACTORY
+static struct TriangleRegistration
+{
+    TriangleRegistration()
+    {
+        DartsFactory<Surface>::register_type("triangle", create_single_triangle);
+    }
+} triangle_registration;
 
 /**
     \file
@@ -0,0 +1,216 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/factory.h>
+#include <darts/sampling.h>
+#include <darts/surface.h>
+#include <darts/surface_group.h>
+#include <darts/test.h>
+#include <darts/triangle.h>
+#include <pcg32.h>
+#include <spdlog/stopwatch.h>
+
+/**
+    A microbenchmark of a single kernel: the intersection routine of a surface, of a lone triangle, or of a box, or one
+    or more of the warping functions in sampling.h.
+
+    The rays or random numbers are generated up front, so only the kernel itself is timed. Each kernel is run over all
+    of them several times, and the fastest run is reported.
+*/
+struct KernelBenchmark : public Test
+{
+    KernelBenchmark(const json &j);
+
+    virtual void run() override;
+    virtual void print_header() const override;
+
+    /// Time \p count calls of \p op (which is passed the index of the call and returns how many of them "hit") and
+    /// report the time per call and the throughput
+    template <typename Op>
+    void time(const string &label, Op &&op) const;
+
+    void generate_rays(const Box3f &target);
+
+    string              name;
+    int                 count   = 1 << 22; ///< The number of rays or samples to run the kernel on
+    int                 repeats = 3;       ///< The number of times to run over all rays/samples
+    shared_ptr<Surface> surface;           ///< The surface to intersect, if any
+    Vec3f               triangle[3];       ///< The vertices to intersect with #single_triangle_intersect()
+    bool                has_triangle = false;
+    Box3f               box;               ///< The box to intersect, if any
+    vector<string>      warps;             ///< The names of the warping functions to time
+    float               exponent  = 20.f;  ///< The exponent for \c sample_hemisphere_cosine_power
+    float               cos_theta = .8f;   ///< The cosine of the opening angle for \c sample_sphere_cap
+
+    std::vector<Ray3f> rays;
+    std::vector<Vec2f> samples;
+};
+
+KernelBenchmark::KernelBenchmark(const json &j)
+{
+    name    = j.value("name", "benchmark");
+    count   = j.value("count", count);
+    repeats = j.value("repeats", repeats);
+
+    if (j.contains("surface"))
+        surface = DartsFactory<Surface>::create(j.at("surface"));
+    else if (j.contains("surfaces"))
+    {
+        json j2    = j["surfaces"];
+        auto group = DartsFactory<Surface>::create(j2);
+        group->build();
+        surface = group;
+    }
+
+    if (j.contains("triangle"))
+    {
+        auto positions = j["triangle"].get<vector<Vec3f>>();
+        if (positions.size() != 3)
+            throw DartsException("A triangle benchmark needs exactly 3 positions, got {}.", positions.size());
+        std::copy(positions.begin(), positions.end(), triangle);
+        has_triangle = true;
+    }
+
+    if (j.contains("box"))
+        box = Box3f(j["box"].at("min").get<Vec3f>(), j["box"].at("max").get<Vec3f>());
+
+    if (j.contains("warps"))
+    {
+        if (j["warps"] == "all")
+            warps = {"sample_disk",
+                     "sample_sphere",
+                     "sample_hemisphere",
+                     "sample_hemisphere_cosine",
+                     "sample_hemisphere_cosine_power",
+                     "sample_sphere_cap",
+                     "sample_triangle"};
+        else
+            warps = j["warps"].get<vector<string>>();
+    }
+    exponent  = j.value("exponent", exponent);
+    cos_theta = j.value("cos theta", cos_theta);
+
+    if (!surface && !has_triangle && box.is_empty() && warps.empty())
+        throw DartsException("Invalid benchmark. Need a 'surface', 'surfaces', 'triangle', 'box', or 'warps' field.");
+}
+
+void KernelBenchmark::print_header() const
+{
+    fmt::print("---------------------------------------------------------------------------\n");
+    fmt::print("Running benchmark \"{}\" with {} rays/samples...\n", name, count);
+}
+
+void KernelBenchmark::generate_rays(const Box3f &target)
+{
+    // shoot rays from a sphere around the target towards points in a slightly enlarged box, so some of them miss
+    pcg32 rng;
+    Vec3f center = target.center();
+    float radius = 2.f * length(target.diagonal()) + 1e-3f;
+    Box3f aim(center - target.diagonal(), center + target.diagonal());
+    rays.resize(count);
+    for (auto &ray : rays)
+    {
+        Vec3f o = center + radius * normalize(2.f * Vec3f{rng.nextFloat(), rng.nextFloat(), rng.nextFloat()} - 1.f);
+        Vec3f p = aim.min + Vec3f{rng.nextFloat(), rng.nextFloat(), rng.nextFloat()} * aim.diagonal();
+        ray     = Ray3f(o, normalize(p - o));
+    }
+}
+
+template <typename Op>
+void KernelBenchmark::time(const string &label, Op &&op) const
+{
+    double  best = std::numeric_limits<double>::infinity();
+    int64_t hits = 0;
+    for (int r = 0; r < repeats; ++r)
+    {
+        hits = 0;
+        spdlog::stopwatch timer;
+        for (int i = 0; i < count; ++i) hits += op(i);
+        best = std::min(best, timer.elapsed().count());
+    }
+
+    fmt::print("  {:<32} {:>9.2f} ns/op {:>10.2f} Mops/s  ({} hits)\n", label, 1e9 * best / count, 1e-6 * count / best,
+               hits);
+}
+
+void KernelBenchmark::run()
+{
+    if (surface)
+    {
+        generate_rays(surface->bounds());
+        time("Surface::intersect",
+             [this](int i)
+             {
+                 HitInfo hit;
+                 return surface->intersect(rays[i], hit);
+             });
+    }
+
+    if (has_triangle)
+    {
+        Box3f bounds;
+        for (auto &v : triangle) bounds.enclose(v);
+        generate_rays(bounds);
+        time("single_triangle_intersect",
+             [this](int i)
+             {
+                 HitInfo hit;
+                 return single_triangle_intersect(rays[i], triangle[0], triangle[1], triangle[2], nullptr, nullptr,
+                                                  nullptr, nullptr, nullptr, nullptr, hit);
+             });
+    }
+
+    if (!box.is_empty())
+    {
+        generate_rays(box);
+        time("Box3f::intersect", [this](int i) { return box.intersect(rays[i]); });
+
+        std::vector<Vec3f> inv_d(count);
+        for (int i = 0; i < count; ++i) inv_d[i] = 1.f / rays[i].d;
+        time("Box3f::intersect (reciprocal)", [this, &inv_d](int i) { return box.intersect(rays[i], inv_d[i]); });
+    }
+
+    if (!warps.empty())
+    {
+        pcg32 rng;
+        samples.resize(count);
+        for (auto &s : samples) s = Vec2f{rng.nextFloat(), rng.nextFloat()};
+
+        // count the samples that land in the upper hemisphere, so the compiler cannot drop the calls
+        auto upper = [](const Vec3f &v) { return v.z > 0.f; };
+        for (auto &warp : warps)
+        {
+            if (warp == "sample_disk")
+                time(warp, [&](int i) { return sample_disk(samples[i]).y > 0.f; });
+            else if (warp == "sample_sphere")
+                time(warp, [&](int i) { return upper(sample_sphere(samples[i])); });
+            else if (warp == "sample_hemisphere")
+                time(warp, [&](int i) { return upper(sample_hemisphere(samples[i])); });
+            else if (warp == "sample_hemisphere_cosine")
+                time(warp, [&](int i) { return upper(sample_hemisphere_cosine(samples[i])); });
+            else if (warp == "sample_hemisphere_cosine_power")
+                time(warp, [&](int i) { return upper(sample_hemisphere_cosine_power(exponent, samples[i])); });
+            else if (warp == "sample_sphere_cap")
+                time(warp, [&](int i) { return upper(sample_sphere_cap(samples[i], cos_theta)); });
+            else if (warp == "sample_triangle")
+                time(warp,
+                     [&](int i)
+                     {
+                         return upper(sample_triangle(Vec3f(-1.f, -1.f, 0.f), Vec3f(1.f, -1.f, 1.f),
+                                                      Vec3f(0.f, 1.f, -1.f), samples[i]));
+                     });
+            else
+                throw DartsException("Unknown warp '{}' in benchmark \"{}\".", warp, name);
+        }
+    }
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Test, KernelBenchmark, "benchmark")
+
+/**
+    \file
+    \brief Class #KernelBenchmark
+*/
@@ -0,0 +1,201 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <cmath>
+#include <darts/factory.h>
+#include <darts/image.h>
+#include <darts/test.h>
+#include <darts/texture.h>
+#include <filesystem>
+
+namespace
+{
+
+/// Exposes the per-level lookups of #ImageTexture to the test
+struct ImageTextureProbe : public ImageTexture
+{
+    using ImageTexture::ImageTexture;
+    using ImageTexture::texel;
+};
+
+/// Apply the wrap \p mode to coordinate \p c of a level with \p size texels, returning -1 for black texels
+int wrap(const string &mode, int c, int size)
+{
+    if (c >= 0 && c < size)
+        return c;
+    if (mode == "black")
+        return -1;
+    return mode == "repeat" ? (c % size + size) % size : clamp(c, 0, size - 1);
+}
+
+} // namespace
+
+/**
+    A class to test #ImageTexture.
+
+    The test writes a synthetic image to a temporary file, builds its mip pyramid independently, and checks the texels
+    of the texture against it: the lookups of the shared tile cache (both when tiles are evicted and when they are all
+    resident), the mip levels chosen for different footprints, and the wrap modes.
+*/
+struct ImageTextureTest : public Test
+{
+    ImageTextureTest(const json &j);
+
+    virtual void run() override;
+    virtual void print_header() const override;
+
+    int   width     = 520;
+    int   height    = 390;
+    float threshold = 1e-3f; ///< The tiles are stored as half floats
+};
+
+ImageTextureTest::ImageTextureTest(const json &j)
+{
+    width     = j.value("width", width);
+    height    = j.value("height", height);
+    threshold = j.value("threshold", threshold);
+}
+
+void ImageTextureTest::print_header() const
+{
+    fmt::print("---------------------------------------------------------------------------\n");
+    fmt::print("Testing image texture...\n");
+}
+
+void ImageTextureTest::run()
+{
+    // Step 1: write an image whose texels all differ, and build the reference pyramid the texture should match
+    string filename =
+        (std::filesystem::temp_directory_path() / fmt::format("darts_image_texture_test_{}x{}.exr", width, height))
+            .string();
+    {
+        Image3f image(width, height);
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                image(x, y) = Color3f(x / float(width), y / float(height), ((7 * x + 13 * y) % 17) / 16.f);
+        if (!image.save(filename))
+            throw DartsException("Cannot write the test image '{}'.", filename);
+    }
+
+    // the image is read back so the reference sees the same precision as the texture
+    vector<Image3f> ref(1);
+    if (!ref[0].load(filename, true))
+        throw DartsException("Cannot read the test image '{}'.", filename);
+    while (ref.back().width() > 1 || ref.back().height() > 1)
+    {
+        const Image3f &prev = ref.back();
+        Image3f        next(std::max(prev.width() / 2, 1), std::max(prev.height() / 2, 1));
+        for (int y = 0; y < next.height(); ++y)
+            for (int x = 0; x < next.width(); ++x)
+            {
+                int x0 = std::min(2 * x, prev.width() - 1), x1 = std::min(2 * x + 1, prev.width() - 1);
+                int y0 = std::min(2 * y, prev.height() - 1), y1 = std::min(2 * y + 1, prev.height() - 1);
+                next(x, y) = 0.25f * (prev(x0, y0) + prev(x1, y0) + prev(x0, y1) + prev(x1, y1));
+            }
+        ref.push_back(std::move(next));
+    }
+
+    auto check = [this](const Color3f &value, const Color3f &expected, const string &what)
+    {
+        if (maxelem(abs(value - expected)) > threshold)
+            throw DartsException("{} is {}, but should be {}.", what, value, expected);
+    };
+
+    json params = {{"type", "image"}, {"filename", filename}, {"raw", true}, {"interpolation", "closest"}};
+    auto texture = make_shared<ImageTextureProbe>(params);
+    if (texture->levels() != int(ref.size()))
+        throw DartsException("The texture has {} mip levels, but should have {}.", texture->levels(), ref.size());
+
+    // Step 2: read every texel of the finest level, tile by tile, and count the tiles decoded by the tile cache
+    constexpr int  tile_size  = ImageTexture::tile_size;
+    int            tiles      = ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+    const Image3f &level0     = ref[0];
+    auto           read_tiles = [&]()
+    {
+        uint64_t before = texture_tiles_decoded();
+        for (int ty = 0; ty < height; ty += tile_size)
+            for (int tx = 0; tx < width; tx += tile_size)
+                for (int y = ty; y < std::min(ty + tile_size, height); ++y)
+                    for (int x = tx; x < std::min(tx + tile_size, width); ++x)
+                        if (maxelem(abs(texture->texel(0, x, y) - level0(x, y))) > threshold)
+                            throw DartsException("Texel ({}, {}) is {}, but should be {}.", x, y,
+                                                 texture->texel(0, x, y), level0(x, y));
+        return texture_tiles_decoded() - before;
+    };
+
+    // with room for only a single tile, every tile is decoded on first use, and most are evicted before they are
+    // used again
+    set_texture_cache_size(sizeof(ImageTexture::Tile));
+    if (uint64_t decoded = read_tiles(); decoded != uint64_t(tiles))
+        throw DartsException("Reading the {} tiles of the texture decoded {} tiles.", tiles, decoded);
+    if (uint64_t decoded = read_tiles(); decoded == 0)
+        throw DartsException("Rereading the texture with room for a single tile didn't evict any of its tiles.");
+
+    // with the default size, all the tiles stay resident, so reading them again only hits the cache
+    set_texture_cache_size(size_t(1) << 30);
+    read_tiles();
+    if (uint64_t decoded = read_tiles(); decoded != 0)
+        throw DartsException("Rereading the resident tiles of the texture decoded {} tiles.", decoded);
+
+    // Step 3: check that the footprint width selects (and interpolates) the right mip levels
+    float max_size = float(std::max(width, height));
+    float t        = std::log2(1.5f);
+    for (int l = 0; l + 1 < texture->levels(); ++l)
+    {
+        const Image3f &level = ref[l], &next = ref[l + 1];
+        int            step  = std::max(std::min(level.width(), level.height()) / 8, 1);
+        for (int y = 0; y < level.height(); y += step)
+            for (int x = 0; x < level.width(); x += step)
+            {
+                // the center of texel (x, y) of level l, and the texel of the next level containing it
+                Vec2f uv((x + 0.5f) / level.width(), 1.f - (y + 0.5f) / level.height());
+                int   nx = int(std::floor(uv.x * next.width())), ny = int(std::floor((1.f - uv.y) * next.height()));
+
+                check(texture->lookup(uv, std::ldexp(1.f, l) / max_size), level(x, y),
+                      fmt::format("Level {} at uv ({}, {})", l, uv.x, uv.y));
+                if (l + 2 < texture->levels())
+                    check(texture->lookup(uv, 1.5f * std::ldexp(1.f, l) / max_size), lerp(level(x, y), next(nx, ny), t),
+                          fmt::format("Level {} at uv ({}, {})", l + t, uv.x, uv.y));
+            }
+    }
+    check(texture->lookup(Vec2f(0.3f, 0.6f), 1.f), ref.back()(0, 0), "The lookup over the whole texture");
+    check(texture->average(), ref.back()(0, 0), "The average");
+    if (texture->lookup(Vec2f(0.3f, 0.6f), 0.f) != texture->lookup(Vec2f(0.3f, 0.6f), 0.1f / max_size))
+        throw DartsException("Footprints smaller than a texel should look up the finest level.");
+
+    // Step 4: check the wrap modes along each axis, on the finest level and a coarser one
+    const string modes[][2] = {{"repeat", "clamp"}, {"clamp", "black"}, {"black", "repeat"}};
+    for (auto &mode : modes)
+    {
+        params["wrap mode x"] = mode[0];
+        params["wrap mode y"] = mode[1];
+        ImageTextureProbe wrapped(params);
+        for (int l : {0, 2})
+        {
+            const Image3f &level = ref[l];
+            int            w = level.width(), h = level.height();
+            for (int y : {-2 * h - 3, -1, 0, h / 2, h - 1, h, h + 5})
+                for (int x : {-w - 3, -1, 0, w / 3, w - 1, w, 2 * w + 7})
+                {
+                    int     wx = wrap(mode[0], x, w), wy = wrap(mode[1], y, h);
+                    Color3f expected = wx < 0 || wy < 0 ? Color3f(0.f) : level(wx, wy);
+                    check(wrapped.texel(l, x, y), expected,
+                          fmt::format("Texel ({}, {}) of level {} wrapped by \"{}\" and \"{}\"", x, y, l, mode[0],
+                                      mode[1]));
+                }
+        }
+    }
+
+    texture.reset();
+    std::filesystem::remove(filename);
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Test, ImageTextureTest, "image texture")
+
+/**
+    \file
+    \brief Class #ImageTextureTest
+*/
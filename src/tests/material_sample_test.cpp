@@ -11,12 +11,13 @@
 #include <darts/test.h>
 
 #include <algorithm>
+#include <atomic>
 
 struct MaterialSampleTest : public SampleTest
 {
     MaterialSampleTest(const json &j);
 
-    bool  sample(Vec3f &dir, const Vec2f &rv, float rv1) override;
+    bool  sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t chunk) override;
     float pdf(const Vec3f &dir, float rv1) const override;
     void  print_more_statistics() override;
 
@@ -25,8 +26,8 @@ struct MaterialSampleTest : public SampleTest
     Vec3f                incoming;
     HitInfo              hit;
 
-    bool any_specular         = false;
-    bool any_below_hemisphere = false;
+    std::atomic<bool> any_specular{false};
+    std::atomic<bool> any_below_hemisphere{false};
 };
 
 MaterialSampleTest::MaterialSampleTest(const json &j) : SampleTest(j)
@@ -41,7 +42,7 @@ MaterialSampleTest::MaterialSampleTest(const json &j) : SampleTest(j)
     hit.uv          = Vec2f(0.5f);
 }
 
-bool MaterialSampleTest::sample(Vec3f &dir, const Vec2f &rv, float rv1)
+bool MaterialSampleTest::sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t)
 {
     // Sample material
     ScatterRecord record;
@@ -7,29 +7,35 @@
 #include <darts/factory.h>
 #include <darts/image.h>
 #include <darts/material.h>
+#include <darts/sampler.h>
 #include <darts/surface.h>
 #include <darts/test.h>
 
 #include <algorithm>
+#include <atomic>
 
 struct MaterialScatterTest : public ScatterTest
 {
     MaterialScatterTest(const json &j);
 
-    bool sample(Vec3f &dir, const Vec2f &rv, float rv1) override;
+    bool sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t chunk) override;
+    void prepare_chunks(uint64_t num_chunks) override;
     void print_more_statistics() override;
 
-    shared_ptr<Material> material;
-    Vec3f                normal;
-    Ray3f                ray;
-    HitInfo              hit;
+    shared_ptr<Material>        material;
+    shared_ptr<Sampler>         sampler;  ///< The prototype of the samplers passed to Material::scatter()
+    vector<unique_ptr<Sampler>> samplers; ///< One copy of #sampler per chunk of samples
+    Vec3f                       normal;
+    Ray3f                       ray;
+    HitInfo                     hit;
 
-    bool any_below_hemisphere = false;
+    std::atomic<bool> any_below_hemisphere{false};
 };
 
 MaterialScatterTest::MaterialScatterTest(const json &j) : ScatterTest(j)
 {
     material = DartsFactory<Material>::create(j.at("material"));
+    sampler  = DartsFactory<Sampler>::create(json{{"type", "independent"}, {"samples", 1}});
     normal   = normalize(j.at("normal").get<Vec3f>());
     ray.d    = normalize(j.value("incoming", Vec3f(0.0f, 0.25f, -1.0f)));
 
@@ -39,12 +45,24 @@ MaterialScatterTest::MaterialScatterTest(const json &j) : ScatterTest(j)
     hit.uv          = Vec2f(0.5f);
 }
 
-bool MaterialScatterTest::sample(Vec3f &dir, const Vec2f &, float)
+void MaterialScatterTest::prepare_chunks(uint64_t num_chunks)
 {
+    samplers.resize(num_chunks);
+    for (auto &s : samplers) s = sampler->clone();
+}
+
+bool MaterialScatterTest::sample(Vec3f &dir, const Vec2f &rv, float, uint64_t chunk)
+{
+    // the chunks are sampled in parallel, so each one scatters with its own copy of the sampler, which is reseeded
+    // from the test's random numbers for each sample
+    Sampler &chunk_sampler = *samplers[chunk];
+    chunk_sampler.start_pixel(int(rv.x * (1 << 24)), int(rv.y * (1 << 24)));
+    chunk_sampler.set_sample(0);
+
     // Sample material
     Color3f attenuation;
     Ray3f   out;
-    if (!material->scatter(ray, hit, attenuation, out))
+    if (!material->scatter(ray, hit, attenuation, out, chunk_sampler))
         return false;
 
     dir = normalize(out.d);
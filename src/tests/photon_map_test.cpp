@@ -11,6 +11,7 @@
 #include <darts/sampling.h>
 #include <darts/test.h>
 #include <filesystem/resolver.h>
+#include <spdlog/stopwatch.h>
 
 #include <algorithm>
 
@@ -18,10 +19,17 @@ struct PhotonMapTest : public SampleTest
 {
     PhotonMapTest(const json &j);
 
-    bool  sample(Vec3f &pos, const Vec2f &rv, float rv1) override;
+    bool  sample(Vec3f &pos, const Vec2f &rv, float rv1, uint64_t chunk) override;
     Vec3f generate_photon(const Vec2f &rv) const;
     float pdf(const Vec3f &pos, float rv1) const override;
     float photon_density(const Vec3f &pos) const;
+    template <typename Map>
+    float photon_density(const Map &map, const Vec3f &pos) const;
+
+    /// Check that the batched k-nearest neighbor searches of \p map find the same photons as a brute-force search of
+    /// the photon \p positions
+    template <typename Map>
+    void check_batch_search(const Map &map, const vector<Vec3f> &positions) const;
 
     Vec2f sample_to_pixel(const Vec3f &pos) const override;
     Vec3f pixel_to_sample(const Vec2f &pixel) const override;
@@ -33,7 +41,13 @@ struct PhotonMapTest : public SampleTest
     int       search_count = 50;
     float     det          = 1.f;
 
-    PhotonMap photon_map;
+    /// The photon map layout to test: "implicit" (#PhotonMap), "bucketed" (#BucketedPhotonMap), or "hash_grid"
+    /// (#PhotonHashGrid, with cells the size of the search radius)
+    string layout = "implicit";
+
+    PhotonMap         photon_map;
+    BucketedPhotonMap bucketed_map;
+    PhotonHashGrid    hash_grid;
 };
 
 PhotonMapTest::PhotonMapTest(const json &j) : SampleTest(j)
@@ -42,9 +56,12 @@ PhotonMapTest::PhotonMapTest(const json &j) : SampleTest(j)
     search_count  = j.value("search count", search_count);
     xform         = j.value("transform", xform);
 
-    det = determinant(xform.m);
+    layout = j.value("layout", layout);
+    if (layout != "implicit" && layout != "bucketed" && layout != "hash_grid")
+        throw DartsException("Unknown photon map layout '{}', expected 'implicit', 'bucketed', or 'hash_grid'.",
+                             layout);
 
-    photon_map.reserve(total_samples);
+    det = determinant(xform.m);
 }
 
 Vec2f PhotonMapTest::sample_to_pixel(const Vec3f &pos) const
@@ -62,7 +79,7 @@ Vec3f PhotonMapTest::generate_photon(const Vec2f &rv) const
     return xform.point(Vec3f{sample_disk(rv), 0.f});
 }
 
-bool PhotonMapTest::sample(Vec3f &dir, const Vec2f &rv, float rv1)
+bool PhotonMapTest::sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t)
 {
     dir = generate_photon(rv);
     return true;
@@ -74,6 +91,17 @@ float PhotonMapTest::pdf(const Vec3f &pos, float rv1) const
 }
 
 float PhotonMapTest::photon_density(const Vec3f &pos) const
+{
+    if (layout == "bucketed")
+        return photon_density(bucketed_map, pos);
+    else if (layout == "hash_grid")
+        return photon_density(hash_grid, pos);
+    else
+        return photon_density(photon_map, pos);
+}
+
+template <typename Map>
+float PhotonMapTest::photon_density(const Map &map, const Vec3f &pos) const
 {
     // this serves as an example of how to use the KNNSearch and FixedRadiusProcess
     Color3f result;
@@ -82,7 +110,7 @@ float PhotonMapTest::photon_density(const Vec3f &pos) const
     {
         // k-nearest neighbor search
         KNNSearch search(pos, search_radius * search_radius, search_count);
-        photon_map.find(search);
+        map.find(search);
 
         // A KNNSearch stores the k nearest neighbors. Here we just need iterate over all found photons and accumulate
         // their powers.
@@ -99,7 +127,7 @@ float PhotonMapTest::photon_density(const Vec3f &pos) const
         // found (using the passed in lambda function).
         auto accum_photon = [&result, &pos, this](const SearchResult &p) { result += p.photon->data.power(); };
         FixedRadiusProcess search(pos, search_radius * search_radius, accum_photon);
-        photon_map.find(search);
+        map.find(search);
 
         // in this case we divide by the area of the fixed-radius disc.
         search_area = M_PI * pow2(search_radius);
@@ -108,45 +136,144 @@ float PhotonMapTest::photon_density(const Vec3f &pos) const
     return luminance(result) / search_area;
 }
 
+template <typename Map>
+void PhotonMapTest::check_batch_search(const Map &map, const vector<Vec3f> &positions) const
+{
+    // spread the queries over the disk of photons with a Fibonacci lattice, so all of them find neighbors
+    constexpr int num_queries = 128;
+    vector<Vec3f> queries(num_queries);
+    for (int i = 0; i < num_queries; ++i)
+        queries[i] = generate_photon({(i + 0.5f) / num_queries, std::fmod(i * 0.618034f, 1.f)});
+
+    // fixed-radius tests still check the k-nearest neighbor searches, with a default k
+    int       k          = search_count > 0 ? search_count : 50;
+    float     radius2    = pow2(search_radius);
+    int       mismatches = 0;
+    KNNSearch search(queries[0], radius2, k);
+    map.find_batch(queries.data(), queries.size(), search,
+                   [&](size_t i, const KNNSearch &s)
+                   {
+                       vector<float> expected, found;
+                       for (auto &p : positions)
+                           if (float dist2 = length2(p - queries[i]); dist2 < radius2)
+                               expected.push_back(dist2);
+                       std::sort(expected.begin(), expected.end());
+                       expected.resize(std::min<size_t>(expected.size(), k));
+
+                       for (auto &result : s.results) found.push_back(result.dist2);
+                       std::sort(found.begin(), found.end());
+
+                       bool match = found.size() == expected.size();
+                       for (size_t j = 0; match && j < found.size(); ++j)
+                           match = std::fabs(found[j] - expected[j]) <= 1e-6f * radius2;
+                       mismatches += !match;
+                   });
+
+    if (mismatches > 0)
+        throw DartsException("{} of the {} batched searches of the {} photon map disagree with a brute-force search.",
+                             mismatches, num_queries, layout);
+    spdlog::info("The {} batched searches of the {} photon map match a brute-force search.", num_queries, layout);
+}
+
 void PhotonMapTest::run()
 {
     // Step 1: Evaluate pdf over the sphere and compute its integral
-    pcg32 rng;
     {
         Progress progress(fmt::format("Generating {} photons", total_samples), total_samples);
-        // First insert all the photons into the photon map
-        for (auto i : range(total_samples))
+
+        // First generate the photons in parallel, each block of photons into its own buffer with its own random
+        // number stream (so the result does not depend on the number of threads). The blocks use distinct sequences of
+        // the same seed, since consecutive seeds of the same sequence produce correlated streams
+        constexpr uint64_t            block_size = 1 << 16;
+        uint64_t                      num_blocks = (total_samples + block_size - 1) / block_size;
+        std::vector<PhotonMap::Nodes> buffers(num_blocks);
+        parallel_for(blocked_range<uint64_t>(0, num_blocks, 1),
+                     [&](blocked_range<uint64_t> r)
+                     {
+                         for (auto b : r)
+                         {
+                             pcg32    block_rng(seed, b);
+                             uint64_t end = std::min(total_samples, (b + 1) * block_size);
+                             buffers[b].reserve(end - b * block_size);
+                             for (uint64_t i = b * block_size; i < end; ++i)
+                             {
+                                 auto p = generate_photon({block_rng.nextFloat(), block_rng.nextFloat()});
+                                 buffers[b].emplace_back(p, Photon(Vec3f{1.f}, Color3f{1.f / total_samples}));
+                             }
+                             progress += end - b * block_size;
+                         }
+                     });
+
+        // keep the photon positions around for checking the searches, since merging clears the buffers
+        vector<Vec3f> positions;
+        positions.reserve(total_samples);
+        for (auto &buffer : buffers)
+            for (auto &node : buffer) positions.push_back(node.position);
+
+        // then merge the buffers into the photon map, and build it
+        spdlog::stopwatch sw;
+        if (layout == "bucketed")
+        {
+            bucketed_map.merge(buffers);
+            bucketed_map.build();
+        }
+        else if (layout == "hash_grid")
+        {
+            hash_grid.merge(buffers);
+            hash_grid.build(search_radius);
+        }
+        else
         {
-            auto p = generate_photon({rng.nextFloat(), rng.nextFloat()});
-            photon_map.insert(p, Photon(Vec3f{1.f}, Color3f{1.f / total_samples}));
-            ++progress;
+            photon_map.merge(buffers);
+            photon_map.build();
         }
-        // Then build the photon map
-        photon_map.build();
         progress.set_done();
+        spdlog::info("Built the {} photon map in {:.3f}s.", layout, sw);
+
+        if (layout == "bucketed")
+            check_batch_search(bucketed_map, positions);
+        else if (layout == "hash_grid")
+            check_batch_search(hash_grid, positions);
+        else
+            check_batch_search(photon_map, positions);
     }
 
-    double         integral = 0.0f;
+    // the rows of the pdf and of the density estimate are evaluated in parallel, and their sums are added up in order
     Array2d<float> pdf(image_size.x, image_size.y);
+    vector<double> row_sums(image_size.y, 0.0);
+    auto           sum_rows = [&]()
+    {
+        double sum = 0.0;
+        for (double row_sum : row_sums) sum += row_sum;
+        return sum / product(image_size);
+    };
     {
         Progress progress("Evaluating analytic PDF", pdf.height());
-        for (int y = 0; y < pdf.height(); ++y, ++progress)
-            for (int x = 0; x < pdf.width(); x++)
-            {
-                float accum = 0.f;
-                for (int sx = 0; sx < super_samples; ++sx)
-                    for (int sy = 0; sy < super_samples; ++sy)
-                        accum += this->pdf(
-                            pixel_to_sample(Vec2f{x + (sx + 0.5f) / super_samples, y + (sy + 0.5f) / super_samples}),
-                            rng.nextFloat());
-
-                accum /= pow2(super_samples);
-
-                integral += pdf(x, y) = accum;
-            }
-        integral /= product(image_size);
+        parallel_for(blocked_range<int>(0, pdf.height(), 1),
+                     [&](blocked_range<int> r)
+                     {
+                         for (auto y : r)
+                         {
+                             pcg32 rng(seed, uint64_t(y));
+                             for (int x = 0; x < pdf.width(); x++)
+                             {
+                                 float accum = 0.f;
+                                 for (int sx = 0; sx < super_samples; ++sx)
+                                     for (int sy = 0; sy < super_samples; ++sy)
+                                         accum += this->pdf(pixel_to_sample(Vec2f{x + (sx + 0.5f) / super_samples,
+                                                                                  y + (sy + 0.5f) / super_samples}),
+                                                            rng.nextFloat());
+
+                                 accum /= pow2(super_samples);
+
+                                 row_sums[y] += pdf(x, y) = accum;
+                             }
+                             ++progress;
+                         }
+                     });
         progress.set_done();
     }
+    double integral = sum_rows();
 
     // Step 2: Compute automatic exposure value as the 99.95th percentile instead of maximum for increased
     // robustness
@@ -168,15 +295,24 @@ void PhotonMapTest::run()
 
     // Step 3: evaluate the photon density estimation result
     Array2d<float> density(image_size.x, image_size.y);
-    double         density_integral = 0.0;
+    std::fill(row_sums.begin(), row_sums.end(), 0.0);
     {
-        Progress progress("Computing photon density estimate", density.height());
-        for (int y = 0; y < density.height(); ++y, ++progress)
-            for (int x = 0; x < density.width(); x++)
-                density_integral += density(x, y) = photon_density(pixel_to_sample({x + 0.5f, y + 0.5f}));
-        density_integral /= product(image_size);
+        spdlog::stopwatch sw;
+        Progress          progress("Computing photon density estimate", density.height());
+        parallel_for(blocked_range<int>(0, density.height(), 1),
+                     [&](blocked_range<int> r)
+                     {
+                         for (auto y : r)
+                         {
+                             for (int x = 0; x < density.width(); x++)
+                                 row_sums[y] += density(x, y) = photon_density(pixel_to_sample({x + 0.5f, y + 0.5f}));
+                             ++progress;
+                         }
+                     });
         progress.set_done();
+        spdlog::info("Computed the density estimate with the {} photon map in {:.3f}s.", layout, sw);
     }
+    double density_integral = sum_rows();
 
     // Now upscale our histogram and pdf
     Array2d<float> density_upsampled = upsample(density, up_samples);
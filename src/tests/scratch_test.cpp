@@ -0,0 +1,107 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <darts/factory.h>
+#include <darts/scratch.h>
+#include <darts/test.h>
+
+/**
+    A class to test the #ScratchArena of the calling thread.
+
+    Checks that a #ScratchArena::Scope rewinds the arena, that allocations larger than the current block make the arena
+    grow without disturbing the earlier allocations, and that the grown blocks are reused by later scopes.
+*/
+struct ScratchArenaTest : public Test
+{
+    ScratchArenaTest(const json &j);
+
+    virtual void run() override;
+    virtual void print_header() const override;
+
+    size_t max_bytes = 16 * 1024 * 1024; ///< The size of the largest allocation
+};
+
+ScratchArenaTest::ScratchArenaTest(const json &j)
+{
+    max_bytes = j.value("max bytes", max_bytes);
+}
+
+void ScratchArenaTest::print_header() const
+{
+    fmt::print("---------------------------------------------------------------------------\n");
+    fmt::print("Testing scratch arena...\n");
+}
+
+void ScratchArenaTest::run()
+{
+    ScratchArena &arena = ScratchArena::local();
+    size_t        start = arena.used();
+
+    // Step 1: a nested scope releases its allocations, so the next allocation reuses the same memory
+    {
+        ScratchArena::Scope outer;
+        outer.arena.alloc<uint32_t>(100);
+        size_t after = arena.used();
+        if (after < start + 100 * sizeof(uint32_t))
+            throw DartsException("Allocating 400 bytes only grew the arena from {} to {} bytes.", start, after);
+
+        void *inner_ptr = nullptr;
+        {
+            ScratchArena::Scope inner;
+            inner_ptr = inner.arena.allocate(1000, 64);
+            if (reinterpret_cast<uintptr_t>(inner_ptr) % 64 != 0)
+                throw DartsException("Allocation {} is not aligned to 64 bytes.", inner_ptr);
+        }
+        if (arena.used() != after)
+            throw DartsException("The nested scope rewound the arena to {} bytes instead of {}.", arena.used(), after);
+
+        void *again = arena.allocate(1000, 64);
+        if (again != inner_ptr)
+            throw DartsException("The rewound arena returned {} instead of reusing {}.", again, inner_ptr);
+    }
+    if (arena.used() != start)
+        throw DartsException("The outer scope rewound the arena to {} bytes instead of {}.", arena.used(), start);
+
+    // Step 2: allocations that don't fit in the current block grow the arena, but leave the earlier ones intact
+    vector<uint8_t *> first_pass;
+    auto              allocate_all = [&](vector<uint8_t *> &ptrs)
+    {
+        ScratchArena::Scope scope;
+        size_t              total = 0;
+        for (size_t bytes = 1024; bytes <= max_bytes; bytes *= 2)
+        {
+            uint8_t *p = scope.arena.alloc<uint8_t>(bytes);
+            std::fill_n(p, bytes, uint8_t(ptrs.size() + 1));
+            ptrs.push_back(p);
+            total += bytes;
+        }
+        if (arena.used() < start + total)
+            throw DartsException("The arena reports {} bytes in use after allocating {} bytes.", arena.used() - start,
+                                 total);
+
+        for (size_t i = 0, bytes = 1024; i < ptrs.size(); ++i, bytes *= 2)
+            if (std::any_of(ptrs[i], ptrs[i] + bytes, [&](uint8_t v) { return v != uint8_t(i + 1); }))
+                throw DartsException("Allocation {} of {} bytes was overwritten by a later allocation.", i, bytes);
+    };
+    allocate_all(first_pass);
+    if (arena.used() != start)
+        throw DartsException("The arena was rewound to {} bytes instead of {}.", arena.used(), start);
+
+    // Step 3: the grown blocks are kept, so the same allocations land at the same addresses again
+    vector<uint8_t *> second_pass;
+    allocate_all(second_pass);
+    if (first_pass != second_pass)
+        throw DartsException("Repeating the allocations didn't reuse the blocks the arena grew to.");
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Test, ScratchArenaTest, "scratch arena")
+
+/**
+    \file
+    \brief Class #ScratchArenaTest
+*/
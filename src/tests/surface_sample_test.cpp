@@ -4,21 +4,24 @@
     Copyright (c) 2017-2022 by Wojciech Jarosz
 */
 
+#include <darts/alias_table.h>
 #include <darts/factory.h>
 #include <darts/image.h>
 #include <darts/material.h>
+#include <darts/sampling.h>
 #include <darts/scene.h>
 #include <darts/surface.h>
 #include <darts/surface_group.h>
 #include <darts/test.h>
 
 #include <algorithm>
+#include <atomic>
 
 struct SurfaceSampleTest : public SampleTest
 {
     SurfaceSampleTest(const json &j);
 
-    bool  sample(Vec3f &dir, const Vec2f &rv, float rv1) override;
+    bool  sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t chunk) override;
     float pdf(const Vec3f &dir, float rv1) const override;
 
     shared_ptr<Surface> surface;
@@ -40,7 +43,7 @@ SurfaceSampleTest::SurfaceSampleTest(const json &j) : SampleTest(j)
         throw DartsException("Invalid sample surface file. No 'surface' or 'surfaces' field found.");
 }
 
-bool SurfaceSampleTest::sample(Vec3f &dir, const Vec2f &rv, float rv1)
+bool SurfaceSampleTest::sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t)
 {
     // Sample geometry
     EmitterRecord rec;
@@ -59,6 +62,128 @@ float SurfaceSampleTest::pdf(const Vec3f &dir, float rv1) const
 
 DARTS_REGISTER_CLASS_IN_FACTORY(Test, SurfaceSampleTest, "sample surface")
 
+/**
+    Test the discrete and piecewise-constant distributions by mapping them onto the sphere of directions.
+
+    A 2D distribution (\c "distribution": \c "2d") is specified by rows of \c "values" and covers the whole sphere
+    through the spherical coordinates \c (phi, theta) = \c (2 pi u, pi v). The 1D distributions (\c "1d", or
+    \c "alias" for an #AliasTable) are over a flat array of \c "values", which determines phi, while z is uniform.
+
+    The test also checks that the pdf reported by sampling a tabulated distribution matches its \c pdf() method.
+*/
+struct DistributionSampleTest : public SampleTest
+{
+    DistributionSampleTest(const json &j);
+
+    bool  sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t chunk) override;
+    float pdf(const Vec3f &dir, float rv1) const override;
+    void  print_more_statistics() override;
+
+    /// Count a mismatch between the \p sampled pdf and the one that the distribution's \c pdf() method \p evaluated
+    void check_pdf(float sampled, float evaluated);
+
+    string         type;
+    Distribution1D dist1d;
+    Distribution2D dist2d;
+    AliasTable     alias;
+
+    std::atomic<uint64_t> pdf_mismatches{0};
+};
+
+DistributionSampleTest::DistributionSampleTest(const json &j) : SampleTest(j)
+{
+    type = j.value("distribution", "2d");
+    if (type == "2d")
+    {
+        auto rows = j.at("values").get<vector<vector<float>>>();
+        if (rows.empty())
+            throw DartsException("Invalid distribution test: 'values' must not be empty.");
+
+        vector<float> values;
+        for (auto &row : rows)
+        {
+            if (row.size() != rows[0].size())
+                throw DartsException("Invalid distribution test: all rows of 'values' must have the same size.");
+            values.insert(values.end(), row.begin(), row.end());
+        }
+        dist2d = Distribution2D(values.data(), int(rows[0].size()), int(rows.size()));
+    }
+    else if (type == "1d")
+        dist1d = Distribution1D(j.at("values").get<vector<float>>());
+    else if (type == "alias")
+        alias = AliasTable(j.at("values").get<vector<float>>());
+    else
+        throw DartsException("Unknown distribution type '{}', expected '1d', '2d', or 'alias'.", type);
+}
+
+bool DistributionSampleTest::sample(Vec3f &dir, const Vec2f &rv, float rv1, uint64_t)
+{
+    if (type == "2d")
+    {
+        float pdf;
+        Vec2f uv = dist2d.sample_continuous(rv, &pdf);
+        dir      = Spherical::spherical_coordinates_to_direction(Vec2f{2 * M_PI * uv.x, M_PI * uv.y});
+        check_pdf(pdf, dist2d.pdf(uv));
+        return true;
+    }
+
+    float u;
+    if (type == "1d")
+    {
+        float pdf;
+        u = dist1d.sample_continuous(rv.x, &pdf);
+        check_pdf(pdf, dist1d.pdf(u));
+    }
+    else
+    {
+        float    r = rv.x;
+        uint32_t i = alias.sample(r);
+        u          = (i + r) / alias.size();
+    }
+
+    float z   = 1.f - 2.f * rv.y;
+    float r   = std::sqrt(std::max(0.f, 1.f - z * z));
+    float phi = 2 * M_PI * u;
+    dir       = Vec3f{r * std::cos(phi), r * std::sin(phi), z};
+    return true;
+}
+
+float DistributionSampleTest::pdf(const Vec3f &dir, float rv1) const
+{
+    Vec2f phi_theta = Spherical::direction_to_spherical_coordinates(dir);
+    float u         = phi_theta.x * INV_TWOPI;
+    if (type == "2d")
+    {
+        float sin_theta = std::sqrt(std::max(1.f - dir.z * dir.z, 0.f));
+        if (sin_theta == 0.f)
+            return 0.f;
+        return dist2d.pdf(Vec2f{u, phi_theta.y * INV_PI}) / (2 * M_PI * M_PI * sin_theta);
+    }
+
+    // uniform in z and the sampled u map to solid angle with a constant Jacobian of 4 pi
+    if (type == "1d")
+        return dist1d.pdf(u) * INV_FOURPI;
+
+    uint32_t i = std::min(uint32_t(std::max(u, 0.f) * alias.size()), uint32_t(alias.size() - 1));
+    return alias.pmf(i) * alias.size() * INV_FOURPI;
+}
+
+void DistributionSampleTest::check_pdf(float sampled, float evaluated)
+{
+    if (!(std::abs(sampled - evaluated) <= 1e-3f * std::max(sampled, evaluated)))
+        ++pdf_mismatches;
+}
+
+void DistributionSampleTest::print_more_statistics()
+{
+    // samples right at the boundary of two elements may be attributed to the neighboring element by pdf()
+    if (pdf_mismatches > total_samples / 1000)
+        throw DartsException("The pdf of {} of the {} samples did not match the distribution's pdf() method.",
+                             pdf_mismatches.load(), total_samples);
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Test, DistributionSampleTest, "sample distribution")
+
 /**
     \file
     \brief Class #SurfaceSampleTest
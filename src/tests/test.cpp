@@ -52,6 +52,7 @@ ScatterTest::ScatterTest(const json &j)
     image_size    = j.value("image size", image_size);
     total_samples = j.value("spp", 1000) * product(image_size);
     up_samples    = j.value("up samples", up_samples);
+    seed          = j.value("seed", seed);
 }
 
 void ScatterTest::print_header() const
@@ -101,51 +102,97 @@ Array2d<float> ScatterTest::upsample(const Array2d<float> &img, int factor)
     return upsampled;
 }
 
+void ScatterTest::accumulate_sample(Array2d<float> &histogram, pcg32 &rng, uint64_t chunk, float weight_scale,
+                                    uint64_t &valid_samples, bool &nan_or_inf)
+{
+    Vec3f dir;
+    if (!sample(dir, Vec2f{rng.nextFloat(), rng.nextFloat()}, rng.nextFloat(), chunk))
+        return;
+
+    dir = normalize(dir);
+
+    if (!la::any(la::isfinite(dir)))
+    {
+        nan_or_inf = true;
+        return;
+    }
+
+    // Map scattered direction to pixel in our sample histogram
+    Vec2i pixel{sample_to_pixel(dir)};
+    if (pixel.x < 0 || pixel.y < 0 || pixel.x >= histogram.width() || pixel.y >= histogram.height())
+        return;
+
+    // Incorporate Jacobian of spherical mapping and bin area into the sample weight
+    float sin_theta = std::max(1e-8f, std::sqrt(max(1.0f - dir.z * dir.z, 0.0f)));
+    float weight    = weight_scale / sin_theta;
+    // Accumulate into histogram
+    float val = histogram(pixel.x, pixel.y) + weight;
+    if (!std::isfinite(val))
+    {
+        spdlog::error("Caught a NaN or Inf: {}; {}; {}; {}; {}", val, weight, pixel, dir, sin_theta);
+        nan_or_inf = true;
+        return;
+    }
+
+    histogram(pixel.x, pixel.y) = val;
+    valid_samples++;
+}
+
 void ScatterTest::run()
 {
     // Step 1: Generate histogram of samples
     Array2d<float> histogram(image_size.x, image_size.y);
 
-    // populate the histogram
+    // The samples are generated in parallel blocks, each with its own random number stream. The blocks are split into
+    // a fixed number of chunks, which accumulate into their own histograms that are added up in order at the end, so
+    // the result does not depend on the number of threads
+    constexpr uint64_t block_size = 1 << 16;
+    uint64_t           num_blocks = (total_samples + block_size - 1) / block_size;
+    uint64_t           num_chunks = std::min<uint64_t>(num_blocks, 64);
+    struct Chunk
+    {
+        Array2d<float> histogram;
+        uint64_t       valid_samples = 0;
+        bool           nan_or_inf    = false;
+    };
+    vector<Chunk> chunks(num_chunks);
+    prepare_chunks(num_chunks);
+
+    // the bin area and the number of samples are the same for all samples
+    float weight_scale = histogram.length() / (M_PI * (2.0f * M_PI) * total_samples);
+    {
+        Progress progress(fmt::format("Generating {} samples", total_samples), total_samples);
+        parallel_for(blocked_range<uint64_t>(0, num_chunks, 1),
+                     [&](blocked_range<uint64_t> r)
+                     {
+                         for (auto c : r)
+                         {
+                             Chunk &chunk = chunks[c];
+                             chunk.histogram.resize(image_size);
+                             chunk.histogram.reset(0.f);
+                             for (uint64_t b = c * num_blocks / num_chunks; b < (c + 1) * num_blocks / num_chunks; ++b)
+                             {
+                                 pcg32    rng(seed, b);
+                                 uint64_t end = std::min(total_samples, (b + 1) * block_size);
+                                 for (uint64_t i = b * block_size; i < end; ++i)
+                                     accumulate_sample(chunk.histogram, rng, c, weight_scale, chunk.valid_samples,
+                                                       chunk.nan_or_inf);
+                                 progress += end - b * block_size;
+                             }
+                         }
+                     });
+        progress.set_done();
+    }
+
     bool     nan_or_inf    = false;
     uint64_t valid_samples = 0;
-    pcg32    rng;
-    Progress progress(fmt::format("Generating {} samples", total_samples), total_samples);
-    for (uint64_t i = 0; i < total_samples; ++i, ++progress)
+    histogram.reset(0.f);
+    for (auto &chunk : chunks)
     {
-        Vec3f dir;
-        if (!sample(dir, Vec2f{rng.nextFloat(), rng.nextFloat()}, rng.nextFloat()))
-            continue;
-
-        dir = normalize(dir);
-
-        if (!la::any(la::isfinite(dir)))
-        {
-            nan_or_inf = true;
-            continue;
-        }
-
-        // Map scattered direction to pixel in our sample histogram
-        Vec2i pixel{sample_to_pixel(dir)};
-        if (pixel.x < 0 || pixel.y < 0 || pixel.x >= histogram.width() || pixel.y >= histogram.height())
-            continue;
-
-        // Incorporate Jacobian of spherical mapping and bin area into the sample weight
-        float sin_theta = std::max(1e-8f, std::sqrt(max(1.0f - dir.z * dir.z, 0.0f)));
-        float weight    = (histogram.length()) / (M_PI * (2.0f * M_PI) * total_samples * sin_theta);
-        // Accumulate into histogram
-        float val = histogram(pixel.x, pixel.y) + weight;
-        if (!std::isfinite(val))
-        {
-            spdlog::error("Caught a NaN or Inf: {}; {}; {}; {}; {}", val, weight, pixel, dir, sin_theta);
-            nan_or_inf = true;
-            continue;
-        }
-
-        histogram(pixel.x, pixel.y) = val;
-        valid_samples++;
+        for (int i = 0; i < histogram.length(); ++i) histogram(i) += chunk.histogram(i);
+        valid_samples += chunk.valid_samples;
+        nan_or_inf |= chunk.nan_or_inf;
     }
-    progress.set_done();
 
     // Step 2: Compute automatic exposure value as the 99.95th percentile instead of maximum for increased robustness
     if (max_value < 0.f)
@@ -184,30 +231,44 @@ SampleTest::SampleTest(const json &j) : ScatterTest(j)
 
 void SampleTest::run()
 {
-    // Step 1: Evaluate pdf over the sphere and compute its integral
-    pcg32          rng;
-    double         integral = 0.0f;
+    // Step 1: Evaluate pdf over the sphere and compute its integral. The rows are evaluated in parallel, each with its
+    // own random number stream, and their integrals are added up in order, so the result does not depend on the
+    // number of threads
     Array2d<float> pdf(image_size.x, image_size.y);
-    Progress       progress1("Evaluating analytic PDF", pdf.height());
-    for (int y = 0; y < pdf.height(); ++y, ++progress1)
-        for (int x = 0; x < pdf.width(); x++)
-        {
-            float accum = 0.f;
-            for (int sx = 0; sx < super_samples; ++sx)
-                for (int sy = 0; sy < super_samples; ++sy)
-                {
-                    Vec3f dir =
-                        pixel_to_sample(Vec2f{x + (sx + 0.5f) / super_samples, y + (sy + 0.5f) / super_samples});
-                    float sin_theta = std::sqrt(max(1.0f - dir.z * dir.z, 0.0f));
-                    float pixel_area =
-                        (M_PI / super_samples) * (M_PI * 2.0f / super_samples) * sin_theta / product(image_size);
-                    float value = this->pdf(dir, rng.nextFloat());
-                    accum += value;
-                    integral += pixel_area * value;
-                }
-            pdf(x, y) = accum / (super_samples * super_samples);
-        }
-    progress1.set_done();
+    vector<double> row_integrals(pdf.height(), 0.0);
+    {
+        Progress progress("Evaluating analytic PDF", pdf.height());
+        parallel_for(blocked_range<int>(0, pdf.height(), 1),
+                     [&](blocked_range<int> r)
+                     {
+                         for (auto y : r)
+                         {
+                             pcg32 rng(seed, uint64_t(y));
+                             for (int x = 0; x < pdf.width(); x++)
+                             {
+                                 float accum = 0.f;
+                                 for (int sx = 0; sx < super_samples; ++sx)
+                                     for (int sy = 0; sy < super_samples; ++sy)
+                                     {
+                                         Vec3f dir       = pixel_to_sample(Vec2f{x + (sx + 0.5f) / super_samples,
+                                                                                 y + (sy + 0.5f) / super_samples});
+                                         float sin_theta = std::sqrt(max(1.0f - dir.z * dir.z, 0.0f));
+                                         float pixel_area =
+                                             (M_PI / super_samples) * (M_PI * 2.0f / super_samples) * sin_theta /
+                                             product(image_size);
+                                         float value = this->pdf(dir, rng.nextFloat());
+                                         accum += value;
+                                         row_integrals[y] += pixel_area * value;
+                                     }
+                                 pdf(x, y) = accum / (super_samples * super_samples);
+                             }
+                             ++progress;
+                         }
+                     });
+        progress.set_done();
+    }
+    double integral = 0.0;
+    for (double row_integral : row_integrals) integral += row_integral;
 
     // Step 2: Compute automatic exposure value as the 99.95th percentile instead of maximum for increased robustness
     if (max_value < 0.f)
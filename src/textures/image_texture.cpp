@@ -0,0 +1,379 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <darts/cache.h>
+#include <darts/dmesh.h>
+#include <darts/parallel.h>
+#include <darts/stats.h>
+#include <darts/texture.h>
+#include <filesystem/resolver.h>
+#include <list>
+#include <unordered_map>
+
+STAT_COUNTER("Textures/Image textures", num_image_textures);
+STAT_MEMORY_COUNTER("Memory/Image texture tiles kept in memory", texture_bytes);
+STAT_PERCENT("Textures/Tile cache misses", num_tile_misses, num_tile_lookups);
+
+// anonymous namespace for variables/functions local to this file
+namespace
+{
+
+constexpr int num_tile_texels = ImageTexture::tile_size * ImageTexture::tile_size;
+
+std::atomic<uint32_t> next_texture_id(0);
+std::atomic<size_t>   texture_cache_size(size_t(1) << 30);
+std::atomic<uint64_t> num_decoded_tiles(0);
+
+LoadedAssets<ImageTexture> loaded_textures;
+
+} // namespace
+
+/**
+    The LRU cache of decoded tiles shared by all #ImageTexture%s.
+
+    The cache is split into shards that are locked independently, so that threads looking up different tiles rarely
+    contend for the same lock. Each shard evicts its least recently used tiles once it holds more than its part of the
+    memory limit. The tiles are reference counted, so a tile that is evicted while another thread still reads it stays
+    alive until that thread is done.
+*/
+class TextureTileCache
+{
+public:
+    using TilePtr = shared_ptr<const ImageTexture::Tile>;
+
+    static TextureTileCache &instance()
+    {
+        static TextureTileCache cache;
+        return cache;
+    }
+
+    /// Return tile \p index of \p texture, decoding it if it is not in the cache
+    TilePtr get(const ImageTexture &texture, uint32_t index)
+    {
+        uint64_t key   = (uint64_t(texture.m_id) << 32) | index;
+        Shard   &shard = m_shards[(key * 0x9e3779b97f4a7c15ull) >> (64 - shard_bits)];
+        ++num_tile_lookups;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (auto it = shard.index.find(key); it != shard.index.end())
+            {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->second;
+            }
+        }
+
+        // decode the tile without holding the lock, so other threads can use the shard in the meantime
+        ++num_tile_misses;
+        ++num_decoded_tiles;
+        auto tile = make_shared<ImageTexture::Tile>();
+        texture.load_tile(index, *tile);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (auto it = shard.index.find(key); it != shard.index.end())
+            return it->second->second; // another thread decoded it first
+
+        shard.lru.emplace_front(key, tile);
+        shard.index[key] = shard.lru.begin();
+
+        size_t capacity = std::max(texture_cache_size.load() / sizeof(ImageTexture::Tile) >> shard_bits, size_t(1));
+        while (shard.lru.size() > capacity)
+        {
+            shard.index.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+        return tile;
+    }
+
+private:
+    static constexpr int shard_bits = 6;
+
+    struct Shard
+    {
+        using List = std::list<std::pair<uint64_t, TilePtr>>;
+
+        std::mutex                                   mutex;
+        List                                         lru;   ///< The tiles, most recently used first
+        std::unordered_map<uint64_t, List::iterator> index; ///< The position of each tile within #lru
+    };
+
+    Shard m_shards[1 << shard_bits];
+};
+
+void set_texture_cache_size(size_t bytes)
+{
+    texture_cache_size = bytes;
+}
+
+uint64_t texture_tiles_decoded()
+{
+    return num_decoded_tiles;
+}
+
+ImageTexture::ImageTexture(const json &j) : Texture(j), m_id(next_texture_id++)
+{
+    string filename = get_file_resolver().resolve(j.at("filename").get<string>()).str();
+    bool   raw      = j.value("raw", false);
+
+    m_scale   = j.value("scale", m_scale);
+    m_closest = j.value("interpolation", string("linear")) == "closest";
+
+    const char *wrap_keys[2] = {"wrap mode x", "wrap mode y"};
+    for (int i = 0; i < 2; ++i)
+    {
+        string mode = j.value(wrap_keys[i], string("repeat"));
+        std::transform(mode.begin(), mode.end(), mode.begin(), [](char c) { return char(std::tolower(c)); });
+        if (mode == "repeat")
+            m_wrap[i] = Wrap::Repeat;
+        else if (mode == "clamp")
+            m_wrap[i] = Wrap::Clamp;
+        else if (mode == "black")
+            m_wrap[i] = Wrap::Black;
+        else
+            throw DartsException("Unknown '{}' \"{}\", expecting \"repeat\", \"clamp\", or \"black\".", wrap_keys[i],
+                                 mode);
+    }
+    if (j.contains("mapping"))
+        spdlog::warn("Ignoring the \"mapping\" of texture '{}', which is not supported yet.", filename);
+
+    ++num_image_textures;
+
+    m_load_key = Hasher().add(filename).add_pod(file_signature(filename)).add_pod(raw).value();
+
+    // read the layout of the pyramid from the cache entry, and remember where its tiles start
+    uint64_t key        = cache_enabled() ? m_load_key : 0;
+    auto     open_tiles = [&]()
+    {
+        auto cache = make_unique<CacheReader>("texture", key);
+        cache->read(m_levels);
+        cache->read(m_average);
+        uint64_t num_halves = 0;
+        cache->read(num_halves);
+        if (!cache->good() || m_levels.empty() ||
+            num_halves != uint64_t(m_levels.back().first_tile + 1) * num_tile_texels * 3)
+            return false;
+        m_cache_pos = cache->position();
+        m_cache     = std::move(cache);
+        return true;
+    };
+
+    // share the pyramid, and the decoded tiles in the tile cache, of a live texture loaded from the same file (e.g. for
+    // the previous frame of a batch)
+    bool other_cached = false;
+    auto share        = [&](const ImageTexture &other)
+    {
+        m_id         = other.m_id;
+        m_levels     = other.m_levels;
+        m_average    = other.m_average;
+        m_halves     = other.m_halves;
+        other_cached = other.m_cache != nullptr;
+    };
+    if (loaded_textures.reuse(m_load_key, share) && (!other_cached || open_tiles()))
+    {
+        spdlog::info("Reused the {} mip levels of texture '{}' loaded for another scene.", levels(), filename);
+        texture_bytes += m_halves.size() * sizeof(uint16_t);
+        loaded_textures.add(m_load_key, this);
+        return;
+    }
+
+    if (cache_enabled() && open_tiles())
+    {
+        spdlog::info("Loaded the {} mip levels of texture '{}' from the cache.", levels(), filename);
+        loaded_textures.add(m_load_key, this);
+        return;
+    }
+
+    Image3f image;
+    if (!image.load(filename, raw))
+        throw DartsException("Cannot load texture '{}'.", filename);
+
+    vector<uint16_t> halves;
+    build_pyramid(image, halves);
+    spdlog::info("Loaded {}x{} texture '{}' with {} mip levels.", image.width(), image.height(), filename, levels());
+
+    if (cache_enabled())
+    {
+        {
+            CacheWriter cache("texture", key);
+            cache.write(m_levels);
+            cache.write(m_average);
+            cache.write(halves);
+        }
+        if (open_tiles())
+        {
+            loaded_textures.add(m_load_key, this);
+            return;
+        }
+    }
+
+    m_halves.swap(halves);
+    texture_bytes += m_halves.size() * sizeof(uint16_t);
+    loaded_textures.add(m_load_key, this);
+}
+
+ImageTexture::~ImageTexture()
+{
+    loaded_textures.remove(m_load_key, this);
+}
+
+void ImageTexture::build_pyramid(const Image3f &image, vector<uint16_t> &halves)
+{
+    // each level averages 2x2 texels of the previous one, until a single texel is left
+    vector<Image3f> levels;
+    levels.push_back(image);
+    while (levels.back().width() > 1 || levels.back().height() > 1)
+    {
+        const Image3f &prev = levels.back();
+        int            w = std::max(prev.width() / 2, 1), h = std::max(prev.height() / 2, 1);
+        Image3f        next(w, h);
+        parallel_for(blocked_range<int>(0, h, 16),
+                     [&](blocked_range<int> rows)
+                     {
+                         for (auto y : rows)
+                             for (int x = 0; x < w; ++x)
+                             {
+                                 int x0 = std::min(2 * x, prev.width() - 1), x1 = std::min(2 * x + 1, prev.width() - 1);
+                                 int y0 = std::min(2 * y, prev.height() - 1),
+                                     y1 = std::min(2 * y + 1, prev.height() - 1);
+                                 next(x, y) = 0.25f * (prev(x0, y0) + prev(x1, y0) + prev(x0, y1) + prev(x1, y1));
+                             }
+                     });
+        levels.push_back(std::move(next));
+    }
+    m_average = levels.back()(0, 0);
+
+    m_levels.clear();
+    uint32_t num_tiles = 0;
+    for (auto &l : levels)
+    {
+        Vec2i size(l.width(), l.height());
+        Vec2i tiles = (size + (tile_size - 1)) / tile_size;
+        m_levels.push_back({size, tiles, num_tiles});
+        num_tiles += uint32_t(tiles.x * tiles.y);
+    }
+
+    // store the tiles as half floats, repeating the last row and column of the level in the tiles along its edges
+    halves.resize(size_t(num_tiles) * num_tile_texels * 3);
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        const Level   &level = m_levels[i];
+        const Image3f &l     = levels[i];
+        parallel_for(blocked_range<int>(0, level.tiles.y, 1),
+                     [&](blocked_range<int> tile_rows)
+                     {
+                         for (auto ty : tile_rows)
+                             for (int tx = 0; tx < level.tiles.x; ++tx)
+                             {
+                                 uint16_t *out = &halves[size_t(level.first_tile + ty * level.tiles.x + tx) *
+                                                         num_tile_texels * 3];
+                                 for (int y = 0; y < tile_size; ++y)
+                                     for (int x = 0; x < tile_size; ++x)
+                                     {
+                                         const Color3f &c = l(std::min(tx * tile_size + x, l.width() - 1),
+                                                              std::min(ty * tile_size + y, l.height() - 1));
+                                         for (int ch = 0; ch < 3; ++ch) *out++ = float_to_half(c[ch]);
+                                     }
+                             }
+                     });
+    }
+}
+
+void ImageTexture::load_tile(uint32_t index, Tile &tile) const
+{
+    std::array<uint16_t, num_tile_texels * 3> halves;
+    if (m_cache)
+    {
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+        m_cache->seek(m_cache_pos + uint64_t(index) * sizeof(halves));
+        m_cache->read(halves);
+        if (!m_cache->good())
+            throw DartsException("Cannot read tile {} of a texture from the cache.", index);
+    }
+    else
+        std::copy_n(&m_halves[size_t(index) * halves.size()], halves.size(), halves.begin());
+
+    for (int i = 0; i < num_tile_texels; ++i)
+        tile[i] = Color3f(half_to_float(halves[3 * i]), half_to_float(halves[3 * i + 1]),
+                          half_to_float(halves[3 * i + 2]));
+}
+
+Color3f ImageTexture::texel(int level, int x, int y) const
+{
+    const Level &l    = m_levels[level];
+    auto         wrap = [](int &c, int size, Wrap mode)
+    {
+        if (c >= 0 && c < size)
+            return true;
+        if (mode == Wrap::Black)
+            return false;
+        c = mode == Wrap::Repeat ? (c % size + size) % size : clamp(c, 0, size - 1);
+        return true;
+    };
+    if (!wrap(x, l.size.x, m_wrap[0]) || !wrap(y, l.size.y, m_wrap[1]))
+        return Color3f(0.f);
+
+    // each thread remembers the last few tiles it used, so that most lookups don't need to lock the shared cache
+    struct RecentTile
+    {
+        uint64_t                   key = ~uint64_t(0);
+        TextureTileCache::TilePtr tile;
+    };
+    thread_local RecentTile recent[4];
+
+    uint32_t    index = l.first_tile + uint32_t((y / tile_size) * l.tiles.x + x / tile_size);
+    uint64_t    key   = (uint64_t(m_id) << 32) | index;
+    RecentTile &r     = recent[index & 3];
+    if (r.key != key)
+    {
+        r.tile = TextureTileCache::instance().get(*this, index);
+        r.key  = key;
+    }
+    return (*r.tile)[(y % tile_size) * tile_size + x % tile_size];
+}
+
+Color3f ImageTexture::filter(int level, const Vec2f &uv) const
+{
+    // the rows of the image go from top to bottom, while v goes from bottom to top
+    const Vec2i &size = m_levels[level].size;
+    Vec2f        p(uv.x * size.x, (1.f - uv.y) * size.y);
+    if (m_closest)
+        return texel(level, int(std::floor(p.x)), int(std::floor(p.y)));
+
+    p -= 0.5f;
+    int   x = int(std::floor(p.x)), y = int(std::floor(p.y));
+    Vec2f t = p - Vec2f(float(x), float(y));
+    return lerp(lerp(texel(level, x, y), texel(level, x + 1, y), t.x),
+                lerp(texel(level, x, y + 1), texel(level, x + 1, y + 1), t.x), t.y);
+}
+
+Color3f ImageTexture::lookup(const Vec2f &uv, float width) const
+{
+    // choose the two levels whose texels are closest to the size of the footprint
+    Vec2i size  = m_levels[0].size;
+    float level = std::log2(std::max(width * std::max(size.x, size.y), 1.f));
+    if (level >= levels() - 1)
+        return m_scale * filter(levels() - 1, uv);
+
+    int     l = int(level);
+    float   t = level - l;
+    Color3f c = filter(l, uv);
+    if (t > 0.f)
+        c = lerp(c, filter(l + 1, uv), t);
+    return m_scale * c;
+}
+
+Color3f ImageTexture::average() const
+{
+    return m_scale * m_average;
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Texture, ImageTexture, "image")
+
+/**
+    \file
+    \brief ImageTexture, and the tile cache shared by all image textures
+*/
@@ -0,0 +1,27 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/texture.h>
+
+ConstantTexture::ConstantTexture(const json &j) : Texture(j)
+{
+    color = j.value("color", color);
+}
+
+shared_ptr<const Texture> parse_texture(const json &j)
+{
+    if (j.is_number() || j.is_array())
+        return make_shared<ConstantTexture>(j.get<Color3f>());
+
+    return DartsFactory<Texture>::create(j);
+}
+
+DARTS_REGISTER_CLASS_IN_FACTORY(Texture, ConstantTexture, "constant")
+
+/**
+    \file
+    \brief ConstantTexture, and parsing textures from json
+*/
@@ -0,0 +1,145 @@
+/*
+    This file is part of darts – the Dartmouth Academic Ray Tracing Skeleton.
+
+    Copyright (c) 2017-2022 by Wojciech Jarosz
+*/
+
+#include <darts/transform.h>
+
+// anonymous namespace for functions local to this file
+namespace
+{
+
+/// Split the linear part of \p m into a rotation \p r (as a quaternion) and the remaining scale and shear \p s
+void decompose(const Mat44f &m, Vec3f &t, Vec4f &r, Mat33f &s)
+{
+    t = m[3].xyz();
+
+    Mat33f a(m[0].xyz(), m[1].xyz(), m[2].xyz());
+
+    // polar decomposition: average the matrix with its inverse transpose until it converges to a rotation
+    Mat33f rot = a;
+    for (int i = 0; i < 100; ++i)
+    {
+        Mat33f inv_t = la::inverse(la::transpose(rot));
+        float  diff  = 0.f;
+        for (int c = 0; c < 3; ++c)
+        {
+            Vec3f next = 0.5f * (rot[c] + inv_t[c]);
+            diff       = std::max(diff, la::maxelem(la::abs(next - rot[c])));
+            rot[c]     = next;
+        }
+        if (diff < 1e-6f)
+            break;
+    }
+
+    // keep reflections in the scale, so that the rotation can be represented by a quaternion
+    if (la::determinant(rot) < 0.f)
+        for (int c = 0; c < 3; ++c) rot[c] = -rot[c];
+    s = la::mul(la::transpose(rot), a);
+
+    // convert the rotation matrix to a quaternion (x, y, z, w), see Shoemake's "Animating rotation with quaternion
+    // curves", SIGGRAPH 1985
+    float trace = rot[0][0] + rot[1][1] + rot[2][2];
+    if (trace > 0.f)
+    {
+        float f = 0.5f / std::sqrt(trace + 1.f);
+        r = Vec4f((rot[1][2] - rot[2][1]) * f, (rot[2][0] - rot[0][2]) * f, (rot[0][1] - rot[1][0]) * f, 0.25f / f);
+    }
+    else
+    {
+        // start from the largest diagonal element for numerical stability
+        int i = rot[0][0] >= rot[1][1] && rot[0][0] >= rot[2][2] ? 0 : rot[1][1] >= rot[2][2] ? 1 : 2;
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+
+        float f = 0.5f / std::sqrt(1.f + rot[i][i] - rot[j][j] - rot[k][k]);
+        r[i]    = 0.25f / f;
+        r[j]    = (rot[i][j] + rot[j][i]) * f;
+        r[k]    = (rot[i][k] + rot[k][i]) * f;
+        r.w     = (rot[j][k] - rot[k][j]) * f;
+    }
+    r = normalize(r);
+}
+
+/// Interpolate between the unit quaternions \p a and \p b along the shortest arc
+Vec4f slerp(const Vec4f &a, Vec4f b, float t)
+{
+    float cos_theta = dot(a, b);
+    if (cos_theta < 0.f)
+    {
+        b         = -b;
+        cos_theta = -cos_theta;
+    }
+
+    // fall back to linear interpolation for nearly identical rotations
+    if (cos_theta > 0.9995f)
+        return normalize(lerp(a, b, t));
+
+    float theta = std::acos(cos_theta);
+    return (std::sin((1.f - t) * theta) * a + std::sin(t * theta) * b) / std::sin(theta);
+}
+
+/// The rotation matrix of the unit quaternion \p q
+Mat33f rotation_matrix(const Vec4f &q)
+{
+    float x = q.x, y = q.y, z = q.z, w = q.w;
+    return Mat33f({1.f - 2.f * (y * y + z * z), 2.f * (x * y + z * w), 2.f * (x * z - y * w)},
+                  {2.f * (x * y - z * w), 1.f - 2.f * (x * x + z * z), 2.f * (y * z + x * w)},
+                  {2.f * (x * z + y * w), 2.f * (y * z - x * w), 1.f - 2.f * (x * x + y * y)});
+}
+
+} // namespace
+
+AnimatedTransform::AnimatedTransform(const Transform &start, const Transform &end) : m_start(start), m_end(end)
+{
+    for (int c = 0; c < 4; ++c) m_animated = m_animated || la::any(la::nequal(start.m[c], end.m[c]));
+    decompose(start.m, m_translation[0], m_rotation[0], m_scale[0]);
+    decompose(end.m, m_translation[1], m_rotation[1], m_scale[1]);
+}
+
+Transform AnimatedTransform::at(float time) const
+{
+    if (!m_animated || time <= 0.f)
+        return m_start;
+    if (time >= 1.f)
+        return m_end;
+
+    Vec3f  t = lerp(m_translation[0], m_translation[1], time);
+    Mat33f s;
+    for (int c = 0; c < 3; ++c) s[c] = lerp(m_scale[0][c], m_scale[1][c], time);
+    Mat33f a = la::mul(rotation_matrix(slerp(m_rotation[0], m_rotation[1], time)), s);
+    return Transform(Mat44f({a[0], 0.f}, {a[1], 0.f}, {a[2], 0.f}, {t, 1.f}));
+}
+
+Box3f AnimatedTransform::motion_bounds(const Box3f &box) const
+{
+    if (!m_animated)
+        return m_start.box(box);
+    if (box.is_empty())
+        return box;
+
+    // enclose the box at evenly spaced times, so the corners' paths are covered up to the chords between those times
+    constexpr int steps  = 16;
+    Box3f         result = m_start.box(box);
+    for (int i = 1; i <= steps; ++i) result.enclose(at(float(i) / steps).box(box));
+
+    // a rotating corner bulges beyond each chord by at most r (1 - cos(angle / 2)), where r is its distance from the
+    // (scaled) origin and angle is the rotation between consecutive times
+    float cos_half = std::min(std::abs(dot(m_rotation[0], m_rotation[1])), 1.f);
+    float angle    = 2.f * std::acos(cos_half) / steps;
+    float radius   = 0.f;
+    for (int c = 0; c < 8; ++c)
+    {
+        Vec3f p((c & 1) ? box.max.x : box.min.x, (c & 2) ? box.max.y : box.min.y, (c & 4) ? box.max.z : box.min.z);
+        radius = std::max({radius, length(la::mul(m_scale[0], p)), length(la::mul(m_scale[1], p))});
+    }
+    float pad = radius * (1.f - std::cos(0.5f * angle));
+    result.min -= pad;
+    result.max += pad;
+    return result;
+}
+
+/**
+    \file
+    \brief Implementation of #AnimatedTransform
+*/